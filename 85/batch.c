@@ -0,0 +1,523 @@
+// batch.c
+#define _GNU_SOURCE
+#include "batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// 目錄以名稱結尾的 '/' 表示
+bool batch_is_dir(const char *name) {
+    size_t len = strlen(name);
+    return len > 1 && name[len - 1] == '/';
+}
+
+//--- HEADER ---//
+static void put_header(unsigned char *h, int type, size_t path_len, mode_t mode, long long size) {
+    memset(h, 0, BATCH_HDR);
+    h[0] = type;
+    h[2] = path_len >> 8;
+    h[3] = path_len;
+    for (int i = 0; i < 4; i++)
+        h[4 + i] = (uint32_t)mode >> (24 - 8 * i);
+    for (int i = 0; i < 8; i++)
+        h[8 + i] = (uint64_t)size >> (56 - 8 * i);
+}
+
+static void get_header(const unsigned char *h, int *type, size_t *path_len, mode_t *mode,
+                       long long *size) {
+    uint32_t m = 0;
+    uint64_t s = 0;
+    for (int i = 0; i < 4; i++)
+        m = m << 8 | h[4 + i];
+    for (int i = 0; i < 8; i++)
+        s = s << 8 | h[8 + i];
+    *type = h[0];
+    *path_len = (size_t)h[2] << 8 | h[3];
+    *mode = m;
+    *size = (long long)s;
+}
+
+// 只接受相對路徑，不能有空的、"." 或 ".." 的部分
+static bool path_ok(const char *path) {
+    if (path[0] == '\0' || path[0] == '/')
+        return false;
+    const char *p = path;
+    while (*p) {
+        const char *end = strchr(p, '/');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n == 0 || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.'))
+            return false;
+        p += n;
+        if (*p == '/')
+            p++;
+    }
+    return true;
+}
+
+// 對方給的名稱只能是目前目錄下的一層（目錄結尾的 '/' 不算），不能用來指到別的位置
+bool batch_name_ok(const char *name) {
+    char tmp[BATCH_PATH_MAX];
+    size_t n = strlen(name);
+    if (n >= sizeof(tmp))
+        return false;
+    memcpy(tmp, name, n + 1);
+    while (n > 1 && tmp[n - 1] == '/')
+        tmp[--n] = '\0';
+    return path_ok(tmp) && !strchr(tmp, '/');
+}
+
+//--- SCAN ---//
+static int add_entry(BatchReader *b, const char *path, bool dir, mode_t mode, long long size) {
+    if (b->count == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 256;
+        BatchEntry *entries = realloc(b->entries, cap * sizeof(BatchEntry));
+        if (!entries)
+            return -1;
+        b->entries = entries;
+        b->cap = cap;
+    }
+    BatchEntry *e = &b->entries[b->count];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    if (!e->path)
+        return -1;
+    e->dir = dir;
+    e->mode = mode & 07777;
+    e->size = dir ? 0 : size;
+    b->count++;
+    b->stream_size += BATCH_HDR + strlen(path) + e->size;
+    if (dir)
+        b->dirs++;
+    else
+        b->files++;
+    return 1;
+}
+
+// 深度優先走訪，父目錄一定排在內容前面；symlink 與特殊檔案略過
+static int scan_dir(BatchReader *b, const char *rel) {
+    int fd = openat(b->root_fd, rel[0] ? rel : ".", O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return -1;
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+    int r = 1;
+    struct dirent *d;
+    char path[BATCH_PATH_MAX];
+    while (r == 1 && (d = readdir(dir)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+        int n = snprintf(path, sizeof(path), "%s%s%s", rel, rel[0] ? "/" : "", d->d_name);
+        if (n >= (int)sizeof(path)) {
+            r = -1;
+            break;
+        }
+        struct stat st;
+        if (fstatat(b->root_fd, path, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            r = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            r = add_entry(b, path, true, st.st_mode, 0);
+            if (r == 1)
+                r = scan_dir(b, path);
+        } else if (S_ISREG(st.st_mode)) {
+            r = add_entry(b, path, false, st.st_mode, st.st_size);
+        }
+    }
+    closedir(dir);
+    return r;
+}
+
+//--- BATCH READER ---//
+// 把一個小檔案整個讀進記憶體
+static char *load_file(int root_fd, const BatchEntry *e) {
+    int fd = openat(root_fd, e->path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    char *data = malloc(e->size ? e->size : 1);
+    long long done = 0;
+    while (data && done < e->size) {
+        ssize_t n = read(fd, data + done, e->size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    close(fd);
+    if (data && done != e->size) {
+        free(data);
+        data = NULL;
+    }
+    return data;
+}
+
+// 讀檔 thread：依序領取小檔案預讀，超過 BATCH_AHEAD 就等網路端送出
+// 網路端正在等的那一個不受限制，避免卡死
+static void *loader_thread(void *arg) {
+    BatchReader *b = (BatchReader*)arg;
+    pthread_mutex_lock(&b->lock);
+    while (!b->stop) {
+        while (b->next_load < b->count &&
+               (b->entries[b->next_load].dir || b->entries[b->next_load].size >= BATCH_SMALL))
+            b->next_load++;
+        if (b->next_load >= b->count)
+            break;
+        BatchEntry *e = &b->entries[b->next_load];
+        if (b->ahead + e->size > BATCH_AHEAD && b->next_load > b->cur) {
+            pthread_cond_wait(&b->changed, &b->lock);
+            continue;
+        }
+        b->next_load++;
+        b->ahead += e->size;
+        e->state = 1;
+        pthread_mutex_unlock(&b->lock);
+
+        char *data = load_file(b->root_fd, e);
+
+        pthread_mutex_lock(&b->lock);
+        e->data = data;
+        e->state = data ? 2 : -1;
+        pthread_cond_broadcast(&b->changed);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+// 掃描目錄，計算 stream 長度；讀檔 threads 在第一次 batch_reader_next 時才啟動
+// 成功回傳 1，失敗回傳 -1
+int batch_reader_open(BatchReader *b, const char *dir) {
+    memset(b, 0, sizeof(*b));
+    snprintf(b->root, sizeof(b->root), "%s", dir);
+    b->root_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (b->root_fd < 0)
+        return -1;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->changed, NULL);
+    b->out = malloc(PIPE_BLOCK_SIZE);
+    if (!b->out || scan_dir(b, "") == -1) {
+        batch_reader_close(b);
+        return -1;
+    }
+    b->stream_size += BATCH_HDR;
+    return 1;
+}
+
+static void start_loaders(BatchReader *b) {
+    b->started = true;
+    b->start_ns = pipe_now_ns();
+    for (int i = 0; i < BATCH_READERS; i++)
+        if (pthread_create(&b->threads[b->nthreads], NULL, loader_thread, b) == 0)
+            b->nthreads++;
+}
+
+// 換到下一個項目；讀檔 threads 可能在等網路端前進
+static void next_entry(BatchReader *b) {
+    pthread_mutex_lock(&b->lock);
+    b->cur++;
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void append(BatchReader *b, size_t *len, const void *data, size_t n) {
+    memcpy(b->out + *len, data, n);
+    *len += n;
+}
+
+// 取得下一個要送出的 block：header 與小檔案合併在 b->out，大檔案直接用 FileReader 的 block
+// 回傳 1 表示有資料，0 表示結束，-1 表示讀檔失敗（例如檔案在掃描後被改動）
+int batch_reader_next(BatchReader *b, const char **data, size_t *len) {
+    if (!b->started)
+        start_loaders(b);
+    if (b->nthreads == 0)
+        return -1;
+    size_t out_len = 0;
+    unsigned char h[BATCH_HDR];
+    while (true) {
+        if (b->big_open) {
+            if (out_len > 0)
+                break;
+            int r = file_reader_next(&b->big, data, len);
+            if (r == 1) {
+                b->from_big = true;
+                b->bytes += *len;
+                return 1;
+            }
+            bool whole = (long long)b->big.bytes == b->entries[b->cur].size;
+            file_reader_close(&b->big);
+            b->big_open = false;
+            if (r < 0 || !whole)
+                return -1;
+            next_entry(b);
+            continue;
+        }
+
+        if (b->cur == b->count) {
+            if (b->ended || out_len + BATCH_HDR > PIPE_BLOCK_SIZE)
+                break;
+            put_header(h, BATCH_END, 0, 0, 0);
+            append(b, &out_len, h, BATCH_HDR);
+            b->ended = true;
+            break;
+        }
+
+        BatchEntry *e = &b->entries[b->cur];
+        size_t path_len = strlen(e->path);
+        bool small = !e->dir && e->size < BATCH_SMALL;
+        size_t need = BATCH_HDR + path_len + (small ? e->size : 0);
+        if (out_len + need > PIPE_BLOCK_SIZE)
+            break;
+
+        if (small) {
+            pthread_mutex_lock(&b->lock);
+            uint64_t t0 = pipe_now_ns();
+            while (e->state != 2 && e->state != -1)
+                pthread_cond_wait(&b->changed, &b->lock);
+            b->stall_ns += pipe_now_ns() - t0;
+            pthread_mutex_unlock(&b->lock);
+            if (e->state == -1)
+                return -1;
+        }
+
+        put_header(h, e->dir ? BATCH_DIR : BATCH_FILE, path_len, e->mode, e->size);
+        append(b, &out_len, h, BATCH_HDR);
+        append(b, &out_len, e->path, path_len);
+        if (e->dir) {
+            next_entry(b);
+        } else if (small) {
+            append(b, &out_len, e->data, e->size);
+            free(e->data);
+            e->data = NULL;
+            pthread_mutex_lock(&b->lock);
+            b->ahead -= e->size;
+            pthread_mutex_unlock(&b->lock);
+            next_entry(b);
+        } else {
+            // 大檔案：header 先隨目前的 block 送出，內容之後由 FileReader 一塊塊交出
+            char path[PATH_MAX];
+            int n = snprintf(path, sizeof(path), "%s/%s", b->root, e->path);
+            if (n < 0 || (size_t)n >= sizeof(path) || file_reader_open(&b->big, path) == -1)
+                return -1;
+            b->big_open = true;
+        }
+    }
+    if (out_len == 0)
+        return 0;
+    b->from_big = false;
+    b->bytes += out_len;
+    *data = b->out;
+    *len = out_len;
+    return 1;
+}
+
+// 網路端送完上一個 block
+void batch_reader_release(BatchReader *b) {
+    if (b->from_big)
+        file_reader_release(&b->big);
+    b->from_big = false;
+}
+
+void batch_reader_close(BatchReader *b) {
+    pthread_mutex_lock(&b->lock);
+    b->stop = true;
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+    for (int i = 0; i < b->nthreads; i++)
+        pthread_join(b->threads[i], NULL);
+    if (b->big_open)
+        file_reader_close(&b->big);
+    for (int i = 0; i < b->count; i++) {
+        free(b->entries[i].path);
+        free(b->entries[i].data);
+    }
+    free(b->entries);
+    free(b->out);
+    if (b->root_fd >= 0)
+        close(b->root_fd);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->changed);
+    memset(b, 0, sizeof(*b));
+    b->root_fd = -1;
+}
+
+void batch_reader_report(const BatchReader *b, const char *name) {
+    double secs = (pipe_now_ns() - b->start_ns) / 1e9;
+    double mb = b->bytes / (1024.0 * 1024.0);
+    printf("[Batch] %s: %d files, %d directories, %.2f MB in %.2f s (%.2f MB/s, %.0f files/s), "
+           "network waited %.1f ms for reads\n",
+           name, b->files, b->dirs, mb, secs, secs > 0 ? mb / secs : 0.0,
+           secs > 0 ? b->files / secs : 0.0, b->stall_ns / 1e6);
+}
+
+//--- BATCH WRITER ---//
+// 建立根目錄（已存在也可以），成功回傳 1，失敗回傳 -1
+int batch_writer_open(BatchWriter *w, const char *dir) {
+    memset(w, 0, sizeof(*w));
+    w->root_fd = -1;
+    snprintf(w->root, sizeof(w->root), "%s", dir);
+    size_t n = strlen(w->root);
+    while (n > 1 && w->root[n - 1] == '/')
+        w->root[--n] = '\0';
+    if (!batch_name_ok(w->root))
+        return -1;
+    if (mkdir(w->root, 0755) == -1 && errno != EEXIST)
+        return -1;
+    w->root_fd = open(w->root, O_RDONLY | O_DIRECTORY);
+    w->small = malloc(BATCH_SMALL);
+    if (w->root_fd < 0 || !w->small) {
+        if (w->root_fd >= 0)
+            close(w->root_fd);
+        free(w->small);
+        return -1;
+    }
+    w->start_ns = pipe_now_ns();
+    return 1;
+}
+
+// header 與路徑收齊：目錄直接建立，檔案準備接收內容
+static int entry_begin(BatchWriter *w) {
+    w->path[w->path_len] = '\0';
+    if (w->type == BATCH_END) {
+        w->ended = true;
+        return 1;
+    }
+    if (!path_ok(w->path) || (w->type != BATCH_DIR && w->type != BATCH_FILE) || w->size < 0)
+        return -1;
+    if (w->type == BATCH_DIR) {
+        if (mkdirat(w->root_fd, w->path, (w->mode & 0777) | 0700) == -1 && errno != EEXIST)
+            return -1;
+        w->dirs++;
+        return 1;
+    }
+    w->remain = w->size;
+    if (w->size >= BATCH_SMALL) {
+        // 完整路徑超過 PATH_MAX 時拒絕這個項目，不截斷後寫到別的位置
+        char path[PATH_MAX];
+        int n = snprintf(path, sizeof(path), "%s/%s", w->root, w->path);
+        if (n < 0 || (size_t)n >= sizeof(path))
+            return -1;
+        w->big = malloc(sizeof(FileWriter));
+        if (!w->big || file_writer_open(w->big, path, w->size) == -1) {
+            free(w->big);
+            w->big = NULL;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// 檔案內容收齊：小檔案一次 open / write / close，不個別 fsync
+static int entry_end(BatchWriter *w) {
+    int r = 1;
+    if (w->big) {
+        r = file_writer_close(w->big);
+        free(w->big);
+        w->big = NULL;
+    } else {
+        int fd = openat(w->root_fd, w->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return -1;
+        long long done = 0;
+        while (done < w->size) {
+            ssize_t n = write(fd, w->small + done, w->size - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                r = -1;
+                break;
+            }
+            done += n;
+        }
+        close(fd);
+    }
+    if (r == 1 && fchmodat(w->root_fd, w->path, w->mode & 0777, 0) == -1)
+        r = -1;
+    w->files++;
+    return r;
+}
+
+// 解析收到的 stream，資料可以在任何位置被切開；格式錯誤或寫檔失敗回傳 -1
+int batch_writer_write(BatchWriter *w, const char *data, size_t len) {
+    w->bytes += len;
+    while (len > 0) {
+        if (w->ended)
+            return -1;
+        size_t n;
+        if (w->phase == 0) {
+            n = BATCH_HDR - w->hdr_len < len ? BATCH_HDR - w->hdr_len : len;
+            memcpy(w->hdr + w->hdr_len, data, n);
+            w->hdr_len += n;
+            if (w->hdr_len == BATCH_HDR) {
+                get_header(w->hdr, &w->type, &w->path_need, &w->mode, &w->size);
+                if (w->path_need > BATCH_PATH_MAX)
+                    return -1;
+                w->path_len = 0;
+                w->phase = 1;
+            }
+        } else if (w->phase == 1) {
+            n = w->path_need - w->path_len < len ? w->path_need - w->path_len : len;
+            memcpy(w->path + w->path_len, data, n);
+            w->path_len += n;
+        } else {
+            n = w->remain < (long long)len ? (size_t)w->remain : len;
+            if (w->big && file_writer_write(w->big, data, n) == -1)
+                return -1;
+            if (!w->big)
+                memcpy(w->small + (w->size - w->remain), data, n);
+            w->remain -= n;
+        }
+        data += n;
+        len -= n;
+
+        if (w->phase == 1 && w->path_len == w->path_need) {
+            if (entry_begin(w) == -1)
+                return -1;
+            w->phase = 2;
+        }
+        if (w->phase == 2 && (w->type != BATCH_FILE || w->remain == 0)) {
+            if (w->type == BATCH_FILE && entry_end(w) == -1)
+                return -1;
+            w->phase = 0;
+            w->hdr_len = 0;
+        }
+    }
+    return 1;
+}
+
+// 確認收到結尾並 syncfs 一次，成功回傳 1
+int batch_writer_close(BatchWriter *w) {
+    int r = w->ended ? 1 : -1;
+    if (w->big) {
+        file_writer_close(w->big);
+        free(w->big);
+        w->big = NULL;
+        r = -1;
+    }
+    uint64_t t0 = pipe_now_ns();
+    if (w->root_fd >= 0 && syncfs(w->root_fd) == -1)
+        r = -1;
+    w->sync_ns = pipe_now_ns() - t0;
+    if (w->root_fd >= 0)
+        close(w->root_fd);
+    w->root_fd = -1;
+    free(w->small);
+    w->small = NULL;
+    return r;
+}
+
+void batch_writer_report(const BatchWriter *w, const char *name) {
+    double secs = (pipe_now_ns() - w->start_ns) / 1e9;
+    double mb = w->bytes / (1024.0 * 1024.0);
+    printf("[Batch] %s: %d files, %d directories, %.2f MB in %.2f s (%.2f MB/s, %.0f files/s), "
+           "syncfs %.1f ms\n",
+           name, w->files, w->dirs, mb, secs, secs > 0 ? mb / secs : 0.0,
+           secs > 0 ? w->files / secs : 0.0, w->sync_ns / 1e6);
+}
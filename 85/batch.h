@@ -0,0 +1,103 @@
+// batch.h
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "file_pipe.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+//--- BATCH STREAM ---//
+// 整個目錄以一個傳輸送出：每個項目是 header + 相對路徑 + 檔案內容，最後以 BATCH_END 結尾
+// header（big-endian）：type 1 byte、保留 1 byte、路徑長度 2 bytes、mode 4 bytes、大小 8 bytes
+#define BATCH_HDR 16
+#define BATCH_DIR 'D'
+#define BATCH_FILE 'F'
+#define BATCH_END 'E'
+#define BATCH_PATH_MAX 4096
+#define BATCH_SMALL (128 * 1024)          // 小於此值的檔案由讀檔 threads 整個預讀
+#define BATCH_READERS 4                   // 預讀小檔案的 thread 數
+#define BATCH_AHEAD (8 * 1024 * 1024)     // 已預讀但還沒送出的上限
+
+typedef struct {
+    char *path;                        // 相對於根目錄
+    bool  dir;
+    mode_t mode;
+    long long size;
+    char *data;                        // 預讀好的內容（小檔案）
+    int   state;                       // 0 未讀，1 讀取中，2 已讀好，-1 失敗
+} BatchEntry;
+
+//--- BATCH READER ---//
+// 傳送端：掃描目錄後，小檔案由多個 thread 平行預讀，大檔案交給 FileReader，
+// 網路端拿到的是合併成 PIPE_BLOCK_SIZE 的 block
+typedef struct {
+    char  root[BATCH_PATH_MAX];
+    int   root_fd;
+    BatchEntry *entries;
+    int   count, cap;
+    int   files, dirs;
+    long long stream_size;             // 整個 stream 的長度（當作傳輸大小）
+
+    int   next_load;                   // 下一個交給讀檔 thread 的項目
+    int   cur;                         // 網路端正在送的項目
+    long long ahead;                   // 已預讀還沒送出的 bytes
+    bool  stop, started, ended;
+    pthread_t threads[BATCH_READERS];
+    int   nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    char *out;                         // 合併 header 與小檔案的 block
+    FileReader big;
+    bool  big_open, from_big;
+
+    // 統計
+    uint64_t bytes;
+    uint64_t stall_ns;                 // 網路端等待預讀的時間
+    uint64_t start_ns;
+} BatchReader;
+
+//--- BATCH WRITER ---//
+// 接收端：邊收邊解析，目錄與小檔案各只需一次系統呼叫，大檔案交給 FileWriter，
+// 結束時對整個檔案系統 syncfs 一次，不逐檔 fsync
+typedef struct {
+    int   root_fd;
+    char  root[BATCH_PATH_MAX];
+    int   phase;                       // 0 收 header，1 收路徑，2 收檔案內容
+    unsigned char hdr[BATCH_HDR];
+    size_t hdr_len;
+    char  path[BATCH_PATH_MAX + 1];
+    size_t path_len, path_need;
+    int   type;
+    mode_t mode;
+    long long size, remain;
+    char *small;                       // 正在收的小檔案
+    FileWriter *big;
+    bool  ended;
+
+    // 統計
+    uint64_t bytes;
+    int   files, dirs;
+    uint64_t start_ns;
+    uint64_t sync_ns;
+} BatchWriter;
+
+bool batch_is_dir(const char *name);
+bool batch_name_ok(const char *name);
+
+int  batch_reader_open(BatchReader *b, const char *dir);
+int  batch_reader_next(BatchReader *b, const char **data, size_t *len);
+void batch_reader_release(BatchReader *b);
+void batch_reader_close(BatchReader *b);
+void batch_reader_report(const BatchReader *b, const char *name);
+
+int  batch_writer_open(BatchWriter *w, const char *dir);
+int  batch_writer_write(BatchWriter *w, const char *data, size_t len);
+int  batch_writer_close(BatchWriter *w);
+void batch_writer_report(const BatchWriter *w, const char *name);
+
+#endif
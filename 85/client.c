@@ -1,5 +1,7 @@
 // client.c
+// 命令列前端：協定都在 libchat，這裡只負責選單、GTK 對話框與播放視頻流
 #include "config.h"
+#include "libchat.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +9,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <assert.h>
@@ -25,47 +28,71 @@
 #include <libavutil/imgutils.h>
 
 //--- THREADS ---//
+// main thread 執行 GTK main loop，client_thread 顯示選單；socket 都由 libchat 的 loop thread 處理
 void *client_thread(void *arg);
-void *relay_thread(void *arg);
-void file_thread();                 // using main thread to run GTK
-void *direct_thread(void *arg);
 bool stop_flag = false;
-pthread_cond_t is_logged_in = PTHREAD_COND_INITIALIZER;       // relay & file thread 在登入後才開始動作
-pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
 
 //--- FUNCTION@ ---//
 // client_thread
 void show_main_menu();
 void show_logged_in_menu();
-int handle_no_logged_ssl(SSL *ssl);
-int send_register_ssl(SSL *ssl);
-int send_login_ssl(SSL *ssl);
-int handle_logged_ssl(SSL *ssl);
-int show_online_ssl(SSL *ssl);
-int send_relay_ssl(SSL *ssl);
-int send_direct_ssl(SSL *ssl);
-int send_file_ssl(SSL *ssl);
-int recv_streaming_ssl(SSL *ssl);   // 添加新的函數聲明
-
-// file_thread
-int file_questioner(char *from, char *filename);
-bool accept_file = false;
-
-//--- USER INFO ---//
+int handle_no_logged();
+int send_register();
+int send_login();
+int handle_logged();
+int show_online();
+int send_relay();
+int send_direct();
+int send_file(bool spool);
+int recv_spool();
+int recv_streaming();   // 添加新的函數聲明
+int show_xfers();
+int manage_contacts();
+int show_history();
+int search_messages();
+
+// 選單等 libchat 的結果
 typedef struct {
-    char name[MAX_NAME];               // 使用者名稱
-    bool status;                       // 是否 Login
-    SSL *ssl_socket;                   // SSL Socket for communicate
-    SSL *relay_ssl;                    // SSL Socket for Relay message
-    SSL *file_ssl;                     // SSL Socket for file transmission
-    int  receiver_fd;                  // Direct message 連接埠號
-    int  receiver_port;                // Direct message 連接埠號
-} User;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int  ok;
+    char reply[BUFFER_SIZE];
+} Reply;
+#define REPLY_INIT { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, 0, "" }
+#define BUSY_RETRIES 5                    // server 過載時最多重新連線幾次
+void reply_done(ChatSession *s, void *arg, int ok, const char *reply);
+int  wait_reply(Reply *r, int submitted);
+
+// Chat History：每個對話已讀到的 seq，登入時由 server 送來，只顯示這之後的 relay 訊息
+long long history_cursor[MAX_USERS];
+
+// libchat 的事件，在 loop thread 呼叫
+void on_message(ChatSession *s, void *ctx, const char *from, const char *mes, bool direct);
+void on_spool(ChatSession *s, void *ctx, const char *from, const char *mes);
+void on_offer(ChatSession *s, void *ctx, int offer_id, const char *from,
+              const char *filename, long long size, int nfiles);
+void on_transfer(ChatSession *s, void *ctx, const ChatTransfer *t);
+void on_closed(ChatSession *s, void *ctx);
+void on_presence(ChatSession *s, void *ctx, int id, const char *name, bool online);
+
+// file offer
+// 對話框由 main thread 的 GTK main loop 顯示，可以同時開好幾個；
+// 使用者的決定以 chat_answer_offer 交回 libchat
+typedef struct {
+    int  offer_id;
+    char from[MAX_NAME];
+    char label[MAX_MES + 32];
+    GtkWidget *window;
+    guint timer;                       // OFFER_TIMEOUT 後自動拒絕
+    bool answered;
+} OfferPrompt;
 
-User user;
+bool gtk_ready = false;                // 沒有 display 時 offer 一律拒絕
+void ask_offer(int offer_id, const char *from, const char *label);
 
-SSL_CTX *ctx;
+ChatClient *chat;
+ChatSession *session;
 
 //--- SHOW MENU ---//
 void show_main_menu() {
@@ -83,73 +110,86 @@ void show_logged_in_menu() {
     printf("4. Send file\n");
     printf("5. Stream video\n");
     printf("6. Log out\n");
+    printf("7. Show file transfers\n");
+    printf("8. Send file via server spool\n");
+    printf("9. Download spooled files\n");
 }
 //--- GTK FUNCTION ---//
-// delete_event 信號處理函數
-gboolean on_delete_event(GtkWidget *widget, GdkEvent *event, gpointer data) {
-    printf("delete_event triggered\n");
-    gtk_main_quit(); // 退出主事件迴圈
-    return FALSE;    // 返回 FALSE允許進一步處理（會觸發 destroy 信號）
+// 以下除了 ask_offer 都在 GTK main loop 執行
+
+// 把決定交給 libchat，每個對話框只交一次
+static void prompt_answer(OfferPrompt *prompt, bool accept) {
+    if (prompt->answered)
+        return;
+    prompt->answered = true;
+    if (prompt->timer)
+        g_source_remove(prompt->timer);
+    prompt->timer = 0;
+
+    if (chat_answer_offer(session, prompt->offer_id, accept) == -1)
+        printf(RED"Error in answering offer #%d\n"NONE, prompt->offer_id);
+    if (accept)
+        printf("you select "GREEN"yes"NONE" for %s\n", prompt->label);
+    else
+        printf("you select "RED"no"NONE" for %s\n", prompt->label);
 }
-
-// destroy 信號處理函數
+// destroy 信號處理函數：直接關掉視窗視為拒絕
 void on_destroy(GtkWidget *widget, gpointer data) {
-    if (accept_file)
-        printf("you select "GREEN"yes\n"NONE);
-    else
-        printf("you select "RED"no\n"NONE);
-    gtk_main_quit(); // 確保主事件迴圈結束
+    (void)widget;
+    OfferPrompt *prompt = (OfferPrompt*)data;
+    prompt_answer(prompt, false);
+    free(prompt);
 }
 
 // "Yes" 按鈕的回調函數
 void on_yes_button_clicked(GtkWidget *widget, gpointer data) {
-    GtkWidget *window = GTK_WIDGET(data); // 傳遞的視窗指標
-    accept_file = 1; // 使用者按下 "Yes"
-    if (GTK_IS_WIDGET(window)) {
-        gtk_widget_destroy(window); // 銷毀視窗
-    }
-    gtk_main_quit(); // 結束主事件迴圈
+    (void)widget;
+    OfferPrompt *prompt = (OfferPrompt*)data;
+    prompt_answer(prompt, true);
+    gtk_widget_destroy(prompt->window);
 }
 
 // "No" 按鈕的回調函數
 void on_no_button_clicked(GtkWidget *widget, gpointer data) {
-    GtkWidget *window = GTK_WIDGET(data); // 傳遞的視窗指標
-    accept_file = 0; // 使用者按下 "No"
-    if (GTK_IS_WIDGET(window)) {
-        gtk_widget_destroy(window); // 銷毀視窗
-    }
-    gtk_main_quit(); // 結束主事件迴圈
+    (void)widget;
+    OfferPrompt *prompt = (OfferPrompt*)data;
+    prompt_answer(prompt, false);
+    gtk_widget_destroy(prompt->window);
 }
 
-// 主函數實作
-int file_questioner(char *from, char *filename) {
-    GtkWidget *window;
+// server 那邊的 offer 已經逾時
+static gboolean on_prompt_timeout(gpointer data) {
+    OfferPrompt *prompt = (OfferPrompt*)data;
+    prompt->timer = 0;
+    prompt_answer(prompt, false);
+    gtk_widget_destroy(prompt->window);
+    return G_SOURCE_REMOVE;
+}
+
+// 建立對話框，不等使用者回答
+static gboolean show_offer(gpointer data) {
+    OfferPrompt *prompt = (OfferPrompt*)data;
     GtkWidget *vbox;
     GtkWidget *label;
     GtkWidget *button_yes;
     GtkWidget *button_no;
     GtkWidget *button_box;
 
-    // 初始化 GTK
-    gtk_init(NULL, NULL);
-
-    // 創建主視窗
-    window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-    gtk_window_set_title(GTK_WINDOW(window), "Confirmation");
-    gtk_window_set_default_size(GTK_WINDOW(window), 300, 150);
-    gtk_container_set_border_width(GTK_CONTAINER(window), 10);
-
-    // 連接信號：delete_event 和 destroy
-    g_signal_connect(G_OBJECT(window), "delete_event", G_CALLBACK(on_delete_event), NULL);
-    g_signal_connect(G_OBJECT(window), "destroy", G_CALLBACK(on_destroy), NULL);
+    // 創建視窗
+    prompt->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_title(GTK_WINDOW(prompt->window), "Confirmation");
+    gtk_window_set_default_size(GTK_WINDOW(prompt->window), 300, 150);
+    gtk_container_set_border_width(GTK_CONTAINER(prompt->window), 10);
+    g_signal_connect(G_OBJECT(prompt->window), "destroy", G_CALLBACK(on_destroy), prompt);
 
     // 設定垂直布局容器
     vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
-    gtk_container_add(GTK_CONTAINER(window), vbox);
+    gtk_container_add(GTK_CONTAINER(prompt->window), vbox);
 
     // 添加標籤顯示訊息
     char message[1024];
-    sprintf(message, "%s sent a file (%s) to you.\nWould you accept it?", from, filename);
+    snprintf(message, sizeof(message), "%s sent a file (%s) to you.\nWould you accept it?",
+             prompt->from, prompt->label);
     label = gtk_label_new(message);
     gtk_box_pack_start(GTK_BOX(vbox), label, TRUE, TRUE, 0);
 
@@ -159,127 +199,201 @@ int file_questioner(char *from, char *filename) {
 
     // 創建 "Yes" 按鈕
     button_yes = gtk_button_new_with_label("Yes");
-    g_signal_connect(button_yes, "clicked", G_CALLBACK(on_yes_button_clicked), window);
+    g_signal_connect(button_yes, "clicked", G_CALLBACK(on_yes_button_clicked), prompt);
     gtk_container_add(GTK_CONTAINER(button_box), button_yes);
 
     // 創建 "No" 按鈕
     button_no = gtk_button_new_with_label("No");
-    g_signal_connect(button_no, "clicked", G_CALLBACK(on_no_button_clicked), window);
+    g_signal_connect(button_no, "clicked", G_CALLBACK(on_no_button_clicked), prompt);
     gtk_container_add(GTK_CONTAINER(button_box), button_no);
 
     // 顯示所有元件
-    gtk_widget_show_all(window);
+    gtk_widget_show_all(prompt->window);
+    prompt->timer = g_timeout_add_seconds(OFFER_TIMEOUT, on_prompt_timeout, prompt);
+    return G_SOURCE_REMOVE;
+}
 
-    // 啟動主事件迴圈
-    gtk_main();
+static gboolean stop_gtk(gpointer data) {
+    (void)data;
+    gtk_main_quit();
+    return G_SOURCE_REMOVE;
+}
 
-    // 返回用戶的選擇
-    return accept_file;
+// 由 on_offer 呼叫：把 offer 排進 GTK main loop，使用者的決定再交給 libchat
+void ask_offer(int offer_id, const char *from, const char *label) {
+    OfferPrompt *prompt = calloc(1, sizeof(OfferPrompt));
+    prompt->offer_id = offer_id;
+    strncpy(prompt->from, from, MAX_NAME - 1);
+    strncpy(prompt->label, label, sizeof(prompt->label) - 1);
+    if (gtk_ready) {
+        g_idle_add(show_offer, prompt);
+        return;
+    }
+    printf(RED"No display, rejecting %s from %s\n"NONE, label, from);
+    prompt_answer(prompt, false);
+    free(prompt);
 }
 
 //--- MAIN FUNCTION ---//
 int main() {
-    // 初始化 SSL 客戶端上下文
-    SSL_library_init();
-    SSL_load_error_strings();
-    OpenSSL_add_ssl_algorithms();
-    ctx = initialize_ssl_client();
-    if (!ctx) {
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+    chat = chat_client_new();
+    if (!chat) {
+        ERR_EXIT("chat_client_new");
     }
 
+    // 初始化 GTK 一次，之後 main thread 執行 GTK main loop 顯示 file offer
+    gtk_ready = gtk_init_check(NULL, NULL);
+    if (!gtk_ready)
+        printf("[Warning] No display, incoming files will be rejected\n");
+
     // 取得 Receiver Port
+    int receiver_port;
     printf("Enter receiver port for direct message: ");
-    scanf("%d", &(user.receiver_port));
-    
-    // 建立Receiver socket
-    struct sockaddr_in rcvraddr;
-    if (create_listen_port (&(user.receiver_fd), &rcvraddr, user.receiver_port, 1) == -1) {
-        ERR_EXIT("create_listen_port");
-    }
+    scanf("%d", &receiver_port);
 
-    // 建立Receiver socket (未使用 SSL)
-    // 注意：Receiver socket 主要在客戶端接收來自其他客戶端的直接消息，不涉及 SSL
-    // 這裡假設客戶端不需要建立接收 socket，因為直接消息是由其他客戶端發起的
-    // 如果需要，您可以自行添加接收 socket 的實作
-
-    // 連線至server
-    struct sockaddr_in servaddr;
-    int sock_fd;
-    if (connect_to_port(&sock_fd, &servaddr, SERVER_IP, SERVER_PORT) == -1) {
-        ERR_EXIT("connect_to_port");
-    }
-
-    // 為連接建立 SSL 結構
-    SSL *ssl = SSL_new(ctx);
-    SSL_set_fd(ssl, sock_fd);
-    if (SSL_connect(ssl) <= 0) {
-        ERR_print_errors_fp(stderr);
-        SSL_free(ssl);
-        close(sock_fd);
-        exit(EXIT_FAILURE);
+    // 連線至server，receiver port 在 server 接受後開始監聽
+    ChatEvents events = { on_message, on_spool, on_offer, on_transfer, on_closed, on_presence };
+    session = chat_session_new(chat, SERVER_IP, SERVER_PORT, receiver_port, &events, NULL);
+    if (!session) {
+        ERR_EXIT("chat_session_new");
     }
 
-    // 接收伺服器回應
-    char buf[BUFFER_SIZE];
-    memset(buf, 0, BUFFER_SIZE);
-    int bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
-        SSL_shutdown(ssl);
-        SSL_free(ssl);
-        close(sock_fd);
-        exit(EXIT_FAILURE);
+    Reply r = REPLY_INIT;
+    int ok = wait_reply(&r, chat_connect(session, reply_done, &r));
+    // server 過載時照它建議的秒數等一下再連
+    for (int tries = 1; ok == 0 && chat_busy_retry(r.reply) > 0 && tries <= BUSY_RETRIES; tries++) {
+        int sec = chat_busy_retry(r.reply);
+        printf("Server is busy, retrying in %d s (%d/%d)\n", sec, tries, BUSY_RETRIES);
+        sleep(sec);
+        r = (Reply)REPLY_INIT;
+        ok = wait_reply(&r, chat_connect(session, reply_done, &r));
     }
-    buf[bytes] = '\0'; // 確保字串結尾
-
-    if (strcmp(buf, QUEUE_FULL) == 0) {
-        printf("Server response: queue full\n");
-        SSL_shutdown(ssl);
-        SSL_free(ssl);
-        close(sock_fd);
-        return 0;
-    } else if (strcmp(buf, ACCEPT_TASK) == 0) {
+    if (ok == 1) {
         printf("Server response: accept task\n");
         printf("Start creating threads...\n");
-        pthread_t client_thd, relay_thd, direct_thd;
-        pthread_create(&relay_thd, NULL, relay_thread, NULL);
-        pthread_create(&direct_thd, NULL, direct_thread, NULL);
-        pthread_create(&client_thd, NULL, client_thread, (void*)ssl);
-        file_thread();
+        pthread_t client_thd;
+        pthread_create(&client_thd, NULL, client_thread, NULL);
+        if (gtk_ready)
+            gtk_main();
         pthread_join(client_thd, NULL);
-        pthread_join(relay_thd, NULL);
-        pthread_join(direct_thd, NULL);
+    } else {
+        printf("Server response: %s\n", r.reply);
     }
 
     // 清理
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    SSL_CTX_free(ctx);
+    chat_session_free(session);
+    chat_client_free(chat);
     cleanup_ssl();
-    close(sock_fd);
-    return 0;
+    return ok == 1 ? 0 : EXIT_FAILURE;
+}
+
+//--- REPLY ---//
+void reply_done(ChatSession *s, void *arg, int ok, const char *reply) {
+    (void)s;
+    Reply *r = (Reply*)arg;
+    pthread_mutex_lock(&r->lock);
+    r->ok = ok;
+    snprintf(r->reply, sizeof(r->reply), "%s", reply ? reply : "");
+    r->done = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// submitted 為 chat_* 的回傳值；回傳 request 的結果（1 / 0 / -1）
+int wait_reply(Reply *r, int submitted) {
+    if (submitted == -1) {
+        strcpy(r->reply, "request not sent");
+        return -1;
+    }
+    pthread_mutex_lock(&r->lock);
+    while (!r->done)
+        pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+    return r->ok;
+}
+
+//--- EVENTS ---//
+void on_message(ChatSession *s, void *ctx, const char *from, const char *mes, bool direct) {
+    (void)s;
+    (void)ctx;
+    printf("<%s>: %s\n", from, mes);
+    printf(direct ? GREEN"Sent by Direct Message\n"NONE : GREEN"Sent by Relay Message\n"NONE);
+}
+
+void on_spool(ChatSession *s, void *ctx, const char *from, const char *mes) {
+    (void)s;
+    (void)ctx;
+    printf(YELLOW"[Spool] <%s>: %s waiting, use option 9 to download\n"NONE, from, mes);
+}
+
+void on_offer(ChatSession *s, void *ctx, int offer_id, const char *from,
+              const char *filename, long long size, int nfiles) {
+    (void)s;
+    (void)ctx;
+    (void)size;
+    char label[MAX_MES + 32];
+    if (nfiles > 0 && filename[strlen(filename) - 1] == '/')
+        snprintf(label, sizeof(label), "%s, %d files", filename, nfiles);
+    else
+        snprintf(label, sizeof(label), "%s", filename);
+    ask_offer(offer_id, from, label);
+}
+
+// on_transfer 可能在傳輸 thread 呼叫
+void on_transfer(ChatSession *s, void *ctx, const ChatTransfer *t) {
+    (void)s;
+    (void)ctx;
+    switch (t->state) {
+    case CHAT_XFER_STARTED:
+        if (t->upload)
+            printf(GREEN"Transfer #%d: %s, sending %s in background\n"NONE, t->id, t->detail, t->filename);
+        else
+            printf(GREEN"Transfer #%d: %s %s in background\n"NONE, t->id, t->detail, t->filename);
+        break;
+    case CHAT_XFER_DONE:
+        printf(GREEN"Transfer #%d: %s %s\n"NONE, t->id, t->filename, t->detail);
+        break;
+    case CHAT_XFER_FAILED:
+        printf(RED"Transfer #%d: %s %s\n"NONE, t->id, t->filename, t->detail ? t->detail : "failed");
+        break;
+    case CHAT_XFER_REJECTED:
+        printf(RED"Offer #%d (%s): rejected\n"NONE, t->offer_id, t->filename);
+        break;
+    case CHAT_XFER_EXPIRED:
+        printf(RED"Offer #%d (%s): no answer in time\n"NONE, t->offer_id, t->filename);
+        break;
+    case CHAT_XFER_CANCELLED:
+        printf(RED"Offer #%d (%s) from %s was cancelled\n"NONE, t->offer_id, t->filename, t->detail);
+        break;
+    }
+}
+
+void on_closed(ChatSession *s, void *ctx) {
+    (void)s;
+    (void)ctx;
+    if (!stop_flag)
+        printf(RED"Connection to server closed\n"NONE);
+}
+
+void on_presence(ChatSession *s, void *ctx, int id, const char *name, bool online) {
+    (void)s;
+    (void)ctx;
+    printf(DARY_GRAY"[%2d] %s is %s\n"NONE, id, name, online ? "online" : "offline");
 }
 
 //--- Client Thread ---//
 void *client_thread(void *arg) {
-    SSL *ssl = (SSL*)arg;
-    user.status = false;
-    if (handle_no_logged_ssl(ssl) != 1)
-        printf("Error in handle_no_logged_ssl\n");
-    stop_flag = true;
-    SSL_shutdown(ssl);
-    shutdown(user.receiver_fd, SHUT_RDWR);
-    close(user.receiver_fd);
-    // 不要關閉 SSL，因為可能在其他地方使用
-    pthread_cond_broadcast(&is_logged_in);
+    (void)arg;
+    if (handle_no_logged() != 1)
+        printf("Error in handle_no_logged\n");
+    if (gtk_ready)
+        g_idle_add(stop_gtk, NULL);
     printf("client thread leave\n");
     return NULL;
 }
 
-// No Logged In via SSL
-int handle_no_logged_ssl(SSL *ssl) {
+// No Logged In
+int handle_no_logged() {
     while (true) {
         show_main_menu();
         int choice;
@@ -287,13 +401,15 @@ int handle_no_logged_ssl(SSL *ssl) {
         scanf("%d", &choice);
 
         if (choice == 1) {
-            send_register_ssl(ssl);
+            send_register();
         } else if (choice == 2) {
-            if (send_login_ssl(ssl) == 1)
-                handle_logged_ssl(ssl);
+            if (send_login() == 1)
+                handle_logged();
         } else if (choice == 3) {
-            if (SSL_write(ssl, EXIT, strlen(EXIT)) <= 0) {
-                printf("Error in SSL_write\n");
+            stop_flag = true;
+            Reply r = REPLY_INIT;
+            if (wait_reply(&r, chat_exit(session, reply_done, &r)) != 1) {
+                printf("Error in sending exit: %s\n", r.reply);
                 break;
             }
             printf("Exiting...\n");
@@ -305,150 +421,52 @@ int handle_no_logged_ssl(SSL *ssl) {
     return 1;
 }
 
-// Register via SSL
-int send_register_ssl(SSL *ssl) {
+// Register
+int send_register() {
     char name[MAX_NAME];
     printf("Enter your username (max %d characters): ", MAX_NAME-1);
-    scanf("%s", name);
-
-    char buf[BUFFER_SIZE];
-    sprintf(buf, "%s%s", REGISTER, name);
-    if (SSL_write(ssl, buf, strlen(buf)) <= 0) {
-        printf("Error in SSL_write\n");
-        return 0;
-    }
+    scanf("%15s", name);
 
-    memset(buf, 0, sizeof(buf));
-    int bytes = SSL_read(ssl, buf, sizeof(buf) - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
-        return 0;
-    }
-    buf[bytes] = '\0';
-
-    if (strcmp(buf, REGISTER_SUCCESS) == 0) {
+    Reply r = REPLY_INIT;
+    if (wait_reply(&r, chat_register(session, name, reply_done, &r)) == 1) {
         printf(GREEN"Register Success!\n"NONE);
         return 1;
     }
-    else {
-        printf("Server response: "RED"%s\n"NONE, buf);
-        return 0;
-    }
+    printf("Server response: "RED"%s\n"NONE, r.reply);
+    return 0;
 }
 
-// Login via SSL
-int send_login_ssl(SSL *ssl) {
+// Login：relay / file socket 與 receiver port 都由 libchat 處理
+int send_login() {
     char name[MAX_NAME];
     printf("Enter your username: ");
-    scanf("%s", name);
-
-    char buf[BUFFER_SIZE];
-    sprintf(buf, "%s%s", LOGIN, name);
-    if (SSL_write(ssl, buf, strlen(buf)) <= 0) {
-        printf("Error in SSL_write\n");
-        return 0;
-    }
-
-    // Relay Socket
-    memset(buf, 0, sizeof(buf));
-    int bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
-        return 0;
-    }
-    buf[bytes] = '\0';
-    if (strcmp(buf, RELAY_SOCKET) != 0) {
-        printf("Server response: User has "RED"%s\n"NONE, buf);
-        return 0;
-    }
-
-    // 建立 Relay Socket
-    struct sockaddr_in relayaddr;
-    int relay_fd;
-    if (connect_to_port(&relay_fd, &relayaddr, SERVER_IP, SIDE_PORT) != 1) {
-        printf("Error in connecting to Relay Socket\n");
-        return 0;
-    }
-
-    SSL *relay_ssl = SSL_new(ctx);
-    SSL_set_fd(relay_ssl, relay_fd);
-    if (SSL_connect(relay_ssl) <= 0) {
-        ERR_print_errors_fp(stderr);
-        SSL_free(relay_ssl);
-        close(relay_fd);
-        return 0;
-    }
-    user.relay_ssl = relay_ssl;
-
-    // File Socket
-    memset(buf, 0, sizeof(buf));
-    bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
-        SSL_shutdown(relay_ssl);
-        SSL_free(relay_ssl);
-        close(relay_fd);
-        return 0;
-    }
-    buf[bytes] = '\0';
-    if (strcmp(buf, FILE_SOCKET) != 0) {
-        printf("the code shouldn't went to here.\n");
-        SSL_shutdown(relay_ssl);
-        SSL_free(relay_ssl);
-        close(relay_fd);
-        return 0;
-    }
-
-    int file_fd;
-    if (connect_to_port(&file_fd, &relayaddr, SERVER_IP, SIDE_PORT) != 1) {
-        printf("Error in connecting to File Socket\n");
-        SSL_shutdown(relay_ssl);
-        SSL_free(relay_ssl);
-        close(relay_fd);
-        return 0;
-    }
-
-    SSL *file_ssl = SSL_new(ctx);
-    SSL_set_fd(file_ssl, file_fd);
-    if (SSL_connect(file_ssl) <= 0) {
-        ERR_print_errors_fp(stderr);
-        SSL_free(file_ssl);
-        close(file_fd);
-        SSL_shutdown(relay_ssl);
-        SSL_free(relay_ssl);
-        close(relay_fd);
-        return 0;
-    }
-    user.file_ssl = file_ssl;
-
-    // 傳 receiver port
-    memset(buf, 0, sizeof(buf));
-    bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (strcmp(buf, ASK_RCVR_PORT) != 0) {
-        printf("the code shouldn't went to here.\n");
-    }
-
-    memset(buf, 0, sizeof(buf));
-    sprintf(buf, "%d", user.receiver_port);
-    SSL_write(ssl, buf, strlen(buf));
-
-    memset(buf, 0, sizeof(buf));
-    bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-
-    if (strcmp(buf, LOGIN_SUCCESS) != 0) {
-        printf("the code shouldn't went to here.\n");
+    scanf("%15s", name);
+
+    Reply r = REPLY_INIT;
+    int ok = wait_reply(&r, chat_login(session, name, reply_done, &r));
+    if (ok == 1) {
+        printf(GREEN"Login Success!\n"NONE);
+        // 每個對話一行 "<ID> <未讀數> <已讀到的 seq>"，chat history 從已讀的地方開始
+        for (char *line = strchr(r.reply, '\n'); line; line = strchr(line + 1, '\n')) {
+            int peer;
+            long long unread, last_read;
+            if (sscanf(line + 1, "%d %lld %lld", &peer, &unread, &last_read) != 3 || peer < 0 || peer >= MAX_USERS)
+                continue;
+            history_cursor[peer] = last_read;
+            if (unread > 0)
+                printf("%lld unread message(s) from ID-%d\n", unread, peer);
+        }
+        return 1;
     }
-
-    strcpy(user.name, name);
-    user.status = true;
-    pthread_cond_broadcast(&is_logged_in);
-    printf(GREEN"Login Success!\n"NONE);
-    return 1;
+    if (ok == 0)
+        printf("Server response: User has "RED"%s\n"NONE, r.reply);
+    else
+        printf(RED"Error in login: %s\n"NONE, r.reply);
+    return 0;
 }
 
-// Logged In via SSL
-int handle_logged_ssl(SSL *ssl) {
-    char buf[BUFFER_SIZE];
+// Logged In
+int handle_logged() {
     while (true) {
         printf("\n%s\n", LINE);
         printf("Command list:\n");
@@ -458,6 +476,12 @@ int handle_logged_ssl(SSL *ssl) {
         printf("4) file transfer\n");
         printf("5) stream video\n");
         printf("6) logout\n");
+        printf("7) file transfers\n");
+        printf("8) send file via spool\n");
+        printf("9) spooled files\n");
+        printf("10) contacts\n");
+        printf("11) chat history\n");
+        printf("12) search messages\n");
         printf("%s\n", LINE);
 
         int choice;
@@ -465,20 +489,33 @@ int handle_logged_ssl(SSL *ssl) {
         scanf("%d", &choice);
 
         if (choice == 1) {
-            show_online_ssl(ssl);
+            show_online();
         } else if (choice == 2) {
-            send_relay_ssl(ssl);
+            send_relay();
         } else if (choice == 3) {
-            send_direct_ssl(ssl);
+            send_direct();
         } else if (choice == 4) {
-            send_file_ssl(ssl);
+            send_file(false);
         } else if (choice == 5) {
-            recv_streaming_ssl(ssl);
+            recv_streaming();
         } else if (choice == 6) {
-            if (SSL_write(ssl, LOGOUT, strlen(LOGOUT)) <= 0)
+            Reply r = REPLY_INIT;
+            if (wait_reply(&r, chat_logout(session, reply_done, &r)) != 1)
                 break;
             printf(GREEN"Logged out successfully.\n"NONE);
             break;
+        } else if (choice == 7) {
+            show_xfers();
+        } else if (choice == 8) {
+            send_file(true);
+        } else if (choice == 9) {
+            recv_spool();
+        } else if (choice == 10) {
+            manage_contacts();
+        } else if (choice == 11) {
+            show_history();
+        } else if (choice == 12) {
+            search_messages();
         } else {
             printf(RED"Unknown choice. Please try again.\n"NONE);
         }
@@ -486,352 +523,286 @@ int handle_logged_ssl(SSL *ssl) {
     return 1;
 }
 
-// Show Online Users via SSL
-int show_online_ssl(SSL *ssl) {
-    char buf[BUFFER_SIZE];
-    if (SSL_write(ssl, SHOW_LIST, strlen(SHOW_LIST)) <= 0) {
-        printf("Error in SSL_write\n");
-        return 0;
-    }
-    memset(buf, 0, sizeof(buf));
-    int bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
+// Show Online Users：roster 在登入時由 server 送來，之後聯絡人的變化會推過來，
+// 其他人的變化只同步上次版本之後的部份
+int show_online() {
+    char list[BUFFER_SIZE * 4];
+    Reply r = REPLY_INIT;
+    if (wait_reply(&r, chat_list(session, reply_done, &r)) != 1) {
+        printf("Error in show list: %s\n", r.reply);
         return 0;
     }
-    buf[bytes] = '\0';
-    printf("Online users:\n%s\n", buf);
+    chat_roster(session, list, sizeof(list));
+    printf("Online users:\n%s\n", list);
     return 1;
 }
 
-// Relay Send Message via SSL
-int send_relay_ssl(SSL *ssl) {
+// Relay Send Message
+int send_relay() {
     int target_id;
-    char buf[BUFFER_SIZE];
     printf("Who you want to send to?\n");
     printf("Please enter his/her ID: ");
     scanf("%d", &target_id);
-    sprintf(buf, "%s%d", RELAY_MES, target_id);
-    if (SSL_write(ssl, buf, strlen(buf)) <= 0) {
-        printf("Error in SSL_write\n");
-        return 0;
-    }
-
-    memset(buf, 0, sizeof(buf));
-    int bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
-        return 0;
-    }
-    buf[bytes] = '\0';
-
-    if (strcmp(buf, ASK_MES) != 0) {
-        printf("Unexpected server response.\n");
-        return 0;
-    }
 
     char message[MAX_MES];
     printf("Enter your message: ");
     scanf(" %[^\n]", message);
-    if (SSL_write(ssl, message, strlen(message)) <= 0) {
-        printf("Error in SSL_write\n");
-        return 0;
-    }
 
-    memset(buf, 0, sizeof(buf));
-    bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
-        return 0;
-    }
-    buf[bytes] = '\0';
-    if (strcmp(buf, MES_SUCCESS) != 0) {
-        printf("Server response: "RED"%s\n"NONE, buf);
+    Reply r = REPLY_INIT;
+    if (wait_reply(&r, chat_relay(session, target_id, message, reply_done, &r)) != 1) {
+        printf("Server response: "RED"%s\n"NONE, r.reply);
         return 0;
     }
-
     printf(GREEN"Relay Send Message Success!\n"NONE);
     return 1;
 }
 
-// Direct Send Message via SSL
-int send_direct_ssl(SSL *ssl) {
+// Direct Send Message：對方的 receiver port 先查 libchat 的 cache，沒有才問 server，訊息直接送過去
+int send_direct() {
     int target_id;
-    char buf[BUFFER_SIZE];
     printf("Who you want to send to?\n");
     printf("Please enter his/her ID: ");
     scanf("%d", &target_id);
-    sprintf(buf, "%s%d", DIRECT_MES, target_id);
-    if (SSL_write(ssl, buf, strlen(buf)) <= 0) {
-        printf("Error in SSL_write\n");
-        return 0;
-    }
-
-    memset(buf, 0, sizeof(buf));
-    int bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
-        return 0;
-    }
-    buf[bytes] = '\0';
-
-    if (strcmp(buf, OFFLINE) == 0) {
-        printf(RED"User offline or doesn't exist. Can't send message.\n"NONE);
-        return 0;
-    }
-
-    char ip[INET_ADDRSTRLEN];
-    int port;
-    sscanf(buf, "%s %d", ip, &port);
-    printf("Target IP: %s\nTarget Port: %d\n", ip, port);
 
     char message[MAX_MES];
     printf("Enter your message: ");
     scanf(" %[^\n]", message);
 
-    int tmp_fd;
-    struct sockaddr_in targetaddr;
-    if (connect_to_port(&tmp_fd, &targetaddr, ip, port) != 1) {
-        printf(RED"Error in connecting to Receiver\n"NONE);
+    Reply r = REPLY_INIT;
+    int ok = wait_reply(&r, chat_direct(session, target_id, message, reply_done, &r));
+    if (ok == 0 && strcmp(r.reply, OFFLINE) == 0) {
+        printf(RED"User offline or doesn't exist. Can't send message.\n"NONE);
         return 0;
     }
-
-    // 傳訊息
-    char to_receiver[BUFFER_SIZE];
-    format_buffer(to_receiver, IS_MES, user.name, "", message);
-    send(tmp_fd, to_receiver, BUFFER_SIZE, 0);
-
-    close(tmp_fd);
+    if (ok != 1) {
+        printf(RED"Error in direct message: %s\n"NONE, r.reply);
+        return 0;
+    }
+    printf(GREEN"Direct Send Message Success!\n"NONE);
     return 1;
 }
 
-// Send File via SSL
-int send_file_ssl(SSL *ssl) {
-    int target_id;
-    char buf[BUFFER_SIZE];
+// Send File
+// spool = true 時檔案先存到 server，接收端不必在線，之後用選項 9 下載
+// 輸入多個以逗號分隔的 ID（如 1,3,4）時，上傳一次由 server 分送給每個人
+int send_file(bool spool) {
+    char targets[64];
     printf("Who you want to send to?\n");
-    printf("Please enter his/her ID: ");
-    scanf("%d", &target_id);
-    sprintf(buf, "%s%d", FILE_TRANSFER, target_id);
-    if (SSL_write(ssl, buf, strlen(buf)) <= 0) {
-        printf("Error in SSL_write\n");
-        return 0;
-    }
+    printf(spool ? "Please enter his/her ID: " : "Please enter his/her ID (or several IDs like 1,3,4): ");
+    scanf("%63s", targets);
 
-    memset(buf, 0, sizeof(buf));
-    int bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
-        return 0;
+    char filename[MAX_MES];
+    printf("Enter your filename (or a directory): ");
+    scanf("%1000s", filename);
+
+    Reply r = REPLY_INIT;
+    int ok = wait_reply(&r, chat_send_file(session, targets, filename, spool, reply_done, &r));
+    if (ok == 1) {
+        // spool 已開始上傳（由 on_transfer 顯示）；直接傳送要等接收端回答
+        int offer_id, invited;
+        if (sscanf(r.reply, OFFER_PENDING" %d %d", &offer_id, &invited) == 2)
+            printf(GREEN"Offer #%d sent to %d user(s), waiting for an answer\n"NONE, offer_id, invited);
+        return 1;
     }
-    buf[bytes] = '\0';
 
-    if (strcmp(buf, ASK_FILE_NAME) != 0) {
-        printf("Unexpected server response.\n");
-        return 0;
-    }
+    if (strcmp(r.reply, "request not sent") == 0)
+        printf(RED"Error! "NONE"Can't read %s\n", filename);
+    else if (strcmp(r.reply, OFFLINE) == 0)
+        printf(RED"User offline or doesn't exist. Can't send file\n"NONE);
+    else if (strcmp(r.reply, SPOOL_FULL) == 0)
+        printf(RED"Server spool is full. Try again later\n"NONE);
+    else
+        printf(RED"Error in asking target: %s\n"NONE, r.reply);
+    return 0;
+}
 
-    char filename[MAX_MES];
-    printf("Enter your filename: ");
-    scanf("%s", filename);
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) {
-        printf(RED"Error! "NONE"Can't open file %s\n", filename);
+// Download Spooled Files
+int recv_spool() {
+    Reply r = REPLY_INIT;
+    if (wait_reply(&r, chat_spool_list(session, reply_done, &r)) != 1) {
+        printf("Error in spool list: %s\n", r.reply);
         return 0;
     }
-    if (SSL_write(ssl, filename, strlen(filename)) <= 0) {
-        printf("Error in SSL_write\n");
-        fclose(fp);
-        return 0;
+    if (strcmp(r.reply, NO_SPOOL) == 0) {
+        printf("No spooled files\n");
+        return 1;
     }
+    printf("Spooled files (ID from size filename):\n%s", r.reply);
 
-    memset(buf, 0, sizeof(buf));
-    bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        printf("Error in SSL_read\n");
-        fclose(fp);
+    int spool_id;
+    printf("Enter spool ID to download (0 to go back): ");
+    scanf("%d", &spool_id);
+    if (spool_id <= 0)
+        return 1;
+
+    // 下載的進度由 on_transfer 顯示
+    Reply get = REPLY_INIT;
+    if (wait_reply(&get, chat_spool_get(session, spool_id, reply_done, &get)) != 1) {
+        printf(RED"Can't download spooled file %d\n"NONE, spool_id);
         return 0;
     }
-    buf[bytes] = '\0';
+    return 1;
+}
 
-    if (strcmp(buf, OFFLINE) == 0) {
-        printf(RED"User offline or doesn't exist. Can't send file\n"NONE);
-        fclose(fp);
+// Show File Transfers
+int show_xfers() {
+    Reply r = REPLY_INIT;
+    if (wait_reply(&r, chat_xfer_stats(session, reply_done, &r)) != 1) {
+        printf("Error in transfer status: %s\n", r.reply);
         return 0;
     }
+    printf("File transfers:\n%s\n", r.reply);
+
+    char jobs[BUFFER_SIZE * 4];
+    chat_session_jobs(session, jobs, sizeof(jobs));
+    printf("This client:\n%s", jobs);
 
-    if (strcmp(buf, FILE_FAIL) == 0) {
-        printf(RED"Error in asking target\n"NONE);
-        fclose(fp);
+    long hits, misses;
+    chat_peer_stats(session, &hits, &misses);
+    printf("Peer address cache: %ld hits, %ld misses", hits, misses);
+    if (hits + misses > 0)
+        printf(" (%.0f%% hit rate)", 100.0 * hits / (hits + misses));
+    printf("\n");
+    return 1;
+}
+
+// Contacts：只有聯絡人登入、登出時會收到通知
+int manage_contacts() {
+    Reply r = REPLY_INIT;
+    if (wait_reply(&r, chat_contacts(session, reply_done, &r)) != 1) {
+        printf("Error in contacts: %s\n", r.reply);
         return 0;
     }
+    const char *lines = strchr(r.reply, '\n');
+    printf("Contacts (ID, online, version, name):\n%s\n", lines ? lines + 1 : "");
 
-    if (strcmp(buf, REJECT_FILE) == 0) {
-        printf(RED"User rejected file\n"NONE);
-        fclose(fp);
+    char action;
+    int target_id;
+    printf("Add (a <ID>), remove (r <ID>) or back (b): ");
+    if (scanf(" %c", &action) != 1 || (action != 'a' && action != 'r'))
+        return 1;
+    if (scanf("%d", &target_id) != 1)
         return 0;
-    }
 
-    // 開始傳送檔案
-    char content[BUFFER_SIZE];
-    memset(content, 0, BUFFER_SIZE);
-    while ((bytes = fread(content, 1, BUFFER_SIZE, fp)) > 0) {
-        if (SSL_write(ssl, content, bytes) <= 0) {
-            printf(RED"Error in sending file\n"NONE);
-            break;
-        }
-        memset(buf, 0, sizeof(buf));
-        bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-        if (bytes <= 0) {
-            printf(RED"Error in SSL_read\n"NONE);
-            break;
-        }
-        buf[bytes] = '\0';
-        if (strcmp(buf, ACK_FILE) != 0) {
-            printf(RED"Error in receiving ACK\n"NONE);
-            break;
-        }
-        memset(content, 0, BUFFER_SIZE);
+    Reply c = REPLY_INIT;
+    int ok = wait_reply(&c, action == 'a' ? chat_contact_add(session, target_id, reply_done, &c)
+                                          : chat_contact_del(session, target_id, reply_done, &c));
+    if (ok != 1) {
+        printf("Server response: "RED"%s\n"NONE, c.reply);
+        return 0;
     }
-    // 傳送結束訊息
-    SSL_write(ssl, END_OF_FILE, strlen(END_OF_FILE));
-    fclose(fp);
+    printf(GREEN"Contact %s.\n"NONE, action == 'a' ? "added" : "removed");
     return 1;
 }
 
-// Relay Thread
-void *relay_thread(void *arg) {
-    while (!stop_flag) {
-        pthread_mutex_lock(&relay_lock);
-        while (!stop_flag && user.status == false)
-            pthread_cond_wait(&is_logged_in, &relay_lock);
-        pthread_mutex_unlock(&relay_lock);
-
-        while (user.status) {
-            char buf[BUFFER_SIZE], signal[SIGNAL_SIZE], from[MAX_NAME], to[MAX_NAME], mes[MAX_MES];
-            int bytes = SSL_read(user.relay_ssl, buf, BUFFER_SIZE - 1);
-            if (bytes <= 0)
-                break;
-            buf[bytes] = '\0';
-            slice_buffer(buf, signal, from, to, mes);
-            if (strcmp(signal, IS_MES) != 0)
-                printf("Unexpected signal in relay_thread\n");
-            printf("<%s>: %s\n", from, mes);
-            printf(GREEN"Sent by Relay Message\n"NONE);
-        }
+// Chat History：顯示上次讀到之後的 relay 訊息，讀完後告訴 server
+int show_history() {
+    int target_id;
+    printf("Whose history do you want to see?\n");
+    printf("Please enter his/her ID: ");
+    scanf("%d", &target_id);
+    if (target_id < 0 || target_id >= MAX_USERS) {
+        printf(RED"Invalid ID.\n"NONE);
+        return 0;
     }
-    printf("Relay thread leave\n");
-    return NULL;
-}
 
-void *direct_thread(void *arg) {
-    while (!stop_flag) {
-        struct sockaddr_in cliaddr;
-        socklen_t clilen = sizeof(cliaddr);
-        int conn_fd = accept(user.receiver_fd, (struct sockaddr*)&cliaddr, &clilen);
-        if (conn_fd < 0) {
-            perror("accept in direct_thread");
-            continue;
+    int more = 1, shown = 0;
+    while (more) {
+        Reply r = REPLY_INIT;
+        long long next;
+        if (wait_reply(&r, chat_history(session, target_id, history_cursor[target_id], reply_done, &r)) != 1 ||
+            sscanf(r.reply, HISTORY_REP " %lld %d", &next, &more) != 2) {
+            printf("Server response: "RED"%s\n"NONE, r.reply);
+            return 0;
         }
-
-        printf("Accepted direct connection from %s:%d\n", inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
-
-        // 讀取數據
-        char buf[BUFFER_SIZE], signal[SIGNAL_SIZE], from[MAX_NAME], to[MAX_NAME], mes[MAX_MES];
-        int bytes = recv(conn_fd, buf, BUFFER_SIZE, 0);
-        if (bytes <= 0) {
-            printf("recv failed or connection closed\n");
-            close(conn_fd);
-            continue;
-        }
-        buf[bytes] = '\0';
-        slice_buffer(buf, signal, from, to, mes);
-        if (strcmp(signal, IS_MES) != 0) {
-            printf("Unexpected signal in direct_thread: %s\n", signal);
+        // 每行 "<seq> <time> <from> <訊息>"
+        char *line = strchr(r.reply, '\n');
+        for (line = line ? line + 1 : NULL; line && *line; ) {
+            char *end = strchr(line, '\n');
+            if (end)
+                *end = '\0';
+            long long t;
+            char from[MAX_NAME];
+            int skip = 0;
+            if (sscanf(line, "%*s %lld %15s %n", &t, from, &skip) == 2 && skip > 0) {
+                time_t when = (time_t)t;
+                char stamp[32];
+                strftime(stamp, sizeof(stamp), "%m-%d %H:%M", localtime(&when));
+                printf("[%s] %s: %s\n", stamp, from, line + skip);
+                shown++;
+            }
+            line = end ? end + 1 : NULL;
         }
-        printf("<%s>: %s\n", from, mes);
-        printf(GREEN"Sent by Direct Message\n"NONE);
-
-        close(conn_fd);
+        history_cursor[target_id] = next;
     }
+    if (shown == 0)
+        printf("No new messages.\n");
 
-    printf("Direct thread leave\n");
-    return NULL;
+    // 告訴 server 已讀到哪裡，下次登入（包括在別台機器）從這裡開始
+    Reply m = REPLY_INIT;
+    if (wait_reply(&m, chat_mark_read(session, target_id, history_cursor[target_id], reply_done, &m)) != 1)
+        printf("Server response: "RED"%s\n"NONE, m.reply);
+    return 1;
 }
 
-// File Thread
-void file_thread() {
-    while (!stop_flag) {
-        pthread_mutex_lock(&file_lock);
-        while (!stop_flag && user.status == false)
-            pthread_cond_wait(&is_logged_in, &file_lock);
-        pthread_mutex_unlock(&file_lock);
-
-        while (user.status) {
-            char buf[BUFFER_SIZE], signal[SIGNAL_SIZE], from[MAX_NAME], to[MAX_NAME], mes[MAX_MES];
-            int bytes = SSL_read(user.file_ssl, buf, BUFFER_SIZE - 1);
-            if (bytes <= 0)
-                break;
-            buf[bytes] = '\0';
-            slice_buffer(buf, signal, from, to, mes);
-            if (strcmp(signal, IS_FILE) != 0)
-                printf("Unexpected signal in file_thread\n");
-
-            int r = file_questioner(from, mes);
-            if (r == 1) {
-                if (SSL_write(user.file_ssl, ACCEPT_FILE, strlen(ACCEPT_FILE)) <= 0) {
-                    printf("Error in SSL_write\n");
-                    continue;
-                }
-                FILE *fp = fopen(mes, "w");
-                if (fp == NULL) {
-                    printf("Error opening file for writing.\n");
-                    continue;
-                }
-                while (true) {
-                    memset(buf, 0, sizeof(buf));
-                    bytes = SSL_read(user.file_ssl, buf, BUFFER_SIZE - 1);
-                    if (bytes <= 0) {
-                        printf("Error in SSL_read\n");
-                        break;
-                    }
-                    buf[bytes] = '\0';
-                    if (strcmp(buf, END_OF_FILE) == 0)
-                        break;
-                    fwrite(buf, 1, bytes, fp);
-                    if (SSL_write(user.file_ssl, ACK_FILE, strlen(ACK_FILE)) <= 0) {
-                        printf("Error in SSL_write\n");
-                        break;
-                    }
-                }
-                fclose(fp);
-            } else {
-                if (SSL_write(user.file_ssl, REJECT_FILE, strlen(REJECT_FILE)) <= 0) {
-                    printf("Error in SSL_write\n");
-                }
-            }
+// Search Messages：在 server 上的 relay 歷史中找含有全部的詞的訊息
+int search_messages() {
+    int target_id, days;
+    char query[MAX_MES];
+    printf("Whose messages do you want to search? (-1 for everyone)\n");
+    printf("Please enter his/her ID: ");
+    scanf("%d", &target_id);
+    printf("Within how many days? (0 for all): ");
+    scanf("%d", &days);
+    printf("Enter the words to search for: ");
+    scanf(" %[^\n]", query);
+
+    time_t since = days > 0 ? time(NULL) - (time_t)days * 24 * 60 * 60 : 0;
+    Reply r = REPLY_INIT;
+    int n;
+    if (wait_reply(&r, chat_search(session, target_id, since, query, reply_done, &r)) != 1 ||
+        sscanf(r.reply, SEARCH_REP " %d", &n) != 1) {
+        printf("Server response: "RED"%s\n"NONE, r.reply);
+        return 0;
+    }
+    // 每行 "<ID> <seq> <time> <from> <片段>"
+    char *line = strchr(r.reply, '\n');
+    for (line = line ? line + 1 : NULL; line && *line; ) {
+        char *end = strchr(line, '\n');
+        if (end)
+            *end = '\0';
+        int peer;
+        long long t;
+        char from[MAX_NAME];
+        int skip = 0;
+        if (sscanf(line, "%d %*s %lld %15s %n", &peer, &t, from, &skip) == 3 && skip > 0) {
+            time_t when = (time_t)t;
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%m-%d %H:%M", localtime(&when));
+            printf("[%s] (ID-%d) %s: %s\n", stamp, peer, from, line + skip);
         }
+        line = end ? end + 1 : NULL;
     }
-    printf("File thread leave\n");
+    if (n == 0)
+        printf("No messages found.\n");
+    return 1;
 }
 
 // 接收視頻流
-int recv_streaming_ssl(SSL *ssl) {
-    char buf[BUFFER_SIZE];
-    
+int recv_streaming() {
     // 发送STREAM_CMD和文件名以请求服务器开始流媒体
     char filename[BUFFER_SIZE];
     printf("请输入要发送的文件名: ");
     scanf("%s", filename);
     filename[strcspn(filename, "\n")] = '\0';
-    
-    char stream_cmd[BUFFER_SIZE];
-    snprintf(stream_cmd, sizeof(stream_cmd), "%s %s", STREAM_CMD, filename);
-    if (SSL_write(ssl, stream_cmd, strlen(stream_cmd)) <= 0) {
-        printf("发送STREAM_CMD失败\n");
+
+    // server 回覆 "<port> <檔名>" 後才開始串流
+    Reply r = REPLY_INIT;
+    if (wait_reply(&r, chat_stream(session, filename, reply_done, &r)) != 1) {
+        printf("Server response: "RED"%s\n"NONE, r.reply);
         return -1;
     }
-    
+
     // 建立到視頻流服務器的連接
     int stream_fd;
     struct sockaddr_in stream_addr;
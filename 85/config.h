@@ -11,6 +11,14 @@
 #define SERVER_PORT 9530
 #define SIDE_PORT 9531
 #define STREAM_PORT 9532
+#define FILE_PORT 9533
+#define XFER_TOKEN_LEN 16              // 檔案資料連線的 token 長度（hex）
+#define P2P_PSK_LEN 32                 // 直接傳檔的 PSK 長度（hex）
+#define OFFER_MAX 64                   // server 同時保留的 file offer 數
+#define OFFER_TIMEOUT 120              // 接收端回覆 file offer 的期限（秒）
+#define HEARTBEAT_SEC 30               // client 閒置這麼久就送一次 PING
+#define SESSION_IDLE_SEC 90            // server 這麼久沒收到 request 就關掉 session（三次 heartbeat）
+#define REQUEST_TIMEOUT_SEC 10         // request 進行到一半（參數、登入的 side socket）等 client 的期限
 
 // 函数声明
 int create_listen_port(int *listen_fd, struct sockaddr_in *servaddr, int port, int max_connection);
@@ -24,6 +32,14 @@ int connect_to_port(int *conn_fd, struct sockaddr_in *servaddr, char *ip, int po
 #define MAX_USERS 20                   // 最多註冊人數
 #define QUEUE_SIZE 20                  // 最多等待連線人數
 
+// 過載控制：新連線在 TLS handshake 之前決定收不收，收不下時回覆明文的 SERVER_BUSY
+#define ADMIT_TARGET_MS 100            // 連線在佇列裡等 worker 的目標時間
+#define ADMIT_INTERVAL_MS 1000         // 等待超過目標持續這麼久就算過載，開始拒絕新連線
+#define ADMIT_CPU_MAX 90               // 整台機器的 CPU 使用率（%）超過時拒絕新連線
+#define ADMIT_SAMPLE_MS 500            // 多久量一次 CPU 使用率、清一次佇列裡等太久的連線
+#define ADMIT_RETRY_SEC 2              // 建議 client 重試的最短秒數，積壓越久越長
+#define ADMIT_RETRY_MAX 30
+
 #define ERR_EXIT(a) do { perror(a); exit(1); } while(0)
 
 // 添加 error_exit 函数定义
@@ -56,7 +72,7 @@ int recv_full(int sockfd, void *buf, size_t len);
 // 訊息定義
 #define LINE "================================"
 
-#define QUEUE_FULL "queue full"
+#define SERVER_BUSY "server_busy"      // 明文（不是 TLS）："server_busy <秒>"，之後 server 關掉連線
 
 #define ACCEPT_TASK "accept task"
 
@@ -71,11 +87,26 @@ int recv_full(int sockfd, void *buf, size_t len);
     #define RELAY_SOCKET "relay_socket"
     #define FILE_SOCKET "file_socket"
     #define ASK_RCVR_PORT "ask_rcvr_port"
-    #define LOGIN_SUCCESS "login_success"
+    #define LOGIN_SUCCESS "login_success"     // 後面接 "\n" 與每個對話一行 "<ID> <未讀數> <已讀到的 seq>"
 #define EXIT "exit"
 #define UNKNOWN "unknown"
-
-#define SHOW_LIST "show_list"
+#define PING "ping"                           // heartbeat：登入前後都可以送，只重設 server 的閒置期限
+    #define PONG "pong"
+
+#define SHOW_LIST "show_list"                 // "show_list <version>"：只回覆該版本之後的變化
+    #define ROSTER "roster"                   // 回覆 "roster <version> <more>\n" 加上數行 "<ID> <0|1> <version> <name>"；
+                                              // 登入後 relay socket 也以此送完整的 roster
+    #define PRESENCE "presence"               // relay socket：mes 為數行 "<ID> <0|1> <version> <name>"，
+                                              // 只推給把他們加進聯絡人的人
+#define ROSTER_QUERY "roster_query"           // "roster_query <page> <0|1 只看在線的> [名稱開頭]"
+    #define ROSTER_PAGE_REP "roster_page"     // 回覆 "roster_page <version> <page> <符合的人數>\n" 加上一頁
+#define CONTACT_ADD "contact_add"             // "contact_add <ID>"：之後收得到他的 presence
+    #define CONTACT_SUCCESS "contact_success" // 加入時後面接 "\n" 與他目前的一行 roster
+    #define CONTACT_FULL "contact_full"
+    #define NO_USER "no_user"
+#define CONTACT_DEL "contact_del"             // "contact_del <ID>"
+#define CONTACT_LIST "contact_list"
+    #define CONTACTS "contacts"               // 回覆 "contacts\n" 加上每個聯絡人一行 roster；登入後 relay socket 也送一次
 #define RELAY_MES "relay_mes"
     #define ASK_MES "ask_mes"
     #define IS_MES "is_mes "
@@ -91,11 +122,39 @@ int recv_full(int sockfd, void *buf, size_t len);
     #define FILE_FAIL "file_fail"
     #define ACCEPT_FILE "accept_file"
     #define REJECT_FILE "reject_file"
-    #define ACK_FILE "ack_file"
-    #define END_OF_FILE "end_of_file"
+    #define OFFER_PENDING "offer_pending"
+    #define OFFER_EXPIRED "offer_expired"
+    #define XFER_ID "xfer_id"
+    #define XFER_UP "up"
+    #define XFER_DOWN "down"
+    #define XFER_P2P "p2p"
+#define MULTI_FILE "multi_file"
+#define SPOOL_FILE "spool_file"
+    #define SPOOL_FULL "spool_full"
+    #define IS_SPOOL "is_spool"
+#define SPOOL_LIST "spool_list"
+    #define NO_SPOOL "no_spool"
+#define SPOOL_GET "spool_get"
+#define XFER_STATS "xfer_stats"
+#define HISTORY "history"                     // "history <ID> <cursor>"：跟該使用者的 relay 訊息中 seq 大於 cursor 的
+    #define HISTORY_REP "history"             // 回覆 "history <next cursor> <more>\n" 加上數行 "<seq> <time> <from> <訊息>"
+#define MARK_READ "mark_read"                 // "mark_read <ID> <seq>"：跟該使用者的對話已讀到 seq
+    #define UNREAD_REP "unread"               // 回覆 "unread <還沒讀的則數>"
+#define SEARCH "search"                       // "search <ID> <since> <詞...>"：自己的 relay 訊息中含有全部的詞、時間不早於 since 的，ID 為 -1 時不限對話
+    #define SEARCH_REP "search"               // 回覆 "search <n>\n" 加上 n 行 "<ID> <seq> <time> <from> <片段>"，從新到舊；ID 為對話的另一個人，seq 可當 history 的 cursor
 #define LOGOUT "logout"
     #define LOGOUT_SUCCESS "logout_success"
 
+// pipelined request："req <seq> <指令與全部參數>"，一個 frame 就是一個完整的 request；
+// 回覆為 "rep <seq> <回覆>"，client 以 seq 對應，不必等上一個回覆就能送下一個
+#define PIPE_REQ "req "
+#define PIPE_REP "rep "
+#define PIPE_WINDOW 32                    // client 每個 session 最多同時等幾個回覆
+
+// presence 只推給 watcher（把自己加進聯絡人的人），由 server 的 presence thread 合成一批送出
+#define CONTACT_MAX 16                    // 每個人最多的聯絡人數
+#define PRESENCE_BATCH_MS 50              // 收到第一個變化後等多久再送，這段時間內的變化合成一批
+
 // 顏色
 #define NONE "\033[m"
 #define RED "\033[0;32;31m"
@@ -0,0 +1,428 @@
+// delta.c
+#define _GNU_SOURCE
+#include "delta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DELTA_OUT (256 * 1024)            // 傳送端合併指令的 buffer
+
+static uint64_t cpu_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+//--- CHECKSUM ---//
+// rsync 的 rolling checksum：a 為 bytes 總和，b 為加權總和，各取 16 bits
+// 一次處理 4 bytes，讓編譯器可以展開與向量化
+static void weak_init(const unsigned char *p, size_t len, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0, s2 = 0;
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        s2 += 4 * (s1 + p[i]) + 3 * p[i + 1] + 2 * p[i + 2] + p[i + 3];
+        s1 += p[i] + p[i + 1] + p[i + 2] + p[i + 3];
+    }
+    for (; i < len; i++) {
+        s1 += p[i];
+        s2 += s1;
+    }
+    *a = s1 & 0xffff;
+    *b = s2 & 0xffff;
+}
+
+static void strong_sum(const unsigned char *p, size_t len, unsigned char *out) {
+    unsigned char md[32];
+    EVP_Digest(p, len, md, NULL, EVP_sha256(), NULL);
+    memcpy(out, md, DELTA_STRONG);
+}
+
+// block 大小約為檔案大小的平方根，block 數與每個 block 的成本取平衡
+static uint32_t block_size_for(long long size) {
+    uint32_t bs = DELTA_BLOCK_MIN;
+    while (bs < DELTA_BLOCK_MAX && (long long)bs * bs < size)
+        bs *= 2;
+    return bs;
+}
+
+//--- SIGNATURE ---//
+// 接收端：對舊檔 path 產生 signature；沒有可用的舊檔時只有 header（block 數為 0）
+// msg 由呼叫端 free，成功回傳 1，記憶體不足回傳 -1
+int delta_sig_make(const char *path, unsigned char **msg, size_t *len) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    uint64_t count = 0;
+    uint32_t bs = DELTA_BLOCK_MIN;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= DELTA_MIN_SIZE) {
+        bs = block_size_for(st.st_size);
+        count = st.st_size / bs;       // 最後不滿一個 block 的部分不做 signature
+    }
+
+    *len = DELTA_SIG_HDR + count * DELTA_SIG_ENTRY;
+    *msg = malloc(*len);
+    if (!*msg) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    unsigned char *p = *msg;
+    memcpy(p, "DSIG", 4);
+    put32(p + 4, bs);
+    put32(p + 8, count >> 32);
+    put32(p + 12, count);
+    p += DELTA_SIG_HDR;
+
+    char *map = count ? mmap(NULL, count * bs, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (count && map == MAP_FAILED) {
+        // 讀不到舊檔就當作沒有
+        count = 0;
+        *len = DELTA_SIG_HDR;
+        memset(*msg + 8, 0, 8);
+    }
+    if (count) {
+        madvise(map, count * bs, MADV_SEQUENTIAL);
+        for (uint64_t i = 0; i < count; i++) {
+            const unsigned char *blk = (const unsigned char*)map + i * bs;
+            uint32_t a, b;
+            weak_init(blk, bs, &a, &b);
+            put32(p, a | b << 16);
+            strong_sum(blk, bs, p + 4);
+            p += DELTA_SIG_ENTRY;
+        }
+        munmap(map, count * bs);
+    }
+    if (fd >= 0)
+        close(fd);
+    return 1;
+}
+
+// 解析 signature header，格式錯誤回傳 -1
+int delta_sig_header(const unsigned char *hdr, uint32_t *block_size, uint64_t *count) {
+    if (memcmp(hdr, "DSIG", 4) != 0)
+        return -1;
+    *block_size = get32(hdr + 4);
+    *count = (uint64_t)get32(hdr + 8) << 32 | get32(hdr + 12);
+    if (*block_size < DELTA_BLOCK_MIN || *block_size > DELTA_BLOCK_MAX)
+        return -1;
+    return 1;
+}
+
+static uint64_t weak_slot(const DeltaSig *sig, uint32_t weak) {
+    return (weak * 2654435761u) & sig->mask;
+}
+
+// 傳送端：載入 signature 並建立 weak checksum 的索引，成功回傳 1
+int delta_sig_load(DeltaSig *sig, uint32_t block_size, uint64_t count, const unsigned char *body) {
+    memset(sig, 0, sizeof(*sig));
+    sig->block_size = block_size;
+    sig->count = count;
+    uint64_t slots = 1024;
+    while (slots < count * 2)
+        slots *= 2;
+    sig->mask = slots - 1;
+    sig->blocks = malloc(count * sizeof(DeltaBlock));
+    sig->head = malloc(slots * sizeof(int64_t));
+    sig->next = malloc(count * sizeof(int64_t));
+    if (!sig->blocks || !sig->head || !sig->next) {
+        delta_sig_free(sig);
+        return -1;
+    }
+    memset(sig->head, 0xff, slots * sizeof(int64_t));
+    for (uint64_t i = 0; i < count; i++) {
+        const unsigned char *e = body + i * DELTA_SIG_ENTRY;
+        sig->blocks[i].weak = get32(e);
+        memcpy(sig->blocks[i].strong, e + 4, DELTA_STRONG);
+    }
+    // 倒著插入，同一個 weak 的 block 依編號由小到大
+    for (uint64_t i = count; i-- > 0;) {
+        uint64_t h = weak_slot(sig, sig->blocks[i].weak);
+        sig->next[i] = sig->head[h];
+        sig->head[h] = i;
+    }
+    return 1;
+}
+
+void delta_sig_free(DeltaSig *sig) {
+    free(sig->blocks);
+    free(sig->head);
+    free(sig->next);
+    memset(sig, 0, sizeof(*sig));
+}
+
+// weak 相同才算 strong hash，strong 也相同才算找到；沒有回傳 -1
+static int64_t find_block(const DeltaSig *sig, uint32_t weak, const unsigned char *p) {
+    bool computed = false;
+    unsigned char strong[DELTA_STRONG];
+    for (int64_t i = sig->head[weak_slot(sig, weak)]; i >= 0; i = sig->next[i]) {
+        if (sig->blocks[i].weak != weak)
+            continue;
+        if (!computed) {
+            strong_sum(p, sig->block_size, strong);
+            computed = true;
+        }
+        if (memcmp(strong, sig->blocks[i].strong, DELTA_STRONG) == 0)
+            return i;
+    }
+    return -1;
+}
+
+//--- ENCODER ---//
+typedef struct {
+    char *buf;
+    size_t len;
+    DeltaEmit emit;
+    void *arg;
+    DeltaStats *st;
+} DeltaOut;
+
+static int out_flush(DeltaOut *o) {
+    if (o->len > 0 && o->emit(o->arg, o->buf, o->len) == -1)
+        return -1;
+    o->st->sent_bytes += o->len;
+    o->len = 0;
+    return 1;
+}
+
+static int out_put(DeltaOut *o, const void *data, size_t len) {
+    while (len > 0) {
+        if (o->len == DELTA_OUT && out_flush(o) == -1)
+            return -1;
+        size_t n = DELTA_OUT - o->len < len ? DELTA_OUT - o->len : len;
+        memcpy(o->buf + o->len, data, n);
+        o->len += n;
+        data = (const char*)data + n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int out_op(DeltaOut *o, int type, uint32_t arg) {
+    unsigned char op[DELTA_OP];
+    op[0] = type;
+    put32(op + 1, arg);
+    return out_put(o, op, DELTA_OP);
+}
+
+static int out_literal(DeltaOut *o, const unsigned char *p, size_t len) {
+    while (len > 0) {
+        uint32_t n = len > DELTA_OUT ? DELTA_OUT : len;
+        if (out_op(o, DELTA_LITERAL, n) == -1 || out_put(o, p, n) == -1)
+            return -1;
+        o->st->literal_bytes += n;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// 以 rolling checksum 逐 byte 比對新檔 path，輸出 literal 與 block 編號，最後附上整個檔案的 SHA-256
+// 成功回傳 1，讀檔或 emit 失敗回傳 -1
+int delta_encode(const DeltaSig *sig, const char *path, DeltaEmit emit, void *arg, DeltaStats *st) {
+    memset(st, 0, sizeof(*st));
+    uint64_t cpu0 = cpu_now_ns();
+    int fd = open(path, O_RDONLY);
+    struct stat fst;
+    if (fd < 0 || fstat(fd, &fst) == -1) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size_t len = fst.st_size;
+    const unsigned char *data = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+    if (len)
+        madvise((void*)data, len, MADV_SEQUENTIAL);
+
+    DeltaOut o = { malloc(DELTA_OUT), 0, emit, arg, st };
+    int r = o.buf ? 1 : -1;
+    size_t bs = sig->block_size, p = 0, lit = 0;
+    uint32_t a = 0, b = 0;
+    if (len >= bs)
+        weak_init(data, bs, &a, &b);
+    while (r == 1 && sig->count > 0 && p + bs <= len) {
+        int64_t idx = find_block(sig, a | b << 16, data + p);
+        if (idx >= 0) {
+            if (out_literal(&o, data + lit, p - lit) == -1 || out_op(&o, DELTA_BLOCK, idx) == -1) {
+                r = -1;
+                break;
+            }
+            st->matched_blocks++;
+            p += bs;
+            lit = p;
+            if (p + bs <= len)
+                weak_init(data + p, bs, &a, &b);
+            continue;
+        }
+        // 往後滑一個 byte
+        if (p + bs < len) {
+            a = (a - data[p] + data[p + bs]) & 0xffff;
+            b = (b - bs * data[p] + a) & 0xffff;
+        }
+        p++;
+    }
+    unsigned char md[32];
+    if (r == 1 && out_literal(&o, data + lit, len - lit) == -1)
+        r = -1;
+    if (r == 1) {
+        EVP_Digest(data, len, md, NULL, EVP_sha256(), NULL);
+        if (out_op(&o, DELTA_DONE, 0) == -1 || out_put(&o, md, sizeof(md)) == -1 ||
+            out_flush(&o) == -1)
+            r = -1;
+    }
+    if (len)
+        munmap((void*)data, len);
+    free(o.buf);
+    st->file_bytes = len;
+    st->cpu_ns = cpu_now_ns() - cpu0;
+    return r;
+}
+
+//--- DECODER ---//
+// 開啟舊檔與暫存檔（path.delta），sig_hdr 為接收端自己送出的 signature header
+int delta_writer_open(DeltaWriter *w, const char *path, long long size, const unsigned char *sig_hdr) {
+    memset(w, 0, sizeof(*w));
+    if (delta_sig_header(sig_hdr, &w->block_size, &w->count) == -1)
+        return -1;
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    snprintf(w->tmp, sizeof(w->tmp), "%s.delta", path);
+    w->basis_fd = open(path, O_RDONLY);
+    w->block = malloc(w->block_size);
+    w->md = EVP_MD_CTX_new();
+    if (w->basis_fd < 0 || !w->block || !w->md || EVP_DigestInit_ex(w->md, EVP_sha256(), NULL) != 1 ||
+        file_writer_open(&w->out, w->tmp, size) == -1) {
+        if (w->basis_fd >= 0)
+            close(w->basis_fd);
+        free(w->block);
+        EVP_MD_CTX_free(w->md);
+        return -1;
+    }
+    return 1;
+}
+
+static int emit_out(DeltaWriter *w, const char *data, size_t len) {
+    EVP_DigestUpdate(w->md, data, len);
+    w->stats.file_bytes += len;
+    return file_writer_write(&w->out, data, len);
+}
+
+// 複製舊檔的一個 block
+static int copy_block(DeltaWriter *w, uint32_t idx) {
+    if (idx >= w->count)
+        return -1;
+    size_t done = 0;
+    while (done < w->block_size) {
+        ssize_t n = pread(w->basis_fd, w->block + done, w->block_size - done,
+                          (off_t)idx * w->block_size + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    w->stats.matched_blocks++;
+    return emit_out(w, w->block, w->block_size);
+}
+
+// 解析 delta stream，資料可以在任何位置被切開；格式錯誤或寫檔失敗回傳 -1
+int delta_writer_write(DeltaWriter *w, const char *data, size_t len) {
+    uint64_t cpu0 = cpu_now_ns();
+    w->stats.sent_bytes += len;
+    int r = 1;
+    while (r == 1 && len > 0) {
+        size_t n;
+        if (w->ended) {
+            r = -1;
+        } else if (w->phase == 0) {
+            n = DELTA_OP - w->op_len < len ? DELTA_OP - w->op_len : len;
+            memcpy(w->op + w->op_len, data, n);
+            w->op_len += n;
+            data += n;
+            len -= n;
+            if (w->op_len < DELTA_OP)
+                break;
+            w->op_len = 0;
+            uint32_t arg = get32(w->op + 1);
+            if (w->op[0] == DELTA_LITERAL) {
+                w->remain = arg;
+                w->phase = arg ? 1 : 0;
+            } else if (w->op[0] == DELTA_BLOCK) {
+                r = copy_block(w, arg);
+            } else if (w->op[0] == DELTA_DONE) {
+                w->sum_len = 0;
+                w->phase = 2;
+            } else {
+                r = -1;
+            }
+        } else if (w->phase == 1) {
+            n = w->remain < len ? w->remain : len;
+            r = emit_out(w, data, n);
+            w->stats.literal_bytes += n;
+            w->remain -= n;
+            data += n;
+            len -= n;
+            if (w->remain == 0)
+                w->phase = 0;
+        } else {
+            n = sizeof(w->sum) - w->sum_len < len ? sizeof(w->sum) - w->sum_len : len;
+            memcpy(w->sum + w->sum_len, data, n);
+            w->sum_len += n;
+            data += n;
+            len -= n;
+            if (w->sum_len == sizeof(w->sum)) {
+                unsigned char md[32];
+                EVP_DigestFinal_ex(w->md, md, NULL);
+                w->verified = memcmp(md, w->sum, sizeof(md)) == 0;
+                w->ended = true;
+            }
+        }
+    }
+    w->stats.cpu_ns += cpu_now_ns() - cpu0;
+    return r;
+}
+
+// 寫完並驗證 SHA-256 後以暫存檔取代舊檔；失敗時刪掉暫存檔、保留舊檔，成功回傳 1
+int delta_writer_close(DeltaWriter *w) {
+    int r = file_writer_close(&w->out);
+    if (!w->ended || !w->verified)
+        r = -1;
+    if (r == 1 && rename(w->tmp, w->path) == -1)
+        r = -1;
+    if (r == -1)
+        unlink(w->tmp);
+    close(w->basis_fd);
+    free(w->block);
+    EVP_MD_CTX_free(w->md);
+    w->block = NULL;
+    w->md = NULL;
+    return r;
+}
+
+void delta_report(const DeltaStats *st, const char *name) {
+    double file_mb = st->file_bytes / (1024.0 * 1024.0);
+    double sent_mb = st->sent_bytes / (1024.0 * 1024.0);
+    printf("[Delta] %s: %.2f MB file, %.2f MB sent (%.1f%%), %llu blocks reused, "
+           "%.2f MB literal, cpu %.1f ms\n",
+           name, file_mb, sent_mb, file_mb > 0 ? 100.0 * sent_mb / file_mb : 0.0,
+           (unsigned long long)st->matched_blocks, st->literal_bytes / (1024.0 * 1024.0),
+           st->cpu_ns / 1e6);
+}
@@ -0,0 +1,84 @@
+// delta.h
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "file_pipe.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+//--- DELTA TRANSFER ---//
+// 接收端已有舊版檔案時，先送出每個 block 的 rolling checksum 與 strong hash（signature），
+// 傳送端只送出新增的資料（literal）與可沿用的 block 編號
+#define DELTA_TAG "delta"                 // offer 的第三欄：傳送端會等接收端的 signature
+#define DELTA_MIN_SIZE (256 * 1024)       // 舊檔小於此值就整個重送
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX (128 * 1024)
+#define DELTA_STRONG 16                   // SHA-256 取前 16 bytes
+#define DELTA_SIG_HDR 16                  // "DSIG"、block 大小 4 bytes、block 數 8 bytes
+#define DELTA_SIG_ENTRY (4 + DELTA_STRONG)
+
+// delta stream 的指令：1 byte 種類 + 4 bytes 參數（big-endian）
+#define DELTA_LITERAL 'L'                 // 參數為長度，後接資料
+#define DELTA_BLOCK 'B'                   // 參數為舊檔的 block 編號
+#define DELTA_DONE 'D'                    // 後接新檔的 SHA-256
+#define DELTA_OP 5
+
+typedef struct {
+    uint32_t weak;
+    unsigned char strong[DELTA_STRONG];
+} DeltaBlock;
+
+// 傳送端收到的 signature，weak checksum 以 hash table 索引
+typedef struct {
+    uint32_t block_size;
+    uint64_t count;
+    DeltaBlock *blocks;
+    int64_t *head, *next;
+    uint64_t mask;
+} DeltaSig;
+
+typedef struct {
+    uint64_t file_bytes;               // 新檔大小
+    uint64_t sent_bytes;               // 實際送出的 delta stream
+    uint64_t literal_bytes;
+    uint64_t matched_blocks;
+    uint64_t cpu_ns;
+} DeltaStats;
+
+typedef int (*DeltaEmit)(void *arg, const char *data, size_t len);
+
+// 接收端：依 signature 從舊檔與 literal 重建到暫存檔，驗證後才取代舊檔
+typedef struct {
+    int   basis_fd;
+    uint32_t block_size;
+    uint64_t count;
+    char  path[1024], tmp[1040];
+    FileWriter out;
+    EVP_MD_CTX *md;
+    char *block;
+    unsigned char op[DELTA_OP];
+    size_t op_len;
+    int   phase;                       // 0 收指令，1 收 literal，2 收 SHA-256
+    uint32_t remain;
+    unsigned char sum[32];
+    size_t sum_len;
+    bool  ended, verified;
+    DeltaStats stats;
+} DeltaWriter;
+
+int  delta_sig_make(const char *path, unsigned char **msg, size_t *len);
+int  delta_sig_header(const unsigned char *hdr, uint32_t *block_size, uint64_t *count);
+int  delta_sig_load(DeltaSig *sig, uint32_t block_size, uint64_t count, const unsigned char *body);
+void delta_sig_free(DeltaSig *sig);
+
+int  delta_encode(const DeltaSig *sig, const char *path, DeltaEmit emit, void *arg, DeltaStats *st);
+
+int  delta_writer_open(DeltaWriter *w, const char *path, long long size, const unsigned char *sig_hdr);
+int  delta_writer_write(DeltaWriter *w, const char *data, size_t len);
+int  delta_writer_close(DeltaWriter *w);
+void delta_report(const DeltaStats *st, const char *name);
+
+#endif
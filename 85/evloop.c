@@ -0,0 +1,201 @@
+// evloop.c
+#define _GNU_SOURCE
+#include "evloop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+uint64_t ev_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//--- POST ---//
+// 清掉 eventfd 的計數，依序執行其他 thread 交來的工作
+static void run_posts(void *arg, uint32_t events) {
+    (void)events;
+    EvLoop *loop = (EvLoop*)arg;
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+
+    pthread_mutex_lock(&loop->lock);
+    EvPost *p = loop->posts;
+    loop->posts = loop->posts_tail = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (p) {
+        EvPost *next = p->next;
+        p->cb(p->arg);
+        loop->posted++;
+        free(p);
+        p = next;
+    }
+}
+
+// 任何 thread 都可以呼叫：cb 之後在 loop thread 執行
+int ev_post(EvLoop *loop, EvCallback cb, void *arg) {
+    EvPost *p = malloc(sizeof(EvPost));
+    if (!p)
+        return -1;
+    p->cb = cb;
+    p->arg = arg;
+    p->next = NULL;
+
+    pthread_mutex_lock(&loop->lock);
+    if (loop->posts_tail)
+        loop->posts_tail->next = p;
+    else
+        loop->posts = p;
+    loop->posts_tail = p;
+    pthread_mutex_unlock(&loop->lock);
+
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+//--- LOOP ---//
+int ev_init(EvLoop *loop) {
+    memset(loop, 0, sizeof(EvLoop));
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0)
+        return -1;
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        close(loop->epfd);
+        return -1;
+    }
+    pthread_mutex_init(&loop->lock, NULL);
+    loop->next_timer = 1;
+    return ev_add(loop, &loop->wake, loop->wake_fd, EPOLLIN, run_posts, loop);
+}
+
+void ev_free(EvLoop *loop) {
+    while (loop->posts) {
+        EvPost *next = loop->posts->next;
+        free(loop->posts);
+        loop->posts = next;
+    }
+    close(loop->wake_fd);
+    close(loop->epfd);
+    pthread_mutex_destroy(&loop->lock);
+}
+
+// 任何 thread 都可以呼叫：目前這一輪結束後 ev_run 回傳
+void ev_stop(EvLoop *loop) {
+    pthread_mutex_lock(&loop->lock);
+    loop->stop = true;
+    pthread_mutex_unlock(&loop->lock);
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+static bool stopped(EvLoop *loop) {
+    pthread_mutex_lock(&loop->lock);
+    bool stop = loop->stop;
+    pthread_mutex_unlock(&loop->lock);
+    return stop;
+}
+
+// 到期的 timer 先從表中移除再執行，callback 裡可以再設新的 timer
+static void run_timers(EvLoop *loop) {
+    uint64_t now = ev_now_ms();
+    while (loop->ntimers > 0 && loop->timers[0].due_ms <= now) {
+        EvTimer t = loop->timers[0];
+        memmove(&loop->timers[0], &loop->timers[1], (loop->ntimers - 1) * sizeof(EvTimer));
+        loop->ntimers--;
+        t.cb(t.arg);
+    }
+}
+
+void ev_run(EvLoop *loop) {
+    struct epoll_event evs[EV_MAX_EVENTS];
+    while (!stopped(loop)) {
+        int timeout = -1;
+        if (loop->ntimers > 0) {
+            uint64_t now = ev_now_ms();
+            timeout = loop->timers[0].due_ms <= now ? 0 : (int)(loop->timers[0].due_ms - now);
+        }
+
+        int n = epoll_wait(loop->epfd, evs, EV_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        loop->wakeups++;
+
+        loop->ndead = 0;
+        for (int i = 0; i < n; i++) {
+            EvWatch *w = evs[i].data.ptr;
+            bool dead = false;
+            for (int j = 0; j < loop->ndead && !dead; j++)
+                dead = loop->dead[j] == w;
+            if (dead)
+                continue;
+            loop->events++;
+            w->handler(w->arg, evs[i].events);
+        }
+        loop->ndead = 0;
+        run_timers(loop);
+    }
+}
+
+//--- WATCH ---//
+int ev_add(EvLoop *loop, EvWatch *w, int fd, uint32_t events, EvHandler handler, void *arg) {
+    w->fd = fd;
+    w->handler = handler;
+    w->arg = arg;
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0 ? 0 : -1;
+}
+
+int ev_mod(EvLoop *loop, EvWatch *w, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, w->fd, &ev) == 0 ? 0 : -1;
+}
+
+// 呼叫後即可釋放 w（fd 由呼叫者自己關閉）
+void ev_del(EvLoop *loop, EvWatch *w) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    if (loop->ndead < EV_MAX_EVENTS)
+        loop->dead[loop->ndead++] = w;
+    w->fd = -1;
+}
+
+//--- TIMER ---//
+// ms 毫秒後在 loop thread 執行一次 cb，回傳可用來取消的 ID（0 表示失敗）
+uint64_t ev_timer(EvLoop *loop, int ms, EvCallback cb, void *arg) {
+    if (loop->ntimers == EV_MAX_TIMERS)
+        return 0;
+    EvTimer t = { loop->next_timer++, ev_now_ms() + (ms > 0 ? ms : 0), cb, arg };
+    int i = loop->ntimers;
+    while (i > 0 && loop->timers[i - 1].due_ms > t.due_ms) {
+        loop->timers[i] = loop->timers[i - 1];
+        i--;
+    }
+    loop->timers[i] = t;
+    loop->ntimers++;
+    return t.id;
+}
+
+void ev_timer_cancel(EvLoop *loop, uint64_t id) {
+    for (int i = 0; i < loop->ntimers; i++) {
+        if (loop->timers[i].id == id) {
+            memmove(&loop->timers[i], &loop->timers[i + 1], (loop->ntimers - i - 1) * sizeof(EvTimer));
+            loop->ntimers--;
+            return;
+        }
+    }
+}
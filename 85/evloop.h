@@ -0,0 +1,77 @@
+// evloop.h
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+//--- EVENT LOOP ---//
+// 一個 thread 以 epoll 等待所有 socket 與 timer；其他 thread 以 ev_post 把工作交給它，
+// 由 eventfd 叫醒。除了 ev_post 與 ev_stop，其他函數只能在 loop thread 呼叫
+#define EV_MAX_EVENTS 64                  // 一次 epoll_wait 取回的事件數
+#define EV_MAX_TIMERS 256
+
+typedef void (*EvHandler)(void *arg, uint32_t events);
+typedef void (*EvCallback)(void *arg);
+
+// 由使用者嵌在自己的結構裡，ev_del 之前不能釋放
+typedef struct {
+    int  fd;
+    EvHandler handler;
+    void *arg;
+} EvWatch;
+
+typedef struct EvPost {
+    EvCallback cb;
+    void *arg;
+    struct EvPost *next;
+} EvPost;
+
+typedef struct {
+    uint64_t id;
+    uint64_t due_ms;
+    EvCallback cb;
+    void *arg;
+} EvTimer;
+
+typedef struct {
+    int   epfd;
+    int   wake_fd;                     // eventfd
+    EvWatch wake;
+    bool  stop;
+
+    pthread_mutex_t lock;              // 保護 posts 與 stop
+    EvPost *posts, *posts_tail;
+
+    EvTimer timers[EV_MAX_TIMERS];     // 依到期時間排序
+    int   ntimers;
+    uint64_t next_timer;
+
+    // 同一輪已取回、但 watch 已被 ev_del 的事件要略過
+    EvWatch *dead[EV_MAX_EVENTS];
+    int   ndead;
+
+    // 統計
+    uint64_t wakeups;                  // epoll_wait 回來的次數
+    uint64_t events;                   // 處理的 fd 事件
+    uint64_t posted;                   // 處理的 ev_post
+} EvLoop;
+
+uint64_t ev_now_ms();
+
+int  ev_init(EvLoop *loop);
+void ev_free(EvLoop *loop);
+void ev_run(EvLoop *loop);
+void ev_stop(EvLoop *loop);
+
+int  ev_add(EvLoop *loop, EvWatch *w, int fd, uint32_t events, EvHandler handler, void *arg);
+int  ev_mod(EvLoop *loop, EvWatch *w, uint32_t events);
+void ev_del(EvLoop *loop, EvWatch *w);
+
+uint64_t ev_timer(EvLoop *loop, int ms, EvCallback cb, void *arg);
+void ev_timer_cancel(EvLoop *loop, uint64_t id);
+
+int  ev_post(EvLoop *loop, EvCallback cb, void *arg);
+
+#endif
@@ -0,0 +1,388 @@
+// file_pipe.c
+#define _GNU_SOURCE
+#include "file_pipe.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// 單調時鐘 (ns)
+uint64_t pipe_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//--- BLOCK RING ---//
+static void ring_init(BlockRing *ring) {
+    memset(ring, 0, sizeof(*ring));
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->not_empty, NULL);
+    pthread_cond_init(&ring->not_full, NULL);
+}
+
+static void ring_destroy(BlockRing *ring) {
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->not_empty);
+    pthread_cond_destroy(&ring->not_full);
+}
+
+// 生產端：等到有空位，回傳 slot index（消費端已關閉則回傳 -1）
+static int ring_reserve(BlockRing *ring) {
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count == PIPE_DEPTH && !ring->closed)
+        pthread_cond_wait(&ring->not_full, &ring->lock);
+    int slot = ring->closed ? -1 : ring->tail;
+    pthread_mutex_unlock(&ring->lock);
+    return slot;
+}
+
+// 生產端：公開已填好的 slot
+static void ring_publish(BlockRing *ring, char *data, size_t len) {
+    pthread_mutex_lock(&ring->lock);
+    ring->slots[ring->tail].data = data;
+    ring->slots[ring->tail].len = len;
+    ring->tail = (ring->tail + 1) % PIPE_DEPTH;
+    ring->count++;
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// 生產端：結束（err 為 0 表示正常 EOF）
+static void ring_finish(BlockRing *ring, int err) {
+    pthread_mutex_lock(&ring->lock);
+    ring->eof = true;
+    ring->err = err;
+    pthread_cond_broadcast(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// 消費端：等到有資料，1 取得 block、0 EOF、-1 生產端錯誤
+// block 在 ring_release 前不會被覆寫
+static int ring_take(BlockRing *ring, PipeBlock *block) {
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count == 0 && !ring->eof)
+        pthread_cond_wait(&ring->not_empty, &ring->lock);
+    int ret;
+    if (ring->count > 0) {
+        *block = ring->slots[ring->head];
+        ret = 1;
+    } else {
+        ret = ring->err ? -1 : 0;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+
+// 消費端：歸還 ring_take 取得的 block，回傳其長度
+static size_t ring_release(BlockRing *ring) {
+    pthread_mutex_lock(&ring->lock);
+    size_t len = ring->slots[ring->head].len;
+    ring->head = (ring->head + 1) % PIPE_DEPTH;
+    ring->count--;
+    pthread_cond_signal(&ring->not_full);
+    pthread_mutex_unlock(&ring->lock);
+    return len;
+}
+
+// 消費端：放棄，讓等待空位的生產端離開
+static void ring_close(BlockRing *ring) {
+    pthread_mutex_lock(&ring->lock);
+    ring->closed = true;
+    pthread_cond_broadcast(&ring->not_full);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static int alloc_bufs(char **bufs) {
+    for (int i = 0; i < PIPE_DEPTH; i++) {
+        if (posix_memalign((void**)&bufs[i], PIPE_ALIGN, PIPE_BLOCK_SIZE) != 0) {
+            for (int j = 0; j < i; j++) {
+                free(bufs[j]);
+                bufs[j] = NULL;
+            }
+            return -1;
+        }
+    }
+    return 1;
+}
+
+//--- FILE READER ---//
+// mmap 模式：逐 page 觸碰，讓 page fault 發生在讀檔 thread 而不是網路 thread
+static void prefault(const char *p, size_t len) {
+    long page = sysconf(_SC_PAGESIZE);
+    volatile char sink = 0;
+    for (size_t off = 0; off < len; off += page)
+        sink ^= p[off];
+    (void)sink;
+}
+
+static void *reader_thread(void *arg) {
+    FileReader *r = (FileReader*)arg;
+    off_t offset = 0;
+
+    while (offset < r->size) {
+        int slot = ring_reserve(&r->ring);
+        if (slot < 0)
+            break;
+
+        size_t want = PIPE_BLOCK_SIZE;
+        if ((off_t)want > r->size - offset)
+            want = r->size - offset;
+
+        uint64_t t0 = pipe_now_ns();
+        char *data;
+        if (r->map) {
+            data = r->map + offset;
+            madvise(data, want, MADV_WILLNEED);
+            prefault(data, want);
+        } else {
+            data = r->bufs[slot];
+            size_t got = 0;
+            while (got < want) {
+                ssize_t n = pread(r->fd, data + got, want - got, offset + got);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    ring_finish(&r->ring, n < 0 ? errno : EIO);
+                    return NULL;
+                }
+                got += n;
+            }
+        }
+        r->read_ns += pipe_now_ns() - t0;
+
+        ring_publish(&r->ring, data, want);
+        offset += want;
+    }
+
+    ring_finish(&r->ring, 0);
+    return NULL;
+}
+
+// 開檔並啟動讀檔 thread，成功回傳 1，失敗回傳 -1
+int file_reader_open(FileReader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(r->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(r->fd);
+        return -1;
+    }
+    r->size = st.st_size;
+
+    // 大檔用 mmap 省去複製，其餘用對齊 buffer + 循序讀取提示
+    if (r->size >= PIPE_MMAP_MIN) {
+        r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+        if (r->map == MAP_FAILED)
+            r->map = NULL;
+        else
+            madvise(r->map, r->size, MADV_SEQUENTIAL);
+    }
+    if (!r->map) {
+        posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (alloc_bufs(r->bufs) == -1) {
+            close(r->fd);
+            return -1;
+        }
+    }
+
+    ring_init(&r->ring);
+    r->start_ns = pipe_now_ns();
+    if (pthread_create(&r->thread, NULL, reader_thread, r) != 0) {
+        ring_destroy(&r->ring);
+        file_reader_close(r);
+        return -1;
+    }
+    r->running = true;
+    return 1;
+}
+
+// 取得下一個 block：1 有資料、0 EOF、-1 讀檔錯誤
+// 使用完畢後必須呼叫 file_reader_release 歸還
+int file_reader_next(FileReader *r, const char **data, size_t *len) {
+    uint64_t t0 = pipe_now_ns();
+    PipeBlock block;
+    int ret = ring_take(&r->ring, &block);
+    r->stall_ns += pipe_now_ns() - t0;
+    if (ret == 1) {
+        *data = block.data;
+        *len = block.len;
+    }
+    return ret;
+}
+
+void file_reader_release(FileReader *r) {
+    r->bytes += ring_release(&r->ring);
+}
+
+// 停止讀檔 thread 並釋放資源（可在傳送中途呼叫）
+void file_reader_close(FileReader *r) {
+    if (r->running) {
+        ring_close(&r->ring);
+        pthread_join(r->thread, NULL);
+        ring_destroy(&r->ring);
+        r->running = false;
+    }
+    if (r->map)
+        munmap(r->map, r->size);
+    for (int i = 0; i < PIPE_DEPTH; i++)
+        free(r->bufs[i]);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->map = NULL;
+    memset(r->bufs, 0, sizeof(r->bufs));
+    r->fd = -1;
+}
+
+// 印出傳輸量與 stall 統計
+void file_reader_report(const FileReader *r, const char *name) {
+    double secs = (pipe_now_ns() - r->start_ns) / 1e9;
+    double mb = r->bytes / (1024.0 * 1024.0);
+    printf("[File] %s: %.2f MB in %.2f s (%.2f MB/s), %s, disk %.1f ms, network stalled %.1f ms\n",
+           name, mb, secs, secs > 0 ? mb / secs : 0.0,
+           r->map ? "mmap" : "read-ahead",
+           r->read_ns / 1e6, r->stall_ns / 1e6);
+}
+
+//--- FILE WRITER ---//
+// 寫檔 thread：把網路端填滿的 block 依序寫進檔案
+static void *writer_thread(void *arg) {
+    FileWriter *w = (FileWriter*)arg;
+    PipeBlock block;
+    int r;
+    while ((r = ring_take(&w->ring, &block)) == 1) {
+        uint64_t t0 = pipe_now_ns();
+        size_t done = 0;
+        while (done < block.len) {
+            ssize_t n = pwrite(w->fd, block.data + done, block.len - done, w->offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                w->err = n < 0 ? errno : EIO;
+                ring_close(&w->ring);
+                return NULL;
+            }
+            done += n;
+        }
+        uint64_t spent = pipe_now_ns() - t0;
+        w->write_ns += spent;
+        if (spent > w->max_write_ns)
+            w->max_write_ns = spent;
+        w->writes++;
+        w->offset += block.len;
+        ring_release(&w->ring);
+    }
+    return NULL;
+}
+
+// 建立檔案並啟動寫檔 thread；size > 0 時先預留空間，成功回傳 1，失敗回傳 -1
+int file_writer_open(FileWriter *w, const char *path, off_t size) {
+    memset(w, 0, sizeof(*w));
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0)
+        return -1;
+
+    // 預先配置，避免邊寫邊長出 extent；檔案系統不支援就算了
+    if (size > 0 && fallocate(w->fd, 0, 0, size) == 0)
+        w->preallocated = true;
+
+    if (alloc_bufs(w->bufs) == -1) {
+        close(w->fd);
+        unlink(path);
+        return -1;
+    }
+
+    ring_init(&w->ring);
+    w->start_ns = pipe_now_ns();
+    if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+        ring_destroy(&w->ring);
+        for (int i = 0; i < PIPE_DEPTH; i++)
+            free(w->bufs[i]);
+        close(w->fd);
+        unlink(path);
+        return -1;
+    }
+    w->running = true;
+    return 1;
+}
+
+// 把收到的資料合併進目前的 block，滿了就交給寫檔 thread
+// 只有在 ring 沒有空位時才會等待（記為 stall），失敗回傳 -1
+int file_writer_write(FileWriter *w, const char *data, size_t len) {
+    while (len > 0) {
+        if (!w->cur) {
+            uint64_t t0 = pipe_now_ns();
+            int slot = ring_reserve(&w->ring);
+            uint64_t waited = pipe_now_ns() - t0;
+            if (waited > 1000000) {
+                w->stall_ns += waited;
+                w->stalls++;
+            }
+            if (slot < 0)
+                return -1;
+            w->cur = w->bufs[slot];
+            w->cur_len = 0;
+        }
+        size_t n = PIPE_BLOCK_SIZE - w->cur_len;
+        if (n > len)
+            n = len;
+        memcpy(w->cur + w->cur_len, data, n);
+        w->cur_len += n;
+        w->bytes += n;
+        data += n;
+        len -= n;
+        if (w->cur_len == PIPE_BLOCK_SIZE) {
+            ring_publish(&w->ring, w->cur, w->cur_len);
+            w->cur = NULL;
+        }
+    }
+    return 1;
+}
+
+// 送出最後的 block，等寫檔完成後截到實際大小並 fsync 一次
+// 成功回傳 1，任何寫檔錯誤回傳 -1
+int file_writer_close(FileWriter *w) {
+    if (w->cur && w->cur_len > 0)
+        ring_publish(&w->ring, w->cur, w->cur_len);
+    w->cur = NULL;
+    ring_finish(&w->ring, 0);
+    pthread_join(w->thread, NULL);
+    ring_destroy(&w->ring);
+    w->running = false;
+
+    int r = w->err ? -1 : 1;
+    if (w->preallocated && ftruncate(w->fd, w->offset) == -1)
+        r = -1;
+    uint64_t t0 = pipe_now_ns();
+    if (fsync(w->fd) == -1)
+        r = -1;
+    w->fsync_ns = pipe_now_ns() - t0;
+    close(w->fd);
+    w->fd = -1;
+    for (int i = 0; i < PIPE_DEPTH; i++) {
+        free(w->bufs[i]);
+        w->bufs[i] = NULL;
+    }
+    return r;
+}
+
+// 印出接收量與寫檔 stall 統計
+void file_writer_report(const FileWriter *w, const char *name) {
+    double secs = (pipe_now_ns() - w->start_ns) / 1e9;
+    double mb = w->bytes / (1024.0 * 1024.0);
+    printf("[File] %s: %.2f MB in %.2f s (%.2f MB/s), %s\n",
+           name, mb, secs, secs > 0 ? mb / secs : 0.0,
+           w->preallocated ? "preallocated" : "not preallocated");
+    printf("[File] %s: %llu writes, disk %.1f ms (max %.1f ms), fsync %.1f ms, network stalled %llu times / %.1f ms\n",
+           name, (unsigned long long)w->writes, w->write_ns / 1e6, w->max_write_ns / 1e6,
+           w->fsync_ns / 1e6, (unsigned long long)w->stalls, w->stall_ns / 1e6);
+}
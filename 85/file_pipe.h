@@ -0,0 +1,91 @@
+// file_pipe.h
+#ifndef FILE_PIPE_H
+#define FILE_PIPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Pipeline 設定
+#define PIPE_BLOCK_SIZE (256 * 1024)          // 每個 block 大小（對齊 page）
+#define PIPE_DEPTH 4                          // ring 中的 block 數量
+#define PIPE_ALIGN 4096                       // buffer 對齊
+#define PIPE_MMAP_MIN (64LL * 1024 * 1024)    // 檔案大於此值改用 mmap
+
+//--- BLOCK RING ---//
+// 固定數量的 block，一端生產（讀檔 thread）一端消費（網路）
+typedef struct {
+    char  *data;                       // block 起點
+    size_t len;                        // 有效長度
+} PipeBlock;
+
+typedef struct {
+    PipeBlock slots[PIPE_DEPTH];
+    int head, tail, count;
+    bool eof;                          // 生產端已結束
+    bool closed;                       // 消費端已放棄
+    int  err;                          // 生產端的 errno
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} BlockRing;
+
+//--- FILE READER ---//
+// 讀檔 thread 預先把檔案讀進 ring，讓磁碟讀取和網路傳送重疊
+typedef struct {
+    int    fd;
+    off_t  size;                       // 檔案大小
+    char  *map;                        // mmap 模式時的映射位址
+    char  *bufs[PIPE_DEPTH];           // read 模式時的對齊 buffer
+    BlockRing ring;
+    pthread_t thread;
+    bool running;                      // 讀檔 thread 是否啟動
+
+    // 統計
+    uint64_t bytes;                    // 已交給網路的 bytes
+    uint64_t read_ns;                  // 讀檔 thread 花在磁碟上的時間
+    uint64_t stall_ns;                 // 網路端等待資料的時間
+    uint64_t start_ns;
+} FileReader;
+
+//--- FILE WRITER ---//
+// 網路端把小塊資料合併成大 block，寫檔 thread 在背景寫入，結束時只 fsync 一次
+typedef struct {
+    int    fd;
+    bool   preallocated;               // 是否已用 fallocate 預留
+    char  *bufs[PIPE_DEPTH];
+    char  *cur;                        // 網路端正在填的 block
+    size_t cur_len;
+    off_t  offset;                     // 寫檔 thread 已寫到的位置
+    int    err;                        // 寫檔 thread 的 errno
+    BlockRing ring;
+    pthread_t thread;
+    bool running;
+
+    // 統計
+    uint64_t bytes;                    // 已收到的 bytes
+    uint64_t writes;                   // pwrite 的 block 數
+    uint64_t write_ns;                 // 寫檔 thread 花在磁碟上的時間
+    uint64_t max_write_ns;             // 最慢的一個 block
+    uint64_t fsync_ns;
+    uint64_t stalls;                   // 網路端等待空 block 的次數（超過 1ms 才算）
+    uint64_t stall_ns;
+    uint64_t start_ns;
+} FileWriter;
+
+int  file_reader_open(FileReader *r, const char *path);
+int  file_reader_next(FileReader *r, const char **data, size_t *len);
+void file_reader_release(FileReader *r);
+void file_reader_close(FileReader *r);
+void file_reader_report(const FileReader *r, const char *name);
+
+int  file_writer_open(FileWriter *w, const char *path, off_t size);
+int  file_writer_write(FileWriter *w, const char *data, size_t len);
+int  file_writer_close(FileWriter *w);
+void file_writer_report(const FileWriter *w, const char *name);
+
+uint64_t pipe_now_ns();
+
+#endif
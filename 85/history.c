@@ -0,0 +1,472 @@
+// history.c
+#define _GNU_SOURCE
+#include "history.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+typedef struct {
+    long long first;                   // 第一則的 seq，也是檔名
+    int  count;
+    int  fd;                           // 有索引時開著，否則 -1
+    long *offsets;                     // count + 1 個：每行的開頭，最後一個是檔案結尾；NULL 表示沒有索引
+    uint64_t used;                     // 最後一次用到，釋放索引時挑最久沒用的
+} Segment;
+
+typedef struct {
+    bool used;
+    char key[4 * MAX_NAME + 2];        // 兩個名稱的 hex，較小的在前
+    int  refs;
+    uint64_t last_used;
+    pthread_mutex_t lock;              // 保護以下
+    Segment *segs;                     // 依 seq 排序
+    int  n_segs, cap_segs;
+    int  n_indexed;
+    uint64_t tick;
+    long long next_seq;                // 下一則訊息的 seq，從 1 開始
+    char *tail[HISTORY_TAIL];          // 最近的訊息，以 seq % HISTORY_TAIL 為索引，每個都是完整的一行
+    int  n_tail;
+} Conv;
+
+static char base[256] = HISTORY_DIR;
+static Conv convs[HISTORY_CONVS];
+static uint64_t clock_tick = 0;
+static HistoryStats stats;
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;     // 保護 convs 的配置、clock_tick、stats
+
+// 名稱可能含有任何字元，目錄名用 hex
+static void conv_key(const char *a, const char *b, char *key) {
+    if (strcmp(a, b) > 0) {
+        const char *t = a;
+        a = b;
+        b = t;
+    }
+    int n = 0;
+    for (const char *p = a; *p && n < 2 * (MAX_NAME - 1); p++)
+        n += sprintf(key + n, "%02x", (unsigned char)*p);
+    key[n++] = '-';
+    for (const char *p = b; *p && n < 4 * (MAX_NAME - 1) + 1; p++)
+        n += sprintf(key + n, "%02x", (unsigned char)*p);
+    key[n] = '\0';
+}
+
+static void seg_path(const Conv *c, long long first, char *path, size_t len) {
+    snprintf(path, len, "%s/%s/%lld.seg", base, c->key, first);
+}
+
+static void seg_drop_index(Conv *c, Segment *seg) {
+    if (!seg->offsets)
+        return;
+    free(seg->offsets);
+    seg->offsets = NULL;
+    close(seg->fd);
+    seg->fd = -1;
+    c->n_indexed--;
+}
+
+// 讀整個 segment 檔建每行的 offset；最後一個 segment 的結尾若有寫到一半的行就截掉。
+// 索引超過 HISTORY_INDEX 個時釋放最久沒用到的（最後一個 segment 一直保留，append 要用）
+static int seg_index(Conv *c, Segment *seg) {
+    seg->used = ++c->tick;
+    if (seg->offsets)
+        return 1;
+
+    char path[512];
+    seg_path(c, seg->first, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    long *offsets = malloc((HISTORY_SEGMENT + 1) * sizeof(long));
+    char *data = NULL;
+    if (!offsets || fstat(fd, &st) == -1 || !(data = malloc(st.st_size + 1)) ||
+        pread(fd, data, st.st_size, 0) != st.st_size) {
+        free(offsets);
+        free(data);
+        close(fd);
+        return -1;
+    }
+
+    bool last = seg == &c->segs[c->n_segs - 1];
+    int limit = last ? HISTORY_SEGMENT : (int)(seg[1].first - seg->first);
+    int count = 0;
+    long pos = 0;
+    offsets[0] = 0;
+    while (count < limit && pos < st.st_size) {
+        char *nl = memchr(data + pos, '\n', st.st_size - pos);
+        if (!nl)
+            break;
+        pos = nl - data + 1;
+        offsets[++count] = pos;
+    }
+    free(data);
+    if (last && pos < st.st_size && ftruncate(fd, pos) == -1) {
+        free(offsets);
+        close(fd);
+        return -1;
+    }
+    seg->count = count;
+    seg->offsets = offsets;
+    seg->fd = fd;
+    c->n_indexed++;
+
+    while (c->n_indexed > HISTORY_INDEX) {
+        Segment *lru = NULL;
+        for (int i = 0; i < c->n_segs - 1; i++)
+            if (c->segs[i].offsets && &c->segs[i] != seg && (!lru || c->segs[i].used < lru->used))
+                lru = &c->segs[i];
+        if (!lru)
+            break;
+        seg_drop_index(c, lru);
+    }
+    return 1;
+}
+
+static Segment *seg_new(Conv *c, long long first) {
+    if (c->n_segs == c->cap_segs) {
+        int cap = c->cap_segs ? c->cap_segs * 2 : 16;
+        Segment *segs = realloc(c->segs, cap * sizeof(Segment));
+        if (!segs)
+            return NULL;
+        c->segs = segs;
+        c->cap_segs = cap;
+    }
+    Segment *seg = &c->segs[c->n_segs++];
+    memset(seg, 0, sizeof(*seg));
+    seg->first = first;
+    seg->fd = -1;
+    if (seg_index(c, seg) == -1) {
+        c->n_segs--;
+        return NULL;
+    }
+    return seg;
+}
+
+// seq 所在的 segment（起始 seq <= seq 的最後一個）
+static Segment *seg_find(Conv *c, long long seq) {
+    int lo = 0, hi = c->n_segs;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (c->segs[mid].first <= seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo > 0 ? &c->segs[lo - 1] : NULL;
+}
+
+static int cmp_seq(const void *a, const void *b) {
+    long long x = ((const Segment*)a)->first, y = ((const Segment*)b)->first;
+    return x < y ? -1 : x > y;
+}
+
+static void conv_free(Conv *c) {
+    for (int i = 0; i < c->n_segs; i++)
+        seg_drop_index(c, &c->segs[i]);
+    free(c->segs);
+    for (int i = 0; i < HISTORY_TAIL; i++)
+        free(c->tail[i]);
+    pthread_mutex_destroy(&c->lock);
+    memset(c, 0, sizeof(*c));
+}
+
+// 列出對話目錄裡的 segment 檔；只有最後一個要讀，找出下一則的 seq 並把最近的訊息放進記憶體
+static int conv_load(Conv *c) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", base, c->key);
+    if (mkdir(path, 0700) == -1 && errno != EEXIST)
+        return -1;
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        long long first;
+        char ext[8];
+        if (sscanf(d->d_name, "%lld.%7s", &first, ext) != 2 || strcmp(ext, "seg") != 0 || first < 1)
+            continue;
+        if (c->n_segs == c->cap_segs) {
+            int cap = c->cap_segs ? c->cap_segs * 2 : 16;
+            Segment *segs = realloc(c->segs, cap * sizeof(Segment));
+            if (!segs) {
+                closedir(dir);
+                return -1;
+            }
+            c->segs = segs;
+            c->cap_segs = cap;
+        }
+        Segment *seg = &c->segs[c->n_segs++];
+        memset(seg, 0, sizeof(*seg));
+        seg->first = first;
+        seg->fd = -1;
+    }
+    closedir(dir);
+
+    c->next_seq = 1;
+    if (c->n_segs == 0)
+        return 1;
+    qsort(c->segs, c->n_segs, sizeof(Segment), cmp_seq);
+    for (int i = 0; i < c->n_segs - 1; i++)
+        c->segs[i].count = c->segs[i + 1].first - c->segs[i].first;
+    Segment *last = &c->segs[c->n_segs - 1];
+    if (seg_index(c, last) == -1)
+        return -1;
+    c->next_seq = last->first + last->count;
+
+    for (int k = last->count > HISTORY_TAIL ? last->count - HISTORY_TAIL : 0; k < last->count; k++) {
+        long n = last->offsets[k + 1] - last->offsets[k];
+        char *line = malloc(n + 1);
+        if (!line || pread(last->fd, line, n, last->offsets[k]) != n) {
+            free(line);
+            return -1;
+        }
+        line[n] = '\0';
+        c->tail[(last->first + k) % HISTORY_TAIL] = line;
+        c->n_tail++;
+    }
+    return 1;
+}
+
+// 取得對話（持有一個參考，用完 conv_put）；不在記憶體時載入，滿了就釋放最久沒用到的
+static Conv *conv_get(const char *a, const char *b) {
+    char key[4 * MAX_NAME + 2];
+    conv_key(a, b, key);
+    pthread_mutex_lock(&history_lock);
+    Conv *c = NULL, *lru = NULL;
+    for (int i = 0; i < HISTORY_CONVS && !c; i++)
+        if (convs[i].used && strcmp(convs[i].key, key) == 0)
+            c = &convs[i];
+    // 空位優先，否則挑沒有人在用、最久沒用到的
+    for (int i = 0; i < HISTORY_CONVS && !c; i++) {
+        if (!convs[i].used) {
+            lru = &convs[i];
+            break;
+        }
+        if (convs[i].refs == 0 && (!lru || convs[i].last_used < lru->last_used))
+            lru = &convs[i];
+    }
+    if (!c && lru) {
+        if (lru->used)
+            conv_free(lru);
+        c = lru;
+        c->used = true;
+        strcpy(c->key, key);
+        pthread_mutex_init(&c->lock, NULL);
+        if (conv_load(c) == -1) {
+            conv_free(c);
+            c = NULL;
+        }
+    }
+    if (c) {
+        c->refs++;
+        c->last_used = ++clock_tick;
+    }
+    pthread_mutex_unlock(&history_lock);
+    return c;
+}
+
+static void conv_put(Conv *c) {
+    pthread_mutex_lock(&history_lock);
+    c->refs--;
+    pthread_mutex_unlock(&history_lock);
+}
+
+//--- API ---//
+// dir 為 NULL 時用 HISTORY_DIR；對話在第一次用到時才載入
+int history_init(const char *dir) {
+    if (dir)
+        snprintf(base, sizeof(base), "%s", dir);
+    if (mkdir(base, 0700) == -1 && errno != EEXIST)
+        return -1;
+    return 1;
+}
+
+// 釋放記憶體裡所有的對話，segment 檔留著；之後用到時重新載入
+void history_close() {
+    pthread_mutex_lock(&history_lock);
+    for (int i = 0; i < HISTORY_CONVS; i++)
+        if (convs[i].used && convs[i].refs == 0)
+            conv_free(&convs[i]);
+    pthread_mutex_unlock(&history_lock);
+}
+
+// a、b 之間的一則訊息，換行換成空白；回傳它的 seq，失敗回傳 -1
+long long history_append(const char *a, const char *b, const char *from, const char *text, time_t t) {
+    Conv *c = conv_get(a, b);
+    if (!c)
+        return -1;
+    pthread_mutex_lock(&c->lock);
+    long long seq = c->next_seq;
+    char line[MAX_MES + 64];
+    int n = snprintf(line, sizeof(line), "%lld %lld %s %s", seq, (long long)t, from, text);
+    if (n > (int)sizeof(line) - 2)
+        n = sizeof(line) - 2;
+    for (char *p = line; p < line + n; p++)
+        if (*p == '\n' || *p == '\r')
+            *p = ' ';
+    line[n++] = '\n';
+    line[n] = '\0';
+
+    Segment *last = c->n_segs > 0 ? &c->segs[c->n_segs - 1] : NULL;
+    if (last && seg_index(c, last) == -1)
+        last = NULL;
+    else if (!last || last->count >= HISTORY_SEGMENT)
+        last = seg_new(c, seq);
+    if (!last || write(last->fd, line, n) != n) {
+        if (last && ftruncate(last->fd, last->offsets[last->count]) == -1)
+            perror("history ftruncate");
+        pthread_mutex_unlock(&c->lock);
+        conv_put(c);
+        return -1;
+    }
+    last->offsets[last->count + 1] = last->offsets[last->count] + n;
+    last->count++;
+    c->next_seq++;
+
+    free(c->tail[seq % HISTORY_TAIL]);
+    c->tail[seq % HISTORY_TAIL] = strdup(line);
+    if (!c->tail[seq % HISTORY_TAIL])
+        c->n_tail = 0;                         // 記憶體不夠，之後從檔案讀
+    else if (c->n_tail < HISTORY_TAIL)
+        c->n_tail++;
+    pthread_mutex_unlock(&c->lock);
+    conv_put(c);
+    return seq;
+}
+
+// seq 大於 after 的訊息，依序放進 out 直到放滿；next 為放進去的最後一則的 seq（沒有新的就是 after），
+// 回傳 1 表示還有更多，0 表示已到最新，-1 表示錯誤。
+// 一行放不進空的 out 時截斷，確保每次至少前進一則
+int history_read(const char *a, const char *b, long long after, char *out, int len, long long *next) {
+    if (after < 0)
+        after = 0;
+    *next = after;
+    out[0] = '\0';
+    Conv *c = conv_get(a, b);
+    if (!c)
+        return -1;
+    pthread_mutex_lock(&c->lock);
+    long long seq = after + 1, tail_first = c->next_seq - c->n_tail;
+    int used = 0, r = 0;
+    long *source = NULL;
+
+    while (seq < c->next_seq && used < len - 1) {
+        if (seq >= tail_first) {
+            // 最近的訊息在記憶體裡
+            const char *line = c->tail[seq % HISTORY_TAIL];
+            int n = strlen(line);
+            if (used + n >= len) {
+                if (used > 0)
+                    break;
+                n = len - 2;
+                memcpy(out, line, n);
+                out[n] = '\n';
+                used = n + 1;
+                seq++;
+                break;
+            }
+            memcpy(out + used, line, n);
+            used += n;
+            seq++;
+            source = source ? source : &stats.tail;
+            continue;
+        }
+
+        Segment *seg = seg_find(c, seq);
+        bool scanned = seg && !seg->offsets;
+        if (!seg || seg_index(c, seg) == -1) {
+            r = -1;
+            break;
+        }
+        if (seq >= seg->first + seg->count) {
+            // segment 檔比預期的短（被截掉），跳到下一個 segment
+            seq = seg + 1 < c->segs + c->n_segs ? seg[1].first : c->next_seq;
+            continue;
+        }
+        source = scanned ? &stats.scanned : source && source != &stats.tail ? source : &stats.indexed;
+
+        // 一次讀出這個 segment 裡放得下的連續幾行
+        int k = seq - seg->first, m = k;
+        while (m < seg->count && seg->offsets[m + 1] - seg->offsets[k] < len - used)
+            m++;
+        long bytes = seg->offsets[m] - seg->offsets[k];
+        bool cut = false;
+        if (m == k) {
+            if (used > 0)
+                break;
+            bytes = len - 2;
+            cut = true;
+            m = k + 1;
+        }
+        if (pread(seg->fd, out + used, bytes, seg->offsets[k]) != bytes) {
+            r = -1;
+            break;
+        }
+        used += bytes;
+        if (cut)
+            out[used++] = '\n';
+        seq = seg->first + m;
+        if (cut || m < seg->count)
+            break;
+    }
+    out[used] = '\0';
+    if (r == 0) {
+        *next = seq - 1;
+        r = seq < c->next_seq ? 1 : 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    conv_put(c);
+
+    if (source) {
+        pthread_mutex_lock(&history_lock);
+        (*source)++;
+        pthread_mutex_unlock(&history_lock);
+    }
+    return r;
+}
+
+// 對每個有歷史的對話呼叫 fn(a, b, arg)，a 為較小的名稱；fn 回傳 -1 時停止
+int history_each(int (*fn)(const char *a, const char *b, void *arg), void *arg) {
+    DIR *dir = opendir(base);
+    if (!dir)
+        return -1;
+    struct dirent *d;
+    int r = 1;
+    while (r != -1 && (d = readdir(dir)) != NULL) {
+        char name[2][MAX_NAME];
+        const char *p = d->d_name;
+        int n = 0, k = 0;
+        unsigned v;
+        for (; *p && k < 2; p++) {
+            if (*p == '-') {
+                name[k++][n] = '\0';
+                n = 0;
+            } else if (p[1] && n < MAX_NAME - 1 && sscanf(p, "%2x", &v) == 1) {
+                name[k][n++] = v;
+                p++;
+            } else {
+                break;
+            }
+        }
+        if (k != 1 || *p || n == 0 || d->d_name[0] == '-')
+            continue;                          // 不是對話的目錄
+        name[1][n] = '\0';
+        r = fn(name[0], name[1], arg);
+    }
+    closedir(dir);
+    return r == -1 ? -1 : 1;
+}
+
+void history_stats(HistoryStats *st) {
+    pthread_mutex_lock(&history_lock);
+    *st = stats;
+    pthread_mutex_unlock(&history_lock);
+}
@@ -0,0 +1,34 @@
+// history.h
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <time.h>
+
+//--- HISTORY ---//
+// relay 訊息的歷史：每個對話（兩個使用者）一個目錄，訊息依序編號，編號就是 client 的 cursor。
+// 訊息存在只會 append 的 segment 檔，每行 "<seq> <time> <from> <訊息>"，檔名為第一則的 seq；
+// 記憶體只保留每個 segment 的起始 seq、最近用到的幾個 segment 的行 offset，以及最近的幾則訊息
+#define HISTORY_DIR "history"
+#define HISTORY_SEGMENT 4096              // 每個 segment 檔的訊息數
+#define HISTORY_INDEX 4                   // 每個對話最多保留幾個 segment 的 offset 索引（含最後一個）
+#define HISTORY_TAIL 128                  // 每個對話在記憶體保留最近的幾則訊息
+#define HISTORY_CONVS 256                 // 記憶體裡最多的對話數，超過時釋放最久沒用到的
+
+// history_read 從哪裡讀到資料
+typedef struct {
+    long tail;                         // 全部在記憶體的最近訊息裡
+    long indexed;                      // 讀 segment 檔，offset 索引已在記憶體
+    long scanned;                      // 先掃過 segment 檔建索引
+} HistoryStats;
+
+int  history_init(const char *dir);
+void history_close();
+long long history_append(const char *a, const char *b, const char *from, const char *text, time_t t);
+int  history_read(const char *a, const char *b, long long after, char *out, int len, long long *next);
+int  history_each(int (*fn)(const char *a, const char *b, void *arg), void *arg);
+void history_stats(HistoryStats *st);
+
+#endif
@@ -0,0 +1,124 @@
+// history_bench.c
+// 聊天歷史的效能測試：不需要 server，直接在一個對話裡 append 很多則訊息，
+// 再量測 client 重新連線時從不同的 cursor 同步到最新要花多久
+//   ./history_bench [messages] [directory]
+// 沒有指定目錄時在 /tmp 建一個暫時的目錄，結束後刪掉
+#define _GNU_SOURCE
+#include "history.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+long long nmessages = 1000000;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 跟 server 一樣一頁一頁讀到最新，回傳頁數
+static long sync_from(long long cursor, long long *received) {
+    char page[BUFFER_SIZE - 64];
+    long pages = 0;
+    long long next;
+    *received = 0;
+    int more;
+    do {
+        more = history_read("alice", "bob", cursor, page, sizeof(page), &next);
+        if (more == -1) {
+            perror("history_read");
+            exit(EXIT_FAILURE);
+        }
+        *received += next - cursor;
+        cursor = next;
+        pages++;
+    } while (more == 1);
+    return pages;
+}
+
+static void remove_dir(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+    struct dirent *d;
+    char sub[512];
+    while ((d = readdir(dir)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+        snprintf(sub, sizeof(sub), "%s/%s", path, d->d_name);
+        if (d->d_type == DT_DIR)
+            remove_dir(sub);
+        else
+            unlink(sub);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+//--- MAIN FUNCTION ---//
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        nmessages = atoll(argv[1]);
+    if (nmessages <= 0) {
+        printf("Usage: %s [messages] [directory]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char tmp[] = "/tmp/history_bench.XXXXXX";
+    const char *dir = argc > 2 ? argv[2] : mkdtemp(tmp);
+    if (!dir || history_init(dir) == -1) {
+        perror("history_init");
+        return EXIT_FAILURE;
+    }
+
+    // 兩個人輪流說話，訊息長度 20 ~ 120
+    printf("%s\n", LINE);
+    srand(1);
+    char text[128];
+    uint64_t t = now_ns();
+    for (long long i = 0; i < nmessages; i++) {
+        int len = 20 + rand() % 100;
+        for (int k = 0; k < len; k++)
+            text[k] = 'a' + rand() % 26;
+        text[len] = '\0';
+        if (history_append("alice", "bob", i % 2 ? "bob" : "alice", text, time(NULL)) == -1) {
+            perror("history_append");
+            return EXIT_FAILURE;
+        }
+    }
+    double sec = (now_ns() - t) / 1e9;
+    printf("append %lld messages: %.2f s, %.0f messages/s\n", nmessages, sec, nmessages / sec);
+
+    // 落後不同數量的 client 同步到最新；cold 為 server 剛啟動（記憶體裡沒有這個對話），warm 為再同步一次
+    long long lags[] = { 0, 50, 10000, 100000, -1 };
+    printf("%12s %10s %10s %12s %12s\n", "behind", "messages", "pages", "cold ms", "warm ms");
+    for (int i = 0; i < 5; i++) {
+        history_close();
+        long long lag = lags[i] < 0 || lags[i] > nmessages ? nmessages : lags[i], received;
+        t = now_ns();
+        long pages = sync_from(nmessages - lag, &received);
+        double cold = (now_ns() - t) / 1e6;
+        t = now_ns();
+        sync_from(nmessages - lag, &received);
+        double warm = (now_ns() - t) / 1e6;
+        printf("%12lld %10lld %10ld %12.2f %12.2f\n", lag, received, pages, cold, warm);
+        if (lags[i] < 0 || lags[i] >= nmessages)
+            break;
+    }
+
+    HistoryStats st;
+    history_stats(&st);
+    printf("reads: %ld from memory tail, %ld from indexed segments, %ld scanned a segment\n",
+           st.tail, st.indexed, st.scanned);
+    printf("%s\n", LINE);
+
+    history_close();
+    if (argc <= 2)
+        remove_dir(dir);
+    return 0;
+}
@@ -0,0 +1,1644 @@
+// libchat.c
+// session 的協定狀態機：所有 socket 都是 non-blocking，只在 ChatClient 的 loop thread 讀寫
+#define _GNU_SOURCE
+#include "libchat_int.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+
+//--- REQUEST ---//
+// 一個使用者操作。pipelined request 的指令與參數放在同一個 frame，加上 seq 連續送出，
+// server 的回覆帶同一個 seq；其他的 request 是 lockstep，一次只有它在等回覆
+#define REQ_CONNECT 1
+#define REQ_SIMPLE 2                      // 送一行、收一個回覆
+#define REQ_LOGIN 3
+#define REQ_LOGOUT 4                      // logout / exit：server 不回覆，送出即完成
+#define REQ_RELAY 5
+#define REQ_DIRECT 6
+#define REQ_FILE 7
+#define REQ_SPOOL_GET 8
+#define REQ_LIST 9                        // 問 server 上次版本之後的 roster 變化
+#define REQ_CONTACT 10                    // 加入、移除或列出聯絡人
+
+struct ChatRequest {
+    ChatSession *s;
+    int  kind;
+    bool pipe;                         // 以 PIPE_REQ 送出
+    bool sent;
+    int  seq;
+    int  target;                       // REQ_DIRECT：接收端的 ID；REQ_CONTACT：加入或移除的 ID
+    char line[BUFFER_SIZE];            // 送給 server 的指令
+    char arg[BUFFER_SIZE];             // 另外保存的內容（direct message、offer、名稱）
+    const char *success;               // REQ_SIMPLE：成功的回覆，NULL 表示任何回覆都算成功
+    const char *failure;               // REQ_SIMPLE：以此開頭的回覆表示失敗
+    FileJob *job;                      // REQ_FILE：還沒交給 server 的上傳
+    ChatDone done;
+    void *done_arg;
+    ChatRequest *next;
+};
+
+// chat_answer_offer 交給 loop thread 的決定
+typedef struct {
+    ChatSession *s;
+    int  offer_id;
+    bool accept;
+} OfferDecision;
+
+static void session_next(ChatSession *s);
+static void session_close(ChatSession *s);
+static void session_event(void *arg, uint32_t events);
+static int  session_write(ChatSession *s, const char *line);
+static void channel_close(Channel *ch);
+static void direct_close(DirectConn *c, int ok, const char *reply);
+static void receiver_event(void *arg, uint32_t events);
+static void direct_send(ChatSession *s, const char *ip, int port, ChatRequest *req);
+static void heartbeat_arm(ChatSession *s);
+
+//--- CLIENT ---//
+static void *loop_thread(void *arg) {
+    ChatClient *c = (ChatClient*)arg;
+    ev_run(&c->loop);
+    return NULL;
+}
+
+ChatClient *chat_client_new() {
+    static bool p2p_ready = false;
+    ChatClient *c = calloc(1, sizeof(ChatClient));
+    if (!c)
+        return NULL;
+
+    SSL_library_init();
+    SSL_load_error_strings();
+    OpenSSL_add_ssl_algorithms();
+    c->ctx = initialize_ssl_client();
+    if (!c->ctx) {
+        ERR_print_errors_fp(stderr);
+        free(c);
+        return NULL;
+    }
+    // p2p 的 SSL_CTX 是整個 process 共用的
+    if (!p2p_ready) {
+        p2p_ready = true;
+        if (p2p_init() == -1)
+            printf("[Warning] Peer-to-peer file transfer unavailable\n");
+    }
+
+    if (ev_init(&c->loop) == -1) {
+        SSL_CTX_free(c->ctx);
+        free(c);
+        return NULL;
+    }
+    if (pthread_create(&c->thread, NULL, loop_thread, c) != 0) {
+        ev_free(&c->loop);
+        SSL_CTX_free(c->ctx);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// 所有 session 都要先 chat_session_free
+void chat_client_free(ChatClient *c) {
+    ev_stop(&c->loop);
+    pthread_join(c->thread, NULL);
+    ev_free(&c->loop);
+    SSL_CTX_free(c->ctx);
+    free(c);
+}
+
+//--- TLS CONNECT ---//
+// non-blocking 的 connect 與 SSL_connect，完成或失敗時呼叫 ready（失敗時由 ready 呼叫 tls_close）
+static void tls_close(TlsConn *t) {
+    if (t->fd < 0)
+        return;
+    ev_del(&t->c->loop, &t->watch);
+    if (t->ssl)
+        SSL_free(t->ssl);
+    close(t->fd);
+    t->ssl = NULL;
+    t->fd = -1;
+}
+
+static void tls_event(void *arg, uint32_t events) {
+    (void)events;
+    TlsConn *t = (TlsConn*)arg;
+    if (!t->ssl) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(t->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            t->ready(t, false);
+            return;
+        }
+        t->ssl = SSL_new(t->c->ctx);
+        SSL_set_fd(t->ssl, t->fd);
+    }
+
+    // 過載的 server 不做 handshake，回覆明文的 "SERVER_BUSY <秒>" 後關閉；TLS record 不會以這些字開頭
+    char peek[SIGNAL_SIZE];
+    int n = recv(t->fd, peek, sizeof(peek) - 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n > 0) {
+        peek[n] = '\0';
+        if ((t->busy = chat_busy_retry(peek)) > 0) {
+            t->ready(t, false);
+            return;
+        }
+    }
+
+    int r = SSL_connect(t->ssl);
+    if (r == 1) {
+        t->ready(t, true);
+        return;
+    }
+    int err = SSL_get_error(t->ssl, r);
+    if (err == SSL_ERROR_WANT_READ)
+        ev_mod(&t->c->loop, &t->watch, EPOLLIN);
+    else if (err == SSL_ERROR_WANT_WRITE)
+        ev_mod(&t->c->loop, &t->watch, EPOLLOUT);
+    else
+        t->ready(t, false);
+}
+
+static int tls_start(TlsConn *t, ChatClient *c, const char *ip, int port,
+                     void (*ready)(TlsConn*, bool), void *arg) {
+    t->c = c;
+    t->ssl = NULL;
+    t->ready = ready;
+    t->arg = arg;
+    t->busy = 0;
+    t->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (t->fd < 0)
+        return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0 ||
+        (connect(t->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) ||
+        ev_add(&c->loop, &t->watch, t->fd, EPOLLOUT, tls_event, t) == -1) {
+        close(t->fd);
+        t->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void ssl_close(SSL *ssl) {
+    int fd = SSL_get_fd(ssl);
+    SSL_free(ssl);
+    close(fd);
+}
+
+//--- SESSION ---//
+ChatSession *chat_session_new(ChatClient *c, const char *ip, int port, int receiver_port,
+                              const ChatEvents *ev, void *ctx) {
+    ChatSession *s = calloc(1, sizeof(ChatSession));
+    if (!s)
+        return NULL;
+    s->c = c;
+    if (ev)
+        s->ev = *ev;
+    s->ctx = ctx;
+    strncpy(s->ip, ip, INET_ADDRSTRLEN - 1);
+    s->port = port;
+    s->receiver_port = receiver_port;
+    s->state = SESSION_CLOSED;
+    s->conn.fd = -1;
+    s->receiver_fd = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->idle, NULL);
+    return s;
+}
+
+static void session_destroy(void *arg) {
+    ChatSession *s = (ChatSession*)arg;
+    s->ev.on_closed = NULL;
+    session_close(s);
+    while (s->directs)
+        direct_close(s->directs, -1, "session closed");
+    pthread_mutex_lock(&s->lock);
+    s->closed = true;
+    pthread_cond_broadcast(&s->idle);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// 關閉所有連線並等進行中的傳輸結束；不能在 callback 裡呼叫
+void chat_session_free(ChatSession *s) {
+    if (ev_post(&s->c->loop, session_destroy, s) == -1)
+        return;
+    pthread_mutex_lock(&s->lock);
+    while (!s->closed || s->running > 0)
+        pthread_cond_wait(&s->idle, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->idle);
+    free(s);
+}
+
+// 登入後的名稱，沒有登入時為空字串
+const char *chat_session_name(ChatSession *s) {
+    return s->name;
+}
+
+// 把進行中的傳輸列到 out，回傳筆數
+int chat_session_jobs(ChatSession *s, char *out, int len) {
+    int n = 0, used = 0;
+    out[0] = '\0';
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < CHAT_MAX_JOBS; i++) {
+        FileJob *job = s->jobs[i];
+        if (!job || used >= len)
+            continue;
+        used += snprintf(out + used, len - used, "#%d %s %s: %.2f / %.2f MB\n", job->id,
+                         job->upload ? "send" : "recv", job->filename,
+                         job->done / (1024.0 * 1024.0), job->size / (1024.0 * 1024.0));
+        n++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+// direct message 的位址 cache 命中與沒命中（問 server）的次數
+void chat_peer_stats(ChatSession *s, long *hits, long *misses) {
+    pthread_mutex_lock(&s->lock);
+    *hits = s->peer_hits;
+    *misses = s->peer_misses;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// 把 request 移出佇列，不通知結果
+static void request_unlink(ChatSession *s, ChatRequest *req) {
+    ChatRequest **p = &s->head, *prev = NULL;
+    while (*p && *p != req) {
+        prev = *p;
+        p = &(*p)->next;
+    }
+    if (!*p)
+        return;
+    *p = req->next;
+    if (s->tail == req)
+        s->tail = prev;
+    if (s->unsent == req)
+        s->unsent = req->next;
+    if (req->sent && req->pipe)
+        s->pending--;
+    else if (req->sent)
+        s->in_flight = false;
+    req->next = NULL;
+}
+
+// 回覆只有一部分（例如 roster 的變化太多）：同一個 request 排回下一個要送出的位置
+static void request_resend(ChatSession *s, ChatRequest *req) {
+    request_unlink(s, req);
+    req->sent = false;
+    ChatRequest **p = &s->head;
+    while (*p != s->unsent)
+        p = &(*p)->next;
+    req->next = s->unsent;
+    *p = req;
+    if (!req->next)
+        s->tail = req;
+    s->unsent = req;
+    session_next(s);
+}
+
+// 移除 request 並通知結果，不處理下一個
+static void finish(ChatSession *s, ChatRequest *req, int ok, const char *reply) {
+    request_unlink(s, req);
+    if (req->job)
+        job_close(req->job);
+    if (req->done)
+        req->done(s, req->done_arg, ok, reply);
+    free(req);
+}
+
+static void complete(ChatSession *s, ChatRequest *req, int ok, const char *reply) {
+    finish(s, req, ok, reply);
+    session_next(s);
+}
+
+//--- PEER ADDRESS ---//
+// 登出或斷線後收不到 PRESENCE，整個 cache 與 roster 作廢
+static void peer_clear(ChatSession *s) {
+    memset(s->peers, 0, sizeof(s->peers));
+    memset(s->contacts, 0, sizeof(s->contacts));
+    pthread_mutex_lock(&s->lock);
+    memset(s->roster, 0, sizeof(s->roster));
+    s->roster_version = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// cache 裡有接收端的位址時，direct message 不必問 server 就直接送出
+static bool peer_cached(ChatSession *s, ChatRequest *req) {
+    if (req->kind != REQ_DIRECT || s->state != SESSION_READY || !s->name[0] ||
+        req->target < 0 || req->target >= MAX_USERS || !s->peers[req->target].valid)
+        return false;
+    pthread_mutex_lock(&s->lock);
+    s->peer_hits++;
+    pthread_mutex_unlock(&s->lock);
+    request_unlink(s, req);
+    direct_send(s, s->peers[req->target].ip, s->peers[req->target].port, req);
+    return true;
+}
+
+//--- ROSTER ---//
+// 持有 s->lock 時呼叫；比現有的舊的變化不套用
+static void roster_set(ChatSession *s, int id, bool online, int version, const char *name) {
+    if (id < 0 || id >= MAX_USERS || (s->roster[id].known && s->roster[id].version > version))
+        return;
+    RosterEntry *e = &s->roster[id];
+    e->known = true;
+    e->online = online;
+    e->version = version;
+    snprintf(e->name, MAX_NAME, "%s", name);
+}
+
+// 套用數行 "<ID> <0|1> <version> <name>"，之後 version 以前的變化都已收到
+static void roster_apply(ChatSession *s, const char *lines, int version) {
+    pthread_mutex_lock(&s->lock);
+    for (const char *p = lines; p && *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : NULL) {
+        int id, online, ver;
+        char name[MAX_NAME];
+        if (sscanf(p, "%d %d %d %15s", &id, &online, &ver, name) == 4)
+            roster_set(s, id, online, ver, name);
+    }
+    if (version > s->roster_version)
+        s->roster_version = version;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// 聯絡人的數行 roster：換掉整個聯絡人列表，不在列表裡的人的位址不再 cache
+static void contacts_apply(ChatSession *s, const char *lines) {
+    memset(s->contacts, 0, sizeof(s->contacts));
+    for (const char *p = lines; *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : "") {
+        int id;
+        if (sscanf(p, "%d", &id) == 1 && id >= 0 && id < MAX_USERS)
+            s->contacts[id] = true;
+    }
+    for (int i = 0; i < MAX_USERS; i++)
+        if (!s->contacts[i])
+            s->peers[i].valid = false;
+    roster_apply(s, lines, 0);
+}
+
+// 自己保存的 roster，格式與 server 的 show list 相同，不必問 server；回傳人數
+int chat_roster(ChatSession *s, char *out, int len) {
+    int n = 0, used = 0;
+    out[0] = '\0';
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < MAX_USERS; i++) {
+        RosterEntry *e = &s->roster[i];
+        if (!e->known || used >= len)
+            continue;
+        used += snprintf(out + used, len - used, "%2d: %s%s\n", i,
+                         strcmp(e->name, s->name) == 0 ? "YOU " : e->online ? " *  " : "    ", e->name);
+        n++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+static void session_ready(TlsConn *t, bool ok) {
+    ChatSession *s = (ChatSession*)t->arg;
+    if (!ok) {
+        ERR_clear_error();
+        tls_close(t);
+        s->state = SESSION_CLOSED;
+        if (t->busy > 0) {
+            char reply[SIGNAL_SIZE];
+            snprintf(reply, sizeof(reply), "%s %d", SERVER_BUSY, t->busy);
+            complete(s, s->head, 0, reply);
+        } else {
+            complete(s, s->head, -1, "can't connect to server");
+        }
+        return;
+    }
+    // 之後同一個 watch 改由 session_event 處理，server 的第一個回覆為 ACCEPT_TASK
+    s->state = SESSION_WAIT_ACCEPT;
+    t->watch.handler = session_event;
+    t->watch.arg = s;
+    ev_mod(&s->c->loop, &t->watch, EPOLLIN);
+    session_event(s, EPOLLIN);
+}
+
+// 依順序送出排隊的 request：pipelined 的最多 PIPE_WINDOW 個同時等回覆，
+// lockstep 的要等前面的都完成；out 一次只放一個 request
+static void session_next(ChatSession *s) {
+    while (s->unsent && !s->in_flight && s->out_len == 0) {
+        ChatRequest *req = s->unsent;
+        if (peer_cached(s, req))
+            continue;
+        if (req->pipe && s->name[0] ? s->pending >= PIPE_WINDOW : req != s->head)
+            return;
+        if (req->kind == REQ_CONNECT) {
+            if (s->state != SESSION_CLOSED) {
+                finish(s, req, 0, "already connected");
+                continue;
+            }
+            req->sent = true;
+            s->unsent = req->next;
+            s->in_flight = true;
+            s->state = SESSION_CONNECTING;
+            if (tls_start(&s->conn, s->c, s->ip, s->port, session_ready, s) == -1) {
+                s->state = SESSION_CLOSED;
+                finish(s, req, -1, "can't connect to server");
+                continue;
+            }
+            return;
+        }
+        if (s->state != SESSION_READY) {
+            finish(s, req, -1, "not connected");
+            continue;
+        }
+        // 還沒登入時 server 不認得 PIPE_REQ，照原本的指令送出，回覆 UNKNOWN
+        if (req->pipe && !s->name[0])
+            req->pipe = false;
+        // show list 問的是自己的 roster 版本之後的變化，送出時才決定
+        if (req->kind == REQ_LIST)
+            snprintf(req->line, BUFFER_SIZE, "%s %d", SHOW_LIST, s->roster_version);
+        char line[BUFFER_SIZE];
+        if (req->pipe && snprintf(line, sizeof(line), "%s%d %s", PIPE_REQ, s->next_seq + 1,
+                                  req->line) >= (int)sizeof(line)) {
+            finish(s, req, 0, "request too long");
+            continue;
+        }
+        req->sent = true;
+        s->unsent = req->next;
+        int rc;
+        if (req->kind == REQ_DIRECT) {
+            pthread_mutex_lock(&s->lock);
+            s->peer_misses++;
+            pthread_mutex_unlock(&s->lock);
+        }
+        if (req->pipe) {
+            req->seq = ++s->next_seq;
+            s->pending++;
+            rc = session_write(s, line);
+        } else {
+            s->in_flight = true;
+            rc = session_write(s, req->line);
+        }
+        if (rc == -1) {
+            session_close(s);
+            return;
+        }
+    }
+}
+
+static void enqueue(void *arg) {
+    ChatRequest *req = (ChatRequest*)arg;
+    ChatSession *s = req->s;
+    if (s->tail)
+        s->tail->next = req;
+    else
+        s->head = req;
+    s->tail = req;
+    if (!s->unsent)
+        s->unsent = req;
+    session_next(s);
+}
+
+static ChatRequest *request_new(ChatSession *s, int kind, ChatDone done, void *arg) {
+    ChatRequest *req = calloc(1, sizeof(ChatRequest));
+    if (!req)
+        return NULL;
+    req->s = s;
+    req->kind = kind;
+    req->done = done;
+    req->done_arg = arg;
+    return req;
+}
+
+static int submit(ChatRequest *req) {
+    if (ev_post(&req->s->c->loop, enqueue, req) == -1) {
+        if (req->job)
+            job_close(req->job);
+        free(req);
+        return -1;
+    }
+    return 0;
+}
+
+// 送出 out 裡的 request 行；送不完就等 EPOLLOUT 再送同一個 buffer，失敗回傳 -1
+static int session_flush(ChatSession *s) {
+    if (s->out_len > 0) {
+        int n = SSL_write(s->conn.ssl, s->out, s->out_len);
+        if (n <= 0) {
+            int err = SSL_get_error(s->conn.ssl, n);
+            if (err == SSL_ERROR_WANT_WRITE && !s->want_out) {
+                s->want_out = true;
+                return ev_mod(&s->c->loop, &s->conn.watch, EPOLLIN | EPOLLOUT);
+            }
+            return err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ? 0 : -1;
+        }
+        s->out_len = 0;
+    }
+    if (s->want_out) {
+        s->want_out = false;
+        if (ev_mod(&s->c->loop, &s->conn.watch, EPOLLIN) == -1)
+            return -1;
+    }
+    // logout 沒有回覆：送出就完成，server 會關掉 relay / file socket
+    if (s->head && s->in_flight && s->head->kind == REQ_LOGOUT) {
+        pthread_mutex_lock(&s->lock);
+        s->name[0] = '\0';
+        pthread_mutex_unlock(&s->lock);
+        peer_clear(s);
+        complete(s, s->head, 1, s->head->line);
+    }
+    return 1;
+}
+
+static int session_write(ChatSession *s, const char *line) {
+    s->last_sent = ev_now_ms();
+    s->out_len = strlen(line);
+    memcpy(s->out, line, s->out_len);
+    return session_flush(s);
+}
+
+// server 斷線或 session 結束：排隊的 request 都以 -1 結束
+static void session_close(ChatSession *s) {
+    bool was_ready = s->state == SESSION_READY;
+    if (s->heartbeat) {
+        ev_timer_cancel(&s->c->loop, s->heartbeat);
+        s->heartbeat = 0;
+    }
+    tls_close(&s->conn);
+    s->state = SESSION_CLOSED;
+    s->out_len = 0;
+    s->want_out = false;
+    if (s->side) {
+        tls_close(s->side);
+        free(s->side);
+        s->side = NULL;
+    }
+    if (s->relay_ssl)
+        ssl_close(s->relay_ssl);
+    if (s->file_ssl)
+        ssl_close(s->file_ssl);
+    s->relay_ssl = s->file_ssl = NULL;
+    if (s->relay)
+        channel_close(s->relay);
+    if (s->file)
+        channel_close(s->file);
+    if (s->receiver_fd >= 0) {
+        ev_del(&s->c->loop, &s->receiver_watch);
+        close(s->receiver_fd);
+        s->receiver_fd = -1;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->name[0] = '\0';
+    pthread_mutex_unlock(&s->lock);
+    peer_clear(s);
+
+    while (s->head)
+        finish(s, s->head, -1, "connection closed");
+    if (was_ready && s->ev.on_closed)
+        s->ev.on_closed(s, s->ctx);
+}
+
+//--- LOGIN ---//
+// server 回覆 RELAY_SOCKET / FILE_SOCKET 後各連一次 SIDE_PORT，server 在 accept 前持有 users_lock，
+// 所以要等這條連線的 handshake 完成 server 才會送下一個回覆
+static void side_ready(TlsConn *t, bool ok) {
+    ChatSession *s = (ChatSession*)t->arg;
+    if (!ok) {
+        ERR_clear_error();
+        session_close(s);
+        return;
+    }
+    ev_del(&s->c->loop, &t->watch);
+    if (s->side_file)
+        s->file_ssl = t->ssl;
+    else
+        s->relay_ssl = t->ssl;
+    free(t);
+    s->side = NULL;
+}
+
+static int side_connect(ChatSession *s, bool file) {
+    if (s->side)
+        return -1;
+    s->side = calloc(1, sizeof(TlsConn));
+    if (!s->side)
+        return -1;
+    s->side_file = file;
+    if (tls_start(s->side, s->c, s->ip, SIDE_PORT, side_ready, s) == -1) {
+        free(s->side);
+        s->side = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void relay_frame(Channel *ch, const char *buf);
+static void file_frame(Channel *ch, const char *buf);
+static Channel *channel_open(ChatSession *s, SSL *ssl, void (*on_frame)(Channel*, const char*));
+
+static void login_step(ChatSession *s, ChatRequest *req, const char *reply) {
+    if (strcmp(reply, RELAY_SOCKET) == 0 || strcmp(reply, FILE_SOCKET) == 0) {
+        if (side_connect(s, strcmp(reply, FILE_SOCKET) == 0) == -1)
+            session_close(s);
+        return;
+    }
+    if (strcmp(reply, ASK_RCVR_PORT) == 0) {
+        char port[16];
+        snprintf(port, sizeof(port), "%d", s->receiver_port);
+        if (session_write(s, port) == -1)
+            session_close(s);
+        return;
+    }
+    size_t len = strlen(LOGIN_SUCCESS);
+    if (strncmp(reply, LOGIN_SUCCESS, len) != 0 || (reply[len] != '\0' && reply[len] != '\n')) {
+        // NO_REGISTER、LOGGED_IN，或 server 收不到 side socket 時的 FILE_FAIL
+        if (s->relay_ssl)
+            ssl_close(s->relay_ssl);
+        if (s->file_ssl)
+            ssl_close(s->file_ssl);
+        s->relay_ssl = s->file_ssl = NULL;
+        complete(s, req, 0, reply);
+        return;
+    }
+    if (!s->relay_ssl || !s->file_ssl) {
+        session_close(s);
+        return;
+    }
+
+    // 登入過程中 server 已經推送的資料還在 kernel 裡，level-triggered 的 epoll 會馬上回報
+    s->relay = channel_open(s, s->relay_ssl, relay_frame);
+    if (!s->relay)
+        ssl_close(s->relay_ssl);
+    s->file = channel_open(s, s->file_ssl, file_frame);
+    if (!s->file)
+        ssl_close(s->file_ssl);
+    s->relay_ssl = s->file_ssl = NULL;
+    pthread_mutex_lock(&s->lock);
+    strncpy(s->name, req->arg, MAX_NAME - 1);
+    pthread_mutex_unlock(&s->lock);
+    complete(s, req, s->relay && s->file ? 1 : -1, reply);
+}
+
+//--- DIRECT MESSAGE ---//
+// 送出用的連線依接收端的 IP 與 port 留在 s->directs 裡，之後的 direct message 沿用同一條；
+// 閒置 CHAT_DIRECT_IDLE 秒後關閉。接收端在同一條連線上一直讀 BUFFER_SIZE 的 frame，直到對方關閉
+static void direct_free(DirectConn *c) {
+    ChatSession *s = c->s;
+    for (DirectConn **p = &s->directs; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    ev_del(&s->c->loop, &c->watch);
+    if (c->timer)
+        ev_timer_cancel(&s->c->loop, c->timer);
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c);
+}
+
+// 關閉連線，排隊中的 direct message 都以 ok 結束；送不出去時丟掉 cache 裡這個位址，下次再問 server
+static void direct_close(DirectConn *c, int ok, const char *reply) {
+    ChatSession *s = c->s;
+    for (int i = 0; c->out && ok == -1 && i < MAX_USERS; i++)
+        if (s->peers[i].valid && s->peers[i].port == c->port && strcmp(s->peers[i].ip, c->ip) == 0)
+            s->peers[i].valid = false;
+    while (c->req) {
+        ChatRequest *req = c->req;
+        c->req = req->next;
+        if (req->done)
+            req->done(s, req->done_arg, ok, reply);
+        free(req);
+    }
+    direct_free(c);
+}
+
+static void direct_timeout(void *arg) {
+    DirectConn *c = (DirectConn*)arg;
+    c->timer = 0;
+    direct_close(c, -1, c->req ? "direct connection timed out" : NULL);
+}
+
+// 正在送或正在收一個 frame 時給 CHAT_DIRECT_TIMEOUT，閒置時給 CHAT_DIRECT_IDLE；
+// 接收端等兩倍的時間，讓送出端先關閉，避免送出端剛好寫進一條對方正要關掉的連線
+static void direct_arm(DirectConn *c) {
+    ChatSession *s = c->s;
+    int sec = c->req || (!c->out && c->len > 0) ? CHAT_DIRECT_TIMEOUT :
+              c->out ? CHAT_DIRECT_IDLE : 2 * CHAT_DIRECT_IDLE;
+    if (c->timer)
+        ev_timer_cancel(&s->c->loop, c->timer);
+    c->timer = ev_timer(&s->c->loop, sec * 1000, direct_timeout, c);
+}
+
+static DirectConn *direct_new(ChatSession *s, int fd, uint32_t events, EvHandler handler) {
+    DirectConn *c = calloc(1, sizeof(DirectConn));
+    if (!c)
+        return NULL;
+    c->s = s;
+    c->fd = fd;
+    if (ev_add(&s->c->loop, &c->watch, fd, events, handler, c) == -1) {
+        free(c);
+        return NULL;
+    }
+    c->next = s->directs;
+    s->directs = c;
+    return c;
+}
+
+static void direct_out_event(void *arg, uint32_t events);
+
+// 開一條新的送出連線；pool 滿了就先關掉一條閒置的
+static DirectConn *direct_connect(ChatSession *s, const char *ip, int port) {
+    int n = 0;
+    DirectConn *idle = NULL;
+    for (DirectConn *c = s->directs; c; c = c->next) {
+        if (!c->out)
+            continue;
+        n++;
+        if (!c->req)
+            idle = c;                  // 新的連線加在前面，最後找到的是最舊的
+    }
+    if (n >= CHAT_DIRECT_POOL && idle)
+        direct_close(idle, 0, NULL);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    DirectConn *c = NULL;
+    if (fd >= 0 && inet_pton(AF_INET, ip, &addr.sin_addr) == 1 &&
+        (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 || errno == EINPROGRESS))
+        c = direct_new(s, fd, EPOLLOUT, direct_out_event);
+    if (!c) {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    c->out = true;
+    snprintf(c->ip, sizeof(c->ip), "%s", ip);
+    c->port = port;
+    return c;
+}
+
+// 送出連線出錯：這條連線之前送過 frame 時，可能是接收端剛好關掉閒置的連線，
+// 排隊的 direct message 改用一條新的連線重送一次
+static void direct_fail(DirectConn *c, const char *reply) {
+    ChatSession *s = c->s;
+    DirectConn *retry = c->frames > 0 && c->req ? direct_connect(s, c->ip, c->port) : NULL;
+    if (!retry) {
+        direct_close(c, -1, reply);
+        return;
+    }
+    retry->req = c->req;
+    retry->req_tail = c->req_tail;
+    c->req = c->req_tail = NULL;
+    direct_free(c);
+    direct_arm(retry);
+}
+
+// 送出的 direct message：connect 完成後依序寫出排隊的 frame，寫完一個就通知一個；
+// 閒置時只等 EPOLLIN，接收端關閉或出錯就會收到
+static void direct_out_event(void *arg, uint32_t events) {
+    DirectConn *c = (DirectConn*)arg;
+    ChatSession *s = c->s;
+    if (!c->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            direct_close(c, -1, "can't connect to receiver");
+            return;
+        }
+        c->connected = true;
+    } else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        direct_fail(c, "receiver closed the connection");
+        return;
+    }
+
+    while (c->req) {
+        ChatRequest *req = c->req;
+        if (c->len == 0) {
+            pthread_mutex_lock(&s->lock);
+            format_buffer(c->buf, IS_MES, s->name, "", req->arg);
+            pthread_mutex_unlock(&s->lock);
+        }
+        while (c->len < BUFFER_SIZE) {
+            int n = send(c->fd, c->buf + c->len, BUFFER_SIZE - c->len, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                ev_mod(&s->c->loop, &c->watch, EPOLLIN | EPOLLOUT);
+                return;
+            }
+            if (n <= 0) {
+                c->len = 0;
+                direct_fail(c, "error in sending to receiver");
+                return;
+            }
+            c->len += n;
+        }
+        c->len = 0;
+        c->frames++;
+        c->req = req->next;
+        if (!c->req)
+            c->req_tail = NULL;
+        if (req->done)
+            req->done(s, req->done_arg, 1, "delivered");
+        free(req);
+    }
+    ev_mod(&s->c->loop, &c->watch, EPOLLIN);
+    direct_arm(c);
+}
+
+// 把 direct message 排到往 ip:port 的連線上，沒有就新開一條
+static void direct_send(ChatSession *s, const char *ip, int port, ChatRequest *req) {
+    DirectConn *c = s->directs;
+    while (c && !(c->out && c->port == port && strcmp(c->ip, ip) == 0))
+        c = c->next;
+    if (!c)
+        c = direct_connect(s, ip, port);
+    if (!c) {
+        if (req->done)
+            req->done(s, req->done_arg, -1, "can't connect to receiver");
+        free(req);
+        return;
+    }
+    bool idle = !c->req;
+    if (c->req_tail)
+        c->req_tail->next = req;
+    else
+        c->req = req;
+    c->req_tail = req;
+    if (!idle)
+        return;
+    direct_arm(c);
+    if (c->connected)
+        direct_out_event(c, EPOLLOUT);
+}
+
+// server 回覆 "<IP> <port>" 後存進 cache，request 離開佇列，直接連線送完才通知結果
+static void direct_step(ChatSession *s, ChatRequest *req, const char *reply) {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    if (strcmp(reply, OFFLINE) == 0 || sscanf(reply, "%15s %d", ip, &port) != 2) {
+        complete(s, req, 0, reply);
+        return;
+    }
+    // 只有聯絡人的變化會推過來，其他人的位址 cache 了也不知道何時失效
+    if (req->target >= 0 && req->target < MAX_USERS && s->contacts[req->target]) {
+        PeerAddr *p = &s->peers[req->target];
+        p->valid = true;
+        snprintf(p->ip, sizeof(p->ip), "%s", ip);
+        p->port = port;
+    }
+    request_unlink(s, req);
+    direct_send(s, ip, port, req);
+    session_next(s);
+}
+
+// receiver port 收到的連線：第一個 byte 決定是 direct message 還是直接傳檔；
+// direct message 的連線一直讀到對方關閉，每收滿一個 frame 通知一次
+static void direct_in_event(void *arg, uint32_t events) {
+    (void)events;
+    DirectConn *c = (DirectConn*)arg;
+    ChatSession *s = c->s;
+
+    // TLS handshake（第一個 byte 為 0x16）是直接傳檔，交給 p2p 的 handshake thread
+    if (c->len == 0 && c->frames == 0) {
+        unsigned char first;
+        int n = recv(c->fd, &first, 1, MSG_PEEK);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n == 1 && first == 0x16) {
+            int fd = c->fd;
+            c->fd = -1;
+            direct_free(c);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            p2p_accept_async(fd);
+            return;
+        }
+    }
+
+    while (true) {
+        int n = recv(c->fd, c->buf + c->len, BUFFER_SIZE - c->len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            direct_free(c);
+            return;
+        }
+        c->len += n;
+        if (c->len < BUFFER_SIZE)
+            continue;
+
+        char signal[SIGNAL_SIZE], from[MAX_NAME], to[MAX_NAME], mes[MAX_MES];
+        slice_buffer(c->buf, signal, from, to, mes);
+        mes[MAX_MES - 1] = '\0';
+        c->len = 0;
+        c->frames++;
+        if (strcmp(signal, IS_MES) == 0 && s->ev.on_message)
+            s->ev.on_message(s, s->ctx, from, mes, true);
+    }
+    direct_arm(c);
+}
+
+static void receiver_event(void *arg, uint32_t events) {
+    (void)events;
+    ChatSession *s = (ChatSession*)arg;
+    while (true) {
+        int conn_fd = accept4(s->receiver_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept on receiver port");
+            return;
+        }
+        DirectConn *c = direct_new(s, conn_fd, EPOLLIN, direct_in_event);
+        if (!c)
+            close(conn_fd);
+        else
+            direct_arm(c);
+    }
+}
+
+static int receiver_open(ChatSession *s) {
+    struct sockaddr_in rcvraddr;
+    if (create_listen_port(&s->receiver_fd, &rcvraddr, s->receiver_port, SOMAXCONN) == -1) {
+        if (s->receiver_fd >= 0)
+            close(s->receiver_fd);
+        s->receiver_fd = -1;
+        return -1;
+    }
+    fcntl(s->receiver_fd, F_SETFL, fcntl(s->receiver_fd, F_GETFL) | O_NONBLOCK);
+    if (ev_add(&s->c->loop, &s->receiver_watch, s->receiver_fd, EPOLLIN, receiver_event, s) == -1) {
+        close(s->receiver_fd);
+        s->receiver_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+//--- REPLY ---//
+static void file_step(ChatSession *s, ChatRequest *req, const char *reply) {
+    // spool 立刻回覆 "accept_file <ID> <token>"；直接傳送回覆 "offer_pending <offer ID> <邀請人數>"，
+    // 接收端的決定之後從 file socket 收到
+    FileJob *job = req->job;
+    if (strncmp(reply, ACCEPT_FILE, strlen(ACCEPT_FILE)) == 0) {
+        req->job = NULL;
+        complete(s, req, start_upload(job, reply + strlen(ACCEPT_FILE)), reply);
+        return;
+    }
+    int invited = 0;
+    if (strncmp(reply, OFFER_PENDING, strlen(OFFER_PENDING)) == 0 &&
+        sscanf(reply + strlen(OFFER_PENDING), "%d %d", &job->offer_id, &invited) == 2) {
+        if (offer_add(job) == -1) {
+            complete(s, req, 0, "too many pending offers");
+            return;
+        }
+        req->job = NULL;
+        complete(s, req, 1, reply);
+        return;
+    }
+    complete(s, req, 0, reply);
+}
+
+// "xfer_id <ID> <token> <size> <filename>"
+static void spool_get_step(ChatSession *s, ChatRequest *req, const char *reply) {
+    FileJob *job = calloc(1, sizeof(FileJob));
+    if (!job || strncmp(reply, XFER_ID, strlen(XFER_ID)) != 0 ||
+        sscanf(reply + strlen(XFER_ID), "%d %16s %lld %s", &job->id, job->token, &job->size,
+               job->filename) != 4) {
+        free(job);
+        complete(s, req, 0, reply);
+        return;
+    }
+    job->s = s;
+    char ids[32];
+    snprintf(ids, sizeof(ids), "%d %s", job->id, job->token);
+    complete(s, req, start_download(job, ids), reply);
+}
+
+// "roster <version> <more>\n" 加上變化的使用者；more 為 1 時以新的版本再問一次，
+// 全部收到後回傳整份 roster
+static void list_step(ChatSession *s, ChatRequest *req, const char *reply) {
+    int version, more;
+    const char *lines = strchr(reply, '\n');
+    if (strncmp(reply, ROSTER, strlen(ROSTER)) != 0 || !lines ||
+        sscanf(reply + strlen(ROSTER), "%d %d", &version, &more) != 2) {
+        complete(s, req, 0, reply);
+        return;
+    }
+    roster_apply(s, lines + 1, version);
+    if (more) {
+        request_resend(s, req);
+        return;
+    }
+    char list[BUFFER_SIZE * 4];
+    chat_roster(s, list, sizeof(list));
+    complete(s, req, 1, list);
+}
+
+// 聯絡人：加入時回覆 "contact_success\n" 加上他目前的一行 roster，列出時為 "contacts\n" 加上數行
+static void contact_step(ChatSession *s, ChatRequest *req, const char *reply) {
+    const char *lines = strchr(reply, '\n');
+    lines = lines ? lines + 1 : "";
+    if (strncmp(req->line, CONTACT_LIST, strlen(CONTACT_LIST)) == 0) {
+        if (strncmp(reply, CONTACTS, strlen(CONTACTS)) != 0) {
+            complete(s, req, 0, reply);
+            return;
+        }
+        contacts_apply(s, lines);
+    } else if (strncmp(reply, CONTACT_SUCCESS, strlen(CONTACT_SUCCESS)) != 0) {
+        complete(s, req, 0, reply);
+        return;
+    } else if (req->target >= 0 && req->target < MAX_USERS) {
+        bool add = strncmp(req->line, CONTACT_ADD, strlen(CONTACT_ADD)) == 0;
+        s->contacts[req->target] = add;
+        if (add)
+            roster_apply(s, lines, 0);
+        else
+            s->peers[req->target].valid = false;
+    }
+    complete(s, req, 1, reply);
+}
+
+//--- HEARTBEAT ---//
+// 連上 server 後，HEARTBEAT_SEC 內沒有送過 request 就送一個 PING，server 才不會當作 client 已經消失；
+// 上一個 PING 過了 HEARTBEAT_SEC 還沒有回覆，就當作 server 已經不在，關掉 session
+static void heartbeat_done(ChatSession *s, void *arg, int ok, const char *reply) {
+    (void)arg;
+    (void)ok;
+    (void)reply;
+    s->ping_sent = 0;
+}
+
+static void heartbeat(void *arg) {
+    ChatSession *s = (ChatSession*)arg;
+    s->heartbeat = 0;
+    if (s->state != SESSION_READY)
+        return;
+    uint64_t now = ev_now_ms();
+    if (s->ping_sent && now - s->ping_sent >= HEARTBEAT_SEC * 1000) {
+        session_close(s);
+        return;
+    }
+    // 有 request 在等回覆時不必送，server 那邊也還在處理
+    if (!s->head && now - s->last_sent >= HEARTBEAT_SEC * 1000) {
+        ChatRequest *req = request_new(s, REQ_SIMPLE, heartbeat_done, NULL);
+        if (req) {
+            req->pipe = true;
+            snprintf(req->line, BUFFER_SIZE, "%s", PING);
+            req->success = PONG;
+            s->ping_sent = now;
+            heartbeat_arm(s);
+            enqueue(req);
+            return;
+        }
+    }
+    heartbeat_arm(s);
+}
+
+static void heartbeat_arm(ChatSession *s) {
+    uint64_t now = ev_now_ms(), due = (s->ping_sent ? s->ping_sent : s->last_sent) + HEARTBEAT_SEC * 1000;
+    s->heartbeat = ev_timer(&s->c->loop, due > now ? (int)(due - now) : HEARTBEAT_SEC * 1000, heartbeat, s);
+}
+
+// main socket 上的一個回覆："rep <seq> " 開頭的交給同一個 seq 的 pipelined request，
+// 其他的交給送出中的 lockstep request（head）
+static void session_reply(ChatSession *s, const char *reply) {
+    if (s->state == SESSION_WAIT_ACCEPT) {
+        if (strcmp(reply, ACCEPT_TASK) != 0) {
+            finish(s, s->head, 0, reply);
+            session_close(s);
+            return;
+        }
+        s->state = SESSION_READY;
+        if (s->receiver_port > 0 && s->receiver_fd < 0 && receiver_open(s) == -1) {
+            finish(s, s->head, 0, "can't listen on receiver port");
+            session_close(s);
+            return;
+        }
+        s->last_sent = ev_now_ms();
+        heartbeat_arm(s);
+        complete(s, s->head, 1, reply);
+        return;
+    }
+
+    ChatRequest *req = NULL;
+    if (strncmp(reply, PIPE_REP, strlen(PIPE_REP)) == 0) {
+        int seq, skip = 0;
+        if (sscanf(reply + strlen(PIPE_REP), "%d %n", &seq, &skip) != 1 || skip == 0)
+            return;
+        reply += strlen(PIPE_REP) + skip;
+        for (req = s->head; req && req != s->unsent; req = req->next)
+            if (req->pipe && req->seq == seq)
+                break;
+        if (req == s->unsent)
+            return;
+    } else {
+        req = s->head;
+        if (!req || !s->in_flight || s->out_len > 0)
+            return;
+    }
+    switch (req->kind) {
+    case REQ_SIMPLE:
+        complete(s, req, (req->success && strcmp(reply, req->success) != 0) ||
+                         (req->failure && strncmp(reply, req->failure, strlen(req->failure)) == 0) ? 0 : 1,
+                 reply);
+        break;
+    case REQ_LOGIN:
+        login_step(s, req, reply);
+        break;
+    case REQ_RELAY:
+        complete(s, req, strcmp(reply, MES_SUCCESS) == 0 ? 1 : 0, reply);
+        break;
+    case REQ_DIRECT:
+        direct_step(s, req, reply);
+        break;
+    case REQ_FILE:
+        file_step(s, req, reply);
+        break;
+    case REQ_SPOOL_GET:
+        spool_get_step(s, req, reply);
+        break;
+    case REQ_LIST:
+        list_step(s, req, reply);
+        break;
+    case REQ_CONTACT:
+        contact_step(s, req, reply);
+        break;
+    }
+}
+
+// main socket：每個 SSL_read 是 server 的一個回覆（每個回覆各自是一個 TLS record）
+static void session_event(void *arg, uint32_t events) {
+    ChatSession *s = (ChatSession*)arg;
+    if (events & EPOLLOUT) {
+        if (session_flush(s) == -1) {
+            session_close(s);
+            return;
+        }
+        session_next(s);
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+
+    char buf[BUFFER_SIZE];
+    while (s->state == SESSION_WAIT_ACCEPT || s->state == SESSION_READY) {
+        int n = SSL_read(s->conn.ssl, buf, BUFFER_SIZE - 1);
+        if (n > 0) {
+            buf[n] = '\0';
+            session_reply(s, buf);
+            continue;
+        }
+        int err = SSL_get_error(s->conn.ssl, n);
+        if (err == SSL_ERROR_WANT_READ)
+            return;
+        if (err == SSL_ERROR_WANT_WRITE) {
+            s->want_out = true;
+            ev_mod(&s->c->loop, &s->conn.watch, EPOLLIN | EPOLLOUT);
+            return;
+        }
+        ERR_clear_error();
+        session_close(s);
+        return;
+    }
+}
+
+//--- CHANNEL ---//
+static void channel_close(Channel *ch) {
+    ChatSession *s = ch->s;
+    ev_del(&s->c->loop, &ch->watch);
+    ssl_close(ch->ssl);
+    if (s->relay == ch)
+        s->relay = NULL;
+    if (s->file == ch) {
+        // 登出後 server 不會再送 offer 的結果
+        s->file = NULL;
+        offer_clear(s);
+    }
+    free(ch);
+}
+
+// 依序送出排隊的回覆，送不出去就等 EPOLLOUT；失敗回傳 -1
+static int channel_flush(Channel *ch) {
+    EvLoop *loop = &ch->s->c->loop;
+    while (ch->out_count > 0) {
+        const char *line = ch->out[ch->out_head];
+        int n = SSL_write(ch->ssl, line, strlen(line));
+        if (n <= 0) {
+            int err = SSL_get_error(ch->ssl, n);
+            if (err == SSL_ERROR_WANT_WRITE)
+                return ev_mod(loop, &ch->watch, EPOLLIN | EPOLLOUT);
+            if (err == SSL_ERROR_WANT_READ)
+                return 0;
+            return -1;
+        }
+        ch->out_head = (ch->out_head + 1) % CHANNEL_QUEUE;
+        ch->out_count--;
+    }
+    return ev_mod(loop, &ch->watch, EPOLLIN);
+}
+
+static int channel_send(Channel *ch, const char *line) {
+    if (ch->out_count == CHANNEL_QUEUE || strlen(line) >= CHANNEL_LINE)
+        return -1;
+    int i = (ch->out_head + ch->out_count) % CHANNEL_QUEUE;
+    strcpy(ch->out[i], line);
+    ch->out_count++;
+    return ch->out_count == 1 ? channel_flush(ch) : 0;
+}
+
+static void channel_event(void *arg, uint32_t events) {
+    Channel *ch = (Channel*)arg;
+    if ((events & EPOLLOUT) && channel_flush(ch) == -1) {
+        channel_close(ch);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+
+    // 讀到 WANT_READ 為止，TLS 層緩衝的資料也一併處理
+    while (true) {
+        int n = SSL_read(ch->ssl, ch->in + ch->in_len, BUFFER_SIZE - ch->in_len);
+        if (n > 0) {
+            ch->in_len += n;
+            if (ch->in_len == BUFFER_SIZE) {
+                ch->in_len = 0;
+                ch->on_frame(ch, ch->in);
+            }
+            continue;
+        }
+        int err = SSL_get_error(ch->ssl, n);
+        if (err == SSL_ERROR_WANT_READ)
+            return;
+        if (err == SSL_ERROR_WANT_WRITE) {
+            ev_mod(&ch->s->c->loop, &ch->watch, EPOLLIN | EPOLLOUT);
+            return;
+        }
+        ERR_clear_error();
+        channel_close(ch);
+        return;
+    }
+}
+
+static Channel *channel_open(ChatSession *s, SSL *ssl, void (*on_frame)(Channel*, const char*)) {
+    Channel *ch = calloc(1, sizeof(Channel));
+    if (!ch)
+        return NULL;
+    int fd = SSL_get_fd(ssl);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    ch->s = s;
+    ch->ssl = ssl;
+    ch->on_frame = on_frame;
+    if (ev_add(&s->c->loop, &ch->watch, fd, EPOLLIN, channel_event, ch) == -1) {
+        free(ch);
+        return NULL;
+    }
+    return ch;
+}
+
+// Relay Socket 的 frame：relay message 與 spool 通知
+static void relay_frame(Channel *ch, const char *buf) {
+    ChatSession *s = ch->s;
+    char signal[SIGNAL_SIZE], from[MAX_NAME], to[MAX_NAME], mes[MAX_MES];
+    slice_buffer(buf, signal, from, to, mes);
+    mes[MAX_MES - 1] = '\0';
+    if (strcmp(signal, IS_SPOOL) == 0) {
+        if (s->ev.on_spool)
+            s->ev.on_spool(s, s->ctx, from, mes);
+    } else if (strcmp(signal, IS_MES) == 0) {
+        if (s->ev.on_message)
+            s->ev.on_message(s, s->ctx, from, mes, false);
+    } else if (strcmp(signal, PRESENCE) == 0) {
+        // 聯絡人註冊、登入或登出，一個 frame 可能有好幾行：更新 roster，位址可能改變；
+        // 只收得到聯絡人的變化，所以 roster_version 不前進
+        for (const char *p = mes; *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : "") {
+            int id, online, version;
+            char name[MAX_NAME];
+            if (sscanf(p, "%d %d %d %15s", &id, &online, &version, name) != 4 || id < 0 || id >= MAX_USERS)
+                continue;
+            pthread_mutex_lock(&s->lock);
+            roster_set(s, id, online, version, name);
+            pthread_mutex_unlock(&s->lock);
+            s->peers[id].valid = false;
+            if (s->ev.on_presence)
+                s->ev.on_presence(s, s->ctx, id, name, online);
+        }
+    } else if (strcmp(signal, ROSTER) == 0) {
+        // 登入後的完整 roster，可能分成好幾個 frame
+        const char *lines = strchr(mes, '\n');
+        if (lines)
+            roster_apply(s, lines + 1, atoi(mes));
+    } else if (strcmp(signal, CONTACTS) == 0) {
+        // 登入後的聯絡人
+        contacts_apply(s, mes);
+    }
+}
+
+// File Socket 的 frame
+// server 從 file socket 送來固定 BUFFER_SIZE 的 frame，mes 都以 offer ID 開頭：
+//   is_file       別人送來的 offer："<offer ID> 檔名 大小 [附加欄位]"
+//   xfer_id       答應的 offer 已建立傳輸："<offer ID> <xfer ID> <token> [<PSK>]"
+//   accept_file   自己的 offer 被接受："<offer ID> <xfer ID> <token> ..."
+//   reject_file / offer_expired / file_fail  offer 沒有結果："<offer ID>"
+static void file_frame(Channel *ch, const char *buf) {
+    ChatSession *s = ch->s;
+    char signal[SIGNAL_SIZE], from[MAX_NAME], to[MAX_NAME], mes[MAX_MES];
+    slice_buffer(buf, signal, from, to, mes);
+    mes[MAX_MES - 1] = '\0';
+    int offer_id = atoi(mes);
+    const char *rest = strchr(mes, ' ');
+    rest = rest ? rest + 1 : "";
+
+    if (strcmp(signal, IS_FILE) == 0) {
+        // "檔名 大小 [DELTA_TAG]"，目錄為 "名稱/ 大小 檔案數"
+        FileJob *job = calloc(1, sizeof(FileJob));
+        if (!job)
+            return;
+        char extra[32] = "";
+        if (sscanf(rest, "%s %lld %31s", job->filename, &job->size, extra) < 1)
+            strncpy(job->filename, rest, MAX_MES - 1);
+        job->s = s;
+        job->nfiles = atoi(extra);
+        job->delta = strcmp(extra, DELTA_TAG) == 0;
+        job->offer_id = offer_id;
+        // 前端沒有處理 offer、名稱不是單一層或表格已滿時直接拒絕
+        if (!s->ev.on_offer || !batch_name_ok(job->filename) || offer_add(job) == -1) {
+            char answer[CHANNEL_LINE];
+            snprintf(answer, sizeof(answer), "%s %d", REJECT_FILE, offer_id);
+            channel_send(ch, answer);
+            free(job);
+            return;
+        }
+        s->ev.on_offer(s, s->ctx, offer_id, from, job->filename, job->size, job->nfiles);
+    } else if (strcmp(signal, XFER_ID) == 0) {
+        FileJob *job = offer_take(s, offer_id, false);
+        if (job)
+            start_download(job, rest);
+    } else if (strcmp(signal, ACCEPT_FILE) == 0) {
+        FileJob *job = offer_take(s, offer_id, true);
+        if (job)
+            start_upload(job, rest);
+    } else if (strcmp(signal, REJECT_FILE) == 0 || strcmp(signal, OFFER_EXPIRED) == 0 ||
+               strcmp(signal, FILE_FAIL) == 0) {
+        FileJob *job = offer_take(s, offer_id, true);
+        if (job) {
+            job_event(job, strcmp(signal, REJECT_FILE) == 0 ? CHAT_XFER_REJECTED :
+                           strcmp(signal, OFFER_EXPIRED) == 0 ? CHAT_XFER_EXPIRED : CHAT_XFER_FAILED,
+                      NULL);
+            job_close(job);
+        } else if ((job = offer_take(s, offer_id, false)) != NULL) {
+            job_event(job, CHAT_XFER_CANCELLED, from);
+            free(job);
+        }
+    }
+}
+
+// 使用者的決定：從 file socket 回覆 server，每個 offer 只回覆一次
+static void offer_decided(void *arg) {
+    OfferDecision *d = (OfferDecision*)arg;
+    ChatSession *s = d->s;
+    FileJob *job = offer_find(s, d->offer_id);
+    if (job && !job->answered && s->file) {
+        if (d->accept) {
+            job->answered = true;
+        } else {
+            job = offer_take(s, d->offer_id, false);
+            free(job);
+        }
+        char answer[CHANNEL_LINE];
+        snprintf(answer, sizeof(answer), "%s %d", d->accept ? ACCEPT_FILE : REJECT_FILE, d->offer_id);
+        if (channel_send(s->file, answer) == -1)
+            channel_close(s->file);
+    }
+    free(d);
+}
+
+//--- API ---//
+int chat_connect(ChatSession *s, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_CONNECT, done, arg);
+    return req ? submit(req) : -1;
+}
+
+// chat_connect 被過載的 server 拒絕（ok 為 0）時，回傳 server 建議幾秒後再連；其他回覆回傳 0
+int chat_busy_retry(const char *reply) {
+    size_t len = strlen(SERVER_BUSY);
+    if (!reply || strncmp(reply, SERVER_BUSY, len) != 0)
+        return 0;
+    int sec = atoi(reply + len);
+    return sec > 0 ? sec : ADMIT_RETRY_SEC;
+}
+
+static int simple(ChatSession *s, const char *line, const char *success, const char *failure,
+                  bool pipe, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_SIMPLE, done, arg);
+    if (!req)
+        return -1;
+    req->pipe = pipe;
+    snprintf(req->line, BUFFER_SIZE, "%s", line);
+    req->success = success;
+    req->failure = failure;
+    return submit(req);
+}
+
+int chat_register(ChatSession *s, const char *name, ChatDone done, void *arg) {
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "%s%s", REGISTER, name);
+    return simple(s, line, REGISTER_SUCCESS, NULL, false, done, arg);
+}
+
+// 成功時 reply 為 "login_success"，後面每個對話一行 "\n<ID> <未讀數> <已讀到的 seq>"；
+// 已讀到的 seq 可當 chat_history 的 cursor，讀完後以 chat_mark_read 告訴 server
+int chat_login(ChatSession *s, const char *name, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_LOGIN, done, arg);
+    if (!req)
+        return -1;
+    snprintf(req->line, BUFFER_SIZE, "%s%s", LOGIN, name);
+    snprintf(req->arg, MAX_NAME, "%s", name);
+    return submit(req);
+}
+
+int chat_logout(ChatSession *s, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_LOGOUT, done, arg);
+    if (!req)
+        return -1;
+    strcpy(req->line, LOGOUT);
+    return submit(req);
+}
+
+// 還沒登入時結束 server 那邊的 session，之後 server 會關閉連線
+int chat_exit(ChatSession *s, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_LOGOUT, done, arg);
+    if (!req)
+        return -1;
+    strcpy(req->line, EXIT);
+    return submit(req);
+}
+
+// 跟 server 同步 roster 後回傳整份；只想看目前的 roster 用 chat_roster 就好
+int chat_list(ChatSession *s, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_LIST, done, arg);
+    if (!req)
+        return -1;
+    req->pipe = true;
+    return submit(req);
+}
+
+// 依名稱排序的一頁（ROSTER_PAGE 人），不必先有整份 roster；
+// 成功時 reply 為 "roster_page <version> <page> <符合的人數>\n" 加上數行 "<ID> <0|1> <version> <name>"
+int chat_roster_query(ChatSession *s, int page, bool online_only, const char *prefix,
+                      ChatDone done, void *arg) {
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "%s %d %d %.*s", ROSTER_QUERY, page, online_only ? 1 : 0,
+             MAX_NAME - 1, prefix ? prefix : "");
+    return simple(s, line, NULL, UNKNOWN, true, done, arg);
+}
+
+static int contact(ChatSession *s, const char *cmd, int target, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_CONTACT, done, arg);
+    if (!req)
+        return -1;
+    req->pipe = true;
+    req->target = target;
+    if (target >= 0)
+        snprintf(req->line, BUFFER_SIZE, "%s %d", cmd, target);
+    else
+        snprintf(req->line, BUFFER_SIZE, "%s", cmd);
+    return submit(req);
+}
+
+// 聯絡人存在 server 上，登出後仍保留；只有聯絡人的註冊、登入、登出會以 on_presence 推過來，
+// direct message 的位址也只 cache 聯絡人的
+int chat_contact_add(ChatSession *s, int target, ChatDone done, void *arg) {
+    return target < 0 ? -1 : contact(s, CONTACT_ADD, target, done, arg);
+}
+
+int chat_contact_del(ChatSession *s, int target, ChatDone done, void *arg) {
+    return target < 0 ? -1 : contact(s, CONTACT_DEL, target, done, arg);
+}
+
+// 成功時 reply 為 "contacts\n" 加上每個聯絡人一行 "<ID> <0|1> <version> <name>"
+int chat_contacts(ChatSession *s, ChatDone done, void *arg) {
+    return contact(s, CONTACT_LIST, -1, done, arg);
+}
+
+// 跟 target 之間的 relay 訊息中 seq 大於 cursor 的一頁；成功時 reply 為 "history <next cursor> <more>\n"
+// 加上數行 "<seq> <time> <from> <訊息>"，more 為 1 時以 next cursor 再呼叫一次。
+// 歷史存在 server 上，換一台機器從 cursor 0 開始就拿得到全部
+int chat_history(ChatSession *s, int target, long long cursor, ChatDone done, void *arg) {
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "%s %d %lld", HISTORY, target, cursor);
+    return simple(s, line, NULL, NO_USER, true, done, arg);
+}
+
+// 跟 target 的對話已讀到 seq，換一台機器登入時未讀數與 cursor 從這裡接續；成功時 reply 為 "unread <還沒讀的則數>"
+int chat_mark_read(ChatSession *s, int target, long long seq, ChatDone done, void *arg) {
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "%s %d %lld", MARK_READ, target, seq);
+    return simple(s, line, NULL, NO_USER, true, done, arg);
+}
+
+// 自己的 relay 訊息中含有 query 全部的詞、時間不早於 since 的，target 為 -1 時不限對話；
+// 成功時 reply 為 "search <n>\n" 加上 n 行 "<ID> <seq> <time> <from> <片段>"，從新到舊。
+// seq 減一當 chat_history 的 cursor 就從那則訊息開始讀
+int chat_search(ChatSession *s, int target, time_t since, const char *query, ChatDone done, void *arg) {
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "%s %d %lld %s", SEARCH, target, (long long)since, query);
+    line[strcspn(line, "\n")] = '\0';
+    return simple(s, line, NULL, NO_USER, true, done, arg);
+}
+
+int chat_relay(ChatSession *s, int target, const char *message, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_RELAY, done, arg);
+    if (!req)
+        return -1;
+    req->pipe = true;
+    snprintf(req->line, BUFFER_SIZE, "%s%d %.*s", RELAY_MES, target, MAX_MES - 1, message);
+    return submit(req);
+}
+
+// 完成表示訊息已經寫進對方的 receiver port
+int chat_direct(ChatSession *s, int target, const char *message, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_DIRECT, done, arg);
+    if (!req)
+        return -1;
+    req->pipe = true;
+    req->target = target;
+    snprintf(req->line, BUFFER_SIZE, "%s%d", DIRECT_MES, target);
+    snprintf(req->arg, MAX_MES, "%s", message);
+    return submit(req);
+}
+
+// targets 為一個 ID，或以逗號分隔的多個 ID（上傳一次由 server 分送）；spool 只接受一個 ID
+// 完成表示 server 已收下 offer，傳輸的結果之後以 on_transfer 通知
+int chat_send_file(ChatSession *s, const char *targets, const char *path, bool spool,
+                   ChatDone done, void *arg) {
+    bool multi = !spool && strchr(targets, ',') != NULL;
+    ChatRequest *req = request_new(s, REQ_FILE, done, arg);
+    if (!req)
+        return -1;
+    req->job = job_prepare(s, path, spool, multi, req->arg, BUFFER_SIZE);
+    if (!req->job) {
+        free(req);
+        return -1;
+    }
+    req->pipe = true;
+    int n;
+    if (multi)
+        n = snprintf(req->line, BUFFER_SIZE, "%s%s %s", MULTI_FILE, targets, req->arg);
+    else
+        n = snprintf(req->line, BUFFER_SIZE, "%s%d %s", spool ? SPOOL_FILE : FILE_TRANSFER,
+                     atoi(targets), req->arg);
+    if (n >= BUFFER_SIZE) {
+        job_close(req->job);
+        free(req);
+        return -1;
+    }
+    return submit(req);
+}
+
+// 回答 on_offer 通知的 offer；答應後傳輸的進度以 on_transfer 通知
+int chat_answer_offer(ChatSession *s, int offer_id, bool accept) {
+    OfferDecision *d = malloc(sizeof(OfferDecision));
+    if (!d)
+        return -1;
+    d->s = s;
+    d->offer_id = offer_id;
+    d->accept = accept;
+    if (ev_post(&s->c->loop, offer_decided, d) == -1) {
+        free(d);
+        return -1;
+    }
+    return 0;
+}
+
+// 沒有檔案時回覆 NO_SPOOL
+int chat_spool_list(ChatSession *s, ChatDone done, void *arg) {
+    return simple(s, SPOOL_LIST, NULL, NULL, true, done, arg);
+}
+
+int chat_spool_get(ChatSession *s, int spool_id, ChatDone done, void *arg) {
+    ChatRequest *req = request_new(s, REQ_SPOOL_GET, done, arg);
+    if (!req)
+        return -1;
+    req->pipe = true;
+    snprintf(req->line, BUFFER_SIZE, "%s %d", SPOOL_GET, spool_id);
+    return submit(req);
+}
+
+int chat_xfer_stats(ChatSession *s, ChatDone done, void *arg) {
+    return simple(s, XFER_STATS, NULL, NULL, true, done, arg);
+}
+
+// 成功時 reply 為 "<STREAM_PORT> <檔名>"，之後由呼叫者連到 STREAM_PORT 接收
+int chat_stream(ChatSession *s, const char *filename, ChatDone done, void *arg) {
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "%s %s", STREAM_CMD, filename);
+    return simple(s, line, NULL, "ERROR", false, done, arg);
+}
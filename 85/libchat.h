@@ -0,0 +1,93 @@
+// libchat.h
+#ifndef LIBCHAT_H
+#define LIBCHAT_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <time.h>
+
+//--- LIBCHAT ---//
+// 不含任何 UI 的 client：一個 ChatClient 有一個 event loop thread，可以同時開很多個 session。
+// 每個操作立刻回傳，結果在 loop thread 以 callback 通知；除了 callback 之外，所有函數都可以從任何
+// thread 呼叫。同一個 session 的 request 依呼叫順序送給 server：登入後的一般操作帶 seq 連續送出，
+// 最多 PIPE_WINDOW 個同時等回覆，結果可能不依順序通知；connect、register、login、logout、exit、
+// stream 要等前面的 request 都完成才送，送出後也要等它完成才送下一個
+#define CHAT_MAX_JOBS 64                  // 每個 session 進行中或等待回覆的傳輸數
+#define CHAT_DIRECT_TIMEOUT 5             // direct message 的 frame 多久沒送完 / 收完就關閉連線（秒）
+#define CHAT_DIRECT_IDLE 30               // 送 direct message 的連線閒置多久後關閉（秒）
+#define CHAT_DIRECT_POOL 16               // 每個 session 最多保留幾條送 direct message 的連線
+
+typedef struct ChatClient ChatClient;
+typedef struct ChatSession ChatSession;
+
+// request 完成：ok 為 1 成功，0 被 server 拒絕，-1 連線錯誤；reply 為 server 的回覆或錯誤說明
+typedef void (*ChatDone)(ChatSession *s, void *arg, int ok, const char *reply);
+
+// 傳輸狀態
+#define CHAT_XFER_STARTED 1               // 資料連線已建立
+#define CHAT_XFER_DONE 2
+#define CHAT_XFER_FAILED 3
+#define CHAT_XFER_REJECTED 4              // 接收端拒絕
+#define CHAT_XFER_EXPIRED 5               // 接收端沒有在 OFFER_TIMEOUT 內回覆
+#define CHAT_XFER_CANCELLED 6             // 傳送端取消或離線
+
+typedef struct {
+    int  id;                           // 傳輸 ID，還沒建立時為 0
+    int  offer_id;
+    const char *filename;
+    bool upload;
+    int  state;                        // CHAT_XFER_*
+    long long bytes, size;
+    const char *detail;                // 例如 "delivered directly"、"accepted by 2/3 users"
+} ChatTransfer;
+
+// session 的事件，不需要的欄位設為 NULL；on_transfer 可能在傳輸 thread 呼叫
+typedef struct {
+    void (*on_message)(ChatSession *s, void *ctx, const char *from, const char *mes, bool direct);
+    void (*on_spool)(ChatSession *s, void *ctx, const char *from, const char *mes);
+    void (*on_offer)(ChatSession *s, void *ctx, int offer_id, const char *from,
+                     const char *filename, long long size, int nfiles);
+    void (*on_transfer)(ChatSession *s, void *ctx, const ChatTransfer *t);
+    void (*on_closed)(ChatSession *s, void *ctx);
+    void (*on_presence)(ChatSession *s, void *ctx, int id, const char *name, bool online);
+} ChatEvents;
+
+ChatClient *chat_client_new();
+void chat_client_free(ChatClient *c);
+
+// receiver_port > 0 時在該 port 收 direct message 與直接傳檔
+ChatSession *chat_session_new(ChatClient *c, const char *ip, int port, int receiver_port,
+                              const ChatEvents *ev, void *ctx);
+void chat_session_free(ChatSession *s);
+const char *chat_session_name(ChatSession *s);
+int  chat_session_jobs(ChatSession *s, char *out, int len);
+void chat_peer_stats(ChatSession *s, long *hits, long *misses);
+int  chat_roster(ChatSession *s, char *out, int len);
+
+int  chat_connect(ChatSession *s, ChatDone done, void *arg);
+int  chat_busy_retry(const char *reply);
+int  chat_register(ChatSession *s, const char *name, ChatDone done, void *arg);
+int  chat_login(ChatSession *s, const char *name, ChatDone done, void *arg);
+int  chat_logout(ChatSession *s, ChatDone done, void *arg);
+int  chat_exit(ChatSession *s, ChatDone done, void *arg);
+int  chat_list(ChatSession *s, ChatDone done, void *arg);
+int  chat_roster_query(ChatSession *s, int page, bool online_only, const char *prefix,
+                       ChatDone done, void *arg);
+int  chat_contact_add(ChatSession *s, int target, ChatDone done, void *arg);
+int  chat_contact_del(ChatSession *s, int target, ChatDone done, void *arg);
+int  chat_contacts(ChatSession *s, ChatDone done, void *arg);
+int  chat_history(ChatSession *s, int target, long long cursor, ChatDone done, void *arg);
+int  chat_mark_read(ChatSession *s, int target, long long seq, ChatDone done, void *arg);
+int  chat_search(ChatSession *s, int target, time_t since, const char *query, ChatDone done, void *arg);
+int  chat_relay(ChatSession *s, int target, const char *message, ChatDone done, void *arg);
+int  chat_direct(ChatSession *s, int target, const char *message, ChatDone done, void *arg);
+int  chat_send_file(ChatSession *s, const char *targets, const char *path, bool spool,
+                    ChatDone done, void *arg);
+int  chat_answer_offer(ChatSession *s, int offer_id, bool accept);
+int  chat_spool_list(ChatSession *s, ChatDone done, void *arg);
+int  chat_spool_get(ChatSession *s, int spool_id, ChatDone done, void *arg);
+int  chat_xfer_stats(ChatSession *s, ChatDone done, void *arg);
+int  chat_stream(ChatSession *s, const char *filename, ChatDone done, void *arg);
+
+#endif
@@ -0,0 +1,171 @@
+// libchat_int.h
+// libchat.c 與 libchat_xfer.c 共用的內部結構，前端不應該 include
+#ifndef LIBCHAT_INT_H
+#define LIBCHAT_INT_H
+
+#include "libchat.h"
+#include "evloop.h"
+#include "file_pipe.h"
+#include "batch.h"
+#include "delta.h"
+#include "p2p.h"
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+
+#define CHANNEL_QUEUE 16               // file socket 上還沒送出的回覆數
+#define CHANNEL_LINE 64
+
+//--- FILE JOB ---//
+// 一個上傳或下載：先在 offers 等 server 的結果，開始傳輸後移到 jobs
+typedef struct {
+    ChatSession *s;
+    int  id;                           // server 給的傳輸 ID
+    char token[XFER_TOKEN_LEN + 1];    // 資料連線報到用
+    char filename[MAX_MES];
+    long long size;
+    bool spool;                        // 上傳到 server 的 spool，而不是直接給接收端
+    char psk[P2P_PSK_LEN + 1];         // 有值時先嘗試直接連線
+    char peer_ip[INET_ADDRSTRLEN];     // 接收端的 receiver port（傳送端使用）
+    int  peer_port;
+    FileReader reader;                 // 上傳時使用
+    BatchReader *batch;                // 上傳整個目錄時使用（filename 以 '/' 結尾）
+    int  nfiles;
+    bool delta;                        // 先交換 signature，接收端有舊版時只送差異
+    bool upload;
+    bool multi;                        // 傳給多個接收端（fan-out）
+    int  offer_id;                     // server 給的 offer ID，等待回覆時使用
+    bool answered;                     // 接收端：已經答應，等 server 建立傳輸
+    long long done;                    // 已送出 / 已收到的 bytes（持有 s->lock 時更新）
+} FileJob;
+
+//--- CHANNEL ---//
+// server 推送的 socket（relay / file）：收滿 BUFFER_SIZE 才算一個 frame；
+// 每個回覆各自是一個 TLS record，server 一次讀一個
+typedef struct Channel {
+    ChatSession *s;
+    SSL *ssl;
+    EvWatch watch;
+    char in[BUFFER_SIZE];
+    int  in_len;
+    char out[CHANNEL_QUEUE][CHANNEL_LINE];
+    int  out_head, out_count;
+    void (*on_frame)(struct Channel *ch, const char *frame);
+} Channel;
+
+// non-blocking 的 connect 加 TLS handshake，完成後呼叫 ready
+typedef struct TlsConn {
+    ChatClient *c;
+    int  fd;
+    SSL *ssl;                          // TCP 連上後才建立
+    EvWatch watch;
+    void (*ready)(struct TlsConn *conn, bool ok);
+    void *arg;
+    int  busy;                         // server 過載、拒絕連線時建議的重試秒數
+} TlsConn;
+
+typedef struct ChatRequest ChatRequest;
+
+// 自己保存的 roster：登入後 server 從 relay socket 送完整的一份，之後推聯絡人的變化，
+// 其他人的變化以 show_list <version> 同步
+typedef struct {
+    bool known;
+    bool online;
+    int  version;                      // server 上最後一次變化的版本，舊的變化不會蓋掉新的
+    char name[MAX_NAME];
+} RosterEntry;
+
+// cache 的接收端位址，以 server 上的使用者 ID 為索引；只存聯絡人的，收到他的 PRESENCE 時失效
+typedef struct {
+    bool valid;
+    char ip[INET_ADDRSTRLEN];
+    int  port;
+} PeerAddr;
+
+// receiver port 收到的連線，或 pool 裡送 direct message 的連線（都不加密，每個 frame 固定 BUFFER_SIZE）
+typedef struct DirectConn {
+    ChatSession *s;
+    int  fd;
+    EvWatch watch;
+    uint64_t timer;                    // 送 / 收一個 frame 的逾時，或閒置逾時
+    char buf[BUFFER_SIZE];
+    int  len;                          // 目前的 frame 已收到 / 已送出的 bytes
+    int  frames;                       // 這條連線已收到 / 已送出的 frame 數
+    bool out;                          // 送出用的連線，以 ip、port 找到
+    bool connected;
+    char ip[INET_ADDRSTRLEN];
+    int  port;
+    ChatRequest *req, *req_tail;       // 排隊中的 direct message，req 為正在送的
+    struct DirectConn *next;
+} DirectConn;
+
+struct ChatClient {
+    SSL_CTX *ctx;
+    EvLoop loop;
+    pthread_t thread;
+};
+
+// session 的狀態
+#define SESSION_CLOSED 0
+#define SESSION_CONNECTING 1              // TCP connect 與 TLS handshake
+#define SESSION_WAIT_ACCEPT 2             // 等 server 的 ACCEPT_TASK
+#define SESSION_READY 3
+
+struct ChatSession {
+    ChatClient *c;
+    ChatEvents ev;
+    void *ctx;
+    char ip[INET_ADDRSTRLEN];
+    int  port;
+    int  receiver_port;
+
+    // 以下只在 loop thread 存取
+    int  state;
+    TlsConn conn;                      // session 連線
+    char out[BUFFER_SIZE];             // 寫到一半的 request 行
+    int  out_len;
+    bool want_out;                     // 已向 epoll 要求 EPOLLOUT
+    ChatRequest *head, *tail;          // 已送出等回覆的 request 在前，還沒送出的在後
+    ChatRequest *unsent;               // 第一個還沒送出的 request
+    bool in_flight;                    // head 是送出中的 lockstep request
+    int  pending;                      // 已送出、還沒收到回覆的 pipelined request
+    int  next_seq;
+    uint64_t heartbeat;                // 下一次檢查是否要送 PING 的 ev_timer，0 表示沒有
+    uint64_t last_sent;                // 最後一次送出 request 的時間（ms）
+    uint64_t ping_sent;                // 還沒收到 PONG 的 PING 送出的時間，0 表示沒有
+    TlsConn *side;                     // 登入時正在建立的 relay / file socket
+    bool side_file;
+    SSL *relay_ssl, *file_ssl;         // 已建立、等 LOGIN_SUCCESS
+    Channel *relay, *file;
+    int  receiver_fd;
+    EvWatch receiver_watch;
+    DirectConn *directs;
+    PeerAddr peers[MAX_USERS];
+    bool contacts[MAX_USERS];          // server 上的聯絡人，只有他們的 PRESENCE 會推過來
+
+    pthread_mutex_t lock;              // 保護 name、jobs、offers、running、closed、peer_hits、peer_misses、roster
+    pthread_cond_t idle;
+    bool closed;                       // chat_session_free 已在 loop thread 關閉所有連線
+    char name[MAX_NAME];
+    FileJob *jobs[CHAT_MAX_JOBS];      // 進行中的傳輸
+    FileJob *offers[CHAT_MAX_JOBS];    // 還沒有結果的 offer（自己送出的與別人送來的）
+    int  running;                      // 還在執行的傳輸 thread
+    long peer_hits, peer_misses;       // direct message 的位址 cache
+    RosterEntry roster[MAX_USERS];     // 以 server 上的使用者 ID 為索引
+    int  roster_version;               // 這個版本以前的變化都已收到
+};
+
+// libchat_xfer.c
+void job_event(FileJob *job, int state, const char *detail);
+void job_close(FileJob *job);
+int  offer_add(FileJob *job);
+FileJob *offer_take(ChatSession *s, int offer_id, bool upload);
+FileJob *offer_find(ChatSession *s, int offer_id);
+void offer_clear(ChatSession *s);
+FileJob *job_prepare(ChatSession *s, const char *path, bool spool, bool multi, char *offer, int len);
+int  start_upload(FileJob *job, const char *reply);
+int  start_download(FileJob *job, const char *reply);
+
+#endif
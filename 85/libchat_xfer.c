@@ -0,0 +1,508 @@
+// libchat_xfer.c
+// 檔案傳輸：每個傳輸各有自己的資料連線與 thread，不佔用 event loop
+#define _GNU_SOURCE
+#include "libchat_int.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+
+//--- TRANSFER EVENT ---//
+void job_event(FileJob *job, int state, const char *detail) {
+    ChatSession *s = job->s;
+    if (!s->ev.on_transfer)
+        return;
+    ChatTransfer t = { job->id, job->offer_id, job->filename, job->upload, state,
+                       job->done, job->size, detail };
+    s->ev.on_transfer(s, s->ctx, &t);
+}
+
+//--- TRANSFER TABLE ---//
+// 表格只用來顯示進度；running 讓 chat_session_free 等傳輸 thread 結束
+static void job_add(FileJob *job) {
+    ChatSession *s = job->s;
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < CHAT_MAX_JOBS; i++) {
+        if (!s->jobs[i]) {
+            s->jobs[i] = job;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void job_progress(FileJob *job, long long bytes) {
+    pthread_mutex_lock(&job->s->lock);
+    job->done += bytes;
+    pthread_mutex_unlock(&job->s->lock);
+}
+
+static void job_remove(FileJob *job) {
+    ChatSession *s = job->s;
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < CHAT_MAX_JOBS; i++)
+        if (s->jobs[i] == job)
+            s->jobs[i] = NULL;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void thread_begin(ChatSession *s) {
+    pthread_mutex_lock(&s->lock);
+    s->running++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void thread_end(ChatSession *s) {
+    pthread_mutex_lock(&s->lock);
+    if (--s->running == 0)
+        pthread_cond_broadcast(&s->idle);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// 關閉上傳 job 的來源並釋放 job
+void job_close(FileJob *job) {
+    if (job->upload) {
+        if (job->batch) {
+            batch_reader_close(job->batch);
+            free(job->batch);
+        } else {
+            file_reader_close(&job->reader);
+        }
+    }
+    free(job);
+}
+
+//--- PENDING OFFERS ---//
+// 送出或答應 offer 後，job 先放在這裡，等 file socket 上的結果
+int offer_add(FileJob *job) {
+    ChatSession *s = job->s;
+    int r = -1;
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < CHAT_MAX_JOBS && r == -1; i++) {
+        if (!s->offers[i]) {
+            s->offers[i] = job;
+            r = 1;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return r;
+}
+
+FileJob *offer_take(ChatSession *s, int offer_id, bool upload) {
+    FileJob *job = NULL;
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < CHAT_MAX_JOBS && !job; i++) {
+        if (s->offers[i] && s->offers[i]->offer_id == offer_id && s->offers[i]->upload == upload) {
+            job = s->offers[i];
+            s->offers[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return job;
+}
+
+// 別人送來、還沒回答的 offer
+FileJob *offer_find(ChatSession *s, int offer_id) {
+    FileJob *job = NULL;
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < CHAT_MAX_JOBS && !job; i++)
+        if (s->offers[i] && s->offers[i]->offer_id == offer_id && !s->offers[i]->upload)
+            job = s->offers[i];
+    pthread_mutex_unlock(&s->lock);
+    return job;
+}
+
+// 登出後 server 不會再送結果
+void offer_clear(ChatSession *s) {
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < CHAT_MAX_JOBS; i++) {
+        if (s->offers[i])
+            job_close(s->offers[i]);
+        s->offers[i] = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// 開啟要送出的檔案或目錄，並在 offer 填入給接收端的 "檔名 大小 [附加欄位]"
+// 目錄：整個目錄以一個 stream 送出，只問一次；傳輸大小為 stream 長度
+FileJob *job_prepare(ChatSession *s, const char *path, bool spool, bool multi, char *offer, int len) {
+    FileJob *job = calloc(1, sizeof(FileJob));
+    if (!job)
+        return NULL;
+    job->s = s;
+    job->upload = true;
+    job->spool = spool;
+    job->multi = multi;
+    strncpy(job->filename, path, MAX_MES - 1);
+
+    struct stat st;
+    if (stat(job->filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+        job->batch = malloc(sizeof(BatchReader));
+        if (!job->batch || batch_reader_open(job->batch, job->filename) == -1) {
+            free(job->batch);
+            free(job);
+            return NULL;
+        }
+        job->size = job->batch->stream_size;
+        job->nfiles = job->batch->files;
+        char *name = job->filename + strlen(job->filename);
+        while (name > job->filename && name[-1] == '/')
+            *--name = '\0';
+        while (name > job->filename && name[-1] != '/')
+            name--;
+        snprintf(offer, len, "%s/ %lld %d", name, job->size, job->nfiles);
+        return job;
+    }
+
+    if (file_reader_open(&job->reader, job->filename) == -1) {
+        free(job);
+        return NULL;
+    }
+    job->size = job->reader.size;
+    // 檔名後附上檔案大小，讓接收端可以預先配置空間
+    // 單一接收端的大檔案標上 DELTA_TAG：接收端若有舊版，只需要送差異
+    job->delta = !spool && !multi && job->size >= DELTA_MIN_SIZE;
+    // 跟目錄一樣只送最後一段名稱，接收端以這個名稱存在自己的目前目錄
+    const char *name = strrchr(job->filename, '/');
+    name = name ? name + 1 : job->filename;
+    snprintf(offer, len, "%s %lld%s", name, job->size, job->delta ? " "DELTA_TAG : "");
+    return job;
+}
+
+//--- DATA CONNECTION ---//
+// 連到 server 的 FILE_PORT 並報到 "<role> <token>"，失敗回傳 NULL
+static SSL *open_data_conn(ChatSession *s, const char *role, const char *token) {
+    struct sockaddr_in fileaddr;
+    int fd;
+    if (connect_to_port(&fd, &fileaddr, s->ip, FILE_PORT) != 1)
+        return NULL;
+    SSL *data = SSL_new(s->c->ctx);
+    SSL_set_fd(data, fd);
+    char line[64];
+    snprintf(line, sizeof(line), "%s %s", role, token);
+    if (SSL_connect(data) <= 0 || SSL_write(data, line, strlen(line)) <= 0) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(data);
+        close(fd);
+        return NULL;
+    }
+    return data;
+}
+
+static void close_data_conn(SSL *data) {
+    int fd = SSL_get_fd(data);
+    SSL_free(data);
+    close(fd);
+}
+
+// 讀滿 len bytes，成功回傳 1
+static int ssl_read_full(SSL *ssl, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        int n = SSL_read(ssl, (char*)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 1;
+}
+
+// 收接收端的 signature，沒有舊版時 sig->count 為 0，成功回傳 1
+static int recv_signature(SSL *data, DeltaSig *sig) {
+    unsigned char hdr[DELTA_SIG_HDR];
+    uint32_t block_size;
+    uint64_t count;
+    if (ssl_read_full(data, hdr, sizeof(hdr)) == -1 ||
+        delta_sig_header(hdr, &block_size, &count) == -1)
+        return -1;
+    if (count == 0)
+        return 1;
+    unsigned char *body = malloc(count * DELTA_SIG_ENTRY);
+    int r = body && ssl_read_full(data, body, count * DELTA_SIG_ENTRY) == 1 ? 1 : -1;
+    if (r == 1)
+        r = delta_sig_load(sig, block_size, count, body);
+    free(body);
+    return r;
+}
+
+typedef struct {
+    SSL *data;
+    FileJob *job;
+} DeltaSink;
+
+static int delta_emit(void *arg, const char *buf, size_t len) {
+    DeltaSink *sink = (DeltaSink*)arg;
+    if (SSL_write(sink->data, buf, len) <= 0)
+        return -1;
+    job_progress(sink->job, len);
+    return 1;
+}
+
+//--- UPLOAD ---//
+// Upload Thread：讀檔 thread 預讀，這裡整塊寫到資料連線
+static void *upload_thread(void *arg) {
+    FileJob *job = (FileJob*)arg;
+    ChatSession *s = job->s;
+    SSL *data = NULL;
+    bool p2p = false;
+    if (job->psk[0]) {
+        data = p2p_connect(job->peer_ip, job->peer_port, job->token, job->psk);
+        p2p = data != NULL;
+        if (p2p) {
+            // 已直接連上：告訴 server 不必再保留這個傳輸的轉送
+            SSL *done = open_data_conn(s, XFER_P2P, job->token);
+            if (done)
+                close_data_conn(done);
+        } else {
+            job_event(job, CHAT_XFER_STARTED, "can't reach receiver directly, relaying through server");
+        }
+    }
+    if (!data)
+        data = open_data_conn(s, XFER_UP, job->token);
+    if (!data) {
+        job_event(job, CHAT_XFER_FAILED, "can't connect to file port");
+        job_close(job);
+        thread_end(s);
+        return NULL;
+    }
+    job_add(job);
+
+    // delta：接收端先送 signature，有舊版時改送差異
+    DeltaSig sig;
+    memset(&sig, 0, sizeof(sig));
+    int r = job->delta ? recv_signature(data, &sig) : 1;
+    bool sent_delta = r == 1 && sig.count > 0;
+    if (sent_delta) {
+        DeltaStats st;
+        DeltaSink sink = { data, job };
+        r = delta_encode(&sig, job->filename, delta_emit, &sink, &st) == 1 ? 0 : -1;
+        delta_report(&st, job->filename);
+    }
+    delta_sig_free(&sig);
+
+    const char *block;
+    size_t block_len;
+    while (r == 1 && (r = job->batch ? batch_reader_next(job->batch, &block, &block_len) :
+                             file_reader_next(&job->reader, &block, &block_len)) == 1) {
+        if (SSL_write(data, block, block_len) <= 0) {
+            r = -1;
+            break;
+        }
+        job_progress(job, block_len);
+        if (job->batch)
+            batch_reader_release(job->batch);
+        else
+            file_reader_release(&job->reader);
+    }
+
+    if (r == 0) {
+        // 送出 close_notify，等接收端收完後回覆 close_notify（轉送時由 server 轉告）
+        char tmp[16];
+        SSL_shutdown(data);
+        if (SSL_read(data, tmp, sizeof(tmp)) <= 0 &&
+            SSL_get_error(data, 0) == SSL_ERROR_ZERO_RETURN)
+            job_event(job, CHAT_XFER_DONE,
+                      job->spool ? "stored on server" : p2p ? "delivered directly" : "delivered");
+        else
+            r = -1;
+    }
+    if (r != 0)
+        job_event(job, CHAT_XFER_FAILED, "error in sending");
+
+    if (job->batch)
+        batch_reader_report(job->batch, job->filename);
+    else if (!sent_delta)
+        file_reader_report(&job->reader, job->filename);
+    close_data_conn(data);
+    job_remove(job);
+    job_close(job);
+    thread_end(s);
+    return NULL;
+}
+
+// 解析 "<ID> <token> ..." 並由 upload thread 送出
+// 單一接收端："<ID> <token> [<IP> <port> <PSK>]"
+// 多個接收端："<ID> <token> <接受人數>/<邀請人數>"
+int start_upload(FileJob *job, const char *reply) {
+    ChatSession *s = job->s;
+    char accepted[16] = "";
+    int fields = job->multi ? sscanf(reply, "%d %16s %15s", &job->id, job->token, accepted) :
+                 sscanf(reply, "%d %16s %15s %d %32s", &job->id, job->token,
+                        job->peer_ip, &job->peer_port, job->psk);
+    if (fields < 2) {
+        job_event(job, CHAT_XFER_FAILED, "bad reply from server");
+        job_close(job);
+        return 0;
+    }
+
+    char detail[64];
+    if (job->multi)
+        snprintf(detail, sizeof(detail), "accepted by %s users", accepted);
+    else
+        snprintf(detail, sizeof(detail), "accepted");
+    job_event(job, CHAT_XFER_STARTED, detail);
+
+    pthread_t upload_thd;
+    thread_begin(s);
+    if (pthread_create(&upload_thd, NULL, upload_thread, job) != 0) {
+        thread_end(s);
+        job_event(job, CHAT_XFER_FAILED, "can't start upload thread");
+        job_close(job);
+        return 0;
+    }
+    pthread_detach(upload_thd);
+    return 1;
+}
+
+//--- DOWNLOAD ---//
+// 下載的寫入端：一般檔案、整個目錄，或依 delta 從舊版重建
+typedef struct {
+    enum { SINK_FILE, SINK_TREE, SINK_DELTA } kind;
+    FileWriter file;
+    BatchWriter tree;
+    DeltaWriter delta;
+} DownloadSink;
+
+static int sink_write(DownloadSink *sink, const char *buf, size_t len) {
+    if (sink->kind == SINK_TREE)
+        return batch_writer_write(&sink->tree, buf, len);
+    if (sink->kind == SINK_DELTA)
+        return delta_writer_write(&sink->delta, buf, len);
+    return file_writer_write(&sink->file, buf, len);
+}
+
+// 關閉並回傳寫出的檔案大小（目錄為 stream 長度），失敗時 *ok 設為 false
+static uint64_t sink_close(DownloadSink *sink, const char *name, bool *ok) {
+    int r;
+    uint64_t bytes;
+    if (sink->kind == SINK_TREE) {
+        r = batch_writer_close(&sink->tree);
+        bytes = sink->tree.bytes;
+        batch_writer_report(&sink->tree, name);
+    } else if (sink->kind == SINK_DELTA) {
+        r = delta_writer_close(&sink->delta);
+        bytes = sink->delta.stats.file_bytes;
+        delta_report(&sink->delta.stats, name);
+    } else {
+        r = file_writer_close(&sink->file);
+        bytes = sink->file.bytes;
+        file_writer_report(&sink->file, name);
+    }
+    if (r == -1)
+        *ok = false;
+    return bytes;
+}
+
+// 開啟寫入端；delta 傳輸要先把舊版的 signature 送給傳送端，成功回傳 1
+static int sink_open(DownloadSink *sink, FileJob *job, SSL *data) {
+    // 名稱來自對方（offer 或 spool），含 '/' 或 ".." 的一律拒絕，不能寫到或讀出目前目錄以外的檔案
+    if (!batch_name_ok(job->filename))
+        return -1;
+    // 以 '/' 結尾的是整個目錄，邊收邊還原目錄樹
+    if (batch_is_dir(job->filename)) {
+        sink->kind = SINK_TREE;
+        return batch_writer_open(&sink->tree, job->filename);
+    }
+    sink->kind = SINK_FILE;
+    if (job->delta) {
+        unsigned char *sig;
+        size_t sig_len;
+        if (delta_sig_make(job->filename, &sig, &sig_len) == -1)
+            return -1;
+        int r = SSL_write(data, sig, sig_len) > 0 ? 1 : -1;
+        if (r == 1 && sig_len > DELTA_SIG_HDR) {
+            sink->kind = SINK_DELTA;
+            r = delta_writer_open(&sink->delta, job->filename, job->size, sig);
+        }
+        free(sig);
+        if (r == -1 || sink->kind == SINK_DELTA)
+            return r;
+    }
+    return file_writer_open(&sink->file, job->filename, job->size);
+}
+
+// Download Thread：收到的資料交給寫檔 thread
+static void *download_thread(void *arg) {
+    FileJob *job = (FileJob*)arg;
+    ChatSession *s = job->s;
+    SSL *data = NULL;
+    if (job->psk[0])
+        data = p2p_wait(job->token, P2P_WAIT);
+    if (!data)
+        data = open_data_conn(s, XFER_DOWN, job->token);
+    if (!data) {
+        job_event(job, CHAT_XFER_FAILED, "can't connect to file port");
+        free(job);
+        thread_end(s);
+        return NULL;
+    }
+
+    DownloadSink sink;
+    if (sink_open(&sink, job, data) == -1) {
+        job_event(job, CHAT_XFER_FAILED, "can't open file for writing");
+        close_data_conn(data);
+        free(job);
+        thread_end(s);
+        return NULL;
+    }
+    job_add(job);
+
+    char buf[64 * 1024];
+    int bytes;
+    bool ok = true;
+    while ((bytes = SSL_read(data, buf, sizeof(buf))) > 0) {
+        if (sink_write(&sink, buf, bytes) == -1) {
+            ok = false;
+            break;
+        }
+        job_progress(job, bytes);
+    }
+    if (bytes <= 0 && SSL_get_error(data, bytes) != SSL_ERROR_ZERO_RETURN)
+        ok = false;
+    SSL_shutdown(data);
+
+    uint64_t got = sink_close(&sink, job->filename, &ok);
+    if (job->size > 0 && (long long)got != job->size)
+        ok = false;
+    if (ok) {
+        job_event(job, CHAT_XFER_DONE, "received");
+    } else {
+        char detail[64];
+        snprintf(detail, sizeof(detail), "incomplete (%llu of %lld bytes)",
+                 (unsigned long long)got, job->size);
+        job_event(job, CHAT_XFER_FAILED, detail);
+    }
+    close_data_conn(data);
+    job_remove(job);
+    free(job);
+    thread_end(s);
+    return NULL;
+}
+
+// 解析 "<xfer ID> <token> [<PSK>]" 並由 download thread 接收，有 PSK 時先等傳送端直接連過來
+int start_download(FileJob *job, const char *reply) {
+    ChatSession *s = job->s;
+    if (sscanf(reply, "%d %16s %32s", &job->id, job->token, job->psk) < 2) {
+        job_event(job, CHAT_XFER_FAILED, "bad reply from server");
+        free(job);
+        return 0;
+    }
+    if (job->psk[0])
+        p2p_expect(job->token, job->psk);
+    job_event(job, CHAT_XFER_STARTED, "receiving");
+
+    pthread_t download_thd;
+    thread_begin(s);
+    if (pthread_create(&download_thd, NULL, download_thread, job) != 0) {
+        thread_end(s);
+        job_event(job, CHAT_XFER_FAILED, "can't start download thread");
+        free(job);
+        return 0;
+    }
+    pthread_detach(download_thd);
+    return 1;
+}
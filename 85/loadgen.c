@@ -0,0 +1,297 @@
+// loadgen.c
+// 壓力測試：一個 process 以 libchat 開很多個 session（virtual user），不需要 GTK / SDL
+// 每個 virtual user 註冊、登入、查自己的 ID，relay 訊息給自己並量測延遲，最後登出離開
+//   ./loadgen <users> <messages per user> [window] [server IP]
+// window 為每個 user 同時送出、還沒收到回覆的 relay 數（預設 1，最多 PIPE_WINDOW）
+#define _GNU_SOURCE
+#include "config.h"
+#include "libchat.h"
+#include "evloop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LOADGEN_TIMEOUT 120               // 整個測試最多等多久（秒）
+
+typedef struct {
+    int  index;
+    ChatSession *s;
+    char name[MAX_NAME];
+    int  id;                           // server 上的 ID，查 show list 得到
+    int  queued, sent, received;       // 已送出 / 已收到回覆 / 已收到的訊息
+    uint64_t t_login;                  // 送出 login 的時間
+    uint64_t retry_at;                 // server 忙碌時，這個時間之後重新連線；持有 done_lock 時存取
+    bool finished, failed;
+} VUser;
+
+// 一個送出中的 relay
+typedef struct {
+    VUser *u;
+    uint64_t t;
+} Relay;
+
+int nusers, nmessages, window = 1;
+VUser *vusers;
+
+// 以下只在 libchat 的 loop thread 寫入，結束後由 main 讀取
+double *login_ms, *relay_ms, *deliver_ms;
+int nlogin, nrelay, ndeliver;
+int finished, failed, busy;         // busy：被過載的 server 拒絕、之後重新連線的次數
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t all_done = PTHREAD_COND_INITIALIZER;
+
+void vu_finish(VUser *u, bool ok, const char *why);
+void on_connected(ChatSession *s, void *arg, int ok, const char *reply);
+void on_registered(ChatSession *s, void *arg, int ok, const char *reply);
+void on_logged_in(ChatSession *s, void *arg, int ok, const char *reply);
+void on_list(ChatSession *s, void *arg, int ok, const char *reply);
+void on_relayed(ChatSession *s, void *arg, int ok, const char *reply);
+void on_logged_out(ChatSession *s, void *arg, int ok, const char *reply);
+void on_message(ChatSession *s, void *ctx, const char *from, const char *mes, bool direct);
+void on_closed(ChatSession *s, void *ctx);
+
+//--- VIRTUAL USER ---//
+void vu_finish(VUser *u, bool ok, const char *why) {
+    if (u->finished)
+        return;
+    u->finished = true;
+    u->failed = !ok;
+    if (!ok)
+        printf(RED"[%s] %s\n"NONE, u->name, why);
+    pthread_mutex_lock(&done_lock);
+    finished++;
+    if (!ok)
+        failed++;
+    if (finished == nusers)
+        pthread_cond_signal(&all_done);
+    pthread_mutex_unlock(&done_lock);
+}
+
+void on_connected(ChatSession *s, void *arg, int ok, const char *reply) {
+    VUser *u = (VUser*)arg;
+    int retry = ok == 0 ? chat_busy_retry(reply) : 0;
+    if (retry > 0) {
+        // server 過載：照建議的秒數再加上最多一半的隨機時間，由 main 重新連線，大家不會同時回來
+        pthread_mutex_lock(&done_lock);
+        busy++;
+        u->retry_at = ev_now_ms() + retry * 1000 + rand() % (retry * 500);
+        pthread_mutex_unlock(&done_lock);
+        return;
+    }
+    if (ok != 1) {
+        vu_finish(u, false, reply);
+        return;
+    }
+    chat_register(s, u->name, on_registered, u);
+}
+
+// 上一次執行已經註冊過也可以
+void on_registered(ChatSession *s, void *arg, int ok, const char *reply) {
+    VUser *u = (VUser*)arg;
+    if (ok != 1 && strcmp(reply, NAME_REGISTERED) != 0) {
+        vu_finish(u, false, reply);
+        return;
+    }
+    u->t_login = ev_now_ms();
+    chat_login(s, u->name, on_logged_in, u);
+}
+
+void on_logged_in(ChatSession *s, void *arg, int ok, const char *reply) {
+    VUser *u = (VUser*)arg;
+    if (ok != 1) {
+        vu_finish(u, false, reply);
+        return;
+    }
+    login_ms[nlogin++] = ev_now_ms() - u->t_login;
+    chat_list(s, on_list, u);
+}
+
+// 補滿 window：同時最多 window 個 relay 還沒收到回覆
+static void send_next(VUser *u) {
+    while (u->queued < nmessages && u->queued - u->sent < window) {
+        Relay *r = malloc(sizeof(Relay));
+        char mes[64];
+        if (r) {
+            r->u = u;
+            r->t = ev_now_ms();
+            snprintf(mes, sizeof(mes), "%llu %d", (unsigned long long)r->t, u->queued);
+        }
+        if (!r || chat_relay(u->s, u->id, mes, on_relayed, r) == -1) {
+            free(r);
+            vu_finish(u, false, "can't queue relay message");
+            return;
+        }
+        u->queued++;
+    }
+}
+
+// show list 的每一行為 "%2d: YOU name"
+void on_list(ChatSession *s, void *arg, int ok, const char *reply) {
+    (void)s;
+    VUser *u = (VUser*)arg;
+    const char *me = ok == 1 ? strstr(reply, "YOU ") : NULL;
+    if (!me) {
+        vu_finish(u, false, "can't find own ID");
+        return;
+    }
+    while (me > reply && me[-1] != '\n')
+        me--;
+    u->id = atoi(me);
+    if (nmessages > 0)
+        send_next(u);
+    else
+        chat_logout(u->s, on_logged_out, u);
+}
+
+// window 為 1 時量到的是單一 request 的來回時間，更大時包含在 pipeline 裡排隊的時間
+void on_relayed(ChatSession *s, void *arg, int ok, const char *reply) {
+    Relay *r = (Relay*)arg;
+    VUser *u = r->u;
+    uint64_t t = r->t;
+    free(r);
+    if (ok != 1) {
+        vu_finish(u, false, reply);
+        return;
+    }
+    relay_ms[nrelay++] = ev_now_ms() - t;
+    if (++u->sent < nmessages)
+        send_next(u);
+    else if (u->received == nmessages)
+        chat_logout(s, on_logged_out, u);
+}
+
+void on_message(ChatSession *s, void *ctx, const char *from, const char *mes, bool direct) {
+    (void)from;
+    (void)direct;
+    VUser *u = (VUser*)ctx;
+    deliver_ms[ndeliver++] = ev_now_ms() - strtoull(mes, NULL, 10);
+    if (++u->received == nmessages && u->sent == nmessages)
+        chat_logout(s, on_logged_out, u);
+}
+
+// 登出後送 EXIT，server 的 worker 才會空出來給排隊中的連線
+void on_logged_out(ChatSession *s, void *arg, int ok, const char *reply) {
+    VUser *u = (VUser*)arg;
+    if (ok != 1) {
+        vu_finish(u, false, reply);
+        return;
+    }
+    chat_exit(s, NULL, NULL);
+    vu_finish(u, true, NULL);
+}
+
+void on_closed(ChatSession *s, void *ctx) {
+    (void)s;
+    vu_finish((VUser*)ctx, false, "connection closed");
+}
+
+//--- REPORT ---//
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, double *ms, int n) {
+    if (n == 0) {
+        printf("%-8s no samples\n", what);
+        return;
+    }
+    qsort(ms, n, sizeof(double), cmp_double);
+    printf("%-8s %6d samples  p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n", what, n,
+           ms[n / 2], ms[(int)(n * 0.99)], ms[n - 1]);
+}
+
+//--- MAIN FUNCTION ---//
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s <users> <messages per user> [window] [server IP]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    nusers = atoi(argv[1]);
+    nmessages = atoi(argv[2]);
+    if (argc > 3)
+        window = atoi(argv[3]);
+    const char *ip = argc > 4 ? argv[4] : SERVER_IP;
+    if (nusers <= 0 || nmessages < 0 || window <= 0 || window > PIPE_WINDOW) {
+        printf("users must be > 0, messages >= 0 and window 1 ~ %d\n", PIPE_WINDOW);
+        return EXIT_FAILURE;
+    }
+
+    vusers = calloc(nusers, sizeof(VUser));
+    login_ms = calloc(nusers, sizeof(double));
+    relay_ms = calloc((size_t)nusers * nmessages + 1, sizeof(double));
+    deliver_ms = calloc((size_t)nusers * nmessages + 1, sizeof(double));
+    ChatClient *chat = chat_client_new();
+    if (!vusers || !login_ms || !relay_ms || !deliver_ms || !chat) {
+        ERR_EXIT("loadgen init");
+    }
+
+    // 名稱固定，重複執行時沿用上一次註冊的帳號（server 最多 MAX_USERS 個帳號）
+    ChatEvents events = { .on_message = on_message, .on_closed = on_closed };
+    uint64_t start = ev_now_ms();
+    for (int i = 0; i < nusers; i++) {
+        VUser *u = &vusers[i];
+        u->index = i;
+        snprintf(u->name, MAX_NAME, "lg_%d", i);
+        u->s = chat_session_new(chat, ip, SERVER_PORT, 0, &events, u);
+        if (!u->s || chat_connect(u->s, on_connected, u) == -1) {
+            printf(RED"Can't start virtual user %d\n"NONE, i);
+            nusers = i;
+            break;
+        }
+    }
+
+    // 等全部結束；每 100 ms 醒來一次，被 server 拒絕的 user 到時間就重新連線
+    pthread_mutex_lock(&done_lock);
+    while (finished < nusers && ev_now_ms() - start < LOADGEN_TIMEOUT * 1000ULL) {
+        uint64_t now = ev_now_ms();
+        for (int i = 0; i < nusers; i++) {
+            VUser *u = &vusers[i];
+            if (u->retry_at == 0 || now < u->retry_at)
+                continue;
+            u->retry_at = 0;
+            pthread_mutex_unlock(&done_lock);
+            if (chat_connect(u->s, on_connected, u) == -1)
+                vu_finish(u, false, "can't reconnect");
+            pthread_mutex_lock(&done_lock);
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&all_done, &done_lock, &ts);
+    }
+    int done = finished, bad = failed, retried = busy;
+    pthread_mutex_unlock(&done_lock);
+    double elapsed = (ev_now_ms() - start) / 1000.0;
+
+    // 還沒結束的 session 直接關閉，之後 loop thread 不會再寫統計
+    for (int i = 0; i < nusers; i++)
+        chat_session_free(vusers[i].s);
+    chat_client_free(chat);
+
+    printf("%s\n", LINE);
+    printf("%d users x %d messages, window %d: %d finished, %d failed, %d unfinished in %.2f s\n",
+           nusers, nmessages, window, done - bad, bad, nusers - done, elapsed);
+    if (retried > 0)
+        printf("server busy: %d reconnect(s) after the suggested delay\n", retried);
+    report("login", login_ms, nlogin);
+    report("relay", relay_ms, nrelay);
+    report("deliver", deliver_ms, ndeliver);
+    if (elapsed > 0)
+        printf("%.0f relay messages/s\n", nrelay / elapsed);
+    printf("%s\n", LINE);
+
+    free(vusers);
+    free(login_ms);
+    free(relay_ms);
+    free(deliver_ms);
+    return bad == 0 && done == nusers ? 0 : EXIT_FAILURE;
+}
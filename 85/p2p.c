@@ -0,0 +1,252 @@
+// p2p.c
+#define _GNU_SOURCE
+#include "p2p.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// 接收端登記的直接連線
+typedef struct {
+    bool used;
+    char token[XFER_TOKEN_LEN + 1];    // 同時作為 PSK identity
+    char psk[P2P_PSK_LEN + 1];
+    bool claimed;                      // 已有連線通過 handshake，正在回覆 P2P_GO
+    bool failed;
+    SSL *ssl;                          // 交給等待中的 download thread
+} P2pExpect;
+
+// 傳送端 handshake 時給 PSK callback 用
+typedef struct {
+    const char *token;
+    const char *psk;
+} P2pPeer;
+
+static P2pExpect expects[P2P_MAX];
+static pthread_mutex_t p2p_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t p2p_changed = PTHREAD_COND_INITIALIZER;
+static SSL_CTX *accept_ctx, *connect_ctx;
+
+static int hex_decode(const char *hex, unsigned char *out, unsigned int max_len) {
+    unsigned int n = strlen(hex) / 2;
+    if (n > max_len)
+        return 0;
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned int v;
+        if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+            return 0;
+        out[i] = v;
+    }
+    return n;
+}
+
+static void set_timeout(int fd, int seconds) {
+    struct timeval tv = { seconds, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static P2pExpect *find_expect(const char *token) {
+    for (int i = 0; i < P2P_MAX; i++)
+        if (expects[i].used && strcmp(expects[i].token, token) == 0)
+            return &expects[i];
+    return NULL;
+}
+
+//--- PSK ---//
+// 接收端：依 identity（token）找出登記的 PSK，還沒登記就稍等
+static unsigned int psk_server_cb(SSL *ssl, const char *identity, unsigned char *psk,
+                                  unsigned int max_psk_len) {
+    // TLS 1.3 的 SSL_get_psk_identity 取不到 identity，記在 accept_thread 給的 buffer
+    snprintf(SSL_get_app_data(ssl), XFER_TOKEN_LEN + 1, "%s", identity);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += P2P_REGISTER_WAIT;
+
+    unsigned int len = 0;
+    pthread_mutex_lock(&p2p_lock);
+    while (true) {
+        P2pExpect *e = find_expect(identity);
+        if (e && !e->claimed) {
+            len = hex_decode(e->psk, psk, max_psk_len);
+            break;
+        }
+        if (e || pthread_cond_timedwait(&p2p_changed, &p2p_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&p2p_lock);
+    return len;
+}
+
+// 傳送端：identity 為 token，PSK 由 server 發給
+static unsigned int psk_client_cb(SSL *ssl, const char *hint, char *identity,
+                                  unsigned int max_identity_len, unsigned char *psk,
+                                  unsigned int max_psk_len) {
+    (void)hint;
+    const P2pPeer *peer = SSL_get_app_data(ssl);
+    snprintf(identity, max_identity_len, "%s", peer->token);
+    return hex_decode(peer->psk, psk, max_psk_len);
+}
+
+// 建立直接連線用的 SSL_CTX（不需要憑證），成功回傳 1，失敗回傳 -1
+int p2p_init() {
+    accept_ctx = SSL_CTX_new(TLS_server_method());
+    connect_ctx = SSL_CTX_new(TLS_client_method());
+    if (!accept_ctx || !connect_ctx)
+        return -1;
+    // TLS 1.3 下舊式 PSK callback 的 key 固定搭配 SHA-256
+    SSL_CTX_set_ciphersuites(accept_ctx, "TLS_AES_128_GCM_SHA256");
+    SSL_CTX_set_ciphersuites(connect_ctx, "TLS_AES_128_GCM_SHA256");
+    SSL_CTX_set_psk_server_callback(accept_ctx, psk_server_cb);
+    SSL_CTX_set_psk_client_callback(connect_ctx, psk_client_cb);
+    return 1;
+}
+
+//--- RECEIVER ---//
+// 登記一個即將到來的直接連線
+void p2p_expect(const char *token, const char *psk) {
+    pthread_mutex_lock(&p2p_lock);
+    for (int i = 0; i < P2P_MAX; i++) {
+        P2pExpect *e = &expects[i];
+        if (e->used)
+            continue;
+        memset(e, 0, sizeof(*e));
+        e->used = true;
+        strncpy(e->token, token, XFER_TOKEN_LEN);
+        strncpy(e->psk, psk, P2P_PSK_LEN);
+        break;
+    }
+    pthread_cond_broadcast(&p2p_changed);
+    pthread_mutex_unlock(&p2p_lock);
+}
+
+// 等待傳送端直接連上，逾時或失敗回傳 NULL（之後改走 server）
+SSL *p2p_wait(const char *token, int seconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+
+    SSL *ssl = NULL;
+    pthread_mutex_lock(&p2p_lock);
+    P2pExpect *e = find_expect(token);
+    while (e && !e->ssl && !e->failed) {
+        // 已經在回覆 P2P_GO 的連線不能放棄，等它結束
+        if (e->claimed)
+            pthread_cond_wait(&p2p_changed, &p2p_lock);
+        else if (pthread_cond_timedwait(&p2p_changed, &p2p_lock, &deadline) == ETIMEDOUT &&
+                 !e->claimed)
+            break;
+    }
+    if (e) {
+        ssl = e->ssl;
+        memset(e, 0, sizeof(*e));
+    }
+    pthread_mutex_unlock(&p2p_lock);
+    return ssl;
+}
+
+// handshake 成功後取得登記，回覆 P2P_GO 再交給等待中的 download thread
+static void *accept_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    set_timeout(fd, P2P_HANDSHAKE_TIMEOUT);
+    char identity[XFER_TOKEN_LEN + 1] = "";
+    SSL *ssl = SSL_new(accept_ctx);
+    SSL_set_fd(ssl, fd);
+    SSL_set_app_data(ssl, identity);
+    if (SSL_accept(ssl) <= 0) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        close(fd);
+        return NULL;
+    }
+
+    SSL_set_app_data(ssl, NULL);
+    pthread_mutex_lock(&p2p_lock);
+    P2pExpect *e = find_expect(identity);
+    if (e && (e->claimed || e->ssl))
+        e = NULL;
+    if (e)
+        e->claimed = true;
+    pthread_mutex_unlock(&p2p_lock);
+    if (!e) {
+        SSL_free(ssl);
+        close(fd);
+        return NULL;
+    }
+
+    bool ok = SSL_write(ssl, P2P_GO, strlen(P2P_GO)) > 0;
+    set_timeout(fd, 0);
+
+    pthread_mutex_lock(&p2p_lock);
+    if (ok)
+        e->ssl = ssl;
+    else
+        e->failed = true;
+    e->claimed = false;
+    pthread_cond_broadcast(&p2p_changed);
+    pthread_mutex_unlock(&p2p_lock);
+    if (!ok) {
+        SSL_free(ssl);
+        close(fd);
+    }
+    return NULL;
+}
+
+// direct_thread 收到 TLS 連線時呼叫，handshake 在另一個 thread 進行，不耽誤 direct message
+void p2p_accept_async(int fd) {
+    pthread_t thd;
+    if (pthread_create(&thd, NULL, accept_thread, (void*)(intptr_t)fd) != 0) {
+        close(fd);
+        return;
+    }
+    pthread_detach(thd);
+}
+
+//--- SENDER ---//
+// 直接連到接收端，收到 P2P_GO 才回傳，失敗回傳 NULL
+SSL *p2p_connect(const char *ip, int port, const char *token, const char *psk) {
+    if (!connect_ctx)
+        return NULL;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return NULL;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        close(fd);
+        return NULL;
+    }
+
+    // SO_SNDTIMEO 同時限制 connect 的時間
+    set_timeout(fd, P2P_CONNECT_TIMEOUT);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    set_timeout(fd, P2P_HANDSHAKE_TIMEOUT);
+
+    P2pPeer peer = { token, psk };
+    SSL *ssl = SSL_new(connect_ctx);
+    SSL_set_fd(ssl, fd);
+    SSL_set_app_data(ssl, &peer);
+    char go[8];
+    int bytes = -1;
+    if (SSL_connect(ssl) > 0)
+        bytes = SSL_read(ssl, go, sizeof(go) - 1);
+    SSL_set_app_data(ssl, NULL);
+    if (bytes <= 0 || (go[bytes] = '\0', strcmp(go, P2P_GO) != 0)) {
+        SSL_free(ssl);
+        close(fd);
+        return NULL;
+    }
+    set_timeout(fd, 0);
+    return ssl;
+}
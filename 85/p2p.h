@@ -0,0 +1,25 @@
+// p2p.h
+#ifndef P2P_H
+#define P2P_H
+
+#include "config.h"
+
+#include <stdbool.h>
+
+//--- PEER-TO-PEER ---//
+// 檔案直接從傳送端連到接收端的 receiver port，以 server 發的一次性 PSK 做 TLS，
+// 連不上時兩端都改走 server 的 transfer engine
+#define P2P_MAX 16                     // 同時等待中的直接連線
+#define P2P_WAIT 10                    // 接收端等待傳送端直接連線的時間（秒）
+#define P2P_CONNECT_TIMEOUT 3          // 傳送端 connect 的逾時（秒）
+#define P2P_HANDSHAKE_TIMEOUT 5        // handshake 與等待 P2P_GO 的逾時（秒）
+#define P2P_REGISTER_WAIT 2            // 接收端還沒登記 token 時，handshake 最多等多久（秒）
+#define P2P_GO "go"                    // 接收端確認由自己接收，傳送端才開始送
+
+int  p2p_init();
+void p2p_expect(const char *token, const char *psk);
+SSL *p2p_wait(const char *token, int seconds);
+void p2p_accept_async(int fd);
+SSL *p2p_connect(const char *ip, int port, const char *token, const char *psk);
+
+#endif
@@ -0,0 +1,185 @@
+// roster.c
+#define _GNU_SOURCE
+#include "roster.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+static pthread_mutex_t roster_lock = PTHREAD_MUTEX_INITIALIZER;
+static RosterSnap *current = NULL;     // 最新的 snapshot，本身持有一個參考
+static int latest = 0;                 // server 目前的 roster 版本
+
+// 有人註冊、登入或登出：目前的 snapshot 過期，下一次查詢時才重建
+void roster_changed(int version) {
+    pthread_mutex_lock(&roster_lock);
+    if (version > latest)
+        latest = version;
+    pthread_mutex_unlock(&roster_lock);
+}
+
+// 取得目前的 snapshot；還沒有或已過期時回傳 NULL，由呼叫者重建後交給 roster_publish
+RosterSnap *roster_acquire() {
+    pthread_mutex_lock(&roster_lock);
+    RosterSnap *snap = current && current->version >= latest ? current : NULL;
+    if (snap)
+        snap->refs++;
+    pthread_mutex_unlock(&roster_lock);
+    return snap;
+}
+
+static void snap_free(RosterSnap *snap) {
+    free(snap->items);
+    free(snap->by_name);
+    free(snap->by_version);
+    free(snap->online);
+    free(snap);
+}
+
+void roster_release(RosterSnap *snap) {
+    if (!snap)
+        return;
+    pthread_mutex_lock(&roster_lock);
+    bool last = --snap->refs == 0;
+    pthread_mutex_unlock(&roster_lock);
+    if (last)
+        snap_free(snap);
+}
+
+static int cmp_name(const void *a, const void *b, void *arg) {
+    const RosterItem *items = (const RosterItem*)arg;
+    return strcmp(items[*(const int*)a].name, items[*(const int*)b].name);
+}
+
+static int cmp_version(const void *a, const void *b, void *arg) {
+    const RosterItem *items = (const RosterItem*)arg;
+    return items[*(const int*)a].version - items[*(const int*)b].version;
+}
+
+// 複製 items 建一份新的 snapshot 與各個索引，參考數為 1（呼叫者的）
+RosterSnap *roster_build(const RosterItem *items, int n, int version) {
+    RosterSnap *snap = calloc(1, sizeof(RosterSnap));
+    if (!snap)
+        return NULL;
+    int cap = n > 0 ? n : 1;
+    snap->version = version;
+    snap->n = n;
+    snap->refs = 1;
+    snap->items = malloc(cap * sizeof(RosterItem));
+    snap->by_name = malloc(cap * sizeof(int));
+    snap->by_version = malloc(cap * sizeof(int));
+    snap->online = malloc(cap * sizeof(int));
+    if (!snap->items || !snap->by_name || !snap->by_version || !snap->online) {
+        snap_free(snap);
+        return NULL;
+    }
+
+    memcpy(snap->items, items, n * sizeof(RosterItem));
+    for (int i = 0; i < n; i++)
+        snap->by_name[i] = snap->by_version[i] = i;
+    qsort_r(snap->by_name, n, sizeof(int), cmp_name, snap->items);
+    qsort_r(snap->by_version, n, sizeof(int), cmp_version, snap->items);
+    for (int k = 0; k < n; k++)
+        if (snap->items[snap->by_name[k]].online)
+            snap->online[snap->n_online++] = snap->by_name[k];
+    return snap;
+}
+
+// snap 比目前的新就換上去；回傳目前最新的一份（已取得參考），snap 的參考交給 roster
+RosterSnap *roster_publish(RosterSnap *snap) {
+    RosterSnap *old = NULL, *drop = NULL;
+    pthread_mutex_lock(&roster_lock);
+    if (snap && (!current || snap->version >= current->version)) {
+        old = current;
+        current = snap;
+        snap->refs++;                  // current 的參考
+    } else if (current) {
+        drop = snap;                   // 別的 thread 已經換上更新的
+        snap = current;
+        snap->refs++;
+    }
+    pthread_mutex_unlock(&roster_lock);
+    roster_release(old);
+    roster_release(drop);
+    return snap;
+}
+
+//--- QUERY ---//
+// 一行 roster："<ID> <0|1> <version> <name>\n"
+int roster_line(const RosterItem *it, char *out, int len) {
+    return snprintf(out, len, "%d %d %d %s\n", it->id, it->online, it->version, it->name);
+}
+
+// 版本 since 之後變化的使用者，依版本排序；放不下時回傳 1，version 為最後放進去的版本
+int roster_since(const RosterSnap *snap, int since, char *out, int len, int *version) {
+    int lo = 0, hi = snap->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (snap->items[snap->by_version[mid]].version <= since)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int used = 0;
+    out[0] = '\0';
+    *version = snap->version;
+    for (int k = lo; k < snap->n; k++) {
+        const RosterItem *it = &snap->items[snap->by_version[k]];
+        char line[64];
+        int n = roster_line(it, line, sizeof(line));
+        if (used + n >= len) {
+            *version = k > lo ? snap->items[snap->by_version[k - 1]].version : since;
+            return 1;
+        }
+        memcpy(out + used, line, n + 1);
+        used += n;
+    }
+    return 0;
+}
+
+// 名稱以 prefix 開頭的範圍在依名稱排序的索引裡是連續的，用二分搜尋找出頭尾
+static int prefix_bound(const RosterSnap *snap, const int *index, int n, const char *prefix,
+                        size_t plen, bool upper) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = strncmp(snap->items[index[mid]].name, prefix, plen);
+        if (c < 0 || (upper && c == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// 依名稱排序的第 page 頁（從 0 開始，每頁 ROSTER_PAGE 人），可以只看在線的或只看 prefix 開頭的；
+// total 為符合條件的人數，回傳這一頁的人數
+int roster_page(const RosterSnap *snap, int page, bool online_only, const char *prefix,
+                char *out, int len, int *total) {
+    const int *index = online_only ? snap->online : snap->by_name;
+    int n = online_only ? snap->n_online : snap->n;
+    int lo = 0, hi = n;
+    size_t plen = prefix ? strlen(prefix) : 0;
+    if (plen > 0) {
+        lo = prefix_bound(snap, index, n, prefix, plen, false);
+        hi = prefix_bound(snap, index, n, prefix, plen, true);
+    }
+    *total = hi - lo;
+
+    int used = 0, count = 0;
+    out[0] = '\0';
+    if (page < 0)
+        return 0;
+    for (long k = lo + (long)page * ROSTER_PAGE; k < hi && count < ROSTER_PAGE; k++) {
+        char line[64];
+        int l = roster_line(&snap->items[index[k]], line, sizeof(line));
+        if (used + l >= len)
+            break;
+        memcpy(out + used, line, l + 1);
+        used += l;
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,42 @@
+// roster.h
+#ifndef ROSTER_H
+#define ROSTER_H
+
+#include "config.h"
+
+#include <stdbool.h>
+
+//--- ROSTER SNAPSHOT ---//
+// 不可變的 roster：有人註冊、登入或登出後，第一次查詢時才重建一份；
+// 查詢只在 roster 自己的 lock 下取得參考，之後不持有任何 lock，也不碰 users_lock
+#define ROSTER_PAGE 25                    // 每頁的使用者數，一頁的回覆放得進一個 BUFFER_SIZE
+
+typedef struct {
+    int  id;
+    bool online;
+    int  version;                      // 最後一次註冊、登入或登出時的 roster 版本
+    char name[MAX_NAME];
+} RosterItem;
+
+typedef struct {
+    int  version;
+    int  n, n_online;
+    RosterItem *items;                 // 依 ID
+    int *by_name;                      // 依名稱排序的 items 索引
+    int *by_version;                   // 依版本排序
+    int *online;                       // 在線的，依名稱
+    int  refs;
+} RosterSnap;
+
+void roster_changed(int version);
+RosterSnap *roster_acquire();
+RosterSnap *roster_build(const RosterItem *items, int n, int version);
+RosterSnap *roster_publish(RosterSnap *snap);
+void roster_release(RosterSnap *snap);
+
+int  roster_line(const RosterItem *it, char *out, int len);
+int  roster_since(const RosterSnap *snap, int since, char *out, int len, int *version);
+int  roster_page(const RosterSnap *snap, int page, bool online_only, const char *prefix,
+                 char *out, int len, int *total);
+
+#endif
@@ -0,0 +1,158 @@
+// roster_bench.c
+// roster snapshot 的效能測試：不需要 server，直接以很多個假的使用者建 snapshot，
+// 量測重建與各種 show list 查詢的延遲，以及多個 thread 同時查詢的速度
+//   ./roster_bench [users] [queries per test] [threads]
+#define _GNU_SOURCE
+#include "roster.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+int nusers = 100000, nqueries = 10000, nthreads = 4;
+RosterItem *items;
+double *lat;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, double *us, int n) {
+    qsort(us, n, sizeof(double), cmp_double);
+    printf("%-24s %6d runs  p50 %10.2f us  p99 %10.2f us  max %10.2f us\n", what, n,
+           us[n / 2], us[(int)(n * 0.99)], us[n - 1]);
+}
+
+// 假的使用者：名稱隨機、版本為一個隨機排列，約一成在線
+static void make_users() {
+    items = malloc(nusers * sizeof(RosterItem));
+    int *perm = malloc(nusers * sizeof(int));
+    if (!items || !perm) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nusers; i++)
+        perm[i] = i + 1;
+    for (int i = nusers - 1; i > 0; i--) {
+        int j = rand() % (i + 1), t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+    for (int i = 0; i < nusers; i++) {
+        items[i].id = i;
+        items[i].online = rand() % 10 == 0;
+        items[i].version = perm[i];
+        snprintf(items[i].name, MAX_NAME, "%c%c%c_%d", 'a' + rand() % 26, 'a' + rand() % 26,
+                 'a' + rand() % 26, i);
+    }
+    free(perm);
+}
+
+// 跟 server 一樣：每次查詢取得目前的 snapshot，過期時重建
+static RosterSnap *snapshot() {
+    RosterSnap *snap = roster_acquire();
+    return snap ? snap : roster_publish(roster_build(items, nusers, nusers));
+}
+
+// 一種查詢：kind 0 最近 100 個變化，1 隨機一頁，2 在線的隨機一頁，3 三個字母的 prefix
+static void query(RosterSnap *snap, int kind, unsigned *seed) {
+    char out[BUFFER_SIZE - 64], prefix[4];
+    int total, version;
+    switch (kind) {
+    case 0:
+        roster_since(snap, snap->version - 100, out, sizeof(out), &version);
+        break;
+    case 1:
+        roster_page(snap, rand_r(seed) % (snap->n / ROSTER_PAGE + 1), false, NULL, out, sizeof(out), &total);
+        break;
+    case 2:
+        roster_page(snap, rand_r(seed) % (snap->n_online / ROSTER_PAGE + 1), true, NULL, out, sizeof(out),
+                    &total);
+        break;
+    default:
+        snprintf(prefix, sizeof(prefix), "%c%c%c", 'a' + rand_r(seed) % 26, 'a' + rand_r(seed) % 26,
+                 'a' + rand_r(seed) % 26);
+        roster_page(snap, 0, false, prefix, out, sizeof(out), &total);
+        break;
+    }
+}
+
+static void *reader(void *arg) {
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    for (int i = 0; i < nqueries; i++) {
+        RosterSnap *snap = snapshot();
+        query(snap, i % 4, &seed);
+        roster_release(snap);
+    }
+    return NULL;
+}
+
+//--- MAIN FUNCTION ---//
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        nusers = atoi(argv[1]);
+    if (argc > 2)
+        nqueries = atoi(argv[2]);
+    if (argc > 3)
+        nthreads = atoi(argv[3]);
+    if (nusers <= 0 || nqueries <= 0 || nthreads <= 0) {
+        printf("Usage: %s [users] [queries per test] [threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    make_users();
+    lat = malloc(nqueries * sizeof(double));
+    if (!lat) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    printf("%s\n%d users, %d queries per test\n", LINE, nusers, nqueries);
+
+    // 重建：有變化後第一次查詢的成本
+    int rebuilds = nqueries < 20 ? nqueries : 20;
+    for (int i = 0; i < rebuilds; i++) {
+        uint64_t t = now_ns();
+        roster_release(roster_build(items, nusers, nusers));
+        lat[i] = (now_ns() - t) / 1000.0;
+    }
+    report("rebuild snapshot", lat, rebuilds);
+
+    roster_changed(nusers);
+    const char *names[] = { "show_list <version>", "page", "page online only", "prefix (3 letters)" };
+    unsigned seed = 1;
+    for (int kind = 0; kind < 4; kind++) {
+        for (int i = 0; i < nqueries; i++) {
+            uint64_t t = now_ns();
+            RosterSnap *snap = snapshot();
+            query(snap, kind, &seed);
+            roster_release(snap);
+            lat[i] = (now_ns() - t) / 1000.0;
+        }
+        report(names[kind], lat, nqueries);
+    }
+
+    // 多個 thread 同時查詢同一份 snapshot
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    uint64_t t = now_ns();
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, reader, (void*)(uintptr_t)(i + 1));
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    double sec = (now_ns() - t) / 1e9;
+    printf("%d threads: %.0f queries/s\n%s\n", nthreads, nthreads * (double)nqueries / sec, LINE);
+
+    free(threads);
+    free(items);
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,1203 @@
+// search.c
+#define _GNU_SOURCE
+#include "search.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+//--- FORMAT ---//
+// segment 檔 "<第一個 doc ID>.idx"：header、詞典（依詞排序）、詞的字串、skip 表、posting lists、doc 表，
+// 每一段都對齊 8 bytes。posting list 每 SEARCH_BLOCK 個 doc 一個區塊，區塊的第一個值是 doc ID - base，
+// 之後是與前一個的差，都是 varint；skip 表記每個區塊的第一個 doc 與 offset，
+// 查詢可以從最後一個區塊往前解，或直接跳到某個 doc 所在的區塊
+#define SEARCH_MAGIC "CHATIDX1"
+#define SEARCH_BLOCK 128
+
+typedef struct {
+    char     magic[8];
+    uint32_t base;                     // 第一個 doc ID
+    uint32_t n_docs;
+    uint32_t n_terms;
+    uint32_t pad;
+    uint64_t terms_off, strings_off, skips_off, postings_off, docs_off, size;
+} IdxHeader;
+
+typedef struct {
+    uint64_t post_off;                 // 從 postings_off 算起
+    uint32_t post_len;                 // bytes
+    uint32_t df;                       // 含這個詞的訊息數
+    uint32_t str_off;                  // 從 strings_off 算起
+    uint32_t str_len;
+    uint32_t skip;                     // 第一個區塊在 skip 表的位置
+    uint32_t pad;
+} IdxTerm;
+
+typedef struct {
+    uint32_t first;                    // 區塊的第一個 doc ID - base
+    uint32_t off;                      // 區塊從 post_off 算起的 offset
+} IdxSkip;
+
+typedef struct {
+    uint32_t conv;                     // 對話 ID，見 convs 檔
+    uint32_t seq;                      // 訊息在對話裡的 seq
+    uint32_t time;
+    uint32_t from_b;                   // 1 表示由對話的第二個人送出
+} IdxDoc;
+
+// mmap 的 segment 檔，不會再改變
+typedef struct {
+    uint32_t base, n_docs, n_terms;
+    char path[512];
+    void *map;
+    size_t size;
+    const IdxTerm *terms;
+    const char *strings;
+    const IdxSkip *skips;
+    const uint8_t *postings;
+    const IdxDoc *docs;
+} Segment;
+
+// 記憶體裡的 segment：詞以 open addressing 的 hash table 存，posting 為 doc ID 的陣列
+typedef struct {
+    uint32_t hash;
+    int  len;
+    uint32_t *docs;
+    int  n, cap;
+    char term[SEARCH_TERM_MAX];
+} MemTerm;
+
+typedef struct {
+    uint32_t base;
+    IdxDoc *docs;
+    int  n_docs, cap_docs;
+    MemTerm **table;
+    int  cap, n_terms;
+} MemSeg;
+
+// 對話：ID 依出現順序，名稱較小的是 a；記在 convs 檔，每行 "<ID> <a 的 hex> <b 的 hex>"
+typedef struct {
+    char a[MAX_NAME], b[MAX_NAME];
+    long long max_seq;                 // 已建索引的最大 seq
+} ConvName;
+
+// relay 時排進佇列的訊息
+typedef struct Pending {
+    struct Pending *next;
+    char a[MAX_NAME], b[MAX_NAME], from[MAX_NAME];
+    long long seq;
+    time_t t;
+    char text[];
+} Pending;
+
+typedef struct {
+    uint8_t *data;
+    size_t len, cap;
+} Buf;
+
+static char base_dir[256] = SEARCH_DIR;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;     // 保護佇列與 indexer 的狀態
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_idle = PTHREAD_COND_INITIALIZER;
+static Pending *q_head, *q_tail;
+static long q_len;
+static bool busy, stopping, running;
+static pthread_t indexer;
+
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;       // 保護 mem、flushing
+static MemSeg *mem, *flushing;        // flushing：正在寫成檔案，查詢時仍要看
+
+static pthread_rwlock_t segs_lock = PTHREAD_RWLOCK_INITIALIZER;    // 查詢持有 read lock，換 segment 時 write lock
+static Segment **segs;                 // 依 base 排序
+static int n_segs, cap_segs;
+static long merges;
+
+static pthread_mutex_t conv_lock = PTHREAD_MUTEX_INITIALIZER;      // 保護對話表
+static ConvName *convs;
+static int n_convs, cap_convs;
+static int *conv_table;                // 對話 ID + 1，0 表示空
+static int conv_cap;
+
+//--- HELPERS ---//
+static uint32_t hash_bytes(const char *s, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    return h;
+}
+
+static int buf_put(Buf *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len)
+            cap *= 2;
+        uint8_t *p = realloc(b->data, cap);
+        if (!p)
+            return -1;
+        b->data = p;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int buf_varint(Buf *b, uint32_t v) {
+    uint8_t out[5];
+    int n = 0;
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return buf_put(b, out, n);
+}
+
+static int term_cmp(const char *a, int alen, const char *b, int blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c ? c : alen - blen;
+}
+
+static void hex_encode(const char *s, char *out) {
+    int n = 0;
+    for (; *s && n < 2 * (MAX_NAME - 1); s++)
+        n += sprintf(out + n, "%02x", (unsigned char)*s);
+    out[n] = '\0';
+}
+
+static void hex_decode(const char *hex, char *out) {
+    int n = 0;
+    unsigned v;
+    for (; hex[0] && hex[1] && n < MAX_NAME - 1 && sscanf(hex, "%2x", &v) == 1; hex += 2)
+        out[n++] = v;
+    out[n] = '\0';
+}
+
+// 一個詞：連續的英數字或非 ASCII 的 byte（UTF-8 的中文等），英文轉小寫，至少 2 bytes；
+// 回傳長度，沒有更多詞時回傳 0
+int search_token(const char **p, char *term) {
+    const unsigned char *s = (const unsigned char*)*p;
+    while (true) {
+        while (*s && !(((*s | 0x20) >= 'a' && (*s | 0x20) <= 'z') || (*s >= '0' && *s <= '9') || *s >= 0x80))
+            s++;
+        if (!*s) {
+            *p = (const char*)s;
+            return 0;
+        }
+        int len = 0;
+        while (((*s | 0x20) >= 'a' && (*s | 0x20) <= 'z') || (*s >= '0' && *s <= '9') || *s >= 0x80) {
+            if (len < SEARCH_TERM_MAX - 1)
+                term[len++] = *s >= 'A' && *s <= 'Z' ? *s | 0x20 : *s;
+            s++;
+        }
+        term[len] = '\0';
+        if (len >= 2) {
+            *p = (const char*)s;
+            return len;
+        }
+    }
+}
+
+// text 中第一個查詢的詞附近的一段，不切斷 UTF-8 字元；out 最多 len - 1 bytes
+void search_snippet(const char *text, const char *query, char *out, int len) {
+    int n = strlen(text), at = 0;
+    const char *p = query;
+    char term[SEARCH_TERM_MAX];
+    if (search_token(&p, term) > 0) {
+        const char *hit = strcasestr(text, term);
+        at = hit ? hit - text : 0;
+    }
+    at = at > len / 4 ? at - len / 4 : 0;
+    if (n - at < len - 1)
+        at = n - (len - 1) > 0 ? n - (len - 1) : 0;
+    while (at > 0 && ((unsigned char)text[at] & 0xc0) == 0x80)
+        at--;
+    int end = at + len - 1 < n ? at + len - 1 : n;
+    if (end < n)
+        while (end > at && ((unsigned char)text[end] & 0xc0) == 0x80)
+            end--;
+    memcpy(out, text + at, end - at);
+    out[end - at] = '\0';
+}
+
+// 每則訊息也以對話的兩個人各建一個詞：'\x01' 加上名稱，search_token 不會產生這種詞；
+// 限定使用者或對話的查詢就是再 AND 這些詞
+static int user_term(const char *name, char *term) {
+    term[0] = '\x01';
+    return 1 + snprintf(term + 1, SEARCH_TERM_MAX - 1, "%s", name);
+}
+
+//--- CONVERSATIONS ---//
+// 以下都在持有 conv_lock 時呼叫
+static int conv_slot(const char *a, const char *b) {
+    char key[2 * MAX_NAME + 1];
+    int n = snprintf(key, sizeof(key), "%s/%s", a, b);
+    uint32_t h = hash_bytes(key, n);
+    for (int i = h & (conv_cap - 1);; i = (i + 1) & (conv_cap - 1)) {
+        int id = conv_table[i] - 1;
+        if (id < 0 || (strcmp(convs[id].a, a) == 0 && strcmp(convs[id].b, b) == 0))
+            return i;
+    }
+}
+
+static int conv_insert(const char *a, const char *b) {
+    if ((n_convs + 1) * 2 > conv_cap) {
+        int cap = conv_cap ? conv_cap * 2 : 1024;
+        int *table = calloc(cap, sizeof(int));
+        if (!table)
+            return -1;
+        free(conv_table);
+        conv_table = table;
+        conv_cap = cap;
+        for (int id = 0; id < n_convs; id++)
+            conv_table[conv_slot(convs[id].a, convs[id].b)] = id + 1;
+    }
+    if (n_convs == cap_convs) {
+        int cap = cap_convs ? cap_convs * 2 : 256;
+        ConvName *p = realloc(convs, cap * sizeof(ConvName));
+        if (!p)
+            return -1;
+        convs = p;
+        cap_convs = cap;
+    }
+    ConvName *c = &convs[n_convs];
+    snprintf(c->a, MAX_NAME, "%s", a);
+    snprintf(c->b, MAX_NAME, "%s", b);
+    c->max_seq = 0;
+    conv_table[conv_slot(a, b)] = n_convs + 1;
+    return n_convs++;
+}
+
+// a、b 已排序；新的對話加到 convs 檔
+static int conv_id(const char *a, const char *b, bool create) {
+    int slot = conv_cap ? conv_slot(a, b) : -1;
+    if (slot >= 0 && conv_table[slot])
+        return conv_table[slot] - 1;
+    if (!create)
+        return -1;
+    int id = conv_insert(a, b);
+    if (id == -1)
+        return -1;
+    char path[512], ha[2 * MAX_NAME], hb[2 * MAX_NAME];
+    snprintf(path, sizeof(path), "%s/convs", base_dir);
+    hex_encode(a, ha);
+    hex_encode(b, hb);
+    FILE *fp = fopen(path, "a");
+    if (fp) {
+        fprintf(fp, "%d %s %s\n", id, ha, hb);
+        fclose(fp);
+    }
+    return id;
+}
+
+static void conv_order(const char **a, const char **b) {
+    if (strcmp(*a, *b) > 0) {
+        const char *t = *a;
+        *a = *b;
+        *b = t;
+    }
+}
+
+//--- MEMORY SEGMENT ---//
+static MemSeg *mem_new(uint32_t base) {
+    MemSeg *m = calloc(1, sizeof(MemSeg));
+    if (!m)
+        return NULL;
+    m->base = base;
+    m->cap = 4096;
+    m->table = calloc(m->cap, sizeof(MemTerm*));
+    if (!m->table) {
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+static void mem_free(MemSeg *m) {
+    if (!m)
+        return;
+    for (int i = 0; i < m->cap; i++) {
+        if (m->table[i]) {
+            free(m->table[i]->docs);
+            free(m->table[i]);
+        }
+    }
+    free(m->table);
+    free(m->docs);
+    free(m);
+}
+
+static int mem_slot(MemTerm **table, int cap, const char *term, int len, uint32_t h) {
+    for (int i = h & (cap - 1);; i = (i + 1) & (cap - 1))
+        if (!table[i] || (table[i]->hash == h && table[i]->len == len && memcmp(table[i]->term, term, len) == 0))
+            return i;
+}
+
+static MemTerm *mem_find(const MemSeg *m, const char *term, int len) {
+    return m->table[mem_slot(m->table, m->cap, term, len, hash_bytes(term, len))];
+}
+
+static int mem_add(MemSeg *m, const char *term, int len, uint32_t doc) {
+    uint32_t h = hash_bytes(term, len);
+    int i = mem_slot(m->table, m->cap, term, len, h);
+    MemTerm *t = m->table[i];
+    if (!t) {
+        if ((m->n_terms + 1) * 10 > m->cap * 7) {
+            int cap = m->cap * 2;
+            MemTerm **table = calloc(cap, sizeof(MemTerm*));
+            if (!table)
+                return -1;
+            for (int k = 0; k < m->cap; k++)
+                if (m->table[k])
+                    table[mem_slot(table, cap, m->table[k]->term, m->table[k]->len, m->table[k]->hash)] = m->table[k];
+            free(m->table);
+            m->table = table;
+            m->cap = cap;
+            i = mem_slot(m->table, m->cap, term, len, h);
+        }
+        t = calloc(1, sizeof(MemTerm));
+        if (!t)
+            return -1;
+        t->hash = h;
+        t->len = len;
+        memcpy(t->term, term, len);
+        m->table[i] = t;
+        m->n_terms++;
+    }
+    if (t->n > 0 && t->docs[t->n - 1] == doc)
+        return 0;                          // 同一則訊息裡重複的詞
+    if (t->n == t->cap) {
+        int cap = t->cap ? t->cap * 2 : 4;
+        uint32_t *docs = realloc(t->docs, cap * sizeof(uint32_t));
+        if (!docs)
+            return -1;
+        t->docs = docs;
+        t->cap = cap;
+    }
+    t->docs[t->n++] = doc;
+    return 0;
+}
+
+//--- SEGMENT FILE ---//
+static void seg_close(Segment *s) {
+    if (!s)
+        return;
+    munmap(s->map, s->size);
+    free(s);
+}
+
+static Segment *seg_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    Segment *s = calloc(1, sizeof(Segment));
+    if (!s || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(IdxHeader)) {
+        free(s);
+        close(fd);
+        return NULL;
+    }
+    s->size = st.st_size;
+    s->map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) {
+        free(s);
+        return NULL;
+    }
+    const IdxHeader *h = s->map;
+    if (memcmp(h->magic, SEARCH_MAGIC, 8) != 0 || h->size != s->size ||
+        h->terms_off + (uint64_t)h->n_terms * sizeof(IdxTerm) > h->size || h->postings_off > h->docs_off ||
+        h->docs_off + (uint64_t)h->n_docs * sizeof(IdxDoc) > h->size) {
+        munmap(s->map, s->size);
+        free(s);
+        return NULL;
+    }
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    s->base = h->base;
+    s->n_docs = h->n_docs;
+    s->n_terms = h->n_terms;
+    s->terms = (const IdxTerm*)((const char*)s->map + h->terms_off);
+    s->strings = (const char*)s->map + h->strings_off;
+    s->skips = (const IdxSkip*)((const char*)s->map + h->skips_off);
+    s->postings = (const uint8_t*)s->map + h->postings_off;
+    s->docs = (const IdxDoc*)((const char*)s->map + h->docs_off);
+    return s;
+}
+
+static const IdxTerm *seg_find(const Segment *s, const char *term, int len) {
+    int lo = 0, hi = s->n_terms;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const IdxTerm *t = &s->terms[mid];
+        int c = term_cmp(s->strings + t->str_off, t->str_len, term, len);
+        if (c == 0)
+            return t;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+static int blocks(const IdxTerm *t) {
+    return (t->df + SEARCH_BLOCK - 1) / SEARCH_BLOCK;
+}
+
+// 解開一個詞的第 k 個區塊，out 至少 SEARCH_BLOCK 個；回傳 doc 數
+static int seg_block(const Segment *s, const IdxTerm *t, int k, uint32_t *out) {
+    const IdxSkip *skip = &s->skips[t->skip + k];
+    const uint8_t *p = s->postings + t->post_off + skip->off;
+    const uint8_t *end = s->postings + t->post_off + (k + 1 < blocks(t) ? skip[1].off : t->post_len);
+    int count = k + 1 < blocks(t) ? SEARCH_BLOCK : t->df - k * SEARCH_BLOCK, n = 0;
+    uint32_t doc = s->base;
+    while (p < end && n < count) {
+        uint32_t v = 0;
+        int shift = 0;
+        while (p < end && (*p & 0x80)) {
+            v |= (uint32_t)(*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        if (p < end)
+            v |= (uint32_t)*p++ << shift;
+        doc = n == 0 ? s->base + v : doc + v;
+        out[n++] = doc;
+    }
+    return n;
+}
+
+// 解開一個詞的整個 posting list，out 至少 t->df 個
+static int seg_postings(const Segment *s, const IdxTerm *t, uint32_t *out) {
+    int n = 0;
+    for (int k = 0; k < blocks(t); k++)
+        n += seg_block(s, t, k, out + n);
+    return n;
+}
+
+// 依序寫出 header、詞典、字串、posting lists、doc 表；先寫暫存檔，完成後才 rename 成 path
+static int seg_write(const char *path, uint32_t base, uint32_t n_docs, const IdxDoc *docs,
+                     Buf *terms, Buf *strings, Buf *skips, Buf *postings) {
+    IdxHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SEARCH_MAGIC, 8);
+    h.base = base;
+    h.n_docs = n_docs;
+    h.n_terms = terms->len / sizeof(IdxTerm);
+    uint64_t off = sizeof(IdxHeader);
+    h.terms_off = off;
+    off = (off + terms->len + 7) & ~7ULL;
+    h.strings_off = off;
+    off = (off + strings->len + 7) & ~7ULL;
+    h.skips_off = off;
+    off = (off + skips->len + 7) & ~7ULL;
+    h.postings_off = off;
+    off = (off + postings->len + 7) & ~7ULL;
+    h.docs_off = off;
+    h.size = off + (uint64_t)n_docs * sizeof(IdxDoc);
+
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp)
+        return -1;
+    static const char zero[8];
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+              fwrite(terms->data, 1, terms->len, fp) == terms->len &&
+              fwrite(zero, 1, h.strings_off - h.terms_off - terms->len, fp) == h.strings_off - h.terms_off - terms->len &&
+              fwrite(strings->data, 1, strings->len, fp) == strings->len &&
+              fwrite(zero, 1, h.skips_off - h.strings_off - strings->len, fp) == h.skips_off - h.strings_off - strings->len &&
+              fwrite(skips->data, 1, skips->len, fp) == skips->len &&
+              fwrite(zero, 1, h.postings_off - h.skips_off - skips->len, fp) == h.postings_off - h.skips_off - skips->len &&
+              fwrite(postings->data, 1, postings->len, fp) == postings->len &&
+              fwrite(zero, 1, h.docs_off - h.postings_off - postings->len, fp) == h.docs_off - h.postings_off - postings->len &&
+              fwrite(docs, sizeof(IdxDoc), n_docs, fp) == n_docs &&
+              fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 1;
+}
+
+static void seg_path(uint32_t base, char *path, size_t len) {
+    snprintf(path, len, "%s/%010u.idx", base_dir, base);
+}
+
+// 加入一個詞與它的 posting list（docs 為遞增的 doc ID），每 SEARCH_BLOCK 個一個區塊
+static int term_put(Buf *terms, Buf *strings, Buf *skips, Buf *postings, const char *term, int len,
+                    const uint32_t *docs, int n, uint32_t base) {
+    IdxTerm t = { postings->len, 0, n, strings->len, len, skips->len / sizeof(IdxSkip), 0 };
+    uint32_t prev = base;
+    for (int i = 0; i < n; i++) {
+        if (i % SEARCH_BLOCK == 0) {
+            IdxSkip skip = { docs[i] - base, postings->len - t.post_off };
+            if (buf_put(skips, &skip, sizeof(skip)) == -1)
+                return -1;
+            prev = base;
+        }
+        if (buf_varint(postings, docs[i] - prev) == -1)
+            return -1;
+        prev = docs[i];
+    }
+    t.post_len = postings->len - t.post_off;
+    return buf_put(strings, term, len) == -1 || buf_put(terms, &t, sizeof(t)) == -1 ? -1 : 0;
+}
+
+static int cmp_memterm(const void *a, const void *b) {
+    const MemTerm *x = *(MemTerm* const*)a, *y = *(MemTerm* const*)b;
+    return term_cmp(x->term, x->len, y->term, y->len);
+}
+
+// 記憶體的 segment 寫成檔案
+static Segment *mem_write(const MemSeg *m) {
+    MemTerm **sorted = malloc((m->n_terms + 1) * sizeof(MemTerm*));
+    if (!sorted)
+        return NULL;
+    int n = 0;
+    for (int i = 0; i < m->cap; i++)
+        if (m->table[i])
+            sorted[n++] = m->table[i];
+    qsort(sorted, n, sizeof(MemTerm*), cmp_memterm);
+
+    Buf terms = { 0 }, strings = { 0 }, skips = { 0 }, postings = { 0 };
+    int r = 0;
+    for (int i = 0; i < n && r == 0; i++)
+        r = term_put(&terms, &strings, &skips, &postings, sorted[i]->term, sorted[i]->len, sorted[i]->docs, sorted[i]->n,
+                     m->base);
+    free(sorted);
+
+    char path[512];
+    seg_path(m->base, path, sizeof(path));
+    Segment *s = NULL;
+    if (r == 0 && seg_write(path, m->base, m->n_docs, m->docs, &terms, &strings, &skips, &postings) == 1)
+        s = seg_open(path);
+    free(terms.data);
+    free(strings.data);
+    free(skips.data);
+    free(postings.data);
+    return s;
+}
+
+//--- INDEXER ---//
+static int segs_insert(Segment *s, int at) {
+    if (n_segs == cap_segs) {
+        int cap = cap_segs ? cap_segs * 2 : 16;
+        Segment **p = realloc(segs, cap * sizeof(Segment*));
+        if (!p)
+            return -1;
+        segs = p;
+        cap_segs = cap;
+    }
+    memmove(&segs[at + 1], &segs[at], (n_segs - at) * sizeof(Segment*));
+    segs[at] = s;
+    n_segs++;
+    return 0;
+}
+
+static void index_doc(const Pending *p) {
+    pthread_mutex_lock(&conv_lock);
+    int conv = conv_id(p->a, p->b, true);
+    if (conv >= 0 && p->seq > convs[conv].max_seq)
+        convs[conv].max_seq = p->seq;
+    pthread_mutex_unlock(&conv_lock);
+    if (conv < 0)
+        return;
+
+    pthread_mutex_lock(&mem_lock);
+    if (mem->n_docs == mem->cap_docs) {
+        int cap = mem->cap_docs ? mem->cap_docs * 2 : 1024;
+        IdxDoc *docs = realloc(mem->docs, cap * sizeof(IdxDoc));
+        if (!docs) {
+            pthread_mutex_unlock(&mem_lock);
+            return;
+        }
+        mem->docs = docs;
+        mem->cap_docs = cap;
+    }
+    uint32_t doc = mem->base + mem->n_docs;
+    mem->docs[mem->n_docs++] = (IdxDoc){ conv, p->seq, p->t, strcmp(p->from, p->a) != 0 };
+    char term[SEARCH_TERM_MAX];
+    int len = user_term(p->a, term);
+    mem_add(mem, term, len, doc);
+    len = user_term(p->b, term);
+    mem_add(mem, term, len, doc);
+    const char *s = p->text;
+    while ((len = search_token(&s, term)) > 0)
+        mem_add(mem, term, len, doc);
+    pthread_mutex_unlock(&mem_lock);
+}
+
+// 記憶體的 segment 寫成檔案；寫檔時查詢仍看得到 flushing，寫完才換成 segment 檔。
+// 寫不出來時 flushing 留著，下次再寫
+static void flush() {
+    pthread_mutex_lock(&mem_lock);
+    if (!flushing && mem->n_docs > 0) {
+        MemSeg *next = mem_new(mem->base + mem->n_docs);
+        if (next) {
+            flushing = mem;
+            mem = next;
+        }
+    }
+    MemSeg *m = flushing;
+    pthread_mutex_unlock(&mem_lock);
+    if (!m)
+        return;
+
+    Segment *s = mem_write(m);
+    if (!s) {
+        fprintf(stderr, "[Search] Can't write segment %u: %s\n", m->base, strerror(errno));
+        return;
+    }
+    pthread_rwlock_wrlock(&segs_lock);
+    pthread_mutex_lock(&mem_lock);
+    bool ok = segs_insert(s, n_segs) == 0;
+    if (ok)
+        flushing = NULL;
+    pthread_mutex_unlock(&mem_lock);
+    pthread_rwlock_unlock(&segs_lock);
+    if (ok)
+        mem_free(m);
+    else
+        seg_close(s);
+}
+
+// 合併 segs[at .. at + k - 1]：詞典依序合併，posting list 接起來（doc ID 範圍不重疊且遞增）
+static Segment *merge_write(int at, int k) {
+    Segment **in = &segs[at];
+    uint32_t base = in[0]->base, n_docs = 0, max_df = 0;
+    for (int i = 0; i < k; i++) {
+        n_docs += in[i]->n_docs;
+        for (uint32_t j = 0; j < in[i]->n_terms; j++)
+            if (in[i]->terms[j].df > max_df)
+                max_df = in[i]->terms[j].df;
+    }
+    IdxDoc *docs = malloc((size_t)(n_docs + 1) * sizeof(IdxDoc));
+    uint32_t *all = malloc((size_t)(n_docs + 1) * sizeof(uint32_t));
+    uint32_t *one = malloc((size_t)(max_df + 1) * sizeof(uint32_t));
+    uint32_t pos[SEARCH_MERGE] = { 0 };
+    Buf terms = { 0 }, strings = { 0 }, skips = { 0 }, postings = { 0 };
+    int r = docs && all && one ? 0 : -1;
+    uint32_t d = 0;
+    for (int i = 0; i < k && r == 0; i++) {
+        memcpy(docs + d, in[i]->docs, in[i]->n_docs * sizeof(IdxDoc));
+        d += in[i]->n_docs;
+    }
+
+    while (r == 0) {
+        // 各 segment 目前的詞中最小的
+        const char *min = NULL;
+        int min_len = 0;
+        for (int i = 0; i < k; i++) {
+            if (pos[i] >= in[i]->n_terms)
+                continue;
+            const IdxTerm *t = &in[i]->terms[pos[i]];
+            const char *s = in[i]->strings + t->str_off;
+            if (!min || term_cmp(s, t->str_len, min, min_len) < 0) {
+                min = s;
+                min_len = t->str_len;
+            }
+        }
+        if (!min)
+            break;
+        int n = 0;
+        for (int i = 0; i < k; i++) {
+            if (pos[i] >= in[i]->n_terms)
+                continue;
+            const IdxTerm *t = &in[i]->terms[pos[i]];
+            if (term_cmp(in[i]->strings + t->str_off, t->str_len, min, min_len) != 0)
+                continue;
+            int m = seg_postings(in[i], t, one);
+            memcpy(all + n, one, m * sizeof(uint32_t));
+            n += m;
+        }
+        char term[SEARCH_TERM_MAX];
+        memcpy(term, min, min_len);
+        for (int i = 0; i < k; i++) {
+            if (pos[i] < in[i]->n_terms) {
+                const IdxTerm *t = &in[i]->terms[pos[i]];
+                if (term_cmp(in[i]->strings + t->str_off, t->str_len, term, min_len) == 0)
+                    pos[i]++;
+            }
+        }
+        r = term_put(&terms, &strings, &skips, &postings, term, min_len, all, n, base);
+    }
+
+    char path[512];
+    seg_path(base, path, sizeof(path));
+    Segment *s = NULL;
+    if (r == 0 && seg_write(path, base, n_docs, docs, &terms, &strings, &skips, &postings) == 1)
+        s = seg_open(path);
+    free(docs);
+    free(all);
+    free(one);
+    free(terms.data);
+    free(strings.data);
+    free(skips.data);
+    free(postings.data);
+    return s;
+}
+
+// segment 檔超過 SEARCH_MAX_SEGS 個時，合併總訊息數最少的 SEARCH_MERGE 個相鄰的；
+// 合併後的檔案取代第一個的檔名，其他的刪掉（中途當掉時，重新啟動會丟掉被涵蓋的舊檔）
+static void merge() {
+    while (n_segs > SEARCH_MAX_SEGS) {
+        int at = 0;
+        long long best = -1;
+        for (int i = 0; i + SEARCH_MERGE <= n_segs; i++) {
+            long long sum = 0;
+            for (int j = 0; j < SEARCH_MERGE; j++)
+                sum += segs[i + j]->n_docs;
+            if (best < 0 || sum < best) {
+                best = sum;
+                at = i;
+            }
+        }
+        Segment *s = merge_write(at, SEARCH_MERGE);
+        if (!s) {
+            fprintf(stderr, "[Search] Can't merge segments: %s\n", strerror(errno));
+            return;
+        }
+        Segment *old[SEARCH_MERGE];
+        pthread_rwlock_wrlock(&segs_lock);
+        memcpy(old, &segs[at], sizeof(old));
+        segs[at] = s;
+        memmove(&segs[at + 1], &segs[at + SEARCH_MERGE], (n_segs - at - SEARCH_MERGE) * sizeof(Segment*));
+        n_segs -= SEARCH_MERGE - 1;
+        merges++;
+        pthread_rwlock_unlock(&segs_lock);
+        for (int j = 0; j < SEARCH_MERGE; j++) {
+            if (j > 0)
+                unlink(old[j]->path);
+            seg_close(old[j]);
+        }
+    }
+}
+
+static void *indexer_thread(void *arg) {
+    (void)arg;
+    int mem_docs = 0;                      // 還沒寫成檔案的訊息數（只有這個 thread 加入）
+    time_t dirty = 0;                      // 其中第一則的時間
+    pthread_mutex_lock(&queue_lock);
+    while (true) {
+        if (!q_head && stopping)
+            break;
+        if (!q_head && mem_docs == 0) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+            continue;
+        }
+        if (!q_head && time(NULL) < dirty + SEARCH_FLUSH_SEC) {
+            struct timespec deadline = { dirty + SEARCH_FLUSH_SEC, 0 };
+            pthread_cond_timedwait(&queue_ready, &queue_lock, &deadline);
+            continue;
+        }
+        Pending *p = q_head;
+        if (p) {
+            q_head = p->next;
+            if (!q_head)
+                q_tail = NULL;
+            q_len--;
+        }
+        busy = true;
+        pthread_mutex_unlock(&queue_lock);
+
+        if (p) {
+            index_doc(p);
+            free(p);
+            if (mem_docs++ == 0)
+                dirty = time(NULL);
+        }
+        if (mem_docs >= SEARCH_FLUSH_DOCS || (mem_docs > 0 && time(NULL) >= dirty + SEARCH_FLUSH_SEC)) {
+            flush();
+            merge();
+            mem_docs = 0;
+        }
+
+        pthread_mutex_lock(&queue_lock);
+        busy = false;
+        if (!q_head)
+            pthread_cond_broadcast(&queue_idle);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    flush();
+    merge();
+    return NULL;
+}
+
+//--- API ---//
+static int cmp_seg(const void *a, const void *b) {
+    const Segment *x = *(Segment* const*)a, *y = *(Segment* const*)b;
+    if (x->base != y->base)
+        return x->base < y->base ? -1 : 1;
+    return x->n_docs > y->n_docs ? -1 : x->n_docs < y->n_docs;
+}
+
+// 載入對話表與所有 segment 檔，啟動 indexer thread；dir 為 NULL 時用 SEARCH_DIR
+int search_init(const char *dir) {
+    if (dir)
+        snprintf(base_dir, sizeof(base_dir), "%s", dir);
+    if (mkdir(base_dir, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    char path[600];
+    snprintf(path, sizeof(path), "%s/convs", base_dir);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        int id;
+        char ha[2 * MAX_NAME + 1], hb[2 * MAX_NAME + 1], a[MAX_NAME], b[MAX_NAME];
+        while (fscanf(fp, "%d %32s %32s", &id, ha, hb) == 3) {
+            hex_decode(ha, a);
+            hex_decode(hb, b);
+            if (id != n_convs || conv_insert(a, b) == -1)
+                break;
+        }
+        fclose(fp);
+    }
+
+    DIR *d = opendir(base_dir);
+    if (!d)
+        return -1;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        size_t len = strlen(e->d_name);
+        snprintf(path, sizeof(path), "%s/%s", base_dir, e->d_name);
+        if (len > 4 && strcmp(e->d_name + len - 4, ".tmp") == 0) {
+            unlink(path);                      // 寫到一半的
+            continue;
+        }
+        if (len < 4 || strcmp(e->d_name + len - 4, ".idx") != 0)
+            continue;
+        Segment *s = seg_open(path);
+        if (!s || segs_insert(s, n_segs) == -1) {
+            fprintf(stderr, "[Search] Ignoring bad segment %s\n", path);
+            seg_close(s);
+        }
+    }
+    closedir(d);
+
+    // 依 base 排序；合併到一半當掉時，被合併後的檔案涵蓋的舊檔丟掉
+    if (n_segs > 0)
+        qsort(segs, n_segs, sizeof(Segment*), cmp_seg);
+    uint32_t next_doc = 0;
+    int kept = 0;
+    for (int i = 0; i < n_segs; i++) {
+        if (segs[i]->base < next_doc) {
+            unlink(segs[i]->path);
+            seg_close(segs[i]);
+            continue;
+        }
+        segs[kept++] = segs[i];
+        next_doc = segs[i]->base + segs[i]->n_docs;
+    }
+    n_segs = kept;
+
+    // 每個對話已建索引的最大 seq，沒有的之後由呼叫者從歷史補回
+    for (int i = 0; i < n_segs; i++)
+        for (uint32_t j = 0; j < segs[i]->n_docs; j++) {
+            const IdxDoc *doc = &segs[i]->docs[j];
+            if (doc->conv < (uint32_t)n_convs && doc->seq > convs[doc->conv].max_seq)
+                convs[doc->conv].max_seq = doc->seq;
+        }
+
+    mem = mem_new(next_doc);
+    if (!mem)
+        return -1;
+    stopping = false;
+    if (pthread_create(&indexer, NULL, indexer_thread, NULL) != 0)
+        return -1;
+    running = true;
+    return 1;
+}
+
+// 佇列裡的訊息都建好索引、寫成檔案後停止，釋放所有記憶體；之後可以再 search_init
+void search_close() {
+    if (!running)
+        return;
+    pthread_mutex_lock(&queue_lock);
+    stopping = true;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(indexer, NULL);
+    running = false;
+
+    for (int i = 0; i < n_segs; i++)
+        seg_close(segs[i]);
+    free(segs);
+    segs = NULL;
+    n_segs = cap_segs = 0;
+    mem_free(mem);
+    mem_free(flushing);
+    mem = flushing = NULL;
+    free(convs);
+    free(conv_table);
+    convs = NULL;
+    conv_table = NULL;
+    n_convs = cap_convs = conv_cap = 0;
+    merges = 0;
+}
+
+// relay 的訊息排進佇列就回傳，不在這裡建索引
+void search_add(const char *a, const char *b, long long seq, const char *from, time_t t, const char *text) {
+    if (!running)
+        return;
+    size_t len = strlen(text);
+    Pending *p = malloc(sizeof(Pending) + len + 1);
+    if (!p)
+        return;
+    conv_order(&a, &b);
+    p->next = NULL;
+    snprintf(p->a, MAX_NAME, "%s", a);
+    snprintf(p->b, MAX_NAME, "%s", b);
+    snprintf(p->from, MAX_NAME, "%s", from);
+    p->seq = seq;
+    p->t = t;
+    memcpy(p->text, text, len + 1);
+
+    pthread_mutex_lock(&queue_lock);
+    if (q_tail)
+        q_tail->next = p;
+    else
+        q_head = p;
+    q_tail = p;
+    q_len++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// a、b 之間已排進索引的最大 seq；server 啟動時從歷史補回這之後的訊息
+long long search_indexed(const char *a, const char *b) {
+    conv_order(&a, &b);
+    pthread_mutex_lock(&conv_lock);
+    int id = conv_id(a, b, false);
+    long long seq = id >= 0 ? convs[id].max_seq : 0;
+    pthread_mutex_unlock(&conv_lock);
+    return seq;
+}
+
+typedef struct {
+    int n_terms, n_words;              // 前 n_words 個是查詢的詞，之後是使用者與對方的詞
+    char term[SEARCH_TERMS + 2][SEARCH_TERM_MAX];
+    int  len[SEARCH_TERMS + 2];
+    const bool *allowed;               // 以對話 ID 為索引
+    int n_allowed;
+    time_t since;
+    SearchHit *hits;
+    uint32_t *conv;                    // 每個結果的對話 ID
+    uint32_t *from_b;
+    int n, max;
+} Query;
+
+// 詞在一個 segment 檔裡的 posting list，與目前解開的區塊
+typedef struct {
+    const IdxTerm *t;
+    int block;                         // -1 表示還沒有
+    int n;
+    uint32_t docs[SEARCH_BLOCK];
+} Cursor;
+
+static bool has_doc(const uint32_t *docs, int n, uint32_t doc) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (docs[mid] < doc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < n && docs[lo] == doc;
+}
+
+// 以 skip 表跳到 doc 所在的區塊，解開後再二分搜尋；查詢由新到舊，同一個區塊通常會連續用到
+static bool cursor_has(const Segment *s, Cursor *c, uint32_t doc) {
+    const IdxSkip *skip = &s->skips[c->t->skip];
+    uint32_t rel = doc - s->base;
+    int lo = 0, hi = blocks(c->t) - 1;
+    if (skip[0].first > rel)
+        return false;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (skip[mid].first <= rel)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    if (lo != c->block) {
+        c->n = seg_block(s, c->t, lo, c->docs);
+        c->block = lo;
+    }
+    return has_doc(c->docs, c->n, doc);
+}
+
+// doc 是否在可以看的對話裡、時間不早於 since
+static bool query_allowed(const Query *q, const IdxDoc *doc) {
+    return doc->conv < (uint32_t)q->n_allowed && q->allowed[doc->conv] && (time_t)doc->time >= q->since;
+}
+
+static void query_hit(Query *q, const IdxDoc *doc) {
+    SearchHit *h = &q->hits[q->n];
+    h->seq = doc->seq;
+    h->time = doc->time;
+    q->conv[q->n] = doc->conv;
+    q->from_b[q->n] = doc->from_b;
+    q->n++;
+}
+
+// 從最短的 posting list 由新到舊走，先以對話與時間過濾，再逐一確認其他查詢的詞；
+// 使用者與對方的詞只在最短時拿來走，否則由 allowed 過濾比較便宜
+static void query_mem(Query *q, const MemSeg *m) {
+    if (!m || m->n_docs == 0 || q->n >= q->max)
+        return;
+    const MemTerm *t[SEARCH_TERMS + 2];
+    int d = 0;
+    for (int i = 0; i < q->n_terms; i++) {
+        t[i] = mem_find(m, q->term[i], q->len[i]);
+        if (!t[i])
+            return;
+        if (t[i]->n < t[d]->n)
+            d = i;
+    }
+    for (int i = t[d]->n - 1; i >= 0 && q->n < q->max; i--) {
+        uint32_t doc = t[d]->docs[i];
+        if (!query_allowed(q, &m->docs[doc - m->base]))
+            continue;
+        int k = 0;
+        while (k < q->n_words && (k == d || has_doc(t[k]->docs, t[k]->n, doc)))
+            k++;
+        if (k == q->n_words)
+            query_hit(q, &m->docs[doc - m->base]);
+    }
+}
+
+// 同上，最短的 posting list 從最後一個區塊往前解，找到 max 則就停
+static void query_seg(Query *q, const Segment *s) {
+    if (q->n >= q->max)
+        return;
+    Cursor c[SEARCH_TERMS + 2];
+    int d = 0;
+    for (int i = 0; i < q->n_terms; i++) {
+        c[i].t = seg_find(s, q->term[i], q->len[i]);
+        c[i].block = -1;
+        if (!c[i].t)
+            return;
+        if (c[i].t->df < c[d].t->df)
+            d = i;
+    }
+    for (int b = blocks(c[d].t) - 1; b >= 0 && q->n < q->max; b--) {
+        int n = seg_block(s, c[d].t, b, c[d].docs);
+        for (int i = n - 1; i >= 0 && q->n < q->max; i--) {
+            uint32_t doc = c[d].docs[i];
+            if (!query_allowed(q, &s->docs[doc - s->base]))
+                continue;
+            int k = 0;
+            while (k < q->n_words && (k == d || cursor_has(s, &c[k], doc)))
+                k++;
+            if (k == q->n_words)
+                query_hit(q, &s->docs[doc - s->base]);
+        }
+    }
+}
+
+// user 的對話中含有 query 全部的詞的訊息，從新到舊最多 max 則；peer 不為 NULL 時只看跟 peer 的對話，
+// 只看 since 之後的；回傳找到的則數
+int search_query(const char *user, const char *peer, time_t since, const char *query,
+                 SearchHit *hits, int max) {
+    Query q;
+    memset(&q, 0, sizeof(q));
+    const char *p = query;
+    while (q.n_terms < SEARCH_TERMS && (q.len[q.n_terms] = search_token(&p, q.term[q.n_terms])) > 0)
+        q.n_terms++;
+    if (q.n_terms == 0 || max <= 0)
+        return 0;
+    q.n_words = q.n_terms;
+    q.len[q.n_terms] = user_term(user, q.term[q.n_terms]);
+    q.n_terms++;
+    if (peer && strcmp(peer, user) != 0) {
+        q.len[q.n_terms] = user_term(peer, q.term[q.n_terms]);
+        q.n_terms++;
+    }
+
+    // 可以看的對話
+    pthread_mutex_lock(&conv_lock);
+    bool *allowed = calloc(n_convs + 1, sizeof(bool));
+    q.n_allowed = allowed ? n_convs : 0;
+    for (int i = 0; i < q.n_allowed; i++) {
+        const ConvName *c = &convs[i];
+        const char *other = strcmp(c->a, user) == 0 ? c->b : strcmp(c->b, user) == 0 ? c->a : NULL;
+        allowed[i] = other && (!peer || strcmp(other, peer) == 0);
+    }
+    pthread_mutex_unlock(&conv_lock);
+    q.allowed = allowed;
+    q.since = since;
+    q.hits = hits;
+    q.max = max;
+    q.conv = malloc(max * sizeof(uint32_t));
+    q.from_b = malloc(max * sizeof(uint32_t));
+    if (!allowed || !q.conv || !q.from_b) {
+        free(allowed);
+        free(q.conv);
+        free(q.from_b);
+        return 0;
+    }
+
+    // 從新到舊：記憶體的 segment、寫檔中的、segment 檔
+    pthread_rwlock_rdlock(&segs_lock);
+    pthread_mutex_lock(&mem_lock);
+    query_mem(&q, mem);
+    query_mem(&q, flushing);
+    pthread_mutex_unlock(&mem_lock);
+    for (int i = n_segs - 1; i >= 0 && q.n < q.max; i--)
+        query_seg(&q, segs[i]);
+    pthread_rwlock_unlock(&segs_lock);
+
+    pthread_mutex_lock(&conv_lock);
+    for (int i = 0; i < q.n; i++) {
+        const ConvName *c = &convs[q.conv[i]];
+        snprintf(hits[i].peer, MAX_NAME, "%s", strcmp(c->a, user) == 0 ? c->b : c->a);
+        snprintf(hits[i].from, MAX_NAME, "%s", q.from_b[i] ? c->b : c->a);
+    }
+    pthread_mutex_unlock(&conv_lock);
+
+    // doc ID 大致依時間；啟動時從歷史補回的依對話排，結果再依時間排一次
+    for (int i = 1; i < q.n; i++)
+        for (int j = i; j > 0 && hits[j].time > hits[j - 1].time; j--) {
+            SearchHit t = hits[j];
+            hits[j] = hits[j - 1];
+            hits[j - 1] = t;
+        }
+    free(allowed);
+    free(q.conv);
+    free(q.from_b);
+    return q.n;
+}
+
+// 等佇列裡的訊息都建好索引（記憶體的 segment 裡），測試與 benchmark 用
+void search_sync() {
+    pthread_mutex_lock(&queue_lock);
+    while (running && (q_head || busy))
+        pthread_cond_wait(&queue_idle, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void search_stats(SearchStats *st) {
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&queue_lock);
+    st->queued = q_len;
+    pthread_mutex_unlock(&queue_lock);
+    pthread_rwlock_rdlock(&segs_lock);
+    pthread_mutex_lock(&mem_lock);
+    st->docs = mem ? mem->base + mem->n_docs : 0;
+    pthread_mutex_unlock(&mem_lock);
+    st->segments = n_segs;
+    for (int i = 0; i < n_segs; i++)
+        st->bytes += segs[i]->size;
+    st->merges = merges;
+    pthread_rwlock_unlock(&segs_lock);
+}
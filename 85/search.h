@@ -0,0 +1,53 @@
+// search.h
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <time.h>
+
+//--- SEARCH ---//
+// relay 訊息的全文索引（inverted index）：relay 時只把訊息排進佇列，由背景的 indexer thread 建索引。
+// 新的訊息先放在記憶體的 segment，滿 SEARCH_FLUSH_DOCS 則或閒置 SEARCH_FLUSH_SEC 秒後寫成一個
+// 不再改變的 segment 檔，以 mmap 讀取；segment 檔太多時合併相鄰的幾個。
+// 每則訊息有一個遞增的 doc ID，posting list 存 doc ID 的差，以 varint 壓縮。
+// server 重新啟動時，還沒寫進 segment 檔的訊息由呼叫者從歷史補回（search_indexed）
+#define SEARCH_DIR "search"
+#define SEARCH_FLUSH_DOCS 65536           // 記憶體的 segment 滿這麼多則就寫成檔案
+#define SEARCH_FLUSH_SEC 60               // 有新訊息但閒置這麼久也寫成檔案
+#define SEARCH_MAX_SEGS 8                 // segment 檔超過這麼多個時合併
+#define SEARCH_MERGE 4                    // 一次合併幾個相鄰的 segment
+#define SEARCH_TERM_MAX 32                // 詞的最大長度（bytes），更長的截斷
+#define SEARCH_TERMS 4                    // 一次查詢最多幾個詞（AND）
+#define SEARCH_RESULTS 8                  // 一次查詢最多回傳幾則
+#define SEARCH_SNIPPET 64                 // 結果附上的訊息片段長度（bytes）
+
+// 查詢結果：對話的另一個人與訊息在對話裡的 seq（即 history 的 cursor）
+typedef struct {
+    char peer[MAX_NAME];
+    char from[MAX_NAME];
+    long long seq;
+    time_t time;
+} SearchHit;
+
+typedef struct {
+    long docs;                         // 已建索引的訊息數
+    long queued;                       // 還在佇列裡的
+    int  segments;                     // segment 檔數
+    long long bytes;                   // segment 檔的總大小
+    long merges;
+} SearchStats;
+
+int  search_init(const char *dir);
+void search_close();
+void search_add(const char *a, const char *b, long long seq, const char *from, time_t t, const char *text);
+long long search_indexed(const char *a, const char *b);
+int  search_query(const char *user, const char *peer, time_t since, const char *query,
+                  SearchHit *hits, int max);
+void search_sync();
+void search_stats(SearchStats *st);
+int  search_token(const char **p, char *term);
+void search_snippet(const char *text, const char *query, char *out, int len);
+
+#endif
@@ -0,0 +1,234 @@
+// search_bench.c
+// 全文索引的效能測試：不需要 server，以 Zipf 分佈的假字彙產生很多則 relay 訊息，
+// 量測 relay 時排進佇列的延遲、背景建索引的速度、segment 檔的大小，以及各種查詢的延遲
+//   ./search_bench [messages] [conversations] [directory]
+// 沒有指定目錄時在 /tmp 建一個暫時的目錄，結束後刪掉
+#define _GNU_SOURCE
+#include "search.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+#define VOCABULARY 50000
+#define USERS 200
+#define QUERIES 200
+
+long long nmessages = 10000000;
+int nconvs = 2000;
+char words[VOCABULARY][12];
+double *zipf;                          // 累積機率，第 i 個字的機率正比於 1 / (i + 1)
+int (*pairs)[2];                       // 每個對話的兩個使用者
+char names[USERS][MAX_NAME];
+uint64_t rng = 88172645463325252ULL;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_rand() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, double *us, int n, long hits) {
+    qsort(us, n, sizeof(double), cmp_double);
+    printf("%-28s p50 %9.1f us  p99 %9.1f us  max %9.1f us  avg hits %.1f\n", what,
+           us[n / 2], us[(int)(n * 0.99)], us[n - 1], (double)hits / n);
+}
+
+static int zipf_word() {
+    double u = (next_rand() >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = VOCABULARY - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// 字彙：每個字 3 ~ 10 個小寫字母，依編號決定；使用者與對話隨機配對
+static void make_corpus() {
+    zipf = malloc(VOCABULARY * sizeof(double));
+    pairs = malloc(nconvs * sizeof(*pairs));
+    if (!zipf || !pairs) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    double sum = 0;
+    for (int i = 0; i < VOCABULARY; i++) {
+        uint64_t h = (i + 1) * 0x9E3779B97F4A7C15ULL;
+        int len = 3 + h % 8;
+        for (int k = 0; k < len; k++) {
+            h = h * 6364136223846793005ULL + 1442695040888963407ULL;
+            words[i][k] = 'a' + (h >> 33) % 26;
+        }
+        words[i][len] = '\0';
+        sum += 1.0 / (i + 1);
+        zipf[i] = sum;
+    }
+    for (int i = 0; i < VOCABULARY; i++)
+        zipf[i] /= sum;
+    for (int i = 0; i < USERS; i++)
+        snprintf(names[i], MAX_NAME, "user%d", i);
+    for (int i = 0; i < nconvs; i++) {
+        pairs[i][0] = next_rand() % USERS;
+        pairs[i][1] = next_rand() % USERS;
+    }
+}
+
+// 跟 server 一樣 relay 時呼叫 search_add，量測每次排進佇列的延遲；
+// 佇列太長時等 indexer 追上，以免假的訊息用完記憶體
+static void add_messages() {
+    double *lat = malloc(nmessages * sizeof(double));
+    long long *seq = calloc(nconvs, sizeof(long long));
+    if (!lat || !seq) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    char text[256];
+    time_t base = time(NULL) - nmessages / 10;
+    uint64_t start = now_ns();
+    for (long long i = 0; i < nmessages; i++) {
+        int c = next_rand() % nconvs, n = 3 + next_rand() % 13, len = 0;
+        for (int k = 0; k < n; k++)
+            len += sprintf(text + len, "%s%s", k ? " " : "", words[zipf_word()]);
+        const char *a = names[pairs[c][0]], *b = names[pairs[c][1]];
+        uint64_t t = now_ns();
+        search_add(a, b, ++seq[c], next_rand() % 2 ? a : b, base + i / 10, text);
+        lat[i] = (now_ns() - t) / 1e3;
+        if (i % 10000 == 0) {
+            SearchStats st;
+            search_stats(&st);
+            while (st.queued > 200000) {
+                usleep(10000);
+                search_stats(&st);
+            }
+        }
+    }
+    search_sync();
+    double sec = (now_ns() - start) / 1e9;
+    printf("indexed %lld messages in %.1f s, %.0f messages/s\n", nmessages, sec, nmessages / sec);
+    qsort(lat, nmessages, sizeof(double), cmp_double);
+    printf("search_add (relay path)      p50 %9.2f us  p99 %9.2f us  max %9.1f us\n",
+           lat[nmessages / 2], lat[(long long)(nmessages * 0.99)], lat[nmessages - 1]);
+    free(lat);
+    free(seq);
+}
+
+// 各種查詢各跑 QUERIES 次，每次換一個字
+static void run_queries(const char *label) {
+    double us[QUERIES];
+    SearchHit hits[SEARCH_RESULTS];
+    char query[64];
+    struct {
+        const char *what;
+        int lo, hi;                    // 字的排名範圍
+        int second;                    // 第二個字的排名，-1 表示只有一個字
+        int filter;                    // 0 所有對話，1 一個使用者的，2 一個對話
+    } tests[] = {
+        { "common word",        0,     10,   -1, 0 },
+        { "mid word",           500,   1000, -1, 0 },
+        { "rare word",          40000, 50000, -1, 0 },
+        { "common AND mid",     0,     10,   500, 0 },
+        { "mid word, one user", 500,   1000, -1, 1 },
+        { "mid word, one pair", 500,   1000, -1, 2 },
+        { "common word, one pair", 0,  10,   -1, 2 },
+    };
+    printf("%s:\n", label);
+    for (size_t k = 0; k < sizeof(tests) / sizeof(tests[0]); k++) {
+        long total = 0;
+        for (int i = 0; i < QUERIES; i++) {
+            int w = tests[k].lo + next_rand() % (tests[k].hi - tests[k].lo);
+            if (tests[k].second >= 0)
+                snprintf(query, sizeof(query), "%s %s", words[w], words[tests[k].second + next_rand() % 500]);
+            else
+                snprintf(query, sizeof(query), "%s", words[w]);
+            int c = next_rand() % nconvs;
+            const char *user = names[pairs[c][0]];
+            const char *peer = tests[k].filter == 2 ? names[pairs[c][1]] : NULL;
+            uint64_t t = now_ns();
+            total += search_query(user, tests[k].filter ? peer : NULL, 0, query, hits, SEARCH_RESULTS);
+            us[i] = (now_ns() - t) / 1e3;
+        }
+        report(tests[k].what, us, QUERIES, total);
+    }
+}
+
+static void remove_dir(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+    struct dirent *d;
+    char sub[512];
+    while ((d = readdir(dir)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+        snprintf(sub, sizeof(sub), "%s/%s", path, d->d_name);
+        unlink(sub);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+//--- MAIN FUNCTION ---//
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        nmessages = atoll(argv[1]);
+    if (argc > 2)
+        nconvs = atoi(argv[2]);
+    if (nmessages <= 0 || nconvs <= 0) {
+        printf("Usage: %s [messages] [conversations] [directory]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char tmp[] = "/tmp/search_bench.XXXXXX";
+    const char *dir = argc > 3 ? argv[3] : mkdtemp(tmp);
+    if (!dir || search_init(dir) == -1) {
+        perror("search_init");
+        return EXIT_FAILURE;
+    }
+    make_corpus();
+
+    printf("%s\n", LINE);
+    printf("%lld messages, %d conversations, %d users, %d words\n", nmessages, nconvs, USERS, VOCABULARY);
+    add_messages();
+    SearchStats st;
+    search_stats(&st);
+    printf("%d segment files, %.1f MB, %ld merges\n", st.segments, st.bytes / 1048576.0, st.merges);
+    run_queries("queries while running (recent messages still in memory)");
+
+    // 重新開啟：記憶體的 segment 寫成檔案，查詢全部從 mmap 的檔案
+    uint64_t t = now_ns();
+    search_close();
+    if (search_init(dir) == -1) {
+        perror("search_init");
+        return EXIT_FAILURE;
+    }
+    printf("close + reopen: %.1f ms\n", (now_ns() - t) / 1e6);
+    search_stats(&st);
+    printf("%d segment files, %.1f MB\n", st.segments, st.bytes / 1048576.0);
+    run_queries("queries after reopen (first pass)");
+    run_queries("queries after reopen (second pass)");
+    printf("%s\n", LINE);
+
+    search_close();
+    if (argc <= 3)
+        remove_dir(dir);
+    return 0;
+}
@@ -1,5 +1,14 @@
 // server.c
+#define _GNU_SOURCE
 #include "config.h"
+#include "srv_io.h"
+#include "xfer.h"
+#include "spool.h"
+#include "roster.h"
+#include "history.h"
+#include "search.h"
+#include "unread.h"
+#include "timer.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -11,7 +20,12 @@
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 
 // OpenSSL Headers
 #include <openssl/ssl.h>
@@ -34,10 +48,32 @@ int login_user_ssl(SSL *ssl, char* name);
 
 // logged in
 int handle_user_ssl(SSL *ssl, char* name);
-int show_user_ssl(SSL *ssl, char* name);
+int user_requests_ssl(SSL *ssl, char* name);
+int reply_ssl(SSL *ssl, const char *mes, int len);
+int read_arg_ssl(SSL *ssl, const char *buf, const char *ask, char *out, int len);
+int show_user_ssl(SSL *ssl, char* name, int since);
+int roster_query_ssl(SSL *ssl, const char *args);
+int history_ssl(SSL *ssl, char* name, const char *args);
+int search_ssl(SSL *ssl, char* name, const char *args);
+int mark_read_ssl(SSL *ssl, char* name, const char *args);
+int search_recover(const char *a, const char *b, void *arg);
 int relay_user_ssl(SSL *ssl, char* name, int targetID, char *message);
 int direct_user_ssl(SSL *ssl, char* username, int targetID);
 int file_user_ssl(SSL *ssl, char* name, int targetID, char *filename);
+int multi_file_user_ssl(SSL *ssl, char* name, char *targets, char *filename);
+int spool_user_ssl(SSL *ssl, char* name, int targetID, char *filename);
+int spool_get_ssl(SSL *ssl, char* name, int spoolID);
+void spool_notify(const SpoolEntry *e);
+RosterSnap *roster_snapshot(bool locked);
+void presence_push(int uid);
+static int user_find(const char *name);
+void *presence_thread(void *arg);
+void roster_send(int uid);
+int contact_add_ssl(SSL *ssl, char* name, int targetID);
+int contact_del_ssl(SSL *ssl, char* name, int targetID);
+int contact_list_ssl(SSL *ssl, char* name);
+int contact_lines(int uid, char *out, int len);
+void *offer_thread(void *arg);
 void *handle_streaming(void *arg);
 
 //--- USER INFO ---//
@@ -53,14 +89,38 @@ typedef struct {
     SSL *file_ssl;                     // SSL Socket for file transmission
     char ip[INET_ADDRSTRLEN];          // IP位址
     int  receiver_port;                // Direct message 連接埠號
+    int  version;                      // 最後一次註冊、登入或登出時的 roster_version
+    bool file_eof;                     // file socket 已讀到 EOF，offer thread 不再 poll
+
+    // 聯絡人，登出後仍保留
+    int  contacts[CONTACT_MAX];        // 自己的聯絡人 ID
+    int  n_contacts;
+    int  watchers[MAX_USERS];          // 反向索引：把自己加進聯絡人的人，presence 只推給他們
+    int  n_watchers;
+    bool presence_queued;              // 已在 presence_queue 裡等 presence thread 送出
 } User;
 
 User users[MAX_USERS];
 int user_count = 0;
+int roster_version = 0;                // 每次有人註冊、登入或登出加一
 pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;          // Access users的lock
+pthread_mutex_t login_lock = PTHREAD_MUTEX_INITIALIZER;          // 一次只有一個人在登入（等 side socket）
+
+//--- PRESENCE ---//
+// 狀態變了、還沒推給 watcher 的使用者，持有 users_lock 時存取；同一個人在一批裡只送最新的狀態
+int presence_queue[MAX_USERS];
+int presence_count = 0;
+pthread_cond_t presence_ready = PTHREAD_COND_INITIALIZER;
+pthread_t presence_thd;
 
 //--- THREAD POOL ---//
-SSL* task_queue_ssl[QUEUE_SIZE];
+// 還沒 handshake 的連線：TLS handshake 由取出的 worker 做，main thread 只 accept
+typedef struct {
+    int fd;
+    uint64_t since;                    // 放進佇列的時間（ms）
+} Task;
+
+Task task_queue[QUEUE_SIZE];
 int queue_front = 0, queue_rear = 0, queue_count = 0;
 pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;          // Access queue的lock
 pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;       // Worker等待有Task
@@ -68,12 +128,87 @@ pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;       // Worker等待
 pthread_t workers[MAX_ONLINE];
 bool stop_flag = false;
 
+//--- ADMISSION ---//
+// 持有 queue_lock 時存取。連線在佇列裡等 worker 的時間持續超過 ADMIT_TARGET_MS 達 ADMIT_INTERVAL_MS
+// 就進入過載（CoDel）：新連線在 handshake 之前回覆 SERVER_BUSY，佇列裡等太久的也一併回覆
+typedef struct {
+    uint64_t above_since;              // 等待時間開始超過目標的時間，0 表示沒有超過
+    bool     dropping;                 // 過載中
+    uint64_t delay;                    // 最近一次量到的等待時間（ms）
+    int      cpu;                      // 最近一次量到的 CPU 使用率（%）
+    long     shed;                     // 上次 admit_sample 之後拒絕的連線數
+} Admission;
+
+Admission admit;
+Timer admit_timer;
+
+//--- FILE OFFER ---//
+// 接收端還沒回覆的 file offer，持有 users_lock 時存取
+typedef struct {
+    int  id;                           // offer ID，0 表示空位
+    int  from_id;
+    char from[MAX_NAME];
+    char filename[MAX_MES];            // 傳送端的 offer："檔名 大小 [附加欄位]"
+    bool multi;                        // 以 fan-out 傳輸分送
+    int  n;
+    int  to_id[XFER_FANOUT_MAX];
+    int  answer[XFER_FANOUT_MAX];      // 0 未回覆，1 接受，-1 拒絕
+    time_t deadline;
+} Offer;
+
+// offers[i] 的 deadline timer；另外放一個陣列，空位重用時可以整格清掉
+Offer offers[OFFER_MAX];
+Timer offer_timers[OFFER_MAX];
+int next_offer_id = 1;
+pthread_t offer_thd;
+
+int offer_send(int uid, const char *signal, const char *from, const char *mes);
+void offer_finish(Offer *o);
+void offer_decide(Offer *o, int uid, int answer);
+void offer_answer(int uid, const char *buf);
+void offer_drop_user(int uid);
+void offer_expire(void *arg);
+
 //--- SOCKET ---//
 int side_fd;
 
 //--- SSL ---//
 SSL_CTX *ssl_ctx;
 
+//--- PIPELINE ---//
+// 目前處理的 pipelined request 的回覆前綴 "rep <seq> "，lockstep 的 request 為空字串
+// 每個 session 由一個 worker thread 處理，所以放在 thread-local
+static __thread char reply_tag[32];
+
+//--- SESSION TIMER ---//
+// 每個 worker 一個：session 超過期限沒有送 request（client 消失、沒有送 FIN）時，
+// 由 timer wheel 的 thread shutdown 它的 socket，卡在讀寫的 worker 就會回來做登出的清理
+#define SESSION_MAIN 0                    // session socket
+#define SESSION_RELAY 1                   // 登入後的 relay socket（別的 worker 可能卡在寫它）
+#define SESSION_FILE 2
+#define SESSION_FDS 3
+
+typedef struct {
+    pthread_mutex_t lock;              // 保護 fds
+    int  fds[SESSION_FDS];             // 各 socket 的 dup，-1 表示沒有；原本的 fd 關掉後不會誤關別人的
+    Timer timer;
+} SessionTimer;
+
+SessionTimer session_timers[MAX_ONLINE];
+static __thread SessionTimer *session_timer;
+
+void session_expire(void *arg);
+void session_touch(int sec);
+void session_watch(int slot, int fd);
+
+static uint64_t mono_ms();
+void admit_update(uint64_t now, uint64_t delay);
+int  admit_retry();
+int  admit_check(int fd);
+void admit_reject(int fd, int sec);
+bool admit_pressure();
+void admit_sample(void *arg);
+
 //--- USER INFO ---//
 int stream_fd;  // 視頻流服務器的 socket
 
@@ -110,58 +245,99 @@ int main() {
     printf("Server is running on port %d\n", SERVER_PORT);
     printf("Streaming server is running on port %d\n", STREAM_PORT);
 
+    // 選擇 I/O backend
+    io_backend_init();
+
+    // 對方斷線時 write 回傳錯誤，而不是讓整個 server 收到 SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    // 離線傳檔的 spool 目錄
+    if (spool_init(spool_notify) == -1) {
+        ERR_EXIT("spool_init");
+    }
+
+    // relay 訊息的歷史
+    if (history_init(NULL) == -1) {
+        ERR_EXIT("history_init");
+    }
+
+    // 每個對話的未讀數與已讀 cursor
+    if (unread_init(NULL) == -1) {
+        ERR_EXIT("unread_init");
+    }
+
+    // relay 訊息的全文索引；上次結束時還沒寫進索引的訊息從歷史補回，由背景的 indexer 建索引
+    if (search_init(NULL) == -1) {
+        ERR_EXIT("search_init");
+    }
+    history_each(search_recover, NULL);
+
+    // 啟動檔案傳輸 engine
+    if (xfer_engine_start(ssl_ctx) == -1) {
+        ERR_EXIT("xfer_engine_start");
+    }
+    printf("File transfer engine is running on port %d\n", FILE_PORT);
+
+    // session 的閒置與 request 期限、file offer 的期限都由同一個 timer wheel 處理
+    if (timer_start() == -1) {
+        ERR_EXIT("timer_start");
+    }
+    for (int i = 0; i < OFFER_MAX; i++)
+        timer_init(&offer_timers[i], offer_expire, &offers[i]);
+    for (int i = 0; i < MAX_ONLINE; i++) {
+        pthread_mutex_init(&session_timers[i].lock, NULL);
+        for (int k = 0; k < SESSION_FDS; k++)
+            session_timers[i].fds[k] = -1;
+        timer_init(&session_timers[i].timer, session_expire, &session_timers[i]);
+    }
+
+    // 量 CPU 使用率，清掉過載時在佇列裡等太久的連線
+    timer_init(&admit_timer, admit_sample, NULL);
+    admit_sample(NULL);
+
+    // 收接收端對 file offer 的回答
+    pthread_create(&offer_thd, NULL, offer_thread, NULL);
+
+    // 把 presence 的變化批次推給 watcher
+    pthread_create(&presence_thd, NULL, presence_thread, NULL);
+
     // 建工作執行緒
     for (int i = 0; i < MAX_ONLINE; i++) {
-        pthread_create(&workers[i], NULL, worker_thread, NULL);
+        pthread_create(&workers[i], NULL, worker_thread, &session_timers[i]);
     }
 
     while (true) {
         // 宣告Client的變數
         struct sockaddr_in cliaddr;
-        socklen_t clilen = sizeof(cliaddr);
 
         // 等待連線
-        int conn_fd = accept(listen_fd, (struct sockaddr*)&cliaddr, &clilen);
+        int conn_fd = io_accept(listen_fd, &cliaddr);
         if (conn_fd < 0) {
             printf("[Error] Accept error\n");
             continue;
         }
 
-        printf("New connection from %s:%d [%s]\n", inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port), timestamp());
-
-        // 為連接建立 SSL 結構
-        SSL *ssl = SSL_new(ssl_ctx);
-        SSL_set_fd(ssl, conn_fd);
-        if (SSL_accept(ssl) <= 0) {
-            ERR_print_errors_fp(stderr);
-            SSL_free(ssl);
-            close(conn_fd);
-            continue;
-        }
-
-        // 將 SSL 指標傳遞給工作執行緒
+        // 將連線傳遞給工作執行緒；過載時在 handshake 之前拒絕，只花一次 write 與 close
         pthread_mutex_lock(&queue_lock);
-        if (queue_count >= QUEUE_SIZE) {
-            // task已滿，回覆連線失敗
-            SSL_write(ssl, QUEUE_FULL, strlen(QUEUE_FULL));
-            SSL_shutdown(ssl);
-            SSL_free(ssl);
-            close(conn_fd);
-        } else {
-            task_queue_ssl[queue_rear] = ssl;
-            queue_rear = (queue_rear + 1) % QUEUE_SIZE;
-            queue_count++;
-            pthread_cond_signal(&queue_not_empty);
-        }
+        int retry = admit_check(conn_fd);
         pthread_mutex_unlock(&queue_lock);
+        if (retry > 0) {
+            admit_reject(conn_fd, retry);
+            continue;
+        }
+        printf("New connection from %s:%d [%s]\n", inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port), timestamp());
     }
 
     // 清理
     stop_flag = true;
     pthread_cond_broadcast(&queue_not_empty);
+    pthread_cond_broadcast(&presence_ready);
     for (int i = 0; i < MAX_ONLINE; i++) {
         pthread_join(workers[i], NULL);
     }
+    timer_stop();
+    search_close();
+    unread_close();
     cleanup_ssl();
     SSL_CTX_free(ssl_ctx);
     close(listen_fd);
@@ -173,35 +349,66 @@ int main() {
 
 // Worker
 void *worker_thread(void *arg) {
-    (void)arg;  // 避免未使用參數的警告
+    session_timer = (SessionTimer*)arg;
     while (!stop_flag) {
         // 取得task
         pthread_mutex_lock(&queue_lock);
-        while (queue_count == 0 && !stop_flag)
+        while (queue_count == 0 && !stop_flag) {
+            // 有 worker 閒著，佇列沒有積壓
+            admit.above_since = 0;
+            admit.dropping = false;
+            admit.delay = 0;
             pthread_cond_wait(&queue_not_empty, &queue_lock);
+        }
         if (stop_flag) {
             pthread_mutex_unlock(&queue_lock);
             break;
         }
-        SSL *ssl = task_queue_ssl[queue_front];
+        Task task = task_queue[queue_front];
         queue_front = (queue_front + 1) % QUEUE_SIZE;
         queue_count--;
+        uint64_t now = mono_ms();
+        admit_update(now, now - task.since);
+        // 過載時等太久的不做 handshake，請它稍後再來，佇列才消得下去
+        int retry = admit.dropping ? admit_retry() : 0;
+        if (retry > 0)
+            admit.shed++;
         pthread_mutex_unlock(&queue_lock);
+        if (retry > 0) {
+            admit_reject(task.fd, retry);
+            continue;
+        }
 
-        // 發送接受任務的回覆
-        if (SSL_write(ssl, ACCEPT_TASK, strlen(ACCEPT_TASK)) <= 0) {
-            printf("[Error] Error in accepting task\n");
-            SSL_shutdown(ssl);
-            SSL_free(ssl);
+        // TLS handshake 在 worker 做，從這裡開始 session 有期限
+        IoStats io_start;
+        io_stats_get(&io_start);
+        session_touch(REQUEST_TIMEOUT_SEC);
+        session_watch(SESSION_MAIN, task.fd);
+        SSL *ssl = io_ssl_accept(ssl_ctx, task.fd);
+        if (!ssl) {
+            session_watch(SESSION_MAIN, -1);
+            timer_cancel(&session_timer->timer);
             continue;
         }
 
-        // 處理未登入狀態
-        handle_no_login(ssl);
+        // 這個 session 的回覆可以延到下一次讀取時一起送出
+        io_ssl_cork(ssl);
+        session_touch(SESSION_IDLE_SEC);
+
+        // 發送接受任務的回覆
+        if (io_ssl_write(ssl, ACCEPT_TASK, strlen(ACCEPT_TASK)) <= 0) {
+            printf("[Error] Error in accepting task\n");
+        } else {
+            // 處理未登入狀態
+            handle_no_login(ssl);
+        }
 
         // 關連接
-        SSL_shutdown(ssl);
-        SSL_free(ssl);
+        for (int k = 0; k < SESSION_FDS; k++)
+            session_watch(k, -1);
+        timer_cancel(&session_timer->timer);
+        io_ssl_close(ssl);
+        io_stats_report("session", &io_start);
     }
     return NULL;
 }
@@ -212,7 +419,9 @@ void handle_no_login(SSL *ssl) {
     while (true) {
         // 接收資料
         memset(buf, 0, BUFFER_SIZE);
-        int bytes = SSL_read(ssl, buf, BUFFER_SIZE);
+        // 有連線在排隊時，還沒登入的閒置 session 先讓出 worker，已登入的不受影響
+        session_touch(admit_pressure() ? REQUEST_TIMEOUT_SEC : SESSION_IDLE_SEC);
+        int bytes = io_ssl_read(ssl, buf, BUFFER_SIZE);
         if (bytes <= 0) {
             printf("[Error] SSL_read wrong in handle_no_login\n");
             break;
@@ -228,9 +437,11 @@ void handle_no_login(SSL *ssl) {
             if (r == -1) break;
         } else if (strncmp(buf, LOGIN, strlen(LOGIN)) == 0) {
             char *name = buf + strlen(LOGIN);
-            pthread_mutex_lock(&users_lock);
+            // side socket 依連線順序配對，同時只能有一個人在登入；等 client 連線要有期限
+            session_touch(REQUEST_TIMEOUT_SEC);
+            pthread_mutex_lock(&login_lock);
             r = login_user_ssl(ssl, name);
-            pthread_mutex_unlock(&users_lock);
+            pthread_mutex_unlock(&login_lock);
             if (r == 0)  continue;
             if (r == -1) break;
 
@@ -240,9 +451,11 @@ void handle_no_login(SSL *ssl) {
         } else if (strncmp(buf, EXIT, strlen(EXIT)) == 0) {
             printf("[Exit] Client Exit\n");
             break;
+        } else if (strcmp(buf, PING) == 0) {
+            if (io_ssl_write(ssl, PONG, strlen(PONG)) <= 0) break;
         } else {
             printf("[Error] Unknown command in handle_no_login: %s\n", buf);
-            r = SSL_write(ssl, UNKNOWN, strlen(UNKNOWN));
+            r = io_ssl_write(ssl, UNKNOWN, strlen(UNKNOWN));
             if (r <= 0) break;
         }
     }
@@ -253,20 +466,20 @@ void handle_no_login(SSL *ssl) {
 int register_user_ssl(SSL *ssl, char* name) {
     // 檢查名額
     if (user_count >= MAX_USERS) {
-        if (SSL_write(ssl, USER_FULL, strlen(USER_FULL)) <= 0) return -1;
+        if (io_ssl_write(ssl, USER_FULL, strlen(USER_FULL)) <= 0) return -1;
         return 0;
     }
 
     // 檢查姓名長度
     if (strlen(name) >= MAX_NAME) {
-        if (SSL_write(ssl, NAME_EXCEED, strlen(NAME_EXCEED)) <= 0) return -1;
+        if (io_ssl_write(ssl, NAME_EXCEED, strlen(NAME_EXCEED)) <= 0) return -1;
         return 0;
     }
 
     // 檢查是否註冊
     for (int i = 0; i < user_count; i++) {
         if (strcmp(users[i].name, name) == 0) {
-            if (SSL_write(ssl, NAME_REGISTERED, strlen(NAME_REGISTERED)) <= 0) return -1;
+            if (io_ssl_write(ssl, NAME_REGISTERED, strlen(NAME_REGISTERED)) <= 0) return -1;
             return 0;
         }
     }
@@ -278,126 +491,241 @@ int register_user_ssl(SSL *ssl, char* name) {
     users[user_count].ssl_socket = NULL;
     users[user_count].relay_ssl = NULL;
     users[user_count].file_ssl = NULL;
+    users[user_count].n_contacts = 0;
+    users[user_count].n_watchers = 0;
+    users[user_count].presence_queued = false;
     user_count++;
+    presence_push(user_count - 1);
 
-    if (SSL_write(ssl, REGISTER_SUCCESS, strlen(REGISTER_SUCCESS)) <= 0) return -1;
+    if (io_ssl_write(ssl, REGISTER_SUCCESS, strlen(REGISTER_SUCCESS)) <= 0) return -1;
     printf("[Register] %s\n", name);
 
     return 1;
 }
 
-// Login User via SSL
-int login_user_ssl(SSL *ssl, char* name) {
-    // 取得 login ID
-    int login_id = -1;
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].name, name) == 0) {
-            login_id = i;
-            break;
-        }
+// 等 client 連上 side port，最多 REQUEST_TIMEOUT_SEC 秒；連上的 socket 交給 session timer 一起管。
+// session 的期限放寬為兩倍，涵蓋之後的 handshake，也不會跟 poll 同時到期
+static int side_accept(int slot) {
+    session_touch(2 * REQUEST_TIMEOUT_SEC);
+    struct pollfd p = { side_fd, POLLIN, 0 };
+    if (poll(&p, 1, REQUEST_TIMEOUT_SEC * 1000) <= 0)
+        return -1;
+    int fd = accept(side_fd, NULL, NULL);
+    if (fd >= 0)
+        session_watch(slot, fd);
+    return fd;
+}
+
+// 關掉使用者的 relay / file socket，持有 users_lock 時由這個 session 的 worker 呼叫
+static void user_close_sockets(int id) {
+    session_watch(SESSION_RELAY, -1);
+    session_watch(SESSION_FILE, -1);
+    if (users[id].relay_ssl) {
+        io_ssl_close(users[id].relay_ssl);
+        users[id].relay_ssl = NULL;
+    }
+    if (users[id].file_ssl) {
+        io_ssl_close(users[id].file_ssl);
+        users[id].file_ssl = NULL;
     }
+}
+
+// 登入到一半失敗：還沒設到使用者身上的 socket 關掉，維持離線，之後可以再登入
+static int login_abort(SSL *relay_ssl, SSL *file_ssl, int r) {
+    session_watch(SESSION_RELAY, -1);
+    session_watch(SESSION_FILE, -1);
+    if (relay_ssl)
+        io_ssl_close(relay_ssl);
+    if (file_ssl)
+        io_ssl_close(file_ssl);
+    return r;
+}
+
+// Login User via SSL：持有 login_lock 時呼叫。等 side socket 與 handshake 時不持有 users_lock，
+// 已登入使用者的 request 不會被正在登入的人卡住；全部建好後才在 users_lock 裡一次設為上線
+int login_user_ssl(SSL *ssl, char* name) {
+    // 取得 login ID；登入由 login_lock 排序，之後到設為上線之前不會有別人把他設為上線
+    pthread_mutex_lock(&users_lock);
+    int login_id = user_find(name);
+    bool online = login_id != -1 && users[login_id].status;
+    pthread_mutex_unlock(&users_lock);
 
     // 排除未註冊
     if (login_id == -1) {
-        if (SSL_write(ssl, NO_REGISTER, strlen(NO_REGISTER)) <= 0) return -1;
+        if (io_ssl_write(ssl, NO_REGISTER, strlen(NO_REGISTER)) <= 0) return -1;
         return 0;
     }
 
     // 排除已登入
-    if (users[login_id].status) {
-        if (SSL_write(ssl, LOGGED_IN, strlen(LOGGED_IN)) <= 0) return -1;
+    if (online) {
+        if (io_ssl_write(ssl, LOGGED_IN, strlen(LOGGED_IN)) <= 0) return -1;
         return 0;
     }
 
-    // 更新使用者狀態
-    users[login_id].status = true;
-    users[login_id].ssl_socket = ssl;
-
     // 建立 Relay Socket
-    if (SSL_write(ssl, RELAY_SOCKET, strlen(RELAY_SOCKET)) <= 0) return -1;
+    SSL *relay_ssl = NULL, *file_ssl = NULL;
+    if (io_ssl_write(ssl, RELAY_SOCKET, strlen(RELAY_SOCKET)) <= 0) return -1;
 
     // 接受 Relay 連接
-    int relay_conn_fd = accept(side_fd, NULL, NULL);
+    io_flush();
+    int relay_conn_fd = side_accept(SESSION_RELAY);
     if (relay_conn_fd < 0) {
         printf("[Error] Accept relay socket failed\n");
-        if (SSL_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
-        return 0;
+        if (io_ssl_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return login_abort(relay_ssl, file_ssl, -1);
+        return login_abort(relay_ssl, file_ssl, 0);
     }
-    SSL *relay_ssl = SSL_new(ssl_ctx);
-    SSL_set_fd(relay_ssl, relay_conn_fd);
-    if (SSL_accept(relay_ssl) <= 0) {
-        ERR_print_errors_fp(stderr);
-        SSL_free(relay_ssl);
-        close(relay_conn_fd);
-        if (SSL_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
-        return 0;
+    relay_ssl = io_ssl_accept(ssl_ctx, relay_conn_fd);
+    if (!relay_ssl) {
+        if (io_ssl_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return login_abort(relay_ssl, file_ssl, -1);
+        return login_abort(relay_ssl, file_ssl, 0);
     }
-    users[login_id].relay_ssl = relay_ssl;
 
     // 建立 File Socket
-    if (SSL_write(ssl, FILE_SOCKET, strlen(FILE_SOCKET)) <= 0) return -1;
+    if (io_ssl_write(ssl, FILE_SOCKET, strlen(FILE_SOCKET)) <= 0) return login_abort(relay_ssl, file_ssl, -1);
 
-    int file_conn_fd = accept(side_fd, NULL, NULL);
+    io_flush();
+    int file_conn_fd = side_accept(SESSION_FILE);
     if (file_conn_fd < 0) {
         printf("[Error] Accept file socket failed\n");
-        if (SSL_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
-        return 0;
+        if (io_ssl_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return login_abort(relay_ssl, file_ssl, -1);
+        return login_abort(relay_ssl, file_ssl, 0);
     }
-    SSL *file_ssl = SSL_new(ssl_ctx);
-    SSL_set_fd(file_ssl, file_conn_fd);
-    if (SSL_accept(file_ssl) <= 0) {
-        ERR_print_errors_fp(stderr);
-        SSL_free(file_ssl);
-        close(file_conn_fd);
-        if (SSL_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
-        return 0;
+    file_ssl = io_ssl_accept(ssl_ctx, file_conn_fd);
+    if (!file_ssl) {
+        if (io_ssl_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return login_abort(relay_ssl, file_ssl, -1);
+        return login_abort(relay_ssl, file_ssl, 0);
     }
-    users[login_id].file_ssl = file_ssl;
 
     // 取得 IP
+    char ip[INET_ADDRSTRLEN];
     struct sockaddr_in cliaddr;
     socklen_t clilen = sizeof(cliaddr);
-    getpeername(SSL_get_fd(ssl), (struct sockaddr*)&cliaddr, &clilen);
-    inet_ntop(AF_INET, &cliaddr.sin_addr, users[login_id].ip, INET_ADDRSTRLEN);
+    getpeername(io_ssl_get_fd(ssl), (struct sockaddr*)&cliaddr, &clilen);
+    inet_ntop(AF_INET, &cliaddr.sin_addr, ip, INET_ADDRSTRLEN);
 
     // 取得 receiver port
-    if (SSL_write(ssl, ASK_RCVR_PORT, strlen(ASK_RCVR_PORT)) <= 0) return -1;
+    if (io_ssl_write(ssl, ASK_RCVR_PORT, strlen(ASK_RCVR_PORT)) <= 0) return login_abort(relay_ssl, file_ssl, -1);
     char buf[BUFFER_SIZE];
     memset(buf, 0, BUFFER_SIZE);
-    int bytes = SSL_read(ssl, buf, BUFFER_SIZE);
-    if (bytes <= 0) return -1;
+    int bytes = io_ssl_read(ssl, buf, BUFFER_SIZE - 1);
+    if (bytes <= 0) return login_abort(relay_ssl, file_ssl, -1);
     buf[bytes] = '\0';
+
+    // 更新使用者狀態
+    pthread_mutex_lock(&users_lock);
+    users[login_id].status = true;
+    users[login_id].ssl_socket = ssl;
+    users[login_id].relay_ssl = relay_ssl;
+    users[login_id].file_ssl = file_ssl;
+    users[login_id].file_eof = false;
+    memcpy(users[login_id].ip, ip, INET_ADDRSTRLEN);
     users[login_id].receiver_port = atoi(buf);
 
-    if (SSL_write(ssl, LOGIN_SUCCESS, strlen(LOGIN_SUCCESS)) <= 0) {
+    // 每個對話的未讀數與已讀 cursor，只讀這個人的紀錄
+    char success[BUFFER_SIZE];
+    UnreadEntry unread[MAX_USERS];
+    int n = unread_list(name, unread, MAX_USERS), len = snprintf(success, sizeof(success), "%s", LOGIN_SUCCESS);
+    for (int i = 0; i < n && len < (int)sizeof(success) - 64; i++) {
+        int peer = user_find(unread[i].peer);
+        if (peer != -1)
+            len += snprintf(success + len, sizeof(success) - len, "\n%d %lld %lld", peer,
+                            unread[i].latest - unread[i].last_read, unread[i].last_read);
+    }
+    if (io_ssl_write(ssl, success, len) <= 0) {
         users[login_id].status = false;
+        user_close_sockets(login_id);
+        pthread_mutex_unlock(&users_lock);
         return -1;
     }
 
     printf("[Login] %s\n", name);
+    presence_push(login_id);
+    roster_send(login_id);
+
+    // 自己的聯絡人，client 只 cache 這些人的位址（只有他們的變化會推過來）
+    char frame[BUFFER_SIZE], contacts[MAX_MES];
+    contact_lines(login_id, contacts, sizeof(contacts));
+    format_buffer(frame, CONTACTS, "server", name, contacts);
+    io_ssl_write(relay_ssl, frame, BUFFER_SIZE);
+
+    // 離線期間有人留下檔案
+    int pending = spool_pending(name);
+    if (pending > 0) {
+        char notice[BUFFER_SIZE], mes[MAX_MES];
+        memset(notice, 0, sizeof(notice));
+        snprintf(mes, sizeof(mes), "%d file(s)", pending);
+        format_buffer(notice, IS_SPOOL, "server", name, mes);
+        io_ssl_write(relay_ssl, notice, BUFFER_SIZE);
+    }
+    pthread_mutex_unlock(&users_lock);
 
     return 1;
 }
 
-// Handle Logged In User via SSL
+// Handle Logged In User via SSL：不論登出、斷線或逾時，最後都設為離線
 int handle_user_ssl(SSL *ssl, char* username) {
+    int r = user_requests_ssl(ssl, username);
+
+    // 將使用者狀態設為離線
+    pthread_mutex_lock(&users_lock);
+    int i = user_find(username);
+    if (i != -1) {
+        users[i].status = false;
+        offer_drop_user(i);
+        presence_push(i);
+        user_close_sockets(i);
+    }
+    pthread_mutex_unlock(&users_lock);
+
+    return r;
+}
+
+// 登入後的 request，登出時回傳 1，斷線或出錯時回傳 -1
+int user_requests_ssl(SSL *ssl, char* username) {
     char buf[BUFFER_SIZE];
 
     while (true) {
         memset(buf, 0, BUFFER_SIZE);
-        int bytes = SSL_read(ssl, buf, BUFFER_SIZE);
+        reply_tag[0] = '\0';
+        session_touch(SESSION_IDLE_SEC);
+        int bytes = io_ssl_read(ssl, buf, BUFFER_SIZE - 1);
         if (bytes <= 0) {
             printf("[Error] SSL_read wrong in handle_user for %s\n", username);
-            break;
+            return -1;
         }
         buf[bytes] = '\0';
 
+        // pipelined request："req <seq> <指令與參數>"，去掉前綴後照一般指令處理，回覆都加上 "rep <seq> "
+        if (strncmp(buf, PIPE_REQ, strlen(PIPE_REQ)) == 0) {
+            int seq, skip = 0;
+            if (sscanf(buf + strlen(PIPE_REQ), "%d %n", &seq, &skip) != 1 || skip == 0) {
+                if (io_ssl_write(ssl, UNKNOWN, strlen(UNKNOWN)) <= 0)
+                    return -1;
+                continue;
+            }
+            snprintf(reply_tag, sizeof(reply_tag), "%s%d ", PIPE_REP, seq);
+            bytes -= strlen(PIPE_REQ) + skip;
+            memmove(buf, buf + strlen(PIPE_REQ) + skip, bytes + 1);
+        }
+
         int r; // 功能 function 的 Return 值
-        if (strncmp(buf, STREAM_CMD, strlen(STREAM_CMD)) == 0) {
+        if (reply_tag[0] && strncmp(buf, STREAM_CMD, strlen(STREAM_CMD)) == 0) {
+            // streaming 會接著佔用這個 socket，只能 lockstep
+            const char *err = "ERROR Streaming can't be pipelined";
+            if (reply_ssl(ssl, err, strlen(err)) <= 0)
+                return -1;
+        } else if (strncmp(buf, STREAM_CMD, strlen(STREAM_CMD)) == 0) {
             // 解析文件名
             char filename[BUFFER_SIZE];
             if (sscanf(buf + strlen(STREAM_CMD) + 1, "%s", filename) != 1) {
-                if (SSL_write(ssl, "ERROR Invalid filename", strlen("ERROR Invalid filename")) <= 0)
+                if (io_ssl_write(ssl, "ERROR Invalid filename", strlen("ERROR Invalid filename")) <= 0)
+                    return -1;
+                continue;
+            }
+
+            // 檔案不存在時只回覆錯誤，每個 request 只有一個回覆
+            if (access(filename, F_OK) == -1) {
+                if (io_ssl_write(ssl, "ERROR File not found", strlen("ERROR File not found")) <= 0)
                     return -1;
                 continue;
             }
@@ -407,39 +735,69 @@ int handle_user_ssl(SSL *ssl, char* username) {
             snprintf(response, sizeof(response), "%d %s", 
                     STREAM_PORT,    // 8784
                     filename);      // "test.mp4"
-            if (SSL_write(ssl, response, strlen(response)) <= 0)
+            if (io_ssl_write(ssl, response, strlen(response)) <= 0)
                 return -1;
             
-            // 處理視頻流
+            // 處理視頻流：串流期間不讀 session socket，不算閒置
+            timer_cancel(&session_timer->timer);
             if (handle_stream_request(ssl, username, filename) < 0) {
                 printf("[Error] Streaming failed for user %s\n", username);
             }
 
-        } else if (strcmp(buf, SHOW_LIST) == 0) {       // Show online users list
+        } else if (strncmp(buf, SHOW_LIST, strlen(SHOW_LIST)) == 0) {       // Show online users list
+            int since = -1;
+            sscanf(buf + strlen(SHOW_LIST), "%d", &since);
+            if (show_user_ssl(ssl, username, since) == -1)
+                return -1;
+        } else if (strncmp(buf, ROSTER_QUERY, strlen(ROSTER_QUERY)) == 0) {  // Roster page
+            if (roster_query_ssl(ssl, buf + strlen(ROSTER_QUERY)) == -1)
+                return -1;
+
+        } else if (strncmp(buf, CONTACT_ADD, strlen(CONTACT_ADD)) == 0) {        // Add contact
+            pthread_mutex_lock(&users_lock);
+            r = contact_add_ssl(ssl, username, atoi(buf + strlen(CONTACT_ADD)));
+            pthread_mutex_unlock(&users_lock);
+            if (r == -1) return -1;
+        } else if (strncmp(buf, CONTACT_DEL, strlen(CONTACT_DEL)) == 0) {        // Remove contact
             pthread_mutex_lock(&users_lock);
-            r = show_user_ssl(ssl, username);
+            r = contact_del_ssl(ssl, username, atoi(buf + strlen(CONTACT_DEL)));
+            pthread_mutex_unlock(&users_lock);
+            if (r == -1) return -1;
+        } else if (strcmp(buf, CONTACT_LIST) == 0) {                // Contact list
+            pthread_mutex_lock(&users_lock);
+            r = contact_list_ssl(ssl, username);
             pthread_mutex_unlock(&users_lock);
             if (r == -1) return -1;
 
         } else if (strncmp(buf, RELAY_MES, strlen(RELAY_MES)) == 0) {            // Relay message
             int target_id = atoi(buf + strlen(RELAY_MES));
 
-            if (SSL_write(ssl, ASK_MES, strlen(ASK_MES)) <= 0)
-                return -1;
-
             char message[MAX_MES];
-            memset(message, 0, sizeof(message));
-            bytes = SSL_read(ssl, message, BUFFER_SIZE);
-            if (bytes <= 0)
+            if (read_arg_ssl(ssl, buf, ASK_MES, message, sizeof(message)) == -1)
                 return -1;
-            message[bytes] = '\0';
 
             printf("Message from %s to ID-%d: %s\n", username, target_id, message);
 
+            char target[MAX_NAME];
             pthread_mutex_lock(&users_lock);
             r = relay_user_ssl(ssl, username, target_id, message);
+            if (r == 1)
+                memcpy(target, users[target_id].name, MAX_NAME);
             pthread_mutex_unlock(&users_lock);
             if (r == -1) return -1;
+
+            // 送達的訊息存進歷史，寫檔時不持有 users_lock；對方多一則未讀，再排進全文索引的佇列，
+            // 由背景的 indexer 處理
+            if (r == 1) {
+                time_t now = time(NULL);
+                long long seq = history_append(username, target, username, message, now);
+                if (seq == -1) {
+                    printf("[Error] Can't save history for %s and %s\n", username, target);
+                } else {
+                    unread_message(username, target, seq);
+                    search_add(username, target, seq, username, now, message);
+                }
+            }
         } else if (strncmp(buf, DIRECT_MES, strlen(DIRECT_MES)) == 0) {       // Direct Message
             int target_id = atoi(buf + strlen(DIRECT_MES));
             pthread_mutex_lock(&users_lock);
@@ -449,15 +807,9 @@ int handle_user_ssl(SSL *ssl, char* username) {
         } else if (strncmp(buf, FILE_TRANSFER, strlen(FILE_TRANSFER)) == 0) {       // File Transfer
             int target_id = atoi(buf + strlen(FILE_TRANSFER));
 
-            if (SSL_write(ssl, ASK_FILE_NAME, strlen(ASK_FILE_NAME)) <= 0)
-                return -1;
-
             char filename[MAX_MES];
-            memset(filename, 0, sizeof(filename));
-            bytes = SSL_read(ssl, filename, BUFFER_SIZE);
-            if (bytes <= 0)
+            if (read_arg_ssl(ssl, buf, ASK_FILE_NAME, filename, sizeof(filename)) == -1)
                 return -1;
-            filename[bytes] = '\0';
 
             printf("File from %s to ID-%d: %s\n", username, target_id, filename);
 
@@ -465,9 +817,65 @@ int handle_user_ssl(SSL *ssl, char* username) {
             r = file_user_ssl(ssl, username, target_id, filename);
             pthread_mutex_unlock(&users_lock);
             if (r == -1) return -1;
+        } else if (strncmp(buf, MULTI_FILE, strlen(MULTI_FILE)) == 0) {          // File to several users
+            char targets[BUFFER_SIZE];
+            strncpy(targets, buf + strlen(MULTI_FILE), BUFFER_SIZE - 1);
+            targets[BUFFER_SIZE - 1] = '\0';
+            targets[strcspn(targets, " ")] = '\0';
+
+            char filename[MAX_MES];
+            if (read_arg_ssl(ssl, buf, ASK_FILE_NAME, filename, sizeof(filename)) == -1)
+                return -1;
+
+            printf("File from %s to IDs %s: %s\n", username, targets, filename);
+
+            pthread_mutex_lock(&users_lock);
+            r = multi_file_user_ssl(ssl, username, targets, filename);
+            pthread_mutex_unlock(&users_lock);
+            if (r == -1) return -1;
+        } else if (strncmp(buf, SPOOL_FILE, strlen(SPOOL_FILE)) == 0) {          // Spool file
+            int target_id = atoi(buf + strlen(SPOOL_FILE));
+
+            char filename[MAX_MES];
+            if (read_arg_ssl(ssl, buf, ASK_FILE_NAME, filename, sizeof(filename)) == -1)
+                return -1;
+
+            printf("Spool file from %s to ID-%d: %s\n", username, target_id, filename);
+
+            pthread_mutex_lock(&users_lock);
+            r = spool_user_ssl(ssl, username, target_id, filename);
+            pthread_mutex_unlock(&users_lock);
+            if (r == -1) return -1;
+        } else if (strcmp(buf, SPOOL_LIST) == 0) {                 // Spooled files
+            char list[BUFFER_SIZE];
+            if (spool_list(username, list, sizeof(list)) == 0)
+                strcpy(list, NO_SPOOL);
+            if (reply_ssl(ssl, list, strlen(list)) <= 0)
+                return -1;
+        } else if (strncmp(buf, SPOOL_GET, strlen(SPOOL_GET)) == 0) {            // Download spooled file
+            if (spool_get_ssl(ssl, username, atoi(buf + strlen(SPOOL_GET))) == -1)
+                return -1;
+        } else if (strncmp(buf, HISTORY, strlen(HISTORY)) == 0) {            // Chat history
+            if (history_ssl(ssl, username, buf + strlen(HISTORY)) == -1)
+                return -1;
+        } else if (strncmp(buf, MARK_READ, strlen(MARK_READ)) == 0) {       // Mark as read
+            if (mark_read_ssl(ssl, username, buf + strlen(MARK_READ)) == -1)
+                return -1;
+        } else if (strncmp(buf, SEARCH, strlen(SEARCH)) == 0) {             // Search messages
+            if (search_ssl(ssl, username, buf + strlen(SEARCH)) == -1)
+                return -1;
+        } else if (strcmp(buf, XFER_STATS) == 0) {                 // Transfer status
+            char stats[BUFFER_SIZE];
+            if (xfer_stats(stats, sizeof(stats)) == 0)
+                strcpy(stats, "No transfers\n");
+            if (reply_ssl(ssl, stats, strlen(stats)) <= 0)
+                return -1;
+        } else if (strcmp(buf, PING) == 0) {                       // Heartbeat
+            if (reply_ssl(ssl, PONG, strlen(PONG)) <= 0)
+                return -1;
         } else if (strcmp(buf, LOGOUT) == 0) {                     // Logout
             printf("[Logout] %s\n", username);
-            break;
+            return 1;
             // Start of Selection
             } else if (strncmp(buf, STREAM_CMD, strlen(STREAM_CMD)) == 0) {
                 char *filename = buf + strlen(STREAM_CMD) + 1;  // +1 跳過空格
@@ -478,7 +886,7 @@ int handle_user_ssl(SSL *ssl, char* username) {
                 if (access(filepath, F_OK) == -1) {
                     char error_msg[BUFFER_SIZE];
                     snprintf(error_msg, BUFFER_SIZE, "ERROR: File %s not found", filename);
-                    if (SSL_write(ssl, error_msg, strlen(error_msg)) <= 0) {
+                    if (io_ssl_write(ssl, error_msg, strlen(error_msg)) <= 0) {
                         return -1;
                     }
                     continue;
@@ -491,7 +899,7 @@ int handle_user_ssl(SSL *ssl, char* username) {
                     perror("pthread_create");
                     char error_msg[BUFFER_SIZE];
                     snprintf(error_msg, BUFFER_SIZE, "ERROR: Failed to start streaming");
-                    if (SSL_write(ssl, error_msg, strlen(error_msg)) <= 0) {
+                    if (io_ssl_write(ssl, error_msg, strlen(error_msg)) <= 0) {
                         return -1;
                     }
                     free(stream_args);
@@ -500,59 +908,239 @@ int handle_user_ssl(SSL *ssl, char* username) {
                 pthread_detach(stream_thread);
 
                 // 通知客戶端開始播放
-                if (SSL_write(ssl, "STREAM_STARTED", strlen("STREAM_STARTED")) <= 0) {
+                if (io_ssl_write(ssl, "STREAM_STARTED", strlen("STREAM_STARTED")) <= 0) {
                     return -1;
                 }
 
         } else {
             printf("[Error] Unknown command: %s\n", buf);
-            if (SSL_write(ssl, UNKNOWN, strlen(UNKNOWN)) <= 0)
-                break;
+            if (reply_ssl(ssl, UNKNOWN, strlen(UNKNOWN)) <= 0)
+                return -1;
         }
     }
+}
 
-    // 將使用者狀態設為離線
-    pthread_mutex_lock(&users_lock);
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(username, users[i].name) == 0) {
-            users[i].status = false;
-            if (users[i].relay_ssl) {
-                SSL_shutdown(users[i].relay_ssl);
-                SSL_free(users[i].relay_ssl);
-                users[i].relay_ssl = NULL;
-            }
-            if (users[i].file_ssl) {
-                SSL_shutdown(users[i].file_ssl);
-                SSL_free(users[i].file_ssl);
-                users[i].file_ssl = NULL;
-            }
-            // users[i].ssl_socket = NULL;
-            break;
+// session 的回覆：pipelined request 的回覆加上 "rep <seq> "，整個回覆仍是一個 TLS record
+int reply_ssl(SSL *ssl, const char *mes, int len) {
+    if (!reply_tag[0])
+        return io_ssl_write(ssl, mes, len);
+    char out[BUFFER_SIZE];
+    int n = snprintf(out, sizeof(out), "%s%.*s", reply_tag, len, mes);
+    if (n >= (int)sizeof(out))
+        n = sizeof(out) - 1;                // client 一次最多讀 BUFFER_SIZE - 1
+    return io_ssl_write(ssl, out, n);
+}
+
+// 指令後面的參數（訊息、offer）：pipelined request 在同一個 frame 的第一個空白之後，
+// lockstep 的 request 先回覆 ask 再讀下一個 frame，最多等 REQUEST_TIMEOUT_SEC 秒
+int read_arg_ssl(SSL *ssl, const char *buf, const char *ask, char *out, int len) {
+    if (reply_tag[0]) {
+        const char *arg = strchr(buf, ' ');
+        snprintf(out, len, "%s", arg ? arg + 1 : "");
+        return 1;
+    }
+    if (io_ssl_write(ssl, ask, strlen(ask)) <= 0)
+        return -1;
+    session_touch(REQUEST_TIMEOUT_SEC);
+    memset(out, 0, len);
+    int bytes = io_ssl_read(ssl, out, len - 1);
+    if (bytes <= 0)
+        return -1;
+    out[bytes] = '\0';
+    return 1;
+}
+
+// Show Online Users via SSL：從 roster snapshot 產生，不持有 users_lock
+// since < 0：整份列表（舊的格式，放不下的部份截掉）；否則只回覆版本 since 之後變化的使用者，
+// 依版本排序，放不下時 more 為 1，client 以回覆的版本再問一次
+int show_user_ssl(SSL *ssl, char* username, int since) {
+    char user_info[BUFFER_SIZE];
+    RosterSnap *snap = roster_snapshot(false);
+    if (!snap) {
+        if (reply_ssl(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
+        return 0;
+    }
+
+    if (since < 0) {
+        int used = 0;
+        user_info[0] = '\0';
+        for (int i = 0; i < snap->n && used < BUFFER_SIZE; i++) {
+            const RosterItem *it = &snap->items[i];
+            used += snprintf(user_info + used, BUFFER_SIZE - used, "%2d: %s%s\n", it->id,
+                             strcmp(username, it->name) == 0 ? "YOU " : it->online ? " *  " : "    ",
+                             it->name);
         }
+    } else {
+        // 留一些空間給 pipelined 回覆的前綴與標頭
+        char lines[BUFFER_SIZE - 64];
+        int version;
+        int more = roster_since(snap, since, lines, sizeof(lines), &version);
+        snprintf(user_info, sizeof(user_info), "%s %d %d\n%s", ROSTER, version, more, lines);
     }
-    pthread_mutex_unlock(&users_lock);
+    roster_release(snap);
 
+    if (reply_ssl(ssl, user_info, strlen(user_info)) <= 0)
+        return -1;
     return 1;
 }
 
-// Show Online Users via SSL
-int show_user_ssl(SSL *ssl, char* username) {
-    char user_info[BUFFER_SIZE];
-    memset(user_info, 0, sizeof(user_info));
-    for (int i = 0; i < user_count; i++) {
-        sprintf(user_info + strlen(user_info), "%2d: ", i);
-        if (strcmp(username, users[i].name) == 0)
-            sprintf(user_info + strlen(user_info), "YOU ");
-        else if (users[i].status)
-            sprintf(user_info + strlen(user_info), " *  ");
-        else
-            sprintf(user_info + strlen(user_info), "    ");
-        sprintf(user_info + strlen(user_info), "%s\n", users[i].name);
+// Roster Page via SSL："roster_query <page> <0|1 只看在線的> [名稱開頭]"
+// 回覆 "roster_page <version> <page> <符合的人數>\n" 加上依名稱排序的一頁
+int roster_query_ssl(SSL *ssl, const char *args) {
+    int page = 0, online = 0;
+    char prefix[MAX_NAME] = "";
+    if (sscanf(args, "%d %d %15s", &page, &online, prefix) < 2) {
+        if (reply_ssl(ssl, UNKNOWN, strlen(UNKNOWN)) <= 0) return -1;
+        return 0;
     }
+    RosterSnap *snap = roster_snapshot(false);
+    if (!snap) {
+        if (reply_ssl(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
+        return 0;
+    }
+
+    char lines[BUFFER_SIZE - 64], reply[BUFFER_SIZE];
+    int total;
+    roster_page(snap, page, online != 0, prefix, lines, sizeof(lines), &total);
+    snprintf(reply, sizeof(reply), "%s %d %d %d\n%s", ROSTER_PAGE_REP, snap->version, page, total, lines);
+    roster_release(snap);
 
-    if (SSL_write(ssl, user_info, strlen(user_info)) <= 0)
+    if (reply_ssl(ssl, reply, strlen(reply)) <= 0)
         return -1;
+    return 1;
+}
+
+// Chat History via SSL："history <ID> <cursor>"
+// 回覆 "history <next cursor> <more>\n" 加上 cursor 之後的訊息，放不下時 more 為 1，client 以 next cursor 再問
+int history_ssl(SSL *ssl, char* username, const char *args) {
+    int target_id;
+    long long cursor;
+    char target[MAX_NAME] = "";
+    if (sscanf(args, "%d %lld", &target_id, &cursor) != 2) {
+        if (reply_ssl(ssl, UNKNOWN, strlen(UNKNOWN)) <= 0) return -1;
+        return 0;
+    }
+    pthread_mutex_lock(&users_lock);
+    if (target_id >= 0 && target_id < user_count)
+        memcpy(target, users[target_id].name, MAX_NAME);
+    pthread_mutex_unlock(&users_lock);
+    if (!target[0]) {
+        if (reply_ssl(ssl, NO_USER, strlen(NO_USER)) <= 0) return -1;
+        return 0;
+    }
+
+    // 留一些空間給 pipelined 回覆的前綴與標頭
+    char lines[BUFFER_SIZE - 64], reply[BUFFER_SIZE];
+    long long next;
+    int more = history_read(username, target, cursor, lines, sizeof(lines), &next);
+    if (more == -1) {
+        if (reply_ssl(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
+        return 0;
+    }
+    snprintf(reply, sizeof(reply), "%s %lld %d\n%s", HISTORY_REP, next, more, lines);
+    if (reply_ssl(ssl, reply, strlen(reply)) <= 0) return -1;
+    return 1;
+}
+
+// Mark Read via SSL："mark_read <ID> <seq>"，回覆 "unread <還沒讀的則數>"
+int mark_read_ssl(SSL *ssl, char* username, const char *args) {
+    int target_id;
+    long long seq;
+    char target[MAX_NAME] = "";
+    if (sscanf(args, "%d %lld", &target_id, &seq) != 2) {
+        if (reply_ssl(ssl, UNKNOWN, strlen(UNKNOWN)) <= 0) return -1;
+        return 0;
+    }
+    pthread_mutex_lock(&users_lock);
+    if (target_id >= 0 && target_id < user_count)
+        memcpy(target, users[target_id].name, MAX_NAME);
+    pthread_mutex_unlock(&users_lock);
+    if (!target[0]) {
+        if (reply_ssl(ssl, NO_USER, strlen(NO_USER)) <= 0) return -1;
+        return 0;
+    }
+
+    char reply[64];
+    snprintf(reply, sizeof(reply), "%s %lld", UNREAD_REP, unread_ack(username, target, seq));
+    if (reply_ssl(ssl, reply, strlen(reply)) <= 0) return -1;
+    return 1;
+}
+
+// Search via SSL："search <ID> <since> <詞...>"
+// 回覆 "search <n>\n" 加上 n 行 "<ID> <seq> <time> <from> <片段>"；片段從歷史讀出
+int search_ssl(SSL *ssl, char* username, const char *args) {
+    int target_id, off = 0;
+    long long since;
+    char target[MAX_NAME] = "";
+    if (sscanf(args, "%d %lld %n", &target_id, &since, &off) != 2 || !args[off]) {
+        if (reply_ssl(ssl, UNKNOWN, strlen(UNKNOWN)) <= 0) return -1;
+        return 0;
+    }
+    const char *query = args + off;
+    pthread_mutex_lock(&users_lock);
+    if (target_id >= 0 && target_id < user_count)
+        memcpy(target, users[target_id].name, MAX_NAME);
+    pthread_mutex_unlock(&users_lock);
+    if (target_id != -1 && !target[0]) {
+        if (reply_ssl(ssl, NO_USER, strlen(NO_USER)) <= 0) return -1;
+        return 0;
+    }
+
+    SearchHit hits[SEARCH_RESULTS];
+    int n = search_query(username, target_id == -1 ? NULL : target, since, query, hits, SEARCH_RESULTS);
+
+    // 對方的 ID 與訊息片段；留一些空間給 pipelined 回覆的前綴
+    char lines[BUFFER_SIZE - 64], reply[BUFFER_SIZE];
+    int used = 0, shown = 0;
+    for (int i = 0; i < n; i++) {
+        char line[MAX_MES + 64], snippet[SEARCH_SNIPPET] = "";
+        long long next, seq;
+        int skip = 0;
+        if (history_read(username, hits[i].peer, hits[i].seq - 1, line, sizeof(line), &next) != -1 &&
+            sscanf(line, "%lld %*s %*s %n", &seq, &skip) == 1 && seq == hits[i].seq && skip > 0) {
+            line[strcspn(line, "\n")] = '\0';
+            search_snippet(line + skip, query, snippet, sizeof(snippet));
+        }
+        pthread_mutex_lock(&users_lock);
+        int peer_id = user_find(hits[i].peer);
+        pthread_mutex_unlock(&users_lock);
+        int len = snprintf(lines + used, sizeof(lines) - used, "%d %lld %lld %s %s\n", peer_id, hits[i].seq,
+                           (long long)hits[i].time, hits[i].from, snippet);
+        if (len >= (int)sizeof(lines) - used)
+            break;
+        used += len;
+        shown++;
+    }
+    lines[used] = '\0';
+    snprintf(reply, sizeof(reply), "%s %d\n%s", SEARCH_REP, shown, lines);
+    if (reply_ssl(ssl, reply, strlen(reply)) <= 0) return -1;
+    return 1;
+}
 
+// server 啟動時，把 a、b 之間還沒建索引的歷史訊息排進全文索引
+int search_recover(const char *a, const char *b, void *arg) {
+    (void)arg;
+    char page[BUFFER_SIZE];
+    long long cursor = search_indexed(a, b), next;
+    int more;
+    do {
+        more = history_read(a, b, cursor, page, sizeof(page), &next);
+        if (more == -1)
+            return 0;
+        for (char *line = page, *end; *line; line = end + 1) {
+            end = line + strcspn(line, "\n");
+            char from[MAX_NAME];
+            long long seq, t;
+            int skip = 0;
+            bool last = !*end;
+            *end = '\0';
+            if (sscanf(line, "%lld %lld %15s %n", &seq, &t, from, &skip) == 3 && skip > 0)
+                search_add(a, b, seq, from, t, line + skip);
+            if (last)
+                break;
+        }
+        cursor = next;
+    } while (more == 1);
     return 1;
 }
 
@@ -560,7 +1148,7 @@ int show_user_ssl(SSL *ssl, char* username) {
 int relay_user_ssl(SSL *ssl, char* username, int targetID, char *message) {
     // 排除不在線
     if (targetID < 0 || targetID >= user_count || users[targetID].status == false) {
-        if (SSL_write(ssl, OFFLINE, strlen(OFFLINE)) <= 0) return -1;
+        if (reply_ssl(ssl, OFFLINE, strlen(OFFLINE)) <= 0) return -1;
         return 0;
     } 
 
@@ -569,11 +1157,11 @@ int relay_user_ssl(SSL *ssl, char* username, int targetID, char *message) {
     memset(to_receiver, 0, sizeof(to_receiver));
     format_buffer(to_receiver, IS_MES, username, "", message);
 
-    if (SSL_write(users[targetID].relay_ssl, to_receiver, BUFFER_SIZE) <= 0) {
-        if (SSL_write(ssl, MES_FAIL, strlen(MES_FAIL)) <= 0) return -1;
+    if (io_ssl_write(users[targetID].relay_ssl, to_receiver, BUFFER_SIZE) <= 0) {
+        if (reply_ssl(ssl, MES_FAIL, strlen(MES_FAIL)) <= 0) return -1;
         return 0;
     } else {
-        if (SSL_write(ssl, MES_SUCCESS, strlen(MES_SUCCESS)) <= 0) return -1;
+        if (reply_ssl(ssl, MES_SUCCESS, strlen(MES_SUCCESS)) <= 0) return -1;
         return 1;
     }
 }
@@ -583,7 +1171,7 @@ int direct_user_ssl(SSL *ssl, char* username, int targetID) {
     (void)username;  // 避免未使用參數的警告
     // 排除不在線
     if (targetID < 0 || targetID >= user_count || users[targetID].status == false) {
-        if (SSL_write(ssl, OFFLINE, strlen(OFFLINE)) <= 0) return -1;
+        if (reply_ssl(ssl, OFFLINE, strlen(OFFLINE)) <= 0) return -1;
         return 0;
     }
 
@@ -591,73 +1179,736 @@ int direct_user_ssl(SSL *ssl, char* username, int targetID) {
     char to_client[BUFFER_SIZE];
     memset(to_client, 0, BUFFER_SIZE);
     sprintf(to_client, "%s %d", users[targetID].ip, users[targetID].receiver_port);
-    if (SSL_write(ssl, to_client, strlen(to_client)) <= 0)
+    if (reply_ssl(ssl, to_client, strlen(to_client)) <= 0)
         return -1;
 
     return 1;
 }
 
-// File Transfer via SSL
+// File Transfer via SSL：只登記 offer 並通知接收端，立刻回覆 "offer_pending <offer ID> 1"
+// 接收端的回答由 offer thread 處理，結果從傳送端的 file socket 送回
 int file_user_ssl(SSL *ssl, char* username, int targetID, char *filename) {
     // 排除不在線
     if (targetID < 0 || targetID >= user_count || users[targetID].status == false) {
-        if (SSL_write(ssl, OFFLINE, strlen(OFFLINE)) <= 0) return -1;
+        if (reply_ssl(ssl, OFFLINE, strlen(OFFLINE)) <= 0) return -1;
         return 0;
     }
 
-    // 傳檔案
-    char buf[BUFFER_SIZE];
-    char to_receiver[BUFFER_SIZE];
-    memset(to_receiver, 0, sizeof(to_receiver));
-    format_buffer(to_receiver, IS_FILE, username, "", filename);
+    char ids[16];
+    snprintf(ids, sizeof(ids), "%d", targetID);
+    return multi_file_user_ssl(ssl, username, ids, filename);
+}
 
-    if (SSL_write(users[targetID].file_ssl, to_receiver, BUFFER_SIZE) <= 0) {
-        if (SSL_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
+// File to Several Users via SSL：targets 為以逗號分隔的 ID
+// 對所有人發出同一個 offer，全部回覆或逾時後，上傳只做一次，由 transfer engine 分送給每個接受的人
+int multi_file_user_ssl(SSL *ssl, char* username, char *targets, char *filename) {
+    Offer *o = NULL;
+    for (int i = 0; i < OFFER_MAX && !o; i++)
+        if (offers[i].id == 0)
+            o = &offers[i];
+    if (!o) {
+        if (reply_ssl(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
         return 0;
-    } 
+    }
 
-    // 等待對方回應
-    memset(buf, 0, BUFFER_SIZE);
-    int bytes = SSL_read(users[targetID].file_ssl, buf, BUFFER_SIZE - 1);
-    if (bytes <= 0) {
-        if (SSL_write(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
+    // timer 不跟著清：上一個 offer 的 callback 可能正在重試（offer_expire 拿不到 users_lock 時重新設定），
+    // 之後以 users_lock 檢查這格現在的 offer，不會提早結束新的 offer
+    timer_cancel(&offer_timers[o - offers]);
+    memset(o, 0, sizeof(*o));
+    o->id = next_offer_id;
+    o->multi = strchr(targets, ',') != NULL;
+    strncpy(o->from, username, MAX_NAME - 1);
+    strncpy(o->filename, filename, MAX_MES - 1);
+    for (int i = 0; i < user_count; i++)
+        if (strcmp(users[i].name, username) == 0)
+            o->from_id = i;
+
+    // 接收端看到的 mes 為 "<offer ID> 檔名 大小 [附加欄位]"
+    char mes[MAX_MES];
+    snprintf(mes, sizeof(mes), "%d %s", o->id, filename);
+    char *save;
+    for (char *tok = strtok_r(targets, ",", &save); tok && o->n < XFER_FANOUT_MAX; tok = strtok_r(NULL, ",", &save)) {
+        int id = atoi(tok);
+        bool dup = false;
+        for (int i = 0; i < o->n; i++)
+            dup = dup || o->to_id[i] == id;
+        if (dup || id < 0 || id >= user_count || users[id].status == false ||
+            (o->multi && strcmp(users[id].name, username) == 0))
+            continue;
+        if (offer_send(id, IS_FILE, username, mes) == 1)
+            o->to_id[o->n++] = id;
+    }
+    if (o->n == 0) {
+        o->id = 0;
+        if (reply_ssl(ssl, o->multi ? OFFLINE : FILE_FAIL, strlen(o->multi ? OFFLINE : FILE_FAIL)) <= 0)
+            return -1;
         return 0;
     }
-    buf[bytes] = '\0';
+    next_offer_id++;
+    o->deadline = time(NULL) + OFFER_TIMEOUT;
+    timer_arm(&offer_timers[o - offers], OFFER_TIMEOUT * 1000);
+
+    char reply[BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "%s %d %d", OFFER_PENDING, o->id, o->n);
+    if (reply_ssl(ssl, reply, strlen(reply)) <= 0) return -1;
+    return 1;
+}
 
-    if (strcmp(buf, REJECT_FILE) == 0) {
-        if (SSL_write(ssl, REJECT_FILE, strlen(REJECT_FILE)) <= 0) return -1;
+//--- SESSION TIMER ---//
+// timer wheel 的 thread 呼叫：期間內沒有被 session_touch 重設，就 shutdown 這個 session 的所有 socket
+void session_expire(void *arg) {
+    SessionTimer *st = (SessionTimer*)arg;
+    pthread_mutex_lock(&st->lock);
+    if (st->fds[SESSION_MAIN] >= 0 && !timer_pending(&st->timer)) {
+        printf("[Timeout] Session idle too long, closing\n");
+        for (int k = 0; k < SESSION_FDS; k++)
+            if (st->fds[k] >= 0)
+                shutdown(st->fds[k], SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+// 這個 worker 的 session 在 sec 秒內要有下一個動作；每次讀 request 前重設
+void session_touch(int sec) {
+    timer_arm(&session_timer->timer, sec * 1000);
+}
+
+// 把 session 的一個 socket 交給 session timer，fd 為 -1 時不再管；存的是 dup，
+// 呼叫者關掉 fd 之前要先 session_watch(slot, -1)，socket 才會真的關閉
+void session_watch(int slot, int fd) {
+    int copy = fd >= 0 ? dup(fd) : -1;
+    pthread_mutex_lock(&session_timer->lock);
+    if (session_timer->fds[slot] >= 0)
+        close(session_timer->fds[slot]);
+    session_timer->fds[slot] = copy;
+    pthread_mutex_unlock(&session_timer->lock);
+}
+
+//--- ADMISSION ---//
+static uint64_t mono_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 以下到 admit_reject 之前都在持有 queue_lock 時呼叫
+
+// 量到一次等待時間：低於目標就回到正常；持續超過目標 ADMIT_INTERVAL_MS 才算過載，短暫的尖峰不算
+void admit_update(uint64_t now, uint64_t delay) {
+    admit.delay = delay;
+    if (delay < ADMIT_TARGET_MS) {
+        admit.above_since = 0;
+        admit.dropping = false;
+    } else if (admit.above_since == 0) {
+        admit.above_since = now;
+    } else if (now - admit.above_since >= ADMIT_INTERVAL_MS) {
+        admit.dropping = true;
+    }
+}
+
+// 建議 client 幾秒後再連：積壓越久、CPU 越滿就越長，避免大家同時回來
+int admit_retry() {
+    int sec = ADMIT_RETRY_SEC + (int)(admit.delay / 1000);
+    if (admit.cpu >= ADMIT_CPU_MAX)
+        sec += ADMIT_RETRY_SEC;
+    return sec < ADMIT_RETRY_MAX ? sec : ADMIT_RETRY_MAX;
+}
+
+// 新連線：收得下就放進佇列並回傳 0，否則回傳建議的重試秒數，由呼叫者放開 lock 後 admit_reject
+int admit_check(int fd) {
+    uint64_t now = mono_ms();
+    if (queue_count > 0)
+        admit_update(now, now - task_queue[queue_front].since);
+    if (queue_count >= QUEUE_SIZE || admit.dropping || admit.cpu >= ADMIT_CPU_MAX) {
+        admit.shed++;
+        return admit_retry();
+    }
+    task_queue[queue_rear].fd = fd;
+    task_queue[queue_rear].since = now;
+    queue_rear = (queue_rear + 1) % QUEUE_SIZE;
+    queue_count++;
+    pthread_cond_signal(&queue_not_empty);
+    return 0;
+}
+
+// 不做 handshake，回覆明文的 "SERVER_BUSY <秒>" 後關閉；不會阻塞
+void admit_reject(int fd, int sec) {
+    char msg[SIGNAL_SIZE];
+    int len = snprintf(msg, sizeof(msg), "%s %d", SERVER_BUSY, sec);
+    send(fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    // client 已送來的 ClientHello 先讀掉，close 時才不會送出 RST 把回覆蓋掉
+    char drain[BUFFER_SIZE];
+    while (recv(fd, drain, sizeof(drain), MSG_DONTWAIT) > 0)
+        ;
+    close(fd);
+}
+
+// 有連線在等 worker，或已經過載
+bool admit_pressure() {
+    pthread_mutex_lock(&queue_lock);
+    bool busy = queue_count > 0 || admit.dropping || admit.cpu >= ADMIT_CPU_MAX;
+    pthread_mutex_unlock(&queue_lock);
+    return busy;
+}
+
+// 整台機器的 CPU 使用率（%），從上一次呼叫到現在；讀不到時回傳 0，不以 CPU 拒絕連線
+static int cpu_busy() {
+    static unsigned long long last_idle, last_total;
+    unsigned long long v[8] = { 0 }, idle, total = 0;
+    FILE *f = fopen("/proc/stat", "r");
+    if (!f)
+        return 0;
+    int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+    fclose(f);
+    if (n < 4)
         return 0;
-    } else if (strcmp(buf, ACCEPT_FILE) == 0) {
-        if (SSL_write(ssl, ACCEPT_FILE, strlen(ACCEPT_FILE)) <= 0) return -1;
+    for (int i = 0; i < 8; i++)
+        total += v[i];
+    idle = v[3] + v[4];                // idle + iowait
+    int busy = 0;
+    if (last_total && total > last_total)
+        busy = (int)(100 - (idle - last_idle) * 100 / (total - last_total));
+    last_idle = idle;
+    last_total = total;
+    return busy;
+}
 
-        // 假設傳檔案過程不會斷線（不處理）
-        while (true) {
-            memset(buf, 0, sizeof(buf));
-            bytes = SSL_read(ssl, buf, BUFFER_SIZE - 1);
-            if (bytes <= 0) {
-                printf("[Error] SSL_read during file transfer\n");
-                break;
+// timer wheel 的 thread 每 ADMIT_SAMPLE_MS 呼叫：更新 CPU 使用率；沒有 worker 空出來時佇列的頭不會被取出，
+// 這裡也量一次等待時間，過載時把等超過 ADMIT_INTERVAL_MS 的連線回覆 SERVER_BUSY，不讓它們一直等
+void admit_sample(void *arg) {
+    (void)arg;
+    int cpu = cpu_busy();
+    int shed_fds[QUEUE_SIZE], nshed = 0, retry = 0;
+
+    pthread_mutex_lock(&queue_lock);
+    admit.cpu = cpu;
+    uint64_t now = mono_ms();
+    if (queue_count > 0)
+        admit_update(now, now - task_queue[queue_front].since);
+    if (admit.dropping) {
+        retry = admit_retry();
+        while (queue_count > 0 && now - task_queue[queue_front].since >= ADMIT_INTERVAL_MS) {
+            shed_fds[nshed++] = task_queue[queue_front].fd;
+            queue_front = (queue_front + 1) % QUEUE_SIZE;
+            queue_count--;
+        }
+    }
+    admit.shed += nshed;
+    if (admit.shed > 0)
+        printf("[Busy] Turned away %ld connection(s): queue %d, delay %llu ms, cpu %d%%\n",
+               admit.shed, queue_count, (unsigned long long)admit.delay, admit.cpu);
+    admit.shed = 0;
+    pthread_mutex_unlock(&queue_lock);
+
+    for (int i = 0; i < nshed; i++)
+        admit_reject(shed_fds[i], retry);
+    timer_arm(&admit_timer, ADMIT_SAMPLE_MS);
+}
+
+//--- FILE OFFER ---//
+// 以下都在持有 users_lock 時呼叫
+
+// 從 file socket 送一個 frame 給在線的使用者，成功回傳 1
+int offer_send(int uid, const char *signal, const char *from, const char *mes) {
+    if (uid < 0 || uid >= user_count || !users[uid].status || !users[uid].file_ssl)
+        return 0;
+    char frame[BUFFER_SIZE];
+    format_buffer(frame, signal, from, users[uid].name, mes);
+    return io_ssl_write(users[uid].file_ssl, frame, BUFFER_SIZE) > 0 ? 1 : 0;
+}
+
+// 所有人都回覆或逾時：建立傳輸並通知兩端
+void offer_finish(Offer *o) {
+    char mes[MAX_MES];
+    char to[XFER_FANOUT_MAX][MAX_NAME];
+    int accepted[XFER_FANOUT_MAX], naccepted = 0;
+    bool expired = false;
+    for (int i = 0; i < o->n; i++) {
+        if (o->answer[i] == 1) {
+            strcpy(to[naccepted], users[o->to_id[i]].name);
+            accepted[naccepted++] = o->to_id[i];
+        }
+        expired = expired || o->answer[i] == 0;
+    }
+
+    // 傳送端已經離線，接受的人不會等到資料
+    bool sender = users[o->from_id].status && strcmp(users[o->from_id].name, o->from) == 0;
+    snprintf(mes, sizeof(mes), "%d", o->id);
+    if (!sender || naccepted == 0) {
+        for (int i = 0; i < naccepted; i++)
+            offer_send(accepted[i], FILE_FAIL, o->from, mes);
+        if (sender)
+            offer_send(o->from_id, expired ? OFFER_EXPIRED : REJECT_FILE, "server", mes);
+        printf("[Offer] #%d from %s: %s\n", o->id, o->from,
+               !sender ? "sender left" : expired ? "expired" : "rejected");
+        o->id = 0;
+        timer_cancel(&offer_timers[o - offers]);
+        return;
+    }
+
+    char name[MAX_MES];
+    long long size = 0;
+    if (sscanf(o->filename, "%s %lld", name, &size) < 1)
+        strcpy(name, o->filename);
+
+    char token[XFER_TOKEN_LEN + 1], tokens[XFER_FANOUT_MAX][XFER_TOKEN_LEN + 1];
+    char psk[P2P_PSK_LEN + 1] = "";
+    int xfer_id;
+    if (o->multi) {
+        xfer_id = xfer_create_fanout(o->from, to, naccepted, name, size, token, tokens);
+    } else {
+        xfer_id = xfer_create(o->from, to[0], name, size, token);
+        strcpy(tokens[0], token);
+        // 接收端有 receiver port 時，附上一次性的 PSK 讓兩端先嘗試直接連線，
+        // 失敗時兩端再各自連到 FILE_PORT，由 transfer engine 轉送
+        if (xfer_id >= 0 && users[accepted[0]].receiver_port > 0)
+            xfer_random_hex(psk, P2P_PSK_LEN);
+    }
+
+    // 接收端："<offer ID> <xfer ID> <token> [<PSK>]"
+    for (int i = 0; i < naccepted; i++) {
+        if (xfer_id < 0) {
+            offer_send(accepted[i], FILE_FAIL, o->from, mes);
+            continue;
+        }
+        snprintf(mes, sizeof(mes), "%d %d %s %s", o->id, xfer_id, tokens[i], psk);
+        offer_send(accepted[i], XFER_ID, o->from, mes);
+    }
+
+    // 傳送端：單一接收端 "<offer ID> <xfer ID> <token> [<IP> <port> <PSK>]"
+    //         多個接收端 "<offer ID> <xfer ID> <token> <接受人數>/<邀請人數>"
+    if (xfer_id < 0) {
+        snprintf(mes, sizeof(mes), "%d", o->id);
+        offer_send(o->from_id, FILE_FAIL, "server", mes);
+    } else if (o->multi) {
+        snprintf(mes, sizeof(mes), "%d %d %s %d/%d", o->id, xfer_id, token, naccepted, o->n);
+        offer_send(o->from_id, ACCEPT_FILE, "server", mes);
+    } else if (psk[0]) {
+        snprintf(mes, sizeof(mes), "%d %d %s %s %d %s", o->id, xfer_id, token,
+                 users[accepted[0]].ip, users[accepted[0]].receiver_port, psk);
+        offer_send(o->from_id, ACCEPT_FILE, "server", mes);
+    } else {
+        snprintf(mes, sizeof(mes), "%d %d %s", o->id, xfer_id, token);
+        offer_send(o->from_id, ACCEPT_FILE, "server", mes);
+    }
+    printf("[Offer] #%d from %s: accepted by %d/%d, transfer #%d\n", o->id, o->from, naccepted, o->n, xfer_id);
+    o->id = 0;
+    timer_cancel(&offer_timers[o - offers]);
+}
+
+// 記下一個回覆，所有人都回覆後完成 offer
+void offer_decide(Offer *o, int uid, int answer) {
+    bool done = true;
+    for (int i = 0; i < o->n; i++) {
+        if (o->to_id[i] == uid && o->answer[i] == 0)
+            o->answer[i] = answer;
+        done = done && o->answer[i] != 0;
+    }
+    if (done)
+        offer_finish(o);
+}
+
+// 接收端從 file socket 送來 "accept_file <offer ID>" 或 "reject_file <offer ID>"
+void offer_answer(int uid, const char *buf) {
+    int answer = strncmp(buf, ACCEPT_FILE, strlen(ACCEPT_FILE)) == 0 ? 1 :
+                 strncmp(buf, REJECT_FILE, strlen(REJECT_FILE)) == 0 ? -1 : 0;
+    const char *arg = strchr(buf, ' ');
+    if (answer == 0 || !arg) {
+        printf("[Error] Unknown answer from %s: %s\n", users[uid].name, buf);
+        return;
+    }
+    int offer_id = atoi(arg + 1);
+
+    for (int i = 0; i < OFFER_MAX; i++) {
+        if (offers[i].id != offer_id)
+            continue;
+        for (int j = 0; j < offers[i].n; j++) {
+            if (offers[i].to_id[j] == uid) {
+                offer_decide(&offers[i], uid, answer);
+                return;
             }
-            buf[bytes] = '\0';
-            SSL_write(users[targetID].file_ssl, buf, bytes);
-            if (strcmp(buf, END_OF_FILE) == 0)
-                break;
-            memset(buf, 0, sizeof(buf));
-            bytes = SSL_read(users[targetID].file_ssl, buf, BUFFER_SIZE - 1);
-            if (bytes <= 0) {
-                printf("[Error] SSL_read during file transfer\n");
+        }
+    }
+
+    // offer 已逾時或已取消
+    if (answer == 1) {
+        char mes[MAX_MES];
+        snprintf(mes, sizeof(mes), "%d", offer_id);
+        offer_send(uid, FILE_FAIL, "server", mes);
+    }
+}
+
+// 使用者離線：他發出的 offer 取消，他還沒回覆的 offer 視為拒絕
+void offer_drop_user(int uid) {
+    for (int i = 0; i < OFFER_MAX; i++) {
+        if (offers[i].id == 0)
+            continue;
+        if (offers[i].from_id == uid) {
+            for (int j = 0; j < offers[i].n; j++)
+                offers[i].answer[j] = offers[i].answer[j] == 0 ? -1 : offers[i].answer[j];
+            offer_finish(&offers[i]);
+        } else {
+            offer_decide(&offers[i], uid, -1);
+        }
+    }
+}
+
+// offer 的 timer 到期，在 timer wheel 的 thread 呼叫：以已接受的人完成。
+// wheel thread 不能等 users_lock（持有時可能在寫給很慢的 client），拿不到就下一個 tick 再試；
+// 這格已經換成新的 offer 時，照新的 deadline 重新設定
+void offer_expire(void *arg) {
+    Offer *o = (Offer*)arg;
+    Timer *t = &offer_timers[o - offers];
+    if (pthread_mutex_trylock(&users_lock) != 0) {
+        timer_arm(t, TIMER_TICK_MS);
+        return;
+    }
+    time_t now = time(NULL);
+    if (o->id != 0 && now >= o->deadline)
+        offer_finish(o);
+    else if (o->id != 0 && !timer_pending(t))
+        timer_arm(t, (o->deadline - now) * 1000);
+    pthread_mutex_unlock(&users_lock);
+}
+
+// Offer Thread：收所有 file socket 上的回答
+void *offer_thread(void *arg) {
+    (void)arg;
+    while (!stop_flag) {
+        struct pollfd fds[MAX_USERS];
+        int ids[MAX_USERS], n = 0;
+
+        pthread_mutex_lock(&users_lock);
+        for (int i = 0; i < user_count; i++) {
+            if (!users[i].status || !users[i].file_ssl || users[i].file_eof)
+                continue;
+            fds[n].fd = io_ssl_get_fd(users[i].file_ssl);
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            ids[n++] = i;
+        }
+        pthread_mutex_unlock(&users_lock);
+
+        // 新登入的使用者最晚一秒後加入；TLS 緩衝裡剩下的只有不完整的 record，等 socket 再可讀
+        poll(fds, n, 1000);
+
+        pthread_mutex_lock(&users_lock);
+        for (int k = 0; k < n; k++) {
+            int i = ids[k];
+            // poll 期間離線，或 fd 已被重新使用
+            if (!users[i].status || !users[i].file_ssl || io_ssl_get_fd(users[i].file_ssl) != fds[k].fd)
+                continue;
+            if (fds[k].revents == 0 && !io_ssl_pending(users[i].file_ssl))
+                continue;
+
+            // 持有 users_lock，不能等 client：讀到沒有完整的 record 為止，半個 record 留到下次可讀
+            char buf[BUFFER_SIZE];
+            int bytes;
+            while ((bytes = io_ssl_try_read(users[i].file_ssl, buf, BUFFER_SIZE - 1)) > 0) {
+                buf[bytes] = '\0';
+                offer_answer(i, buf);
+            }
+            if (bytes < 0)
+                users[i].file_eof = true;
+        }
+        pthread_mutex_unlock(&users_lock);
+    }
+    return NULL;
+}
+
+// Spool File via SSL：檔案先傳到 server，接收端不必在線
+int spool_user_ssl(SSL *ssl, char* username, int targetID, char *filename) {
+    // 排除不存在
+    if (targetID < 0 || targetID >= user_count) {
+        if (reply_ssl(ssl, OFFLINE, strlen(OFFLINE)) <= 0) return -1;
+        return 0;
+    }
+
+    // spool 需要事先知道大小才能預留空間
+    char name[MAX_MES];
+    long long size;
+    if (sscanf(filename, "%s %lld", name, &size) != 2) {
+        if (reply_ssl(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
+        return 0;
+    }
+
+    SpoolEntry e;
+    int spool_id = spool_reserve(username, users[targetID].name, name, size, &e);
+    if (spool_id <= 0) {
+        const char *reply = spool_id == 0 ? SPOOL_FULL : FILE_FAIL;
+        if (reply_ssl(ssl, reply, strlen(reply)) <= 0) return -1;
+        return 0;
+    }
+
+    char token[XFER_TOKEN_LEN + 1];
+    int xfer_id = xfer_create_spool(&e, true, token);
+    if (xfer_id < 0) {
+        spool_commit(spool_id, false);
+        if (reply_ssl(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
+        return 0;
+    }
+
+    char reply[BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "%s %d %s", ACCEPT_FILE, xfer_id, token);
+    if (reply_ssl(ssl, reply, strlen(reply)) <= 0) return -1;
+    return 1;
+}
+
+// Download Spooled File via SSL：回覆 "xfer_id <ID> <token> <size> <filename>"
+int spool_get_ssl(SSL *ssl, char* username, int spoolID) {
+    SpoolEntry e;
+    if (spool_checkout(spoolID, username, &e) != 1) {
+        if (reply_ssl(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
+        return 0;
+    }
+
+    char token[XFER_TOKEN_LEN + 1];
+    int xfer_id = xfer_create_spool(&e, false, token);
+    if (xfer_id < 0) {
+        spool_checkin(spoolID, false);
+        if (reply_ssl(ssl, FILE_FAIL, strlen(FILE_FAIL)) <= 0) return -1;
+        return 0;
+    }
+
+    char reply[BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "%s %d %s %lld %s", XFER_ID, xfer_id, token, e.size, e.filename);
+    if (reply_ssl(ssl, reply, strlen(reply)) <= 0) return -1;
+    return 1;
+}
+
+//--- PRESENCE ---//
+// 目前的 roster snapshot（已取得參考，用完 roster_release）；過期時從 users 重建，
+// 只有變化後的第一次查詢需要 users_lock。locked 表示呼叫者已持有 users_lock
+RosterSnap *roster_snapshot(bool locked) {
+    RosterSnap *snap = roster_acquire();
+    if (snap)
+        return snap;
+
+    if (!locked)
+        pthread_mutex_lock(&users_lock);
+    RosterItem *items = malloc((user_count > 0 ? user_count : 1) * sizeof(RosterItem));
+    if (items) {
+        for (int i = 0; i < user_count; i++) {
+            items[i].id = i;
+            items[i].online = users[i].status;
+            items[i].version = users[i].version;
+            memcpy(items[i].name, users[i].name, MAX_NAME);
+        }
+        snap = roster_build(items, user_count, roster_version);
+        free(items);
+    }
+    if (!locked)
+        pthread_mutex_unlock(&users_lock);
+    return roster_publish(snap);
+}
+
+// 以下都在持有 users_lock 時呼叫
+
+// 使用者註冊、登入或登出：版本加一，有 watcher 時排進 presence_queue，由 presence thread 送出；
+// 沒有人關心的變化只花 O(1)，roster 的其他部份由 client 以 show_list <version> 同步
+void presence_push(int uid) {
+    users[uid].version = ++roster_version;
+    roster_changed(roster_version);
+    if (users[uid].n_watchers == 0 || users[uid].presence_queued)
+        return;
+    users[uid].presence_queued = true;
+    presence_queue[presence_count++] = uid;
+    pthread_cond_signal(&presence_ready);
+}
+
+// 登入後從 relay socket 送完整的 roster，之後只推變化；
+// 每個 frame 的 mes 為 "<version>\n" 加上數行 roster，放不下就分成好幾個 frame
+void roster_send(int uid) {
+    RosterSnap *snap = roster_snapshot(true);
+    if (!snap)
+        return;
+    char frame[BUFFER_SIZE], mes[MAX_MES];
+    int head = snprintf(mes, sizeof(mes), "%d\n", snap->version), used = head;
+    for (int i = 0; i <= snap->n; i++) {
+        char line[64];
+        int len = i < snap->n ? roster_line(&snap->items[i], line, sizeof(line)) : 0;
+        if (i == snap->n || used + len >= MAX_MES) {
+            format_buffer(frame, ROSTER, "server", users[uid].name, mes);
+            if (io_ssl_write(users[uid].relay_ssl, frame, BUFFER_SIZE) <= 0)
                 break;
+            used = head;
+            mes[used] = '\0';
+        }
+        memcpy(mes + used, line, len);
+        used += len;
+        mes[used] = '\0';
+    }
+    roster_release(snap);
+}
+
+// Presence thread：等第一個變化後再等 PRESENCE_BATCH_MS，把這段時間的變化一起送出。
+// 每個在線的 watcher 收到一個 frame，mes 為數行 "<ID> <0|1> <version> <name>"（太長才分成好幾個）；
+// 成本只跟變化的人的 watcher 數有關，跟在線人數無關
+void *presence_thread(void *arg) {
+    (void)arg;
+    static char batch[MAX_USERS][MAX_MES];   // 每個 watcher 這一批的內容
+    int used[MAX_USERS] = { 0 };
+    int touched[MAX_USERS];
+
+    while (!stop_flag) {
+        pthread_mutex_lock(&users_lock);
+        while (presence_count == 0 && !stop_flag)
+            pthread_cond_wait(&presence_ready, &users_lock);
+        pthread_mutex_unlock(&users_lock);
+        usleep(PRESENCE_BATCH_MS * 1000);
+
+        pthread_mutex_lock(&users_lock);
+        int n_touched = 0;
+        char frame[BUFFER_SIZE];
+        for (int k = 0; k < presence_count; k++) {
+            User *u = &users[presence_queue[k]];
+            u->presence_queued = false;
+
+            RosterItem it = { u->id, u->status, u->version, "" };
+            memcpy(it.name, u->name, MAX_NAME);
+            char line[64];
+            int len = roster_line(&it, line, sizeof(line));
+            for (int j = 0; j < u->n_watchers; j++) {
+                int w = u->watchers[j];
+                if (!users[w].status || !users[w].relay_ssl)
+                    continue;
+                if (used[w] == 0) {
+                    touched[n_touched++] = w;
+                } else if (used[w] + len >= MAX_MES) {
+                    // 這一批放不下，先送出已有的
+                    format_buffer(frame, PRESENCE, "server", users[w].name, batch[w]);
+                    io_ssl_write(users[w].relay_ssl, frame, BUFFER_SIZE);
+                    used[w] = 0;
+                }
+                memcpy(batch[w] + used[w], line, len + 1);
+                used[w] += len;
             }
-            buf[bytes] = '\0';
-            if (strncmp(buf, ACK_FILE, strlen(ACK_FILE)) != 0)
-                printf("[Error] error in transferring file\n");
-            SSL_write(ssl, ACK_FILE, strlen(ACK_FILE));
         }
+        presence_count = 0;
+
+        for (int k = 0; k < n_touched; k++) {
+            int w = touched[k];
+            format_buffer(frame, PRESENCE, "server", users[w].name, batch[w]);
+            io_ssl_write(users[w].relay_ssl, frame, BUFFER_SIZE);
+            used[w] = 0;
+        }
+        pthread_mutex_unlock(&users_lock);
     }
+    return NULL;
+}
+
+//--- CONTACTS ---//
+// 以下都在持有 users_lock 時呼叫
+
+static int user_find(const char *name) {
+    for (int i = 0; i < user_count; i++)
+        if (strcmp(users[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+static void id_remove(int *ids, int *n, int id) {
+    for (int i = 0; i < *n; i++) {
+        if (ids[i] == id) {
+            ids[i] = ids[--*n];
+            return;
+        }
+    }
+}
+
+// uid 的每個聯絡人一行 roster；回傳長度
+int contact_lines(int uid, char *out, int len) {
+    int used = 0;
+    out[0] = '\0';
+    for (int i = 0; i < users[uid].n_contacts; i++) {
+        const User *c = &users[users[uid].contacts[i]];
+        RosterItem it = { c->id, c->status, c->version, "" };
+        memcpy(it.name, c->name, MAX_NAME);
+        char line[64];
+        int n = roster_line(&it, line, sizeof(line));
+        if (used + n >= len)
+            break;
+        memcpy(out + used, line, n + 1);
+        used += n;
+    }
+    return used;
+}
+
+// Add Contact via SSL：成功時回覆 "contact_success\n" 加上他目前的一行 roster
+int contact_add_ssl(SSL *ssl, char* username, int targetID) {
+    int uid = user_find(username);
+    if (uid == -1 || targetID < 0 || targetID >= user_count || targetID == uid) {
+        if (reply_ssl(ssl, NO_USER, strlen(NO_USER)) <= 0) return -1;
+        return 0;
+    }
+
+    User *u = &users[uid], *t = &users[targetID];
+    bool found = false;
+    for (int i = 0; i < u->n_contacts; i++)
+        found = found || u->contacts[i] == targetID;
+    if (!found) {
+        if (u->n_contacts >= CONTACT_MAX) {
+            if (reply_ssl(ssl, CONTACT_FULL, strlen(CONTACT_FULL)) <= 0) return -1;
+            return 0;
+        }
+        u->contacts[u->n_contacts++] = targetID;
+        t->watchers[t->n_watchers++] = uid;
+    }
+
+    char reply[BUFFER_SIZE];
+    RosterItem it = { t->id, t->status, t->version, "" };
+    memcpy(it.name, t->name, MAX_NAME);
+    int n = snprintf(reply, sizeof(reply), "%s\n", CONTACT_SUCCESS);
+    n += roster_line(&it, reply + n, sizeof(reply) - n);
+    if (reply_ssl(ssl, reply, n) <= 0) return -1;
+    return 1;
+}
+
+// Remove Contact via SSL：不在聯絡人裡也算成功
+int contact_del_ssl(SSL *ssl, char* username, int targetID) {
+    int uid = user_find(username);
+    if (uid == -1 || targetID < 0 || targetID >= user_count) {
+        if (reply_ssl(ssl, NO_USER, strlen(NO_USER)) <= 0) return -1;
+        return 0;
+    }
+    id_remove(users[uid].contacts, &users[uid].n_contacts, targetID);
+    id_remove(users[targetID].watchers, &users[targetID].n_watchers, uid);
+    if (reply_ssl(ssl, CONTACT_SUCCESS, strlen(CONTACT_SUCCESS)) <= 0) return -1;
     return 1;
 }
 
+// Contact List via SSL：回覆 "contacts\n" 加上每個聯絡人一行 roster
+int contact_list_ssl(SSL *ssl, char* username) {
+    int uid = user_find(username);
+    char reply[BUFFER_SIZE - 64];
+    int n = snprintf(reply, sizeof(reply), "%s\n", CONTACTS);
+    if (uid != -1)
+        n += contact_lines(uid, reply + n, sizeof(reply) - n);
+    if (reply_ssl(ssl, reply, n) <= 0) return -1;
+    return 1;
+}
+
+// 檔案存進 spool 後，接收端在線就從 relay socket 通知
+void spool_notify(const SpoolEntry *e) {
+    printf("[Spool] #%d %s -> %s %s: waiting for download\n", e->id, e->from, e->to, e->filename);
+
+    char notice[BUFFER_SIZE], mes[MAX_MES];
+    memset(notice, 0, sizeof(notice));
+    snprintf(mes, sizeof(mes), "%s (%lld bytes)", e->filename, e->size);
+    format_buffer(notice, IS_SPOOL, e->from, e->to, mes);
+
+    pthread_mutex_lock(&users_lock);
+    for (int i = 0; i < user_count; i++) {
+        if (strcmp(users[i].name, e->to) == 0 && users[i].status && users[i].relay_ssl) {
+            io_ssl_write(users[i].relay_ssl, notice, BUFFER_SIZE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&users_lock);
+}
+
 // 添加視頻流處理函數
 void *handle_streaming(void *arg) {
     printf("handle_streaming\n");
@@ -754,11 +2005,86 @@ void *handle_streaming(void *arg) {
     return NULL;
 }
 
+//--- STREAM FILE ---//
+// 影片檔的讀取走 I/O backend（io_uring 模式使用註冊的讀檔 buffer）
+typedef struct {
+    int fd;
+    int64_t pos;
+    int64_t size;
+} StreamFile;
+
+static int stream_read(void *opaque, uint8_t *buf, int size) {
+    StreamFile *sf = (StreamFile*)opaque;
+    int n = io_file_read(sf->fd, buf, size, sf->pos);
+    if (n < 0)
+        return AVERROR(errno);
+    if (n == 0)
+        return AVERROR_EOF;
+    sf->pos += n;
+    return n;
+}
+
+static int64_t stream_seek(void *opaque, int64_t offset, int whence) {
+    StreamFile *sf = (StreamFile*)opaque;
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE)
+        return sf->size;
+    if (whence == SEEK_CUR)
+        offset += sf->pos;
+    else if (whence == SEEK_END)
+        offset += sf->size;
+    else if (whence != SEEK_SET)
+        return -1;
+    if (offset < 0)
+        return -1;
+    sf->pos = offset;
+    return offset;
+}
+
+// 以自訂 AVIOContext 開啟影片，失敗回傳 < 0
+static int stream_open_input(AVFormatContext **ctx, const char *filename) {
+    StreamFile *sf = calloc(1, sizeof(StreamFile));
+    sf->fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (sf->fd < 0 || fstat(sf->fd, &st) < 0) {
+        if (sf->fd >= 0)
+            close(sf->fd);
+        free(sf);
+        return -1;
+    }
+    sf->size = st.st_size;
+
+    unsigned char *avio_buf = av_malloc(IO_FILE_SIZE);
+    AVIOContext *pb = avio_alloc_context(avio_buf, IO_FILE_SIZE, 0, sf, stream_read, NULL, stream_seek);
+    *ctx = avformat_alloc_context();
+    (*ctx)->pb = pb;
+    (*ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    int r = avformat_open_input(ctx, filename, NULL, NULL);
+    if (r < 0) {
+        av_freep(&pb->buffer);
+        avio_context_free(&pb);
+        close(sf->fd);
+        free(sf);
+    }
+    return r;
+}
+
+static void stream_close_input(AVFormatContext **ctx) {
+    AVIOContext *pb = (*ctx)->pb;
+    StreamFile *sf = (StreamFile*)pb->opaque;
+    avformat_close_input(ctx);
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+    close(sf->fd);
+    free(sf);
+}
+
 // 處理視頻流請求
 int handle_stream_request(SSL *ssl, const char *username, const char *filename) {
     printf("server handle_stream_request\n");
     if (access(filename, F_OK) == -1) {
-        if (SSL_write(ssl, "ERROR File not found", strlen("ERROR File not found")) <= 0)
+        if (io_ssl_write(ssl, "ERROR File not found", strlen("ERROR File not found")) <= 0)
             return -1;
         return 0;
     }
@@ -768,6 +2094,7 @@ int handle_stream_request(SSL *ssl, const char *username, const char *filename)
     socklen_t stream_client_len = sizeof(stream_client_addr);
 
     printf("Waiting for client to connect...\n");
+    io_flush();
     int stream_client_fd = accept(stream_fd, (struct sockaddr*)&stream_client_addr, &stream_client_len);
     
     printf("stream_client_fd: %d\n", stream_client_fd);
@@ -789,7 +2116,7 @@ int handle_stream_request(SSL *ssl, const char *username, const char *filename)
 
     // 打開視頻文件
     AVFormatContext *format_ctx = NULL;
-    if (avformat_open_input(&format_ctx, filename, NULL, NULL) < 0) {
+    if (stream_open_input(&format_ctx, filename) < 0) {
         fprintf(stderr, "Could not open video file\n");
         close(stream_client_fd);
         return -1;
@@ -800,7 +2127,7 @@ int handle_stream_request(SSL *ssl, const char *username, const char *filename)
     // 查找流信息
     if (avformat_find_stream_info(format_ctx, NULL) < 0) {
         fprintf(stderr, "Could not find stream information.\n");
-        avformat_close_input(&format_ctx);
+        stream_close_input(&format_ctx);
         close(stream_client_fd);
         return -1;
     }
@@ -815,7 +2142,7 @@ int handle_stream_request(SSL *ssl, const char *username, const char *filename)
     }
     if (video_stream_index == -1) {
         fprintf(stderr, "Could not find a video stream.\n");
-        avformat_close_input(&format_ctx);
+        stream_close_input(&format_ctx);
         close(stream_client_fd);
         return -1;
     }
@@ -842,15 +2169,9 @@ int handle_stream_request(SSL *ssl, const char *username, const char *filename)
     uint8_t *sps = codec_params->extradata;
     int sps_size = codec_params->extradata_size;
 
-    if (send(stream_client_fd, &sps_size, sizeof(sps_size), 0) == -1) {
-        fprintf(stderr, "Failed to send SPS size\n");
-        avformat_close_input(&format_ctx);
-        close(stream_client_fd);
-        return -1;
-    }
-    if (send(stream_client_fd, sps, sps_size, 0) == -1) {
-        fprintf(stderr, "Failed to send SPS data\n");
-        avformat_close_input(&format_ctx);
+    if (io_send_frame(stream_client_fd, &sps_size, sizeof(sps_size), sps, sps_size) == -1) {
+        fprintf(stderr, "Failed to send SPS/PPS\n");
+        stream_close_input(&format_ctx);
         close(stream_client_fd);
         return -1;
     }
@@ -864,8 +2185,8 @@ int handle_stream_request(SSL *ssl, const char *username, const char *filename)
     while (av_read_frame(format_ctx, &packet) >= 0) {
         if (packet.stream_index == video_stream_index) {
             int frame_size = packet.size;
-            if (send(stream_client_fd, &frame_size, sizeof(frame_size), 0) == -1 ||
-                send_full(stream_client_fd, packet.data, packet.size) == -1) {
+            if (io_send_frame(stream_client_fd, &frame_size, sizeof(frame_size),
+                              packet.data, packet.size) == -1) {
                 av_packet_unref(&packet);
                 break;
             }
@@ -876,7 +2197,7 @@ int handle_stream_request(SSL *ssl, const char *username, const char *filename)
         printf("frame_count: %d\n", frame_count);
     }
 
-    avformat_close_input(&format_ctx);
+    stream_close_input(&format_ctx);
     close(stream_client_fd);
     return 1;
 }
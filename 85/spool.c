@@ -0,0 +1,180 @@
+// spool.c
+#define _GNU_SOURCE
+#include "spool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+static SpoolEntry entries[SPOOL_MAX];
+static int next_id = 1;
+static long long total_bytes = 0;      // 所有 entry 預留的大小
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+static SpoolNotify on_ready;
+
+static SpoolEntry *find_entry(int id) {
+    for (int i = 0; i < SPOOL_MAX; i++)
+        if (entries[i].used && entries[i].id == id)
+            return &entries[i];
+    return NULL;
+}
+
+void spool_path(int id, char *path, size_t len) {
+    snprintf(path, len, "%s/%d", SPOOL_DIR, id);
+}
+
+// 刪除檔案並釋放預留的空間（呼叫前需持有 spool_lock）
+static void drop_entry(SpoolEntry *e) {
+    char path[64];
+    spool_path(e->id, path, sizeof(path));
+    unlink(path);
+    total_bytes -= e->size;
+    memset(e, 0, sizeof(*e));
+}
+
+// 建立 spool 目錄並清掉上次留下的檔案（entry 只存在記憶體中）
+int spool_init(SpoolNotify notify) {
+    on_ready = notify;
+    if (mkdir(SPOOL_DIR, 0700) == -1 && errno != EEXIST)
+        return -1;
+    DIR *dir = opendir(SPOOL_DIR);
+    if (!dir)
+        return -1;
+    struct dirent *d;
+    char path[512];
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", SPOOL_DIR, d->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    return 1;
+}
+
+// 預留空間給一個上傳，成功回傳 spool ID 並填入 out，超過限額回傳 0，表已滿回傳 -1
+int spool_reserve(const char *from, const char *to, const char *filename, long long size,
+                  SpoolEntry *out) {
+    if (size < 0)
+        return -1;
+    pthread_mutex_lock(&spool_lock);
+    long long user_bytes = 0;
+    SpoolEntry *slot = NULL;
+    for (int i = 0; i < SPOOL_MAX; i++) {
+        if (!entries[i].used)
+            slot = slot ? slot : &entries[i];
+        else if (strcmp(entries[i].from, from) == 0)
+            user_bytes += entries[i].size;
+    }
+
+    int id;
+    if (total_bytes + size > SPOOL_QUOTA_TOTAL || user_bytes + size > SPOOL_QUOTA_USER) {
+        id = 0;
+    } else if (!slot) {
+        id = -1;
+    } else {
+        memset(slot, 0, sizeof(*slot));
+        slot->used = true;
+        slot->id = id = next_id++;
+        strncpy(slot->from, from, MAX_NAME - 1);
+        strncpy(slot->to, to, MAX_NAME - 1);
+        strncpy(slot->filename, filename, SPOOL_NAME_MAX - 1);
+        slot->size = size;
+        slot->created = time(NULL);
+        slot->state = SPOOL_UPLOADING;
+        total_bytes += size;
+        *out = *slot;
+    }
+    pthread_mutex_unlock(&spool_lock);
+    return id;
+}
+
+// 上傳結束：成功則通知接收端，失敗則刪除
+void spool_commit(int id, bool ok) {
+    SpoolEntry copy;
+    bool notify = false;
+    pthread_mutex_lock(&spool_lock);
+    SpoolEntry *e = find_entry(id);
+    if (e && ok) {
+        e->state = SPOOL_READY;
+        copy = *e;
+        notify = true;
+    } else if (e) {
+        drop_entry(e);
+    }
+    pthread_mutex_unlock(&spool_lock);
+
+    if (notify && on_ready)
+        on_ready(&copy);
+}
+
+// 接收端開始下載：只有收件人本人且檔案已上傳完成才可以，成功回傳 1
+int spool_checkout(int id, const char *to, SpoolEntry *out) {
+    int r = 0;
+    pthread_mutex_lock(&spool_lock);
+    SpoolEntry *e = find_entry(id);
+    if (e && e->state == SPOOL_READY && strcmp(e->to, to) == 0) {
+        e->state = SPOOL_SENDING;
+        *out = *e;
+        r = 1;
+    }
+    pthread_mutex_unlock(&spool_lock);
+    return r;
+}
+
+// 下載結束：送達則刪除，否則留著等下次下載
+void spool_checkin(int id, bool delivered) {
+    pthread_mutex_lock(&spool_lock);
+    SpoolEntry *e = find_entry(id);
+    if (e && delivered)
+        drop_entry(e);
+    else if (e)
+        e->state = SPOOL_READY;
+    pthread_mutex_unlock(&spool_lock);
+}
+
+// 列出給 to 的檔案，每行 "<spool ID> <from> <size> <filename>"，回傳寫入的長度
+int spool_list(const char *to, char *out, int out_size) {
+    int len = 0;
+    out[0] = '\0';
+    pthread_mutex_lock(&spool_lock);
+    for (int i = 0; i < SPOOL_MAX && len < out_size; i++) {
+        SpoolEntry *e = &entries[i];
+        if (e->used && e->state == SPOOL_READY && strcmp(e->to, to) == 0)
+            len += snprintf(out + len, out_size - len, "%d %s %lld %s\n",
+                            e->id, e->from, e->size, e->filename);
+    }
+    pthread_mutex_unlock(&spool_lock);
+    if (len >= out_size)
+        len = out_size - 1;
+    return len;
+}
+
+int spool_pending(const char *to) {
+    int n = 0;
+    pthread_mutex_lock(&spool_lock);
+    for (int i = 0; i < SPOOL_MAX; i++)
+        if (entries[i].used && entries[i].state == SPOOL_READY && strcmp(entries[i].to, to) == 0)
+            n++;
+    pthread_mutex_unlock(&spool_lock);
+    return n;
+}
+
+// 刪除超過 SPOOL_TTL 仍未被下載的檔案
+void spool_sweep() {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&spool_lock);
+    for (int i = 0; i < SPOOL_MAX; i++) {
+        SpoolEntry *e = &entries[i];
+        if (e->used && e->state == SPOOL_READY && now - e->created > SPOOL_TTL) {
+            printf("[Spool] #%d %s -> %s %s: expired\n", e->id, e->from, e->to, e->filename);
+            drop_entry(e);
+        }
+    }
+    pthread_mutex_unlock(&spool_lock);
+}
@@ -0,0 +1,48 @@
+// spool.h
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <time.h>
+
+//--- SPOOL ---//
+// 離線傳檔：上傳端先把檔案傳到 server 的 spool 目錄，接收端之後再下載
+#define SPOOL_DIR "spool"
+#define SPOOL_MAX 64                               // spool 中最多的檔案數
+#define SPOOL_QUOTA_TOTAL (1024LL * 1024 * 1024)   // 全部 spool 的大小上限
+#define SPOOL_QUOTA_USER (256LL * 1024 * 1024)     // 每個上傳者的大小上限
+#define SPOOL_TTL (24 * 60 * 60)                   // 檔案保留時間（秒）
+#define SPOOL_NAME_MAX 256
+
+typedef enum {
+    SPOOL_UPLOADING,                   // 上傳中（已預留空間）
+    SPOOL_READY,                       // 等待接收端下載
+    SPOOL_SENDING                      // 下載中（不會被清掉）
+} SpoolState;
+
+typedef struct {
+    bool used;
+    int  id;
+    char from[MAX_NAME], to[MAX_NAME];
+    char filename[SPOOL_NAME_MAX];
+    long long size;
+    time_t created;
+    SpoolState state;
+} SpoolEntry;
+
+typedef void (*SpoolNotify)(const SpoolEntry *e);
+
+int  spool_init(SpoolNotify notify);
+int  spool_reserve(const char *from, const char *to, const char *filename, long long size,
+                   SpoolEntry *out);
+void spool_path(int id, char *path, size_t len);
+void spool_commit(int id, bool ok);
+int  spool_checkout(int id, const char *to, SpoolEntry *out);
+void spool_checkin(int id, bool delivered);
+int  spool_list(const char *to, char *out, int out_size);
+int  spool_pending(const char *to);
+void spool_sweep();
+
+#endif
@@ -0,0 +1,534 @@
+// srv_io.c
+#define _GNU_SOURCE
+#include "srv_io.h"
+#include "config.h"
+#include "uring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+
+#define TAG_ONE 0xffff0000ULL         // 讀取或單一操作的 user_data
+#define TAG_ACCEPT 0xacc00000ULL      // accept 的 user_data（低位元為 slot）
+
+//--- PER THREAD ---//
+typedef struct {
+    Uring ring;
+    bool  fixed;                       // 是否成功註冊固定 buffer
+    char *rx;                          // buffer index 0
+    char *tx;                          // buffer index 1
+    char *file;                        // buffer index 2
+    SSL  *corked;                      // 本 thread 負責的 session，回覆延後送出
+
+    // accept 批次
+    int  accept_fd;
+    int  accept_armed;
+    struct sockaddr_in accept_addr[IO_ACCEPT_BATCH];
+    socklen_t accept_len[IO_ACCEPT_BATCH];
+    int  ready_slot[IO_ACCEPT_BATCH];  // 其他操作順便收到的 accept 結果
+    int  ready_res[IO_ACCEPT_BATCH];
+    int  ready_count;
+} IoThread;
+
+typedef struct {
+    int fd;
+} IoConn;
+
+static bool use_uring = false;
+static __thread IoThread *tls_io = NULL;
+static __thread IoStats tls_stats;
+
+//--- BACKEND ---//
+static IoThread *io_thread_new() {
+    IoThread *t = calloc(1, sizeof(IoThread));
+    if (!t || uring_init(&t->ring, IO_RING_ENTRIES) == -1) {
+        free(t);
+        return NULL;
+    }
+    t->rx = aligned_alloc(4096, IO_RX_SIZE);
+    t->tx = aligned_alloc(4096, IO_TX_SIZE);
+    t->file = aligned_alloc(4096, IO_FILE_SIZE);
+    if (!t->rx || !t->tx || !t->file) {
+        uring_exit(&t->ring);
+        free(t->rx); free(t->tx); free(t->file);
+        free(t);
+        return NULL;
+    }
+
+    // RLIMIT_MEMLOCK 不足時退回一般的 READ/WRITE
+    struct iovec iov[3] = {
+        { t->rx, IO_RX_SIZE }, { t->tx, IO_TX_SIZE }, { t->file, IO_FILE_SIZE }
+    };
+    t->fixed = uring_register_buffers(&t->ring, iov, 3) == 1;
+    t->accept_fd = -1;
+    return t;
+}
+
+static IoThread *io_thread() {
+    if (!tls_io) {
+        tls_io = io_thread_new();
+        if (!tls_io)
+            ERR_EXIT("io_uring thread setup");
+    }
+    return tls_io;
+}
+
+// 依環境變數 IO_BACKEND 選擇 backend，io_uring 無法使用時退回 blocking
+void io_backend_init() {
+    const char *name = getenv("IO_BACKEND");
+    if (name && strcmp(name, "uring") == 0) {
+        IoThread *t = io_thread_new();
+        if (t) {
+            use_uring = true;
+            tls_io = t;
+        } else {
+            perror("[Warning] io_uring unavailable, using blocking I/O");
+        }
+    }
+    printf("I/O backend: %s%s\n", io_backend_name(),
+           use_uring && !tls_io->fixed ? " (without registered buffers)" : "");
+}
+
+const char *io_backend_name() {
+    return use_uring ? "io_uring" : "blocking";
+}
+
+//--- BLOCKING ---//
+// 計算 socket BIO 實際呼叫 read/write 的次數
+static long count_bio_cb(BIO *b, int oper, const char *argp, size_t len, int argi,
+                         long argl, int ret, size_t *processed) {
+    (void)b; (void)argp; (void)len; (void)argi; (void)argl; (void)processed;
+    if (oper == (BIO_CB_READ | BIO_CB_RETURN) || oper == (BIO_CB_WRITE | BIO_CB_RETURN))
+        tls_stats.syscalls++;
+    return ret;
+}
+
+//--- URING ---//
+static void prep_rw(IoThread *t, struct io_uring_sqe *sqe, bool write, int fd,
+                    char *buf, unsigned len, int index, uint64_t tag) {
+    if (write)
+        uring_prep_write_fixed(sqe, fd, buf, len, 0, index, tag);
+    else
+        uring_prep_read_fixed(sqe, fd, buf, len, 0, index, tag);
+    if (!t->fixed) {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->buf_index = 0;
+    }
+}
+
+// 等待並取出 n 個 cqe，結果依 user_data 存入 res
+static int reap(IoThread *t, unsigned n, int *res, unsigned nres, int *read_res) {
+    while (n > 0) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(&t->ring);
+        if (!cqe) {
+            if (uring_submit_and_wait(&t->ring, n) < 0)
+                return -1;
+            continue;
+        }
+        if ((cqe->user_data & ~0xffffULL) == TAG_ACCEPT) {
+            // 不是這次等的操作，留給 io_accept
+            t->ready_slot[t->ready_count] = cqe->user_data & 0xffff;
+            t->ready_res[t->ready_count] = cqe->res;
+            t->ready_count++;
+            uring_cqe_seen(&t->ring);
+            continue;
+        }
+        if (cqe->user_data == TAG_ONE)
+            *read_res = cqe->res;
+        else if (cqe->user_data < nres)
+            res[cqe->user_data] = cqe->res;
+        uring_cqe_seen(&t->ring);
+        n--;
+    }
+    return 1;
+}
+
+// 寫完剩下的部份（socket 很少發生 short write）
+static int write_rest(IoThread *t, int fd, char *buf, unsigned len) {
+    while (len > 0) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&t->ring);
+        prep_rw(t, sqe, true, fd, buf, len, 1, 0);
+        int res = -1, dummy;
+        if (uring_submit_and_wait(&t->ring, 1) < 0 || reap(t, 1, &res, 1, &dummy) < 0 || res <= 0)
+            return -1;
+        buf += res;
+        len -= res;
+    }
+    return 1;
+}
+
+// 一次 io_uring_enter：送出 corked session 與 ssl 的待送密文，want_read 時同時讀 ssl 的 socket
+// 讀到的密文放進 rbio，回傳讀到的 bytes；不讀時回傳 0；錯誤回傳 -1
+static int io_round(SSL *ssl, bool want_read) {
+    IoThread *t = io_thread();
+    SSL *targets[2] = { t->corked, ssl };
+    if (targets[0] == targets[1])
+        targets[0] = NULL;
+
+    while (true) {
+        struct { int fd; unsigned off, len; } w[8];
+        unsigned nw = 0, used = 0;
+        bool more = false;
+        for (int i = 0; i < 2; i++) {
+            if (!targets[i])
+                continue;
+            BIO *wbio = SSL_get_wbio(targets[i]);
+            IoConn *c = SSL_get_app_data(targets[i]);
+            while (BIO_ctrl_pending(wbio) > 0) {
+                if (used == IO_TX_SIZE || nw == 8) {
+                    more = true;
+                    break;
+                }
+                int n = BIO_read(wbio, t->tx + used, IO_TX_SIZE - used);
+                if (n <= 0)
+                    break;
+                w[nw].fd = c->fd;
+                w[nw].off = used;
+                w[nw].len = n;
+                nw++;
+                used += n;
+            }
+        }
+
+        bool do_read = want_read && !more;
+        if (nw == 0 && !do_read)
+            return 0;
+
+        for (unsigned i = 0; i < nw; i++)
+            prep_rw(t, uring_get_sqe(&t->ring), true, w[i].fd, t->tx + w[i].off, w[i].len, 1, i);
+        if (do_read) {
+            IoConn *c = SSL_get_app_data(ssl);
+            prep_rw(t, uring_get_sqe(&t->ring), false, c->fd, t->rx, IO_RX_SIZE, 0, TAG_ONE);
+        }
+
+        int res[8], read_res = 0;
+        if (uring_submit_and_wait(&t->ring, nw + do_read) < 0 ||
+            reap(t, nw + do_read, res, nw, &read_res) < 0)
+            return -1;
+
+        for (unsigned i = 0; i < nw; i++) {
+            if (res[i] < 0)
+                return -1;
+            if ((unsigned)res[i] < w[i].len &&
+                write_rest(t, w[i].fd, t->tx + w[i].off + res[i], w[i].len - res[i]) < 0)
+                return -1;
+        }
+
+        if (do_read) {
+            if (read_res <= 0)
+                return read_res < 0 ? -1 : 0;
+            BIO_write(SSL_get_rbio(ssl), t->rx, read_res);
+            return read_res;
+        }
+        if (!more && !want_read)
+            return 0;
+    }
+}
+
+//--- SSL ---//
+// 建立 SSL 並完成 handshake，失敗時關閉 fd 並回傳 NULL
+SSL *io_ssl_accept(SSL_CTX *ctx, int fd) {
+    SSL *ssl = SSL_new(ctx);
+    IoConn *c = calloc(1, sizeof(IoConn));
+    c->fd = fd;
+    SSL_set_app_data(ssl, c);
+
+    int r;
+    if (!use_uring) {
+        SSL_set_fd(ssl, fd);
+        BIO_set_callback_ex(SSL_get_rbio(ssl), count_bio_cb);
+        r = SSL_accept(ssl);
+    } else {
+        BIO *rbio = BIO_new(BIO_s_mem());
+        BIO *wbio = BIO_new(BIO_s_mem());
+        BIO_set_mem_eof_return(rbio, -1);
+        SSL_set_bio(ssl, rbio, wbio);
+        SSL_set_accept_state(ssl);
+        while ((r = SSL_do_handshake(ssl)) != 1) {
+            int err = SSL_get_error(ssl, r);
+            if (err != SSL_ERROR_WANT_READ || io_round(ssl, true) <= 0) {
+                io_round(ssl, false);      // 盡量把 alert 送出去
+                r = -1;
+                break;
+            }
+        }
+        if (r == 1 && io_round(ssl, false) < 0)
+            r = -1;
+    }
+
+    if (r <= 0) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        free(c);
+        close(fd);
+        return NULL;
+    }
+    return ssl;
+}
+
+// 語意同 SSL_read：回傳 > 0 為讀到的 bytes，<= 0 為錯誤或關閉
+int io_ssl_read(SSL *ssl, void *buf, int len) {
+    int n;
+    if (!use_uring) {
+        n = SSL_read(ssl, buf, len);
+    } else {
+        while ((n = SSL_read(ssl, buf, len)) <= 0) {
+            int err = SSL_get_error(ssl, n);
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+                break;
+            int r = io_round(ssl, true);
+            if (r <= 0) {
+                n = r;
+                break;
+            }
+        }
+    }
+    if (n > 0) {
+        tls_stats.messages++;
+        tls_stats.bytes += n;
+    }
+    return n;
+}
+
+// 不阻塞的 io_ssl_read：回傳 > 0 為讀到的 bytes；socket 上還沒有完整的應用層 record 時回傳 0
+// （只收到半個 record，或只有非應用層的 record），等 socket 再可讀時再呼叫；錯誤或關閉回傳 -1。
+// blocking 模式下 socket 暫時設為 non-blocking，呼叫期間不能有別的 thread 使用這個 SSL
+int io_ssl_try_read(SSL *ssl, void *buf, int len) {
+    int n, fd = io_ssl_get_fd(ssl), flags = 0;
+    if (!use_uring) {
+        flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    while ((n = SSL_read(ssl, buf, len)) <= 0) {
+        int err = SSL_get_error(ssl, n);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            n = -1;
+            break;
+        }
+        n = 0;
+        if (!use_uring)
+            break;
+
+        // uring 模式的 rbio 已經讀完：把 socket 上現有的密文直接收進來，沒有就回傳
+        char chunk[4096];
+        int got = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        tls_stats.syscalls++;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (got <= 0) {
+            n = -1;
+            break;
+        }
+        BIO_write(SSL_get_rbio(ssl), chunk, got);
+    }
+    if (!use_uring)
+        fcntl(fd, F_SETFL, flags);
+    if (n > 0) {
+        tls_stats.messages++;
+        tls_stats.bytes += n;
+    }
+    return n;
+}
+
+// 語意同 SSL_write；corked session 的資料留到下一次讀取時一起送出
+int io_ssl_write(SSL *ssl, const void *buf, int len) {
+    int n = SSL_write(ssl, buf, len);
+    if (n <= 0)
+        return n;
+    tls_stats.bytes += n;
+    if (use_uring && ssl != io_thread()->corked && io_round(ssl, false) < 0)
+        return -1;
+    return n;
+}
+
+// TLS 層是否還有沒交給應用層的資料（poll 看不到這些資料）
+bool io_ssl_pending(SSL *ssl) {
+    if (SSL_has_pending(ssl))
+        return true;
+    return use_uring && BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0;
+}
+
+int io_ssl_get_fd(SSL *ssl) {
+    IoConn *c = SSL_get_app_data(ssl);
+    return c ? c->fd : SSL_get_fd(ssl);
+}
+
+// 指定本 thread 負責的 session：對它的回覆不立刻送出
+void io_ssl_cork(SSL *ssl) {
+    if (use_uring)
+        io_thread()->corked = ssl;
+}
+
+// 阻塞在其他東西上（例如 accept）之前，先把延後的回覆送出
+void io_flush() {
+    if (use_uring && tls_io && tls_io->corked)
+        io_round(tls_io->corked, false);
+}
+
+// shutdown、釋放 SSL 並關閉 socket
+void io_ssl_close(SSL *ssl) {
+    SSL_shutdown(ssl);
+    IoConn *c = SSL_get_app_data(ssl);
+    int fd = io_ssl_get_fd(ssl);
+    if (use_uring) {
+        io_round(ssl, false);
+        if (tls_io->corked == ssl)
+            tls_io->corked = NULL;
+    }
+    SSL_free(ssl);
+    free(c);
+    if (fd >= 0)
+        close(fd);
+}
+
+//--- ACCEPT / FILE / STREAM ---//
+static void arm_accept(IoThread *t, int slot) {
+    t->accept_len[slot] = sizeof(struct sockaddr_in);
+    struct io_uring_sqe *sqe = uring_get_sqe(&t->ring);
+    uring_prep_accept(sqe, t->accept_fd, TAG_ACCEPT | slot);
+    sqe->addr = (uint64_t)(uintptr_t)&t->accept_addr[slot];
+    sqe->addr2 = (uint64_t)(uintptr_t)&t->accept_len[slot];
+}
+
+// uring 模式下同時掛著 IO_ACCEPT_BATCH 個 accept，一次 enter 可收回多個連線
+int io_accept(int listen_fd, struct sockaddr_in *addr) {
+    if (!use_uring) {
+        socklen_t len = sizeof(*addr);
+        tls_stats.syscalls++;
+        return accept(listen_fd, (struct sockaddr*)addr, &len);
+    }
+
+    IoThread *t = io_thread();
+    t->accept_fd = listen_fd;
+    while (t->accept_armed < IO_ACCEPT_BATCH)
+        arm_accept(t, t->accept_armed++);
+
+    int slot, fd;
+    if (t->ready_count > 0) {
+        t->ready_count--;
+        slot = t->ready_slot[t->ready_count];
+        fd = t->ready_res[t->ready_count];
+    } else {
+        struct io_uring_cqe *cqe;
+        while (!(cqe = uring_peek_cqe(&t->ring))) {
+            if (uring_submit_and_wait(&t->ring, 1) < 0)
+                return -1;
+        }
+        slot = cqe->user_data & 0xffff;
+        fd = cqe->res;
+        uring_cqe_seen(&t->ring);
+    }
+    *addr = t->accept_addr[slot];
+
+    // 重新掛上這個 slot，等下一次 enter 時一起送出
+    arm_accept(t, slot);
+
+    if (fd < 0) {
+        errno = -fd;
+        return -1;
+    }
+    return fd;
+}
+
+// 語意同 pread
+int io_file_read(int fd, void *buf, int len, int64_t offset) {
+    int n;
+    if (!use_uring) {
+        tls_stats.syscalls++;
+        n = pread(fd, buf, len, offset);
+    } else {
+        IoThread *t = io_thread();
+        if (len > IO_FILE_SIZE)
+            len = IO_FILE_SIZE;
+        struct io_uring_sqe *sqe = uring_get_sqe(&t->ring);
+        prep_rw(t, sqe, false, fd, t->file, len, 2, TAG_ONE);
+        sqe->off = offset;
+        n = -1;
+        int dummy;
+        if (uring_submit_and_wait(&t->ring, 1) < 0 || reap(t, 1, &dummy, 0, &n) < 0)
+            return -1;
+        if (n > 0)
+            memcpy(buf, t->file, n);
+        else if (n < 0) {
+            errno = -n;
+            n = -1;
+        }
+    }
+    if (n > 0)
+        tls_stats.bytes += n;
+    return n;
+}
+
+// 傳送 [header][data]：blocking 為兩次 send，uring 為一個 SENDMSG
+int io_send_frame(int fd, const void *hdr, int hdr_len, const void *data, int len) {
+    struct iovec iov[2] = {
+        { (void*)hdr, hdr_len }, { (void*)data, len }
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    size_t left = hdr_len + len;
+
+    while (left > 0) {
+        ssize_t n;
+        if (!use_uring) {
+            // 維持原本的行為：header 和 data 各自 send
+            tls_stats.syscalls++;
+            n = send(fd, msg.msg_iov[0].iov_base, msg.msg_iov[0].iov_len, MSG_NOSIGNAL);
+        } else {
+            IoThread *t = io_thread();
+            uring_prep_sendmsg(uring_get_sqe(&t->ring), fd, &msg, TAG_ONE);
+            int res = -1, dummy;
+            if (uring_submit_and_wait(&t->ring, 1) < 0 || reap(t, 1, &dummy, 0, &res) < 0)
+                return -1;
+            n = res;
+        }
+        if (n <= 0)
+            return -1;
+        left -= n;
+
+        // 跳過已送出的部份
+        while (n > 0 && msg.msg_iovlen > 0) {
+            if ((size_t)n >= msg.msg_iov[0].iov_len) {
+                n -= msg.msg_iov[0].iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            } else {
+                msg.msg_iov[0].iov_base = (char*)msg.msg_iov[0].iov_base + n;
+                msg.msg_iov[0].iov_len -= n;
+                n = 0;
+            }
+        }
+        while (msg.msg_iovlen > 0 && msg.msg_iov[0].iov_len == 0) {
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+    }
+    tls_stats.bytes += hdr_len + len;
+    return hdr_len + len;
+}
+
+//--- STATS ---//
+void io_stats_get(IoStats *stats) {
+    *stats = tls_stats;
+    if (use_uring && tls_io)
+        stats->syscalls += tls_io->ring.enters;
+}
+
+// 印出從 since 之後本 thread 的 syscall 次數，以及每則訊息 / 每 MB 的平均
+void io_stats_report(const char *who, const IoStats *since) {
+    IoStats now;
+    io_stats_get(&now);
+    uint64_t calls = now.syscalls - since->syscalls;
+    uint64_t msgs = now.messages - since->messages;
+    double mb = (now.bytes - since->bytes) / (1024.0 * 1024.0);
+    printf("[IO] %s (%s): %llu syscalls, %llu messages, %.2f MB, %.2f syscalls/message, %.1f syscalls/MB\n",
+           who, io_backend_name(), (unsigned long long)calls, (unsigned long long)msgs, mb,
+           msgs ? (double)calls / msgs : 0.0, mb > 0 ? calls / mb : 0.0);
+}
@@ -0,0 +1,46 @@
+// srv_io.h
+#ifndef SRV_IO_H
+#define SRV_IO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+//--- I/O BACKEND ---//
+// blocking：原本的阻塞式 syscall
+// uring   ：io_uring（環境變數 IO_BACKEND=uring 啟用），OpenSSL 改用 memory BIO，
+//           同一個 thread 延後的回覆會和下一次讀取合併成一次 io_uring_enter
+#define IO_RX_SIZE (32 * 1024)            // 每個 thread 註冊的接收 buffer
+#define IO_TX_SIZE (64 * 1024)            // 每個 thread 註冊的傳送 buffer
+#define IO_FILE_SIZE (64 * 1024)          // 每個 thread 註冊的讀檔 buffer
+#define IO_ACCEPT_BATCH 8                 // 同時掛著的 accept 數量
+#define IO_RING_ENTRIES 64
+
+typedef struct {
+    uint64_t syscalls;                 // 實際進入 kernel 的次數
+    uint64_t messages;                 // 收到的應用層訊息數
+    uint64_t bytes;                    // 應用層傳輸的 bytes（含串流與讀檔）
+} IoStats;
+
+void io_backend_init();
+const char *io_backend_name();
+
+SSL *io_ssl_accept(SSL_CTX *ctx, int fd);
+int  io_ssl_read(SSL *ssl, void *buf, int len);
+int  io_ssl_try_read(SSL *ssl, void *buf, int len);
+int  io_ssl_write(SSL *ssl, const void *buf, int len);
+int  io_ssl_get_fd(SSL *ssl);
+bool io_ssl_pending(SSL *ssl);
+void io_ssl_cork(SSL *ssl);
+void io_flush();
+void io_ssl_close(SSL *ssl);
+
+int  io_accept(int listen_fd, struct sockaddr_in *addr);
+int  io_file_read(int fd, void *buf, int len, int64_t offset);
+int  io_send_frame(int fd, const void *hdr, int hdr_len, const void *data, int len);
+
+void io_stats_get(IoStats *stats);
+void io_stats_report(const char *who, const IoStats *since);
+
+#endif
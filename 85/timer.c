@@ -0,0 +1,202 @@
+// timer.c
+#define _GNU_SOURCE
+#include "timer.h"
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+// 第 level 層的格子 i 放到期 tick 的第 level 組 TIMER_BITS 為 i 的 timer
+static Timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+static Timer *expiring;                // 這個 tick 到期、還沒呼叫的；callback 執行時它們仍可被取消
+static uint64_t base;                  // 下一個要處理的 tick
+static uint64_t start_ms;
+static TimerStats stats;
+static bool running, stopping;
+static pthread_t thread;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;   // 保護以上全部與 Timer 的 list 欄位
+
+static uint64_t mono_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_tick() {
+    return (mono_ms() - start_ms) / TIMER_TICK_MS;
+}
+
+static void link_timer(Timer **head, Timer *t) {
+    t->next = *head;
+    if (*head)
+        (*head)->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+static void unlink_timer(Timer *t) {
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+// 依離 base 多遠決定層數：第 0 層放 TIMER_SLOTS 個 tick 以內的，每上一層範圍乘 TIMER_SLOTS。
+// 已經過期的放在 base 的格子，下一個 tick 處理
+static void insert(Timer *t) {
+    if (t->expires < base)
+        t->expires = base;
+    uint64_t d = t->expires - base;
+    if (d > TIMER_MAX_TICKS) {
+        d = TIMER_MAX_TICKS;
+        t->expires = base + d;
+    }
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && d >> (TIMER_BITS * (level + 1)))
+        level++;
+    link_timer(&wheel[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK], t);
+}
+
+// 上一層的一格轉到了：裡面的 timer 都在下一圈以內，重新放一次就會落到下面的層
+static void cascade(int level, int slot) {
+    Timer *t = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    while (t) {
+        Timer *next = t->next;
+        insert(t);
+        stats.cascaded++;
+        t = next;
+    }
+}
+
+// 處理 base 這個 tick，持有 timer_lock 時呼叫，callback 執行時放開
+static void run_tick() {
+    int slot = base & TIMER_MASK;
+    for (int level = 1, idx = slot; level < TIMER_LEVELS && idx == 0; level++) {
+        idx = (base >> (TIMER_BITS * level)) & TIMER_MASK;
+        cascade(level, idx);
+    }
+    uint64_t lag = mono_ms() - start_ms - base * TIMER_TICK_MS;
+    if (lag > stats.lag_max_ms)
+        stats.lag_max_ms = lag;
+    base++;
+
+    expiring = wheel[0][slot];
+    wheel[0][slot] = NULL;
+    if (expiring)
+        expiring->pprev = &expiring;
+    while (expiring) {
+        Timer *t = expiring;
+        unlink_timer(t);
+        stats.pending--;
+        stats.fired++;
+        TimerFn fn = t->fn;
+        void *arg = t->arg;
+        pthread_mutex_unlock(&timer_lock);
+        fn(arg);
+        pthread_mutex_lock(&timer_lock);
+    }
+}
+
+// Timer Thread：睡到下一個 tick；落後時（callback 太久、機器太忙）一次補完
+static void *timer_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&timer_lock);
+    while (!stopping) {
+        uint64_t now = now_tick();
+        while (base <= now && !stopping)
+            run_tick();
+
+        uint64_t due = start_ms + base * TIMER_TICK_MS;
+        struct timespec ts = { due / 1000, (due % 1000) * 1000000 };
+        pthread_mutex_unlock(&timer_lock);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        pthread_mutex_lock(&timer_lock);
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return NULL;
+}
+
+//--- API ---//
+// 啟動 wheel thread，之後才能 timer_arm
+int timer_start() {
+    pthread_mutex_lock(&timer_lock);
+    if (running) {
+        pthread_mutex_unlock(&timer_lock);
+        return 1;
+    }
+    start_ms = mono_ms();
+    base = 0;
+    stopping = false;
+    if (pthread_create(&thread, NULL, timer_thread, NULL) != 0) {
+        pthread_mutex_unlock(&timer_lock);
+        return -1;
+    }
+    running = true;
+    pthread_mutex_unlock(&timer_lock);
+    return 1;
+}
+
+// 停止 wheel thread；還沒到期的 timer 不會再被呼叫
+void timer_stop() {
+    pthread_mutex_lock(&timer_lock);
+    if (!running) {
+        pthread_mutex_unlock(&timer_lock);
+        return;
+    }
+    stopping = true;
+    pthread_mutex_unlock(&timer_lock);
+    pthread_join(thread, NULL);
+    pthread_mutex_lock(&timer_lock);
+    running = false;
+    pthread_mutex_unlock(&timer_lock);
+}
+
+void timer_init(Timer *t, TimerFn fn, void *arg) {
+    memset(t, 0, sizeof(Timer));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+// ms 之後呼叫 t->fn；已經在等的先取消。不會提早，最多晚一個 tick
+void timer_arm(Timer *t, int ms) {
+    pthread_mutex_lock(&timer_lock);
+    if (t->pprev)
+        unlink_timer(t);
+    else
+        stats.pending++;
+    // 期限所在的 tick 無條件進位，tick 處理的時間不早於期限
+    t->expires = (mono_ms() - start_ms + (ms > 0 ? ms : 0) + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    insert(t);
+    pthread_mutex_unlock(&timer_lock);
+}
+
+// 還沒到期時取消並回傳 true。不等正在執行的 callback：
+// callback 要以自己的 lock 與 timer_pending 判斷這次是否仍然有效
+bool timer_cancel(Timer *t) {
+    pthread_mutex_lock(&timer_lock);
+    bool pending = t->pprev != NULL;
+    if (pending) {
+        unlink_timer(t);
+        stats.pending--;
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return pending;
+}
+
+bool timer_pending(Timer *t) {
+    pthread_mutex_lock(&timer_lock);
+    bool pending = t->pprev != NULL;
+    pthread_mutex_unlock(&timer_lock);
+    return pending;
+}
+
+void timer_stats(TimerStats *st) {
+    pthread_mutex_lock(&timer_lock);
+    *st = stats;
+    pthread_mutex_unlock(&timer_lock);
+}
@@ -0,0 +1,44 @@
+// timer.h
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//--- TIMER WHEEL ---//
+// server 所有 session 共用的階層式 timer wheel：TIMER_LEVELS 層，每層 TIMER_SLOTS 格，
+// 第 0 層一格一個 tick，上一層一格等於下一層一整圈。加入與取消都只改一個 list（O(1)），
+// 上層的格子轉到時才把裡面的 timer 往下一層分（cascade）。
+// 一個背景 thread 每個 tick 醒來一次，在 lock 之外呼叫到期的 callback；
+// callback 不能阻塞太久，否則後面的 timer 都會延後
+#define TIMER_TICK_MS 100
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4                    // 最長約 64^4 個 tick（19 天），更長的當作最長
+
+typedef void (*TimerFn)(void *arg);
+
+// 由使用者嵌在自己的結構裡，timer_init 之後才能使用；pending 時不能釋放
+typedef struct Timer {
+    struct Timer *next, **pprev;       // pprev 為 NULL 表示不在 wheel 裡
+    uint64_t expires;                  // 到期的 tick
+    TimerFn fn;
+    void *arg;
+} Timer;
+
+typedef struct {
+    long pending;                      // 還在 wheel 裡的 timer
+    long fired;                        // 已呼叫的 callback
+    long cascaded;                     // 從上層搬到下層的次數
+    uint64_t lag_max_ms;               // wheel thread 最多落後幾 ms
+} TimerStats;
+
+int  timer_start();
+void timer_stop();
+void timer_init(Timer *t, TimerFn fn, void *arg);
+void timer_arm(Timer *t, int ms);
+bool timer_cancel(Timer *t);
+bool timer_pending(Timer *t);
+void timer_stats(TimerStats *st);
+
+#endif
@@ -0,0 +1,152 @@
+// timer_bench.c
+// timer wheel 的效能測試：不需要 server，模擬很多個 session 各自有一個閒置 timer，
+// 量測 timer_arm（每個 request 重設閒置期限）、timer_cancel 的延遲，以及 callback 比期限晚多久
+//   ./timer_bench [sessions] [seconds]
+#define _GNU_SOURCE
+#include "timer.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct {
+    Timer timer;
+    uint64_t due_ns;                   // 最後一次 arm 的期限
+    int  fired;
+} Session;
+
+int nsessions = 100000;
+int seconds = 10;
+Session *sessions;
+double *late_ms;                       // 每次 callback 比期限晚多少
+long nlate;
+pthread_mutex_t late_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t rng = 88172645463325252ULL;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_rand() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, double *v, long n, const char *unit) {
+    if (n == 0) {
+        printf("%-28s no samples\n", what);
+        return;
+    }
+    qsort(v, n, sizeof(double), cmp_double);
+    printf("%-28s p50 %9.2f %s  p99 %9.2f %s  max %9.2f %s  (%ld)\n", what,
+           v[n / 2], unit, v[(long)(n * 0.99)], unit, v[n - 1], unit, n);
+}
+
+static void on_expire(void *arg) {
+    Session *s = (Session*)arg;
+    uint64_t t = now_ns();
+    pthread_mutex_lock(&late_lock);
+    s->fired++;
+    if (nlate < nsessions * 4L)
+        late_ms[nlate++] = ((double)t - (double)s->due_ns) / 1e6;
+    pthread_mutex_unlock(&late_lock);
+}
+
+static void arm(Session *s, int ms) {
+    pthread_mutex_lock(&late_lock);
+    s->due_ns = now_ns() + (uint64_t)ms * 1000000;
+    pthread_mutex_unlock(&late_lock);
+    timer_arm(&s->timer, ms);
+}
+
+//--- MAIN FUNCTION ---//
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        nsessions = atoi(argv[1]);
+    if (argc > 2)
+        seconds = atoi(argv[2]);
+    if (nsessions <= 0 || seconds <= 0) {
+        printf("Usage: %s [sessions] [seconds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    sessions = calloc(nsessions, sizeof(Session));
+    late_ms = malloc(nsessions * 4L * sizeof(double));
+    double *us = malloc(nsessions * sizeof(double));
+    if (!sessions || !late_ms || !us || timer_start() == -1) {
+        perror("timer_bench");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < nsessions; i++)
+        timer_init(&sessions[i].timer, on_expire, &sessions[i]);
+
+    printf("%s\n", LINE);
+    printf("%d sessions, tick %d ms, %d s\n", nsessions, TIMER_TICK_MS, seconds);
+
+    // 每個 session 登入：都是 SESSION_IDLE_SEC 的閒置期限
+    for (int i = 0; i < nsessions; i++) {
+        uint64_t t = now_ns();
+        timer_arm(&sessions[i].timer, SESSION_IDLE_SEC * 1000);
+        us[i] = (now_ns() - t) / 1e3;
+    }
+    report("arm (new)", us, nsessions, "us");
+
+    // 每個 session 收到一個 request：重設閒置期限（已在 wheel 裡，先移除再放入）
+    for (int i = 0; i < nsessions; i++) {
+        uint64_t t = now_ns();
+        timer_arm(&sessions[i].timer, SESSION_IDLE_SEC * 1000 + (int)(next_rand() % 1000));
+        us[i] = (now_ns() - t) / 1e3;
+    }
+    report("re-arm (request)", us, nsessions, "us");
+
+    // 一半的 session 登出
+    int ncancel = 0;
+    for (int i = 0; i < nsessions; i += 2) {
+        uint64_t t = now_ns();
+        timer_cancel(&sessions[i].timer);
+        us[ncancel++] = (now_ns() - t) / 1e3;
+    }
+    report("cancel (logout)", us, ncancel, "us");
+
+    // 期限分散在接下來的 seconds 秒，量測 callback 的延遲；
+    // 其中四分之一在到期前又被重設（活著的 session），不應該呼叫
+    for (int i = 0; i < nsessions; i++)
+        arm(&sessions[i], (i % 4 == 0 ? 1000 : 0) + (int)(next_rand() % (seconds * 1000)));
+    for (int i = 0; i < nsessions; i += 4)
+        arm(&sessions[i], seconds * 1000 + 5000 + (int)(next_rand() % 1000));
+    sleep(seconds + 1);
+
+    TimerStats st;
+    timer_stats(&st);
+    long fired = 0, twice = 0;
+    for (int i = 0; i < nsessions; i++) {
+        fired += sessions[i].fired > 0;
+        twice += sessions[i].fired > 1;
+    }
+    pthread_mutex_lock(&late_lock);
+    printf("fired %ld / %d expected, %ld twice, %ld still pending, %ld cascades, wheel lag max %llu ms\n",
+           fired, nsessions - (nsessions + 3) / 4, twice, st.pending, st.cascaded,
+           (unsigned long long)st.lag_max_ms);
+    report("callback after deadline", late_ms, nlate, "ms");
+    pthread_mutex_unlock(&late_lock);
+    printf("%s\n", LINE);
+
+    timer_stop();
+    free(us);
+    free(late_ms);
+    free(sessions);
+    return 0;
+}
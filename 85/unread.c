@@ -0,0 +1,207 @@
+// unread.c
+#define _GNU_SOURCE
+#include "unread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// 檔案裡的一筆，第 i 筆在 offset i * sizeof(UnreadRec)；只會新增，不會刪除
+typedef struct {
+    char    user[MAX_NAME];
+    char    peer[MAX_NAME];
+    int64_t last_read;
+    int64_t latest;
+} UnreadRec;
+
+static UnreadRec *recs;
+static int *next_of;                   // 同一個使用者的下一筆，-1 表示沒有
+static int n_recs, cap_recs;
+static int *pairs;                     // (user, peer) 的 hash table，存筆數 + 1，0 表示空
+static int *heads;                     // user 的 hash table，存他的第一筆 + 1
+static int table_cap;
+static int fd = -1;
+static pthread_mutex_t unread_lock = PTHREAD_MUTEX_INITIALIZER;   // 保護以上全部
+
+static uint32_t hash_name(uint32_t h, const char *s) {
+    for (; *s; s++)
+        h = (h ^ (uint8_t)*s) * 16777619u;
+    return h;
+}
+
+static int pair_slot(const char *user, const char *peer) {
+    uint32_t h = hash_name(hash_name(2166136261u, user) * 31, peer);
+    for (int i = h & (table_cap - 1);; i = (i + 1) & (table_cap - 1)) {
+        int r = pairs[i] - 1;
+        if (r < 0 || (strcmp(recs[r].user, user) == 0 && strcmp(recs[r].peer, peer) == 0))
+            return i;
+    }
+}
+
+static int head_slot(const char *user) {
+    uint32_t h = hash_name(2166136261u, user);
+    for (int i = h & (table_cap - 1);; i = (i + 1) & (table_cap - 1)) {
+        int r = heads[i] - 1;
+        if (r < 0 || strcmp(recs[r].user, user) == 0)
+            return i;
+    }
+}
+
+// 把第 r 筆加進兩個 hash table
+static void link_rec(int r) {
+    pairs[pair_slot(recs[r].user, recs[r].peer)] = r + 1;
+    int h = head_slot(recs[r].user);
+    next_of[r] = heads[h] - 1;
+    heads[h] = r + 1;
+}
+
+static int grow() {
+    if (n_recs == cap_recs) {
+        int cap = cap_recs ? cap_recs * 2 : 64;
+        UnreadRec *r = realloc(recs, cap * sizeof(UnreadRec));
+        if (!r)
+            return -1;
+        recs = r;
+        int *n = realloc(next_of, cap * sizeof(int));
+        if (!n)
+            return -1;
+        next_of = n;
+        cap_recs = cap;
+    }
+    if ((n_recs + 1) * 2 > table_cap) {
+        int cap = table_cap ? table_cap * 2 : 128;
+        int *p = calloc(cap, sizeof(int)), *h = calloc(cap, sizeof(int));
+        if (!p || !h) {
+            free(p);
+            free(h);
+            return -1;
+        }
+        free(pairs);
+        free(heads);
+        pairs = p;
+        heads = h;
+        table_cap = cap;
+        for (int r = 0; r < n_recs; r++)
+            link_rec(r);
+    }
+    return 0;
+}
+
+// user 在跟 peer 的對話的紀錄，沒有時 create 才新增
+static int rec_get(const char *user, const char *peer, bool create) {
+    if (table_cap) {
+        int r = pairs[pair_slot(user, peer)] - 1;
+        if (r >= 0)
+            return r;
+    }
+    if (!create || grow() == -1)
+        return -1;
+    int r = n_recs++;
+    memset(&recs[r], 0, sizeof(UnreadRec));
+    snprintf(recs[r].user, MAX_NAME, "%s", user);
+    snprintf(recs[r].peer, MAX_NAME, "%s", peer);
+    link_rec(r);
+    return r;
+}
+
+static void rec_save(int r) {
+    if (fd >= 0 && pwrite(fd, &recs[r], sizeof(UnreadRec), (off_t)r * sizeof(UnreadRec)) != sizeof(UnreadRec))
+        perror("unread pwrite");
+}
+
+//--- API ---//
+// path 為 NULL 時用 UNREAD_FILE；整個檔案讀進記憶體，寫到一半的最後一筆丟掉
+int unread_init(const char *path) {
+    fd = open(path ? path : UNREAD_FILE, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -1;
+    int n = st.st_size / sizeof(UnreadRec);
+    if (ftruncate(fd, (off_t)n * sizeof(UnreadRec)) == -1)
+        return -1;
+
+    pthread_mutex_lock(&unread_lock);
+    UnreadRec rec;
+    for (int i = 0; i < n && pread(fd, &rec, sizeof(rec), (off_t)i * sizeof(rec)) == sizeof(rec); i++) {
+        rec.user[MAX_NAME - 1] = rec.peer[MAX_NAME - 1] = '\0';
+        if (grow() == -1)
+            break;
+        recs[n_recs] = rec;
+        link_rec(n_recs++);
+    }
+    pthread_mutex_unlock(&unread_lock);
+    return 1;
+}
+
+void unread_close() {
+    pthread_mutex_lock(&unread_lock);
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    free(recs);
+    free(next_of);
+    free(pairs);
+    free(heads);
+    recs = NULL;
+    next_of = pairs = heads = NULL;
+    n_recs = cap_recs = table_cap = 0;
+    pthread_mutex_unlock(&unread_lock);
+}
+
+// from 送給 to 的訊息，seq 為它在 history 裡的 seq：to 多一則未讀，from 已讀到這則
+void unread_message(const char *from, const char *to, long long seq) {
+    pthread_mutex_lock(&unread_lock);
+    int r = rec_get(to, from, true);
+    if (r >= 0 && seq > recs[r].latest) {
+        recs[r].latest = seq;
+        rec_save(r);
+    }
+    // from == to 時是同一筆紀錄，latest 上面已經推進，所以只看 last_read
+    r = rec_get(from, to, true);
+    if (r >= 0 && seq > recs[r].last_read) {
+        if (seq > recs[r].latest)
+            recs[r].latest = seq;
+        recs[r].last_read = seq;
+        rec_save(r);
+    }
+    pthread_mutex_unlock(&unread_lock);
+}
+
+// user 跟 peer 的對話已讀到 seq（不會倒退）；回傳還沒讀的則數
+long long unread_ack(const char *user, const char *peer, long long seq) {
+    pthread_mutex_lock(&unread_lock);
+    int r = rec_get(user, peer, false);
+    long long left = 0;
+    if (r >= 0) {
+        if (seq > recs[r].latest)
+            seq = recs[r].latest;
+        if (seq > recs[r].last_read) {
+            recs[r].last_read = seq;
+            rec_save(r);
+        }
+        left = recs[r].latest - recs[r].last_read;
+    }
+    pthread_mutex_unlock(&unread_lock);
+    return left;
+}
+
+// user 的每個對話，最多 max 個；回傳個數
+int unread_list(const char *user, UnreadEntry *out, int max) {
+    pthread_mutex_lock(&unread_lock);
+    int n = 0;
+    for (int r = table_cap ? heads[head_slot(user)] - 1 : -1; r >= 0 && n < max; r = next_of[r]) {
+        snprintf(out[n].peer, MAX_NAME, "%s", recs[r].peer);
+        out[n].last_read = recs[r].last_read;
+        out[n].latest = recs[r].latest;
+        n++;
+    }
+    pthread_mutex_unlock(&unread_lock);
+    return n;
+}
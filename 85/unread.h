@@ -0,0 +1,27 @@
+// unread.h
+#ifndef UNREAD_H
+#define UNREAD_H
+
+#include "config.h"
+
+#include <stdbool.h>
+
+//--- UNREAD ---//
+// 每個使用者在每個對話的已讀 cursor 與對話最新的 seq（與 history 的 seq 相同），未讀數就是兩者的差。
+// 自己送出訊息時視為已讀到那則，所以已讀之後的都是對方的訊息。
+// relay 與 ack 時只改一筆固定大小的紀錄並寫回檔案的同一個位置；登入時只讀自己的幾筆，與歷史多長無關
+#define UNREAD_FILE "unread"
+
+typedef struct {
+    char peer[MAX_NAME];
+    long long last_read;               // 已讀到的 seq，可當 history 的 cursor
+    long long latest;                  // 對話最新的 seq
+} UnreadEntry;
+
+int  unread_init(const char *path);
+void unread_close();
+void unread_message(const char *from, const char *to, long long seq);
+long long unread_ack(const char *user, const char *peer, long long seq);
+int  unread_list(const char *user, UnreadEntry *out, int max);
+
+#endif
@@ -0,0 +1,161 @@
+// uring.c
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// 建立 ring 並映射 SQ/CQ，成功回傳 1，失敗回傳 -1（errno 保留）
+int uring_init(Uring *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_io_uring_setup(entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED || u->sqes == MAP_FAILED) {
+        int e = errno;
+        uring_exit(u);
+        errno = e;
+        return -1;
+    }
+
+    char *sq = u->sq_ptr, *cq = u->cq_ptr;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    u->sqe_tail = *u->sq_tail;
+    return 1;
+}
+
+void uring_exit(Uring *u) {
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ptr && u->cq_ptr != MAP_FAILED)
+        munmap(u->cq_ptr, u->cq_size);
+    if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+        munmap(u->sq_ptr, u->sq_size);
+    if (u->fd > 0)
+        close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+// 註冊固定 buffer：kernel 只 pin 一次，之後 READ/WRITE_FIXED 不必每次 pin page
+int uring_register_buffers(Uring *u, const struct iovec *iov, unsigned n) {
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, n) < 0)
+        return -1;
+    return 1;
+}
+
+// 取得一個空的 sqe，SQ 已滿回傳 NULL
+struct io_uring_sqe *uring_get_sqe(Uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sqe_tail - head >= u->sq_entries)
+        return NULL;
+    unsigned idx = u->sqe_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sqe_tail++;
+    u->to_submit++;
+    return sqe;
+}
+
+// 一次送出所有準備好的 sqe，並等待至少 wait_nr 個完成
+int uring_submit_and_wait(Uring *u, unsigned wait_nr) {
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    unsigned submit = u->to_submit;
+    if (submit == 0 && wait_nr == 0)
+        return 0;
+    int r;
+    do {
+        r = sys_io_uring_enter(u->fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        u->enters++;
+    } while (r < 0 && errno == EINTR);
+    if (r < 0)
+        return -1;
+    u->submitted += r;
+    u->to_submit -= r;
+    return r;
+}
+
+// 取得已完成的 cqe（不會進入 kernel），沒有則回傳 NULL
+struct io_uring_cqe *uring_peek_cqe(Uring *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(Uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+//--- PREP ---//
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len,
+                           uint64_t offset, int buf_index, uint64_t user_data) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len,
+                            uint64_t offset, int buf_index, uint64_t user_data) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+                        uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,54 @@
+// uring.h
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+//--- IO_URING ---//
+// 直接使用 io_uring 系統呼叫的最小封裝（不依賴 liburing）
+typedef struct {
+    int fd;
+
+    // Submission queue
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;                 // 已取用但尚未送出的 sqe
+    unsigned to_submit;
+
+    // Completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // mmap 區域
+    void  *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+
+    // 統計
+    uint64_t enters;                   // io_uring_enter 次數
+    uint64_t submitted;                // 送出的 sqe 數
+} Uring;
+
+int  uring_init(Uring *u, unsigned entries);
+void uring_exit(Uring *u);
+int  uring_register_buffers(Uring *u, const struct iovec *iov, unsigned n);
+
+struct io_uring_sqe *uring_get_sqe(Uring *u);
+int  uring_submit_and_wait(Uring *u, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(Uring *u);
+void uring_cqe_seen(Uring *u);
+
+// 準備常用的 sqe
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len,
+                           uint64_t offset, int buf_index, uint64_t user_data);
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len,
+                            uint64_t offset, int buf_index, uint64_t user_data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+                        uint64_t user_data);
+
+#endif
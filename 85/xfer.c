@@ -0,0 +1,1092 @@
+// xfer.c
+#define _GNU_SOURCE
+#include "xfer.h"
+#include "file_pipe.h"
+#include "spool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <openssl/rand.h>
+
+#define XFER_NAME_MAX 256
+#define XFER_HANDSHAKE_TIMEOUT 5          // 資料連線從 accept 到報到完成的期限（秒）
+#define XFER_HANDSHAKE_MAX 64             // 同時在 handshake 的資料連線數
+#define XFER_EV_LISTEN (XFER_MAX + XFER_HANDSHAKE_MAX)   // epoll 上 welcome socket 的編號
+#define XFER_WINDOW (4 * 1024 * 1024)     // 一對多傳輸共用的記憶體 window
+#define XFER_STAGE (64 * 1024)            // 一對多傳輸每個接收端的送出暫存
+
+// 離開 window 的資料必須已經寫進暫存檔：FileWriter 最多只有 PIPE_DEPTH 個 block 加上
+// 正在填的 block 還沒寫到磁碟
+#if XFER_WINDOW <= PIPE_BLOCK_SIZE * (PIPE_DEPTH + 1)
+#error "XFER_WINDOW must be larger than the FileWriter backlog"
+#endif
+
+//--- TRANSFER ---//
+// 單一方向的搬運：from 讀進 ring，再寫到 to
+// from 為 NULL 時改從 spool 檔 src_fd 讀；to 為 NULL 時寫進 sink（sink 也為 NULL 則丟棄）
+typedef struct {
+    SSL  *from, *to;
+    int   src_fd;
+    long long end;                     // src_fd 的大小
+    bool  sendfile;                    // to 已啟用 kTLS，src_fd 直接交給 kernel 送出
+    FileWriter *sink;
+    char *buf;
+    uint64_t head, tail;               // 已寫出 / 已讀入的累計 bytes
+    int   pend;                        // 上次未完成的 SSL_write 長度（重試時必須相同）
+    bool  eof;                         // from 已送出 close_notify
+    bool  shut;                        // 已對 to 送出 close_notify
+} XferPipe;
+
+typedef enum {
+    XFER_RELAY,                        // 上傳端 → 下載端
+    XFER_SPOOL_IN,                     // 上傳端 → spool 檔
+    XFER_SPOOL_OUT,                    // spool 檔 → 下載端
+    XFER_FANOUT                        // 上傳端 → 多個下載端
+} XferMode;
+
+//--- FAN-OUT ---//
+// 一對多：上傳只做一次，最近的資料放在共用的 window，完整內容寫到暫存檔，
+// 落後超過 window 的接收端改從暫存檔讀，不會拖慢上傳與其他接收端
+typedef struct {
+    char  name[MAX_NAME];
+    char  token[XFER_TOKEN_LEN + 1];
+    SSL  *ssl;
+    uint32_t events;
+    char *stage;                       // 正在送出的資料（SSL_write 重試時內容必須相同）
+    int   stage_pos, stage_len;
+    uint64_t off;                      // 已放進 stage 的 bytes
+    uint64_t disk_bytes;               // 從暫存檔讀的 bytes
+    bool  shut;                        // 已送出 close_notify
+    bool  done, failed;
+    uint64_t done_ns;
+} FanReader;
+
+typedef struct {
+    char *window;                      // 最近 XFER_WINDOW bytes 的上傳資料
+    uint64_t tail;                     // 已收到的 bytes
+    bool  eof;
+    FileWriter *sink;                  // 暫存檔（開啟後立即 unlink）
+    int   src_fd;
+    int   nreaders;
+    FanReader readers[XFER_FANOUT_MAX];
+} Fanout;
+
+typedef struct {
+    bool  used;
+    int   id;
+    XferMode mode;
+    int   spool_id;
+    char  token[XFER_TOKEN_LEN + 1];
+    char  from[MAX_NAME], to[MAX_NAME];
+    char  filename[XFER_NAME_MAX];
+    long long size;
+
+    SSL  *up, *down;                   // 上傳端、下載端的資料連線
+    XferPipe pipe[2];                  // [0] 資料方向，[1] 反方向（delta 的 signature 與 close_notify）
+    int   npipes;
+    Fanout *fan;                       // XFER_FANOUT 才有
+    uint32_t up_events, down_events;   // 目前註冊在 epoll 的事件
+    bool  queued;                      // 兩端已連上，等使用者有空的名額才開始
+    time_t   created;
+    uint64_t start_ns;
+} Xfer;
+
+// 上傳到 spool（或一對多的暫存檔）結束後，關檔（fsync）與回覆上傳端交給 commit thread，不卡住 engine
+typedef struct Commit {
+    struct Commit *next;
+    int   spool_id;
+    SSL  *up;
+    FileWriter *sink;
+    long long size;
+    bool  ok;
+} Commit;
+
+static Xfer xfers[XFER_MAX];
+static int next_id = 1;
+static pthread_mutex_t xfer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static SSL_CTX *xfer_ctx;
+static int file_fd;                    // FILE_PORT 的 welcome socket
+static int epfd;
+
+static int p2p_count;                  // 直接在 client 之間完成的傳輸
+static long long p2p_bytes;
+
+static Commit *commit_head, *commit_tail;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_ready = PTHREAD_COND_INITIALIZER;
+
+// 還沒報到的資料連線，只有 engine thread 存取；epoll 的編號為 XFER_MAX + 索引
+typedef struct {
+    SSL   *ssl;                        // NULL 表示空位
+    uint32_t events;
+    time_t deadline;
+} Handshake;
+
+static Handshake handshakes[XFER_HANDSHAKE_MAX];
+
+//--- PIPE ---//
+// 讀進 ring，回傳 1 表示有進展，0 表示無法前進，-1 表示錯誤
+static int pipe_fill(XferPipe *p) {
+    // ring 滿了就不讀，TCP 自然對上傳端施加 backpressure
+    uint64_t used = p->tail - p->head;
+    if (p->eof || used >= XFER_RING_SIZE)
+        return 0;
+    size_t off = p->tail % XFER_RING_SIZE;
+    size_t space = XFER_RING_SIZE - off;
+    if (space > XFER_RING_SIZE - used)
+        space = XFER_RING_SIZE - used;
+
+    if (!p->from) {
+        ssize_t n = pread(p->src_fd, p->buf + off, space, p->tail);
+        if (n < 0)
+            return errno == EINTR ? 0 : -1;
+        if (n == 0)
+            p->eof = true;
+        p->tail += n;
+        return 1;
+    }
+
+    int n = SSL_read(p->from, p->buf + off, space);
+    if (n > 0) {
+        p->tail += n;
+        return 1;
+    }
+    int err = SSL_get_error(p->from, n);
+    if (err == SSL_ERROR_ZERO_RETURN) {
+        p->eof = true;
+        return 1;
+    }
+    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+}
+
+// 把 ring 中的資料寫出，回傳值同 pipe_fill
+static int pipe_drain(XferPipe *p) {
+    if (p->tail == p->head)
+        return 0;
+    size_t off = p->head % XFER_RING_SIZE;
+    size_t len = p->pend;
+    if (len == 0) {
+        len = XFER_RING_SIZE - off;
+        if (len > p->tail - p->head)
+            len = p->tail - p->head;
+    }
+
+    if (!p->to) {
+        if (p->sink && file_writer_write(p->sink, p->buf + off, len) == -1)
+            return -1;
+        p->head += len;
+        return 1;
+    }
+
+    int n = SSL_write(p->to, p->buf + off, len);
+    if (n > 0) {
+        p->head += n;
+        p->pend = 0;
+        return 1;
+    }
+    int err = SSL_get_error(p->to, n);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+        return -1;
+    p->pend = len;
+    return 0;
+}
+
+// kTLS：由 kernel 從 page cache 加密送出，檔案內容不經過 user space
+static int pipe_sendfile(XferPipe *p) {
+    while ((long long)p->head < p->end) {
+        ossl_ssize_t n = SSL_sendfile(p->to, p->src_fd, p->head, p->end - p->head, 0);
+        if (n <= 0) {
+            int err = SSL_get_error(p->to, n);
+            return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 1 : -1;
+        }
+        p->head += n;
+        p->tail = p->head;
+    }
+    p->eof = true;
+    return 1;
+}
+
+// 盡量搬運，直到兩邊都無法前進；連線錯誤回傳 -1
+static int pipe_run(XferPipe *p) {
+    if (p->sendfile && pipe_sendfile(p) < 0)
+        return -1;
+    while (!p->sendfile) {
+        int r = pipe_fill(p), w = pipe_drain(p);
+        if (r < 0 || w < 0)
+            return -1;
+        if (r == 0 && w == 0)
+            break;
+    }
+
+    // 來源結束且 ring 已清空：把結束轉告另一端
+    if (p->eof && p->head == p->tail && !p->shut) {
+        if (p->to)
+            SSL_shutdown(p->to);
+        p->shut = true;
+    }
+    return 1;
+}
+
+//--- FAN-OUT ---//
+// 讀上傳端：資料放進 window 並寫到暫存檔，不等任何接收端
+static int fan_upload(Xfer *x) {
+    Fanout *f = x->fan;
+    while (!f->eof) {
+        size_t off = f->tail % XFER_WINDOW;
+        size_t space = XFER_WINDOW - off;
+        if (space > XFER_RING_SIZE)
+            space = XFER_RING_SIZE;
+        int n = SSL_read(x->up, f->window + off, space);
+        if (n <= 0) {
+            int err = SSL_get_error(x->up, n);
+            if (err == SSL_ERROR_ZERO_RETURN)
+                f->eof = true;
+            else if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                return 1;
+            else
+                return -1;
+            break;
+        }
+        if (file_writer_write(f->sink, f->window + off, n) == -1)
+            return -1;
+        f->tail += n;
+        if ((long long)f->tail > x->size)
+            return -1;
+    }
+    return 1;
+}
+
+// 送資料給一個接收端：在 window 內就從記憶體複製，落後就從暫存檔讀
+static int fan_send(Fanout *f, FanReader *r) {
+    while (true) {
+        if (r->stage_pos == r->stage_len) {
+            r->stage_pos = r->stage_len = 0;
+            uint64_t avail = f->tail - r->off;
+            if (avail == 0)
+                break;
+            size_t len = avail < XFER_STAGE ? avail : XFER_STAGE;
+            uint64_t win_start = f->tail > XFER_WINDOW ? f->tail - XFER_WINDOW : 0;
+            if (r->off >= win_start) {
+                size_t woff = r->off % XFER_WINDOW;
+                if (len > XFER_WINDOW - woff)
+                    len = XFER_WINDOW - woff;
+                memcpy(r->stage, f->window + woff, len);
+            } else {
+                if (len > win_start - r->off)
+                    len = win_start - r->off;
+                ssize_t n = pread(f->src_fd, r->stage, len, r->off);
+                if (n <= 0)
+                    return n < 0 && errno == EINTR ? 1 : -1;
+                len = n;
+                r->disk_bytes += n;
+            }
+            r->stage_len = len;
+            r->off += len;
+        }
+
+        int n = SSL_write(r->ssl, r->stage + r->stage_pos, r->stage_len - r->stage_pos);
+        if (n <= 0) {
+            int err = SSL_get_error(r->ssl, n);
+            return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 1 : -1;
+        }
+        r->stage_pos += n;
+    }
+
+    // 上傳結束且已全部送出：送出 close_notify，等接收端回覆
+    if (f->eof && r->off == f->tail && !r->shut) {
+        SSL_shutdown(r->ssl);
+        r->shut = true;
+    }
+
+    // 接收端不會送資料，讀取只是為了收到 close_notify
+    char tmp[256];
+    int n;
+    while ((n = SSL_read(r->ssl, tmp, sizeof(tmp))) > 0)
+        ;
+    int err = SSL_get_error(r->ssl, n);
+    if (err == SSL_ERROR_ZERO_RETURN && r->shut) {
+        r->done = true;
+        r->done_ns = pipe_now_ns();
+        return 1;
+    }
+    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 1 : -1;
+}
+
+static void fan_close_reader(FanReader *r) {
+    if (!r->ssl)
+        return;
+    int fd = SSL_get_fd(r->ssl);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    SSL_free(r->ssl);
+    close(fd);
+    r->ssl = NULL;
+}
+
+static void xfer_finish(Xfer *x, bool ok);
+static void set_events(SSL *ssl, uint32_t *current, uint32_t want, int idx);
+
+static void fan_pump(Xfer *x) {
+    Fanout *f = x->fan;
+    if (fan_upload(x) < 0) {
+        xfer_finish(x, false);
+        return;
+    }
+
+    bool all = f->eof, any = false;
+    int idx = x - xfers;
+    for (int i = 0; i < f->nreaders; i++) {
+        FanReader *r = &f->readers[i];
+        if (r->ssl && !r->done && fan_send(f, r) < 0) {
+            r->failed = true;
+            fan_close_reader(r);
+        }
+        if (r->done)
+            fan_close_reader(r);
+        all = all && (r->done || r->failed);
+        any = any || r->done;
+        if (r->ssl)
+            set_events(r->ssl, &r->events,
+                       EPOLLIN | (r->stage_pos < r->stage_len ? EPOLLOUT : 0), idx);
+    }
+    if (all) {
+        xfer_finish(x, any);
+        return;
+    }
+    set_events(x->up, &x->up_events, f->eof ? 0 : EPOLLIN, idx);
+}
+
+//--- ENGINE ---//
+static void xfer_free(Xfer *x) {
+    SSL *ends[2] = { x->up, x->down };
+    for (int i = 0; i < 2; i++) {
+        if (!ends[i])
+            continue;
+        int fd = SSL_get_fd(ends[i]);
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        SSL_free(ends[i]);
+        close(fd);
+    }
+    if (x->pipe[0].src_fd > 0)
+        close(x->pipe[0].src_fd);
+    free(x->pipe[0].buf);
+    free(x->pipe[1].buf);
+    if (x->fan) {
+        for (int i = 0; i < x->fan->nreaders; i++) {
+            fan_close_reader(&x->fan->readers[i]);
+            free(x->fan->readers[i].stage);
+        }
+        if (x->fan->src_fd > 0)
+            close(x->fan->src_fd);
+        free(x->fan->window);
+        free(x->fan);
+    }
+    memset(x, 0, sizeof(*x));
+}
+
+static void xfer_dequeue();
+
+// 結束一個傳輸：spool 的部分交回 spool，上傳到 spool 的收尾交給 commit thread
+static void xfer_end(Xfer *x, bool ok) {
+    if (x->mode == XFER_SPOOL_IN || x->mode == XFER_FANOUT) {
+        Commit *c = calloc(1, sizeof(Commit));
+        c->spool_id = x->spool_id;
+        c->sink = x->mode == XFER_FANOUT ? x->fan->sink : x->pipe[0].sink;
+        c->size = x->size;
+        c->ok = ok;
+        if (x->up) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, SSL_get_fd(x->up), NULL);
+            c->up = x->up;
+            x->up = NULL;
+        }
+        pthread_mutex_lock(&commit_lock);
+        if (commit_tail)
+            commit_tail->next = c;
+        else
+            commit_head = c;
+        commit_tail = c;
+        pthread_cond_signal(&commit_ready);
+        pthread_mutex_unlock(&commit_lock);
+    } else if (x->mode == XFER_SPOOL_OUT) {
+        spool_checkin(x->spool_id, ok);
+    }
+    xfer_free(x);
+    xfer_dequeue();
+}
+
+// 一對多：每個接收端的完成時間，以及省下的上傳量
+static void fan_report(Xfer *x, bool ok) {
+    Fanout *f = x->fan;
+    double secs = (pipe_now_ns() - x->start_ns) / 1e9;
+    double mb = f->tail / (1024.0 * 1024.0);
+    int delivered = 0;
+    for (int i = 0; i < f->nreaders; i++)
+        delivered += f->readers[i].done;
+    printf("[Xfer] #%d %s -> %d users %s: %s, %.2f MB uploaded once in %.2f s, "
+           "delivered to %d, %.2f MB of upload saved\n",
+           x->id, x->from, f->nreaders, x->filename, ok ? "done" : "aborted", mb, secs,
+           delivered, delivered > 1 ? mb * (delivered - 1) : 0.0);
+    for (int i = 0; i < f->nreaders; i++) {
+        FanReader *r = &f->readers[i];
+        if (r->done)
+            printf("[Xfer] #%d   %s: done in %.2f s (%.2f MB from disk)\n", x->id, r->name,
+                   (r->done_ns - x->start_ns) / 1e9, r->disk_bytes / (1024.0 * 1024.0));
+        else
+            printf("[Xfer] #%d   %s: failed after %.2f MB\n", x->id, r->name,
+                   r->off / (1024.0 * 1024.0));
+    }
+}
+
+static void xfer_finish(Xfer *x, bool ok) {
+    if (x->mode == XFER_FANOUT) {
+        fan_report(x, ok);
+        xfer_end(x, ok);
+        return;
+    }
+    double secs = (pipe_now_ns() - x->start_ns) / 1e9;
+    double mb = x->pipe[0].head / (1024.0 * 1024.0);
+    const char *result = !ok ? "aborted" : x->mode == XFER_SPOOL_IN ? "spooled" : "done";
+    printf("[Xfer] #%d %s -> %s %s: %s, %.2f MB in %.2f s (%.2f MB/s)%s\n",
+           x->id, x->from, x->to, x->filename, result,
+           mb, secs, secs > 0 ? mb / secs : 0.0, x->pipe[0].sendfile ? " [sendfile]" : "");
+    xfer_end(x, ok);
+}
+
+static bool xfer_ready(const Xfer *x) {
+    if (x->mode == XFER_FANOUT)
+        return x->up != NULL;
+    return (x->up || x->mode == XFER_SPOOL_OUT) && (x->down || x->mode == XFER_SPOOL_IN);
+}
+
+static void set_events(SSL *ssl, uint32_t *current, uint32_t want, int idx) {
+    if (!ssl || *current == want)
+        return;
+    struct epoll_event ev;
+    ev.events = want;
+    ev.data.u64 = idx;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, SSL_get_fd(ssl), &ev);
+    *current = want;
+}
+
+// 處理一個傳輸的事件，並依 ring 狀態更新 epoll 關注的事件
+static void xfer_pump(Xfer *x) {
+    if (!xfer_ready(x) || x->queued)
+        return;
+    if (x->mode == XFER_FANOUT) {
+        fan_pump(x);
+        return;
+    }
+    bool done = true;
+    for (int i = 0; i < x->npipes; i++) {
+        if (pipe_run(&x->pipe[i]) < 0) {
+            xfer_finish(x, false);
+            return;
+        }
+        done = done && x->pipe[i].shut;
+    }
+    // spool 已預留宣告的大小，超過就中止
+    if (x->mode == XFER_SPOOL_IN && (long long)x->pipe[0].tail > x->size) {
+        xfer_finish(x, false);
+        return;
+    }
+    if (done) {
+        xfer_finish(x, true);
+        return;
+    }
+
+    // ring 未滿才讀，ring 有殘留（寫不出去）才等可寫
+    uint32_t up_want = 0, down_want = 0;
+    for (int i = 0; i < x->npipes; i++) {
+        XferPipe *p = &x->pipe[i];
+        if (p->from && !p->eof && p->tail - p->head < XFER_RING_SIZE)
+            *(p->from == x->up ? &up_want : &down_want) |= EPOLLIN;
+        if (p->to && (p->tail > p->head || (p->sendfile && !p->eof)))
+            *(p->to == x->up ? &up_want : &down_want) |= EPOLLOUT;
+    }
+    int idx = x - xfers;
+    set_events(x->up, &x->up_events, up_want, idx);
+    set_events(x->down, &x->down_events, down_want, idx);
+}
+
+// 清掉建立後太久沒有連上的傳輸
+static void xfer_sweep() {
+    static time_t last = 0;
+    time_t now = time(NULL);
+    if (now == last)
+        return;
+    last = now;
+    for (int i = 0; i < XFER_MAX; i++) {
+        Xfer *x = &xfers[i];
+        if (x->used && !xfer_ready(x) && now - x->created > XFER_ATTACH_TIMEOUT) {
+            printf("[Xfer] #%d %s -> %s %s: expired before both ends connected\n",
+                   x->id, x->from, x->to, x->filename);
+            xfer_end(x, false);
+            continue;
+        }
+
+        // 一對多：沒有連上的接收端視為失敗，其他人繼續
+        if (x->used && x->mode == XFER_FANOUT && now - x->created > XFER_ATTACH_TIMEOUT) {
+            bool changed = false;
+            for (int j = 0; j < x->fan->nreaders; j++) {
+                FanReader *r = &x->fan->readers[j];
+                if (!r->ssl && !r->done && !r->failed) {
+                    r->failed = changed = true;
+                }
+            }
+            if (changed)
+                xfer_pump(x);
+        }
+    }
+    spool_sweep();
+}
+
+static void hs_accept();
+static void hs_step(Handshake *h);
+static void hs_sweep();
+
+static void *engine_thread(void *arg) {
+    (void)arg;
+    struct epoll_event evs[64];
+    while (true) {
+        int n = epoll_wait(epfd, evs, 64, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait in transfer engine");
+            continue;
+        }
+        // 新連線與 handshake 不用 xfer_lock，報到時 xfer_attach 自己會拿
+        for (int i = 0; i < n; i++) {
+            uint64_t idx = evs[i].data.u64;
+            if (idx == XFER_EV_LISTEN)
+                hs_accept();
+            else if (idx >= XFER_MAX && handshakes[idx - XFER_MAX].ssl)
+                hs_step(&handshakes[idx - XFER_MAX]);
+        }
+        hs_sweep();
+        pthread_mutex_lock(&xfer_lock);
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.u64 >= XFER_MAX)
+                continue;
+            Xfer *x = &xfers[evs[i].data.u64];
+            if (x->used)
+                xfer_pump(x);
+        }
+        xfer_sweep();
+        pthread_mutex_unlock(&xfer_lock);
+    }
+    return NULL;
+}
+
+// 上傳到 spool 的收尾：寫檔 thread 結束並 fsync 後，才以 close_notify 告訴上傳端已收妥
+static void *commit_thread(void *arg) {
+    (void)arg;
+    while (true) {
+        pthread_mutex_lock(&commit_lock);
+        while (!commit_head)
+            pthread_cond_wait(&commit_ready, &commit_lock);
+        Commit *c = commit_head;
+        commit_head = c->next;
+        if (!commit_head)
+            commit_tail = NULL;
+        pthread_mutex_unlock(&commit_lock);
+
+        bool ok = c->ok;
+        if (c->sink) {
+            if (file_writer_close(c->sink) == -1 || (long long)c->sink->bytes != c->size)
+                ok = false;
+            if (c->spool_id > 0) {
+                char name[32];
+                snprintf(name, sizeof(name), "spool #%d", c->spool_id);
+                file_writer_report(c->sink, name);
+            }
+            free(c->sink);
+        }
+        if (c->up) {
+            int fd = SSL_get_fd(c->up);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            if (ok)
+                SSL_shutdown(c->up);
+            SSL_free(c->up);
+            close(fd);
+        }
+        if (c->spool_id > 0)
+            spool_commit(c->spool_id, ok);
+        free(c);
+    }
+    return NULL;
+}
+
+//--- QUEUE ---//
+// 使用者正在進行（已開始搬運）的傳輸數，只算實際連上的那一端
+static int xfer_running(const char *name) {
+    int n = 0;
+    for (int i = 0; i < XFER_MAX; i++) {
+        const Xfer *x = &xfers[i];
+        if (!x->used || !x->start_ns)
+            continue;
+        if ((x->mode != XFER_SPOOL_OUT && strcmp(x->from, name) == 0) ||
+            ((x->mode == XFER_RELAY || x->mode == XFER_SPOOL_OUT) && strcmp(x->to, name) == 0))
+            n++;
+    }
+    return n;
+}
+
+static bool xfer_can_start(const Xfer *x) {
+    if (x->mode != XFER_SPOOL_OUT && xfer_running(x->from) >= XFER_USER_ACTIVE)
+        return false;
+    if ((x->mode == XFER_RELAY || x->mode == XFER_SPOOL_OUT) && xfer_running(x->to) >= XFER_USER_ACTIVE)
+        return false;
+    return true;
+}
+
+// 兩端都到齊：設定 pipe 並註冊到 epoll
+static void xfer_start(Xfer *x) {
+    x->queued = false;
+    XferPipe *data = &x->pipe[0], *back = &x->pipe[1];
+    if (x->mode == XFER_SPOOL_OUT) {
+        char path[64];
+        spool_path(x->spool_id, path, sizeof(path));
+        data->src_fd = open(path, O_RDONLY);
+        if (data->src_fd < 0) {
+            xfer_end(x, false);
+            return;
+        }
+        data->end = x->size;
+        data->sendfile = BIO_get_ktls_send(SSL_get_wbio(x->down));
+        posix_fadvise(data->src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (x->mode != XFER_FANOUT) {
+        data->from = x->up;
+        data->to = x->down;
+        back->from = x->down;
+        back->to = x->up;
+        x->npipes = x->mode == XFER_SPOOL_IN ? 1 : 2;
+        data->buf = malloc(XFER_RING_SIZE);
+        back->buf = malloc(XFER_RING_SIZE);
+    }
+    x->start_ns = pipe_now_ns();
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = x - xfers;
+    if (x->up)
+        epoll_ctl(epfd, EPOLL_CTL_ADD, SSL_get_fd(x->up), &ev);
+    if (x->down)
+        epoll_ctl(epfd, EPOLL_CTL_ADD, SSL_get_fd(x->down), &ev);
+    x->up_events = x->down_events = EPOLLIN;
+    printf("[Xfer] #%d %s -> %s %s: started\n", x->id, x->from, x->to, x->filename);
+
+    // spool 檔不會觸發 epoll，先搬一輪
+    xfer_pump(x);
+}
+
+// 有傳輸結束時，依建立順序啟動還能開始的排隊傳輸
+static void xfer_dequeue() {
+    static bool busy = false;
+    if (busy)
+        return;
+    busy = true;
+    while (true) {
+        Xfer *next = NULL;
+        for (int i = 0; i < XFER_MAX; i++) {
+            Xfer *x = &xfers[i];
+            if (x->used && x->queued && xfer_can_start(x) && (!next || x->id < next->id))
+                next = x;
+        }
+        if (!next)
+            break;
+        xfer_start(next);
+    }
+    busy = false;
+}
+
+//--- ATTACH ---//
+// 傳送端回報已直接送達接收端：釋放保留給轉送的傳輸，回傳 0（連線由呼叫端關閉）
+static int xfer_p2p_done(const char *token) {
+    int r = -1;
+    pthread_mutex_lock(&xfer_lock);
+    for (int i = 0; i < XFER_MAX; i++) {
+        Xfer *x = &xfers[i];
+        if (x->used && x->mode == XFER_RELAY && !x->up && !x->down &&
+            strcmp(x->token, token) == 0) {
+            printf("[Xfer] #%d %s -> %s %s: sent peer-to-peer, %.2f MB kept off the server\n",
+                   x->id, x->from, x->to, x->filename, x->size / (1024.0 * 1024.0));
+            p2p_count++;
+            p2p_bytes += x->size;
+            xfer_free(x);
+            r = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&xfer_lock);
+    return r;
+}
+
+// 資料連線報到：兩端都到齊後註冊到 epoll 開始搬運
+// 回傳 1 表示連線交給 engine，0 表示已處理完畢，-1 表示無效
+static int xfer_attach(const char *role, const char *token, SSL *ssl) {
+    if (strcmp(role, XFER_P2P) == 0)
+        return xfer_p2p_done(token);
+    bool up = strcmp(role, XFER_UP) == 0;
+    if (!up && strcmp(role, XFER_DOWN) != 0)
+        return -1;
+
+    pthread_mutex_lock(&xfer_lock);
+    Xfer *x = NULL;
+    FanReader *reader = NULL;
+    for (int i = 0; i < XFER_MAX && !x; i++) {
+        if (!xfers[i].used)
+            continue;
+        if (strcmp(xfers[i].token, token) == 0)
+            x = &xfers[i];
+        for (int j = 0; !up && xfers[i].fan && j < xfers[i].fan->nreaders; j++) {
+            if (strcmp(xfers[i].fan->readers[j].token, token) == 0) {
+                x = &xfers[i];
+                reader = &xfers[i].fan->readers[j];
+            }
+        }
+    }
+    if (!x || (x->mode == XFER_FANOUT && !up && !reader) ||
+        (reader ? reader->ssl || reader->failed : up ? x->up != NULL : x->down != NULL)) {
+        pthread_mutex_unlock(&xfer_lock);
+        return -1;
+    }
+
+    // 一對多的接收端：隨時可以加入，從頭開始送
+    if (reader) {
+        int fd = SSL_get_fd(ssl);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        reader->ssl = ssl;
+        struct epoll_event ev;
+        ev.events = reader->events = EPOLLIN;
+        ev.data.u64 = x - xfers;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        xfer_pump(x);
+        pthread_mutex_unlock(&xfer_lock);
+        return 1;
+    }
+
+    // 一對多的上傳端：暫存檔開好讀寫兩個 fd 後就 unlink，傳輸結束時自動消失
+    if (up && x->mode == XFER_FANOUT) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/fan-%d", SPOOL_DIR, x->id);
+        Fanout *f = x->fan;
+        f->sink = malloc(sizeof(FileWriter));
+        if (file_writer_open(f->sink, path, x->size) == -1) {
+            free(f->sink);
+            f->sink = NULL;
+            xfer_end(x, false);
+            pthread_mutex_unlock(&xfer_lock);
+            return -1;
+        }
+        f->src_fd = open(path, O_RDONLY);
+        unlink(path);
+        f->window = malloc(XFER_WINDOW);
+        if (f->src_fd < 0 || !f->window) {
+            xfer_end(x, false);
+            pthread_mutex_unlock(&xfer_lock);
+            return -1;
+        }
+    }
+
+    // 上傳到 spool：先開好 spool 檔（依宣告大小預先配置）
+    if (up && x->mode == XFER_SPOOL_IN) {
+        char path[64];
+        spool_path(x->spool_id, path, sizeof(path));
+        x->pipe[0].sink = malloc(sizeof(FileWriter));
+        if (file_writer_open(x->pipe[0].sink, path, x->size) == -1) {
+            free(x->pipe[0].sink);
+            x->pipe[0].sink = NULL;
+            xfer_end(x, false);
+            pthread_mutex_unlock(&xfer_lock);
+            return -1;
+        }
+    }
+
+    int fd = SSL_get_fd(ssl);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (up)
+        x->up = ssl;
+    else
+        x->down = ssl;
+
+    if (xfer_ready(x)) {
+        if (xfer_can_start(x)) {
+            xfer_start(x);
+        } else {
+            x->queued = true;
+            printf("[Xfer] #%d %s -> %s %s: queued\n", x->id, x->from, x->to, x->filename);
+        }
+    }
+    pthread_mutex_unlock(&xfer_lock);
+    return 1;
+}
+
+//--- HANDSHAKE ---//
+// 資料連線從 accept 起就是非阻塞的，由 engine 的 epoll 推進 SSL_accept 與報到那一行，
+// 慢的 client 只佔自己的一格，不會擋住其他傳輸連上；超過 XFER_HANDSHAKE_TIMEOUT 就關掉
+static void hs_close(Handshake *h) {
+    int fd = SSL_get_fd(h->ssl);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    SSL_free(h->ssl);
+    close(fd);
+    h->ssl = NULL;
+}
+
+// welcome socket 可讀：收下所有等待中的連線，各佔一格 handshake
+static void hs_accept() {
+    while (true) {
+        int fd = accept4(file_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0)
+            return;
+        Handshake *h = NULL;
+        for (int i = 0; i < XFER_HANDSHAKE_MAX && !h; i++)
+            if (!handshakes[i].ssl)
+                h = &handshakes[i];
+        if (!h) {
+            printf("[Error] Too many data connections in handshake\n");
+            close(fd);
+            continue;
+        }
+
+        // commit thread 以阻塞模式送 close_notify，送不出去時不能一直卡住
+        struct timeval tv = { XFER_HANDSHAKE_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        SSL *ssl = SSL_new(xfer_ctx);
+        SSL_set_fd(ssl, fd);
+#ifdef SSL_OP_ENABLE_KTLS
+        // kernel 支援時改由 kTLS 加密，spool 下載可以用 sendfile
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+        h->ssl = ssl;
+        h->deadline = time(NULL) + XFER_HANDSHAKE_TIMEOUT;
+        struct epoll_event ev;
+        ev.events = h->events = EPOLLIN;
+        ev.data.u64 = XFER_MAX + (h - handshakes);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// SSL 還在等對方：依需要改成等可讀或可寫，回傳 0；其他錯誤回傳 -1
+static int hs_wait(Handshake *h, int r) {
+    int err = SSL_get_error(h->ssl, r);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+        return -1;
+    set_events(h->ssl, &h->events, err == SSL_ERROR_WANT_WRITE ? EPOLLOUT : EPOLLIN,
+               XFER_MAX + (h - handshakes));
+    return 0;
+}
+
+// 推進一格 handshake：完成後讀一行 "<role> <token>"，交給 xfer_attach
+static void hs_step(Handshake *h) {
+    int r = 1;
+    if (!SSL_is_init_finished(h->ssl))
+        r = SSL_accept(h->ssl);
+    char line[64];
+    if (r > 0)
+        r = SSL_read(h->ssl, line, sizeof(line) - 1);
+    if (r <= 0) {
+        if (hs_wait(h, r) == -1) {
+            ERR_print_errors_fp(stderr);
+            hs_close(h);
+        }
+        return;
+    }
+    line[r] = '\0';
+
+    // 連線離開 handshake 表；交給 engine 時由 xfer_attach 以傳輸的編號重新註冊
+    SSL *ssl = h->ssl;
+    int fd = SSL_get_fd(ssl);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    h->ssl = NULL;
+
+    char role[8], token[XFER_TOKEN_LEN + 1];
+    r = -1;
+    if (sscanf(line, "%7s %16s", role, token) == 2)
+        r = xfer_attach(role, token, ssl);
+    if (r < 0) {
+        printf("[Error] Unknown data connection: %s\n", line);
+        SSL_write(ssl, FILE_FAIL, strlen(FILE_FAIL));
+    }
+    if (r <= 0) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(fd);
+    }
+}
+
+// 關掉超過期限還沒報到的連線
+static void hs_sweep() {
+    static time_t last = 0;
+    time_t now = time(NULL);
+    if (now == last)
+        return;
+    last = now;
+    for (int i = 0; i < XFER_HANDSHAKE_MAX; i++) {
+        if (handshakes[i].ssl && now >= handshakes[i].deadline) {
+            printf("[Error] Data connection did not report within %d s\n", XFER_HANDSHAKE_TIMEOUT);
+            hs_close(&handshakes[i]);
+        }
+    }
+}
+
+// 開 FILE_PORT 並啟動 engine 與 commit thread，失敗回傳 -1
+// welcome socket 也註冊在 engine 的 epoll，新連線由 engine 收下並推進 handshake
+int xfer_engine_start(SSL_CTX *ctx) {
+    xfer_ctx = ctx;
+    struct sockaddr_in fileaddr;
+    if (create_listen_port(&file_fd, &fileaddr, FILE_PORT, MAX_ONLINE) == -1)
+        return -1;
+    if ((epfd = epoll_create1(0)) == -1)
+        return -1;
+    fcntl(file_fd, F_SETFL, fcntl(file_fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = XFER_EV_LISTEN;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, file_fd, &ev) == -1)
+        return -1;
+
+    pthread_t engine, committer;
+    if (pthread_create(&engine, NULL, engine_thread, NULL) != 0 ||
+        pthread_create(&committer, NULL, commit_thread, NULL) != 0)
+        return -1;
+    pthread_detach(engine);
+    pthread_detach(committer);
+    return 1;
+}
+
+//--- API ---//
+// 產生 len 個 hex 字元的隨機字串（len 為偶數，out 需 len + 1），失敗回傳 -1
+int xfer_random_hex(char *out, int len) {
+    unsigned char raw[64];
+    if (len / 2 > (int)sizeof(raw) || RAND_bytes(raw, len / 2) != 1)
+        return -1;
+    for (int j = 0; j < len / 2; j++)
+        sprintf(out + 2 * j, "%02x", raw[j]);
+    return 1;
+}
+
+static int xfer_new(XferMode mode, int spool_id, Fanout *fan, const char *from, const char *to,
+                    const char *filename, long long size, char *token) {
+    char fresh[XFER_TOKEN_LEN + 1];
+    if (xfer_random_hex(fresh, XFER_TOKEN_LEN) == -1)
+        return -1;
+
+    pthread_mutex_lock(&xfer_lock);
+    int id = -1;
+    for (int i = 0; i < XFER_MAX; i++) {
+        Xfer *x = &xfers[i];
+        if (x->used)
+            continue;
+        memset(x, 0, sizeof(*x));
+        x->used = true;
+        x->id = id = next_id++;
+        x->mode = mode;
+        x->spool_id = spool_id;
+        x->fan = fan;
+        strcpy(x->token, fresh);
+        strncpy(x->from, from, MAX_NAME - 1);
+        strncpy(x->to, to, MAX_NAME - 1);
+        strncpy(x->filename, filename, XFER_NAME_MAX - 1);
+        x->size = size;
+        x->created = time(NULL);
+        strcpy(token, x->token);
+        break;
+    }
+    pthread_mutex_unlock(&xfer_lock);
+    return id;
+}
+
+// 建立一個等待兩端連線的傳輸，token 寫入呼叫端（XFER_TOKEN_LEN + 1）
+// 成功回傳傳輸 ID，表已滿回傳 -1
+int xfer_create(const char *from, const char *to, const char *filename, long long size,
+                char *token) {
+    return xfer_new(XFER_RELAY, 0, NULL, from, to, filename, size, token);
+}
+
+// 建立 spool 的上傳（upload = true）或下載傳輸，只需要一端連線，回傳值同 xfer_create
+int xfer_create_spool(const SpoolEntry *e, bool upload, char *token) {
+    return xfer_new(upload ? XFER_SPOOL_IN : XFER_SPOOL_OUT, e->id, NULL, e->from, e->to,
+                    e->filename, e->size, token);
+}
+
+// 建立一對多傳輸：tokens[i] 給 to[i] 的下載連線，token 給上傳連線，回傳值同 xfer_create
+int xfer_create_fanout(const char *from, char to[][MAX_NAME], int n, const char *filename,
+                       long long size, char *token, char tokens[][XFER_TOKEN_LEN + 1]) {
+    if (n <= 0 || n > XFER_FANOUT_MAX)
+        return -1;
+    Fanout *f = calloc(1, sizeof(Fanout));
+    if (!f)
+        return -1;
+    f->nreaders = n;
+    for (int i = 0; i < n; i++) {
+        FanReader *r = &f->readers[i];
+        strncpy(r->name, to[i], MAX_NAME - 1);
+        r->stage = malloc(XFER_STAGE);
+        if (!r->stage || xfer_random_hex(r->token, XFER_TOKEN_LEN) == -1) {
+            for (int j = 0; j <= i; j++)
+                free(f->readers[j].stage);
+            free(f);
+            return -1;
+        }
+        strcpy(tokens[i], r->token);
+    }
+
+    char group[MAX_NAME];
+    snprintf(group, sizeof(group), "%d users", n);
+    int id = xfer_new(XFER_FANOUT, 0, f, from, group, filename, size, token);
+    if (id < 0) {
+        for (int i = 0; i < n; i++)
+            free(f->readers[i].stage);
+        free(f);
+    }
+    return id;
+}
+
+// 列出所有傳輸與目前速率，回傳寫入的長度
+int xfer_stats(char *out, int out_size) {
+    int len = 0;
+    out[0] = '\0';
+    pthread_mutex_lock(&xfer_lock);
+    uint64_t now = pipe_now_ns();
+    if (p2p_count > 0)
+        len += snprintf(out, out_size, "Peer-to-peer: %d transfers, %.2f MB kept off the server\n",
+                        p2p_count, p2p_bytes / (1024.0 * 1024.0));
+    for (int i = 0; i < XFER_MAX && len < out_size; i++) {
+        Xfer *x = &xfers[i];
+        if (!x->used)
+            continue;
+        const char *via = x->mode == XFER_SPOOL_IN || x->mode == XFER_SPOOL_OUT ? " (spool)" : "";
+        if (!xfer_ready(x) || x->queued) {
+            len += snprintf(out + len, out_size - len, "#%d %s -> %s%s %s: %s\n",
+                            x->id, x->from, x->to, via, x->filename,
+                            x->queued ? "queued" : "waiting");
+            continue;
+        }
+        double secs = (now - x->start_ns) / 1e9;
+        double mb = (x->fan ? x->fan->tail : x->pipe[0].head) / (1024.0 * 1024.0);
+        len += snprintf(out + len, out_size - len, "#%d %s -> %s%s %s: %.2f / %.2f MB, %.2f MB/s\n",
+                        x->id, x->from, x->to, via, x->filename, mb, x->size / (1024.0 * 1024.0),
+                        secs > 0 ? mb / secs : 0.0);
+        for (int j = 0; x->fan && j < x->fan->nreaders && len < out_size; j++) {
+            FanReader *r = &x->fan->readers[j];
+            len += snprintf(out + len, out_size - len, "    %s: %s%.2f MB\n", r->name,
+                            r->done ? "done, " : r->failed ? "failed, " : "",
+                            r->off / (1024.0 * 1024.0));
+        }
+    }
+    pthread_mutex_unlock(&xfer_lock);
+    if (len >= out_size)
+        len = out_size - 1;
+    return len;
+}
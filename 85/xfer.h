@@ -0,0 +1,29 @@
+// xfer.h
+#ifndef XFER_H
+#define XFER_H
+
+#include "config.h"
+#include "spool.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//--- TRANSFER ENGINE ---//
+// 檔案資料不再經過 worker：上傳端與下載端各自連到 FILE_PORT 的資料連線，
+// 由 engine thread 以 epoll + 非阻塞 SSL 在兩端之間搬運
+#define XFER_MAX 64                       // 同時存在的傳輸數
+#define XFER_RING_SIZE (256 * 1024)       // 每個方向的 ring buffer
+#define XFER_ATTACH_TIMEOUT 30            // 建立後多久內兩端必須連上（秒）
+#define XFER_FANOUT_MAX 32                // 一對多傳輸的接收端上限
+#define XFER_USER_ACTIVE 4                // 每個使用者同時搬運的傳輸數，其餘排隊依序開始
+
+int  xfer_engine_start(SSL_CTX *ctx);
+int  xfer_create(const char *from, const char *to, const char *filename, long long size,
+                 char *token);
+int  xfer_create_spool(const SpoolEntry *e, bool upload, char *token);
+int  xfer_create_fanout(const char *from, char to[][MAX_NAME], int n, const char *filename,
+                        long long size, char *token, char tokens[][XFER_TOKEN_LEN + 1]);
+int  xfer_stats(char *out, int out_size);
+int  xfer_random_hex(char *out, int len);
+
+#endif